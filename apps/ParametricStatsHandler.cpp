@@ -0,0 +1,213 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "ParametricStatsHandler.h"
+
+#include <osgViewer/View>
+#include <osgViewer/ViewerBase>
+
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+using namespace osgParametric;
+
+namespace
+{
+
+const float s_pageWidth = 1280.0f;
+const float s_pageHeight = 1024.0f;
+const float s_characterSize = 20.0f;
+const float s_rowHeight = 24.0f;
+
+// x position of the name, cull, draw, GPU and triangles columns
+const float s_columns[] = { 10.0f, 300.0f, 420.0f, 540.0f, 660.0f };
+
+// frames skipped at the end of the averaged range, as the GPU times of the most recent frames aren't available yet
+const unsigned int s_latency = 4;
+
+std::string formatAttribute(osg::Stats* stats, unsigned int startFrame, unsigned int endFrame, const std::string& name, int precision)
+{
+    double value = 0.0;
+    if (!stats->getAveragedAttribute(startFrame, endFrame, name, value)) return "-";
+
+    std::ostringstream str;
+    str<<std::fixed<<std::setprecision(precision)<<value;
+    return str.str();
+}
+
+}
+
+ParametricStatsHandler::ParametricStatsHandler(ParametricScene* scene):
+    _scene(scene),
+    _keyEventToggle('p'),
+    _numFramesToAverage(30),
+    _enabled(false)
+{
+}
+
+ParametricStatsHandler::~ParametricStatsHandler()
+{
+}
+
+bool ParametricStatsHandler::handle(const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa)
+{
+    osgViewer::View* view = dynamic_cast<osgViewer::View*>(&aa);
+    if (!view) return false;
+
+    osg::ref_ptr<ParametricScene> scene;
+    if (!_scene.lock(scene)) return false;
+
+    switch(ea.getEventType())
+    {
+        case(osgGA::GUIEventAdapter::KEYDOWN):
+        {
+            if (ea.getKey()!=_keyEventToggle) return false;
+
+            if (!_camera && !setUpHUDCamera(view)) return false;
+
+            _enabled = !_enabled;
+            _camera->setNodeMask(_enabled ? 0xffffffff : 0);
+
+            osg::Stats* stats = view->getViewerStats();
+            scene->setStats(stats);
+            stats->collectStats("parametric", _enabled);
+
+            aa.requestRedraw();
+            return true;
+        }
+        case(osgGA::GUIEventAdapter::FRAME):
+        {
+            if (!_enabled || !view->getFrameStamp()) return false;
+
+            if (!_textureMemory || _rows.size()!=scene->getPassTimers().size()) setUpRows();
+
+            updateRows(view->getViewerStats(), view->getFrameStamp()->getFrameNumber());
+            return false;
+        }
+        default:
+            return false;
+    }
+}
+
+void ParametricStatsHandler::getUsage(osg::ApplicationUsage& usage) const
+{
+    std::string key(1, static_cast<char>(_keyEventToggle));
+    usage.addKeyboardMouseBinding(key, "On screen ParametricScene pass stats, per pass cull, draw and GPU times and triangle counts.");
+}
+
+bool ParametricStatsHandler::setUpHUDCamera(osgViewer::View* view)
+{
+    osg::GraphicsContext* context = view->getCamera()->getGraphicsContext();
+    if (!context && view->getNumSlaves()>0) context = view->getSlave(0)._camera->getGraphicsContext();
+    if (!context || !context->getTraits()) return false;
+
+    _camera = new osg::Camera;
+    _camera->setName("ParametricStatsHandler");
+    _camera->setGraphicsContext(context);
+    _camera->setViewport(0, 0, context->getTraits()->width, context->getTraits()->height);
+    _camera->setProjectionResizePolicy(osg::Camera::FIXED);
+    _camera->setRenderOrder(osg::Camera::POST_RENDER, 11);
+    _camera->setProjectionMatrix(osg::Matrix::ortho2D(0.0, s_pageWidth, 0.0, s_pageHeight));
+    _camera->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
+    _camera->setViewMatrix(osg::Matrix::identity());
+    _camera->setClearMask(0);
+    _camera->setAllowEventFocus(false);
+
+    _geode = new osg::Geode;
+    osg::StateSet* stateset = _geode->getOrCreateStateSet();
+    stateset->setMode(GL_LIGHTING, osg::StateAttribute::OFF);
+    stateset->setMode(GL_DEPTH_TEST, osg::StateAttribute::OFF);
+    _camera->addChild(_geode.get());
+
+    // the slave needs its own renderer, so the viewer's threads are stopped while it's added
+    osgViewer::ViewerBase* viewer = view->getViewerBase();
+    if (viewer) viewer->stopThreading();
+    view->addSlave(_camera.get(), false);
+    if (viewer) viewer->startThreading();
+
+    return true;
+}
+
+osg::ref_ptr<osgText::Text> ParametricStatsHandler::createText(const osg::Vec3& position, const std::string& str)
+{
+    osg::ref_ptr<osgText::Text> text = new osgText::Text;
+    text->setFont("fonts/arial.ttf");
+    text->setCharacterSize(s_characterSize);
+    text->setColor(osg::Vec4(1.0f, 1.0f, 0.5f, 1.0f));
+    text->setPosition(position);
+    text->setDataVariance(osg::Object::DYNAMIC);
+    text->setText(str);
+    _geode->addDrawable(text.get());
+    return text;
+}
+
+void ParametricStatsHandler::setUpRows()
+{
+    _geode->removeDrawables(0, _geode->getNumDrawables());
+    _rows.clear();
+
+    osg::ref_ptr<ParametricScene> scene;
+    if (!_scene.lock(scene)) return;
+
+    float y = s_pageHeight-2.0f*s_rowHeight;
+    createText(osg::Vec3(s_columns[0], y, 0.0f), "Pass");
+    createText(osg::Vec3(s_columns[1], y, 0.0f), "Cull ms");
+    createText(osg::Vec3(s_columns[2], y, 0.0f), "Draw ms");
+    createText(osg::Vec3(s_columns[3], y, 0.0f), "GPU ms");
+    createText(osg::Vec3(s_columns[4], y, 0.0f), "Triangles");
+
+    const ParametricScene::PassTimers& timers = scene->getPassTimers();
+    for(ParametricScene::PassTimers::const_iterator itr = timers.begin();
+        itr != timers.end();
+        ++itr)
+    {
+        y -= s_rowHeight;
+
+        Row row;
+        row.name = (*itr)->getName();
+        createText(osg::Vec3(s_columns[0], y, 0.0f), row.name);
+        row.cullTime = createText(osg::Vec3(s_columns[1], y, 0.0f), "-");
+        row.drawTime = createText(osg::Vec3(s_columns[2], y, 0.0f), "-");
+        row.gpuTime = createText(osg::Vec3(s_columns[3], y, 0.0f), "-");
+        row.triangles = createText(osg::Vec3(s_columns[4], y, 0.0f), "-");
+        _rows.push_back(row);
+    }
+
+    y -= s_rowHeight*1.5f;
+    _textureMemory = createText(osg::Vec3(s_columns[0], y, 0.0f), "");
+}
+
+void ParametricStatsHandler::updateRows(osg::Stats* stats, unsigned int frameNumber)
+{
+    if (frameNumber<=s_latency) return;
+
+    unsigned int endFrame = frameNumber-s_latency;
+    unsigned int startFrame = endFrame>_numFramesToAverage ? endFrame-_numFramesToAverage : 0;
+    startFrame = std::max(startFrame, stats->getEarliestFrameNumber());
+
+    for(Rows::iterator itr = _rows.begin();
+        itr != _rows.end();
+        ++itr)
+    {
+        itr->cullTime->setText(formatAttribute(stats, startFrame, endFrame, itr->name+" cull time", 2));
+        itr->drawTime->setText(formatAttribute(stats, startFrame, endFrame, itr->name+" draw time", 2));
+        itr->gpuTime->setText(formatAttribute(stats, startFrame, endFrame, itr->name+" GPU time", 2));
+        itr->triangles->setText(formatAttribute(stats, startFrame, endFrame, itr->name+" triangles", 0));
+    }
+
+    std::string memory = "Depth texture memory "+formatAttribute(stats, startFrame, endFrame, "Depth texture memory", 1)+" MB, "+
+                         "render target pool "+formatAttribute(stats, startFrame, endFrame, "Render target pool memory", 1)+" MB";
+
+    osg::ref_ptr<ParametricScene> scene;
+    if (_scene.lock(scene) && scene->getRenderTargetPool()->getMemoryBudget()>0)
+    {
+        std::ostringstream budget;
+        budget<<std::fixed<<std::setprecision(1)<<static_cast<double>(scene->getRenderTargetPool()->getMemoryBudget())/(1024.0*1024.0);
+        memory += " of "+budget.str()+" MB budget";
+    }
+
+    _textureMemory->setText(memory);
+}
@@ -0,0 +1,82 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef PARAMETRIC_PARAMETRICSTATSHANDLER
+#define PARAMETRIC_PARAMETRICSTATSHANDLER 1
+
+#include <osgParametric/ParametricScene.h>
+
+#include <osgGA/GUIEventHandler>
+#include <osgText/Text>
+#include <osg/Geode>
+
+#include <vector>
+
+namespace osgViewer { class View; }
+
+namespace osgParametric
+{
+
+/** Stats page listing the cull, draw and GPU times and triangle counts of each of ParametricScene's passes, averaged over
+  * recent frames, along with the memory used by the depth textures. The page is toggled by a key, 'p' by default, and reads
+  * the attributes ParametricScene publishes to the viewer's stats, so the scene needs setCollectPassTimes(true) before setup().
+  * Part of the example rather than the library, so that the library doesn't depend on osgText and osgViewer.*/
+class ParametricStatsHandler : public osgGA::GUIEventHandler
+{
+public:
+
+    ParametricStatsHandler(ParametricScene* scene);
+
+    void setKeyEventToggle(int key) { _keyEventToggle = key; }
+    int getKeyEventToggle() const { return _keyEventToggle; }
+
+    /** Set the number of frames the values shown are averaged over.*/
+    void setNumFramesToAverage(unsigned int num) { _numFramesToAverage = num; }
+    unsigned int getNumFramesToAverage() const { return _numFramesToAverage; }
+
+    osg::Camera* getCamera() { return _camera.get(); }
+    const osg::Camera* getCamera() const { return _camera.get(); }
+
+    virtual bool handle(const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa);
+
+    virtual void getUsage(osg::ApplicationUsage& usage) const;
+
+protected:
+
+    virtual ~ParametricStatsHandler();
+
+    bool setUpHUDCamera(osgViewer::View* view);
+
+    osg::ref_ptr<osgText::Text> createText(const osg::Vec3& position, const std::string& str);
+
+    void setUpRows();
+
+    void updateRows(osg::Stats* stats, unsigned int frameNumber);
+
+    struct Row
+    {
+        std::string                     name;
+        osg::ref_ptr<osgText::Text>     cullTime;
+        osg::ref_ptr<osgText::Text>     drawTime;
+        osg::ref_ptr<osgText::Text>     gpuTime;
+        osg::ref_ptr<osgText::Text>     triangles;
+    };
+
+    typedef std::vector<Row> Rows;
+
+    osg::observer_ptr<ParametricScene>  _scene;
+    int                                 _keyEventToggle;
+    unsigned int                        _numFramesToAverage;
+    bool                                _enabled;
+
+    osg::ref_ptr<osg::Camera>           _camera;
+    osg::ref_ptr<osg::Geode>            _geode;
+    Rows                                _rows;
+    osg::ref_ptr<osgText::Text>         _textureMemory;
+};
+
+}
+
+#endif
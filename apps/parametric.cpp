@@ -16,336 +16,662 @@
 #include <osgViewer/ViewerEventHandlers>
 
 #include <osgParametric/ParametricScene.h>
+#include <osgParametric/HeightFieldTexture.h>
+#include <osgParametric/MeshExporter.h>
+#include <osgParametric/PagedSurface.h>
+#include <osgParametric/SurfaceAnalytics.h>
+#include <osgParametric/SurfaceInstances.h>
+#include <osgParametric/SurfaceIntersector.h>
 
+#include "ParametricStatsHandler.h"
 
-osg::ref_ptr<osg::Geometry> createMesh(const osg::Vec3& origin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, unsigned int uCells, unsigned vCells, bool top)
-{
-    osg::ref_ptr<osg::Geometry> geometry = new osg::Geometry;
-    geometry->setUseVertexBufferObjects(true);
+#include <iostream>
+#include <fstream>
+#include <algorithm>
 
-    unsigned int numVertices = (uCells+1)*(vCells+1);
 
-    // set up vertices
-    osg::ref_ptr<osg::Vec3Array> vertices = new osg::Vec3Array;
-    vertices->reserve(numVertices);
+osg::ref_ptr<osg::Program> createProgram(osg::ArgumentParser& arguments)
+{
+    osg::ref_ptr<osg::Program> program = new osg::Program;
 
-    osg::Vec3 ua = uAxis; ua /= static_cast<float>(uCells);
-    osg::Vec3 va = vAxis; va /= static_cast<float>(vCells);
+    std::string filename;
+    typedef std::map<osg::Shader::Type, osg::ref_ptr<osg::Shader> > ShaderMap;
+    ShaderMap shaders;
 
-    for(unsigned int r=0; r<=vCells; ++r)
+    while(arguments.read("--shader",filename))
     {
-        for(unsigned int c=0; c<=uCells; ++c)
+        osg::ref_ptr<osg::Shader> shader = osgDB::readRefShaderFile(filename);
+        if (shader.valid())
         {
-            vertices->push_back(origin + ua*static_cast<float>(c) + va*static_cast<float>(r));
+            shaders[shader->getType()] = shader;
         }
     }
-    geometry->setVertexArray(vertices);
 
-    // set up normal
-    osg::Vec3 verticalAxis(uAxis ^ vAxis);
-    verticalAxis.normalize();
+    for(ShaderMap::iterator itr = shaders.begin();
+        itr != shaders.end();
+        ++itr)
+    {
+        program->addShader(itr->second);
+    }
 
-    geometry->getOrCreateStateSet()->addUniform(new osg::Uniform("verticalAxis", verticalAxis));
+    return program;
+}
 
-    osg::ref_ptr<osg::Vec3Array> normals = new osg::Vec3Array();
-    normals->push_back(osg::Vec3(0.0f,0.0f,0.0f));
-    geometry->setNormalArray(normals, osg::Array::BIND_OVERALL);
+osg::ref_ptr<osg::Group> createParametric(osg::ArgumentParser& arguments)
+{
+    osg::ref_ptr<osg::Group> parametric_group = new osg::Group;
+    parametric_group->setName("ParametricGroup");
 
+    osg::Vec3 origin(0.0, 0.0, 0.0);
+    osg::Vec3 uAxis(1.0,0.0,0.0);
+    osg::Vec3 vAxis(0.0,1.0,0.0);
 
-    // set up colour
-    osg::Vec4 color(1.0,1.0,1.0,1.0);
-    osg::ref_ptr<osg::Vec4Array> colours = new osg::Vec4Array;
-    colours->push_back(color);
-    geometry->setColorArray(colours, osg::Array::BIND_OVERALL);
+    unsigned int uCells = 10;
+    unsigned int vCells = 10;
 
+    while (arguments.read("--columns", uCells)) {}
+    while (arguments.read("--rows", vCells)) {}
 
-    // set up mesh
+    bool triangleStrips = false;
+    while (arguments.read("--strips")) triangleStrips = true;
 
-    OSG_NOTICE<<"numVertices = "<<numVertices<<std::endl;
-    OSG_NOTICE<<"numVertices>>16 = "<<(numVertices>>16)<<std::endl;
+    bool vertexID = false;
+    while (arguments.read("--vertex-id")) vertexID = true;
 
+    // view dependent level of detail, --rows and --columns are then ignored
+    bool lod = false;
+    unsigned int patchCells = 32;
+    unsigned int maxLevel = 8;
+    float maxScreenError = 2.0f;
+    while (arguments.read("--lod")) lod = true;
+    while (arguments.read("--lod-patch-cells", patchCells)) lod = true;
+    while (arguments.read("--lod-levels", maxLevel)) lod = true;
+    while (arguments.read("--lod-error", maxScreenError)) lod = true;
 
-    osg::ref_ptr<osg::DrawElements> primitives;
-    if ((numVertices>>16)==0) primitives = new osg::DrawElementsUShort(GL_TRIANGLES);
-    else primitives = new osg::DrawElementsUInt(GL_TRIANGLES);
+    // large grids are split into tiles of at most tileCells by tileCells cells, 0 disables tiling
+    unsigned int tileCells = 254;
+    while (arguments.read("--tile-cells", tileCells)) {}
 
-    geometry->addPrimitiveSet(primitives);
+    osg::Vec3 baseOrigin = origin;
+    osg::Vec3 topOrigin = baseOrigin+osg::Vec3(0.0,0.0,1.0);
 
-    for(unsigned int r=0; r<vCells; ++r)
+    // page a grid of columns by rows floats too large for memory in as the top, in tiles loaded by the DatabasePager
+    osg::ref_ptr<osgParametric::PagedSurface> pagedSurface;
+    std::string pagedFilename;
+    unsigned int pagedColumns, pagedRows;
+    while (arguments.read("--paged", pagedFilename, pagedColumns, pagedRows))
     {
-        for(unsigned int c=0; c<uCells; ++c)
-        {
-            unsigned int p0 = c+r*(uCells+1);
-            unsigned int p1 = p0+(uCells+1);
-            unsigned int p2 = p0+1;
-            unsigned int p3 = p1+1;
-            if (top)
-            {
-                primitives->addElement(p0);
-                primitives->addElement(p2);
-                primitives->addElement(p1);
-                primitives->addElement(p2);
-                primitives->addElement(p3);
-                primitives->addElement(p1);
-            }
-            else
-            {
-                primitives->addElement(p0);
-                primitives->addElement(p1);
-                primitives->addElement(p2);
-                primitives->addElement(p2);
-                primitives->addElement(p1);
-                primitives->addElement(p3);
-            }
-        }
+        pagedSurface = new osgParametric::PagedSurface;
+        if (!pagedSurface->open(pagedFilename, pagedColumns, pagedRows)) pagedSurface = 0;
     }
 
-    osg::Vec3 wAxis = verticalAxis*((uAxis.length()+vAxis.length())*0.5);
+    float pagedWidth = 1.0f;
+    float pagedHeight = 1.0f;
+    while (arguments.read("--paged-size", pagedWidth, pagedHeight)) {}
 
-    osg::BoundingBox bb;
-    bb.expandBy(origin);
-    bb.expandBy(origin+uAxis);
-    bb.expandBy(origin+vAxis);
-    bb.expandBy(origin+uAxis+vAxis);
+    unsigned int pagedTileCells;
+    float pagedCellPixels;
+    if (pagedSurface.valid())
+    {
+        pagedSurface->setOrigin(topOrigin);
+        pagedSurface->setUAxis(uAxis*pagedWidth);
+        pagedSurface->setVAxis(vAxis*pagedHeight);
+        pagedSurface->setUseVertexID(vertexID);
+        while (arguments.read("--paged-tile-cells", pagedTileCells)) pagedSurface->setTileCells(pagedTileCells);
+        while (arguments.read("--paged-cell-pixels", pagedCellPixels)) pagedSurface->setMaxCellPixels(pagedCellPixels);
+    }
 
-    bb.expandBy(origin+wAxis);
-    bb.expandBy(origin+uAxis+wAxis);
-    bb.expandBy(origin+vAxis+wAxis);
-    bb.expandBy(origin+uAxis+vAxis+wAxis);
+    // draw columns by rows copies of the surfaces spacing apart, each with a single instanced draw per pass,
+    // the surface functions' instanceParameter0 and instanceParameter1 run from 0 to 1 across the columns and rows
+    unsigned int instanceColumns = 0;
+    unsigned int instanceRows = 0;
+    float instanceSpacing = 1.5f;
+    while (arguments.read("--instances", instanceColumns, instanceRows, instanceSpacing)) {}
 
-    geometry->setInitialBound(bb);
+    bool renderBase = false;
+    bool renderTop = true;
+    bool renderSidewalls = false;
 
-    return geometry;
-}
+    while (arguments.read("--base")) renderBase=true;
+    while (arguments.read("--top")) renderTop=true;
+    while (arguments.read("--walls")) renderSidewalls=true;
+    while (arguments.read("--all")) { renderBase = true; renderTop = true; renderSidewalls = true; }
 
-osg::ref_ptr<osg::Geometry> createSideWalls(const osg::Vec3& baseOrigin, const osg::Vec3& topOrigin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, int uCells, int vCells)
-{
-    osg::ref_ptr<osg::Geometry> geometry = new osg::Geometry;
-    geometry->setUseVertexBufferObjects(true);
+    // base, top and walls as a single geometry drawn in one call
+    bool renderSolid = false;
+    while (arguments.read("--solid")) renderSolid = true;
 
-    int numVertices = 2*(uCells+1) + 2*(vCells+1);
+    std::string function;
+    while(arguments.read("--Z_FUNCTION", function)) { parametric_group->getOrCreateStateSet()->setDefine("Z_FUNCTION", function); }
+    while(arguments.read("--Z_BASE", function)) { parametric_group->getOrCreateStateSet()->setDefine("Z_BASE", function); }
+    while(arguments.read("--Z_TOP", function)) { parametric_group->getOrCreateStateSet()->setDefine("Z_TOP", function); }
 
+    std::string name;
+    float value;
+    while(arguments.read("--uniform",name,value))
+    {
+        parametric_group->getOrCreateStateSet()->addUniform(new osg::Uniform(name.c_str(), value));
+    }
 
-    // set up vertices
-    osg::ref_ptr<osg::Vec3Array> vertices = new osg::Vec3Array;
-    vertices->reserve(numVertices);
+    // displace the surface by frames of columns by rows floats streamed from a file, played at fps frames per second of simulation time
+    std::string heightFieldFilename;
+    unsigned int heightFieldColumns, heightFieldRows;
+    double heightFieldRate;
+    while(arguments.read("--heightfield", heightFieldFilename, heightFieldColumns, heightFieldRows, heightFieldRate))
+    {
+        osg::ref_ptr<osgParametric::HeightFieldStream> stream = new osgParametric::HeightFieldStream;
+        if (!stream->open(heightFieldFilename, heightFieldColumns, heightFieldRows)) continue;
 
-    // normals
-    osg::ref_ptr<osg::Vec3Array> normals = new osg::Vec3Array();
-    geometry->setNormalArray(normals, osg::Array::BIND_PER_PRIMITIVE_SET);
+        osg::ref_ptr<osgParametric::HeightFieldTexture> heightField = new osgParametric::HeightFieldTexture(stream.get());
+        heightField->setFrameRate(heightFieldRate);
+        heightField->setExtents(osg::Vec4(origin.x(), origin.y(), uAxis.length(), vAxis.length()));
+        heightField->addToStateSet(parametric_group->getOrCreateStateSet());
+    }
 
 
-    osg::Vec3 ua = uAxis; ua /= static_cast<float>(uCells);
-    osg::Vec3 va = vAxis; va /= static_cast<float>(vCells);
+    // solid
+    if (renderSolid)
+    {
+        // a solid tile carries both grids and its walls, so it takes smaller tiles to stay on 16 bit indices
+        unsigned int solidTileCells = std::min(tileCells, 178u);
+        if (solidTileCells>0 && (uCells>solidTileCells || vCells>solidTileCells))
+        {
+            parametric_group->addChild(osgParametric::createTiledSolid(baseOrigin, topOrigin, uAxis, vAxis, uCells, vCells, solidTileCells));
+        }
+        else
+        {
+            osg::ref_ptr<osg::Geometry> geometry = osgParametric::createSolid(baseOrigin, topOrigin, uAxis, vAxis, uCells, vCells);
+            parametric_group->addChild(geometry.get());
+        }
+        renderBase = false;
+        renderTop = false;
+        renderSidewalls = false;
+    }
 
-    int vn = vertices->size();
-    int c=0;
-    int r=0;
-    for(r=0; r<=vCells; ++r)
+    // base
+    if (renderBase)
     {
-        vertices->push_back(baseOrigin + ua*static_cast<float>(c) + va*static_cast<float>(r));
-        vertices->push_back(topOrigin + ua*static_cast<float>(c) + va*static_cast<float>(r));
+        if (lod)
+        {
+            osg::ref_ptr<osgParametric::SurfaceLOD> surface = new osgParametric::SurfaceLOD(osgParametric::SurfaceGeometry::BASE, baseOrigin, uAxis, vAxis, patchCells, maxLevel);
+            surface->setMaxScreenError(maxScreenError);
+            parametric_group->addChild(surface.get());
+        }
+        else if (tileCells>0 && (uCells>tileCells || vCells>tileCells))
+        {
+            parametric_group->addChild(osgParametric::createTiledMesh(baseOrigin, uAxis, vAxis, uCells, vCells, false, tileCells, triangleStrips, vertexID));
+        }
+        else
+        {
+            osg::ref_ptr<osg::Geometry> geometry = osgParametric::createMesh(baseOrigin, uAxis, vAxis, uCells, vCells, false, triangleStrips, vertexID);
+            parametric_group->addChild(geometry.get());
+        }
     }
-    normals->push_back(osg::Vec3(-1.0f,0.0f,0.0f));
-    geometry->addPrimitiveSet(new osg::DrawArrays(GL_TRIANGLE_STRIP, vn, vertices->size()-vn));
 
-    vn = vertices->size();
-    r = vCells;
-    for(c=0; c<=uCells; ++c)
+    // top
+    if (renderTop)
     {
-        vertices->push_back(baseOrigin + ua*static_cast<float>(c) + va*static_cast<float>(r));
-        vertices->push_back(topOrigin + ua*static_cast<float>(c) + va*static_cast<float>(r));
+        if (pagedSurface.valid())
+        {
+            parametric_group->addChild(pagedSurface->createRoot());
+        }
+        else if (lod)
+        {
+            osg::ref_ptr<osgParametric::SurfaceLOD> surface = new osgParametric::SurfaceLOD(osgParametric::SurfaceGeometry::TOP, topOrigin, uAxis, vAxis, patchCells, maxLevel);
+            surface->setMaxScreenError(maxScreenError);
+            parametric_group->addChild(surface.get());
+        }
+        else if (tileCells>0 && (uCells>tileCells || vCells>tileCells))
+        {
+            parametric_group->addChild(osgParametric::createTiledMesh(topOrigin, uAxis, vAxis, uCells, vCells, true, tileCells, triangleStrips, vertexID));
+        }
+        else
+        {
+            osg::ref_ptr<osg::Geometry> geometry = osgParametric::createMesh(topOrigin, uAxis, vAxis, uCells, vCells, true, triangleStrips, vertexID);
+            parametric_group->addChild(geometry.get());
+        }
     }
-    normals->push_back(osg::Vec3(0.0f,1.0f,0.0f));
-    geometry->addPrimitiveSet(new osg::DrawArrays(GL_TRIANGLE_STRIP, vn, vertices->size()-vn));
 
-    vn = vertices->size();
-    c = uCells;
-    for(r=vCells; r>=0; --r)
+    // sidewalls
+    if (renderSidewalls)
     {
-        vertices->push_back(baseOrigin + ua*static_cast<float>(c) + va*static_cast<float>(r));
-        vertices->push_back(topOrigin + ua*static_cast<float>(c) + va*static_cast<float>(r));
+        osg::ref_ptr<osg::Geometry> geometry = osgParametric::createSideWalls(baseOrigin, topOrigin, uAxis, vAxis, uCells, vCells);
+        parametric_group->addChild(geometry.get());
     }
-    normals->push_back(osg::Vec3(1.0f,0.0f,0.0f));
-    geometry->addPrimitiveSet(new osg::DrawArrays(GL_TRIANGLE_STRIP, vn, vertices->size()-vn));
 
-    vn = vertices->size();
-    r = 0;
-    for(c=uCells; c>=0; --c)
+    if (instanceColumns>0 && instanceRows>0)
     {
-        vertices->push_back(baseOrigin + ua*static_cast<float>(c) + va*static_cast<float>(r));
-        vertices->push_back(topOrigin + ua*static_cast<float>(c) + va*static_cast<float>(r));
+        osgParametric::SurfaceInstances::Instances list;
+        for(unsigned int r=0; r<instanceRows; ++r)
+        {
+            for(unsigned int c=0; c<instanceColumns; ++c)
+            {
+                osg::Vec3 instanceOrigin = uAxis*(static_cast<float>(c)*instanceSpacing) + vAxis*(static_cast<float>(r)*instanceSpacing);
+                osg::Vec4 parameters(static_cast<float>(c)/static_cast<float>(std::max(1u, instanceColumns-1)),
+                                     static_cast<float>(r)/static_cast<float>(std::max(1u, instanceRows-1)), 0.0f, 0.0f);
+                list.push_back(osgParametric::SurfaceInstances::Instance(instanceOrigin, osg::Vec3(1.0f, 0.0f, 0.0f), osg::Vec3(0.0f, 1.0f, 0.0f), parameters));
+            }
+        }
+
+        // SurfaceLOD and paged surfaces build their own patches, so only the grids are instanced
+        osg::ref_ptr<osgParametric::SurfaceInstances> instances = new osgParametric::SurfaceInstances;
+        instances->setInstances(list);
+        instances->instanceSurfaces(parametric_group.get());
     }
-    normals->push_back(osg::Vec3(0.0f,-1.0f,0.0f));
-    geometry->addPrimitiveSet(new osg::DrawArrays(GL_TRIANGLE_STRIP, vn, vertices->size()-vn));
 
-    geometry->setVertexArray(vertices);
+    return parametric_group;
+}
 
-    // set up normal
-    osg::Vec3 verticalAxis(uAxis ^ vAxis);
-    verticalAxis.normalize();
+/** Create an offscreen pbuffer for the viewer's master camera, falling back to an undecorated window where pbuffers aren't supported.*/
+bool setUpBenchmarkContext(osgViewer::Viewer& viewer, unsigned int width, unsigned int height)
+{
+    osg::ref_ptr<osg::GraphicsContext::Traits> traits = new osg::GraphicsContext::Traits;
+    traits->x = 0;
+    traits->y = 0;
+    traits->width = width;
+    traits->height = height;
+    traits->red = 8;
+    traits->green = 8;
+    traits->blue = 8;
+    traits->alpha = 8;
+    traits->depth = 24;
+    traits->doubleBuffer = false;
+    traits->sharedContext = 0;
+    traits->pbuffer = true;
+
+    osg::ref_ptr<osg::GraphicsContext> gc = osg::GraphicsContext::createGraphicsContext(traits.get());
+    if (!gc)
+    {
+        OSG_NOTICE<<"Benchmark: pbuffer not available, using an undecorated window instead"<<std::endl;
+
+        traits->pbuffer = false;
+        traits->doubleBuffer = true;
+        traits->windowDecoration = false;
+        gc = osg::GraphicsContext::createGraphicsContext(traits.get());
+        if (!gc) return false;
+    }
 
-    geometry->getOrCreateStateSet()->addUniform(new osg::Uniform("verticalAxis", verticalAxis));
+    osg::Camera* camera = viewer.getCamera();
+    camera->setGraphicsContext(gc.get());
+    camera->setViewport(new osg::Viewport(0, 0, width, height));
+    camera->setProjectionMatrixAsPerspective(30.0, static_cast<double>(width)/static_cast<double>(height), 1.0, 10000.0);
 
-    // set up colour
-    osg::Vec4 color(1.0,1.0,1.0,1.0);
-    osg::ref_ptr<osg::Vec4Array> colours = new osg::Vec4Array;
-    colours->push_back(color);
-    geometry->setColorArray(colours, osg::Array::BIND_OVERALL);
+    GLenum buffer = traits->doubleBuffer ? GL_BACK : GL_FRONT;
+    camera->setDrawBuffer(buffer);
+    camera->setReadBuffer(buffer);
 
+    return true;
+}
 
-    // set up mesh
+/** Per pass timings gathered by the benchmark, in milliseconds.*/
+struct BenchmarkPass
+{
+    BenchmarkPass(const std::string& n): name(n) {}
 
-    OSG_NOTICE<<"numVertices = "<<numVertices<<std::endl;
-    OSG_NOTICE<<"numVertices>>16 = "<<(numVertices>>16)<<std::endl;
+    struct Sample
+    {
+        Sample(unsigned int f, double c, double d, double g): frameNumber(f), cullTime(c), drawTime(d), gpuTime(g) {}
 
-    osg::Vec3 wAxis = verticalAxis*((uAxis.length()+vAxis.length())*0.5);
+        unsigned int    frameNumber;
+        double          cullTime;
+        double          drawTime;
+        double          gpuTime;
+    };
 
-    osg::BoundingBox bb;
-    bb.expandBy(baseOrigin);
-    bb.expandBy(baseOrigin+uAxis);
-    bb.expandBy(baseOrigin+vAxis);
-    bb.expandBy(baseOrigin+uAxis+vAxis);
+    std::string             name;
+    std::vector<Sample>     samples;
+};
 
-    bb.expandBy(baseOrigin+wAxis);
-    bb.expandBy(baseOrigin+uAxis+wAxis);
-    bb.expandBy(baseOrigin+vAxis+wAxis);
-    bb.expandBy(baseOrigin+uAxis+vAxis+wAxis);
+typedef std::vector<BenchmarkPass> BenchmarkPasses;
 
-    bb.expandBy(baseOrigin-wAxis);
-    bb.expandBy(baseOrigin+uAxis-wAxis);
-    bb.expandBy(baseOrigin+vAxis-wAxis);
-    bb.expandBy(baseOrigin+uAxis+vAxis-wAxis);
+void writeStatistics(std::ostream& out, const char* name, const std::vector<double>& values)
+{
+    out<<"      \""<<name<<"\": ";
+    if (values.empty())
+    {
+        out<<"null";
+        return;
+    }
 
-    geometry->setInitialBound(bb);
+    double total = 0.0;
+    for(std::vector<double>::const_iterator itr = values.begin(); itr != values.end(); ++itr) total += *itr;
 
-    return geometry;
+    out<<"{ \"mean\": "<<total/static_cast<double>(values.size())
+       <<", \"min\": "<<*std::min_element(values.begin(), values.end())
+       <<", \"max\": "<<*std::max_element(values.begin(), values.end())<<" }";
 }
 
-osg::ref_ptr<osg::Program> createProgram(osg::ArgumentParser& arguments)
+/** Render numFrames frames orbiting the scene and gather the cull, draw and GPU times of the depth passes, the main camera and the whole frame.
+  * Frame is the viewer's own osg::Stats, Main is the main camera on its own with the cull time of the depth passes and render subgraphs subtracted.*/
+BenchmarkPasses runBenchmark(osgViewer::Viewer& viewer, osgParametric::ParametricScene* ps, osg::GraphicsContext* gc, unsigned int numFrames)
 {
-    osg::ref_ptr<osg::Program> program = new osg::Program;
+    osg::Camera* camera = viewer.getCamera();
+    camera->setStats(new osg::Stats("Camera", numFrames+64));
+    camera->getStats()->collectStats("rendering", true);
+    camera->getStats()->collectStats("gpu", true);
 
-    std::string filename;
-    typedef std::map<osg::Shader::Type, osg::ref_ptr<osg::Shader> > ShaderMap;
-    ShaderMap shaders;
+    osg::ref_ptr<osgParametric::PassTimer> mainTimer = new osgParametric::PassTimer("Main");
+    mainTimer->setMaxNumRecords(numFrames+64);
+    mainTimer->attach(camera);
 
-    while(arguments.read("--shader",filename))
+    const osgParametric::ParametricScene::PassTimers& passTimers = ps->getPassTimers();
+    for(osgParametric::ParametricScene::PassTimers::const_iterator itr = passTimers.begin(); itr != passTimers.end(); ++itr)
     {
-        osg::ref_ptr<osg::Shader> shader = osgDB::readRefShaderFile(filename);
-        if (shader.valid())
+        (*itr)->setMaxNumRecords(numFrames+64);
+    }
+
+    // fixed path, one orbit around the scene over the measured frames, after a few frames to compile and upload everything
+    const osg::BoundingSphere& bs = ps->getBound();
+    double radius = bs.valid() ? bs.radius()*2.5 : 10.0;
+    const unsigned int numWarmupFrames = 10;
+    const unsigned int numFlushFrames = 4;
+
+    std::vector<unsigned int> frameNumbers;
+    for(unsigned int i=0; i<numWarmupFrames+numFrames+numFlushFrames; ++i)
+    {
+        double angle = (i<numWarmupFrames) ? 0.0 : osg::PI*2.0*static_cast<double>(i-numWarmupFrames)/static_cast<double>(numFrames);
+        osg::Vec3d eye = osg::Vec3d(bs.center()) + osg::Vec3d(cos(angle), sin(angle), 0.6)*radius;
+        camera->setViewMatrixAsLookAt(eye, bs.center(), osg::Vec3d(0.0, 0.0, 1.0));
+
+        viewer.frame();
+
+        if (i>=numWarmupFrames && i<numWarmupFrames+numFrames) frameNumbers.push_back(viewer.getFrameStamp()->getFrameNumber());
+    }
+
+    // read back any outstanding timer queries
+    if (gc->makeCurrent())
+    {
+        mainTimer->collectGPUResults(*(gc->getState()), true);
+        for(osgParametric::ParametricScene::PassTimers::const_iterator itr = passTimers.begin(); itr != passTimers.end(); ++itr)
         {
-            shaders[shader->getType()] = shader;
+            (*itr)->collectGPUResults(*(gc->getState()), true);
         }
+        gc->releaseContext();
     }
 
-    for(ShaderMap::iterator itr = shaders.begin();
-        itr != shaders.end();
-        ++itr)
+    BenchmarkPasses passes;
+    for(osgParametric::ParametricScene::PassTimers::const_iterator itr = passTimers.begin(); itr != passTimers.end(); ++itr)
     {
-        program->addShader(itr->second);
+        passes.push_back(BenchmarkPass((*itr)->getName()));
     }
+    passes.push_back(BenchmarkPass(mainTimer->getName()));
+    passes.push_back(BenchmarkPass("Frame"));
 
-    return program;
-}
-
-osg::ref_ptr<osg::Group> createParametric(osg::ArgumentParser& arguments)
-{
-    osg::ref_ptr<osg::Group> parametric_group = new osg::Group;
-    parametric_group->setName("ParametricGroup");
+    for(std::vector<unsigned int>::iterator fitr = frameNumbers.begin(); fitr != frameNumbers.end(); ++fitr)
+    {
+        unsigned int frameNumber = *fitr;
 
-    osg::Vec3 origin(0.0, 0.0, 0.0);
-    osg::Vec3 uAxis(1.0,0.0,0.0);
-    osg::Vec3 vAxis(0.0,1.0,0.0);
+        double depthCullTime = 0.0;
+        osgParametric::PassTimer::Record record;
+        for(unsigned int i=0; i<passTimers.size(); ++i)
+        {
+            if (!passTimers[i]->getRecord(frameNumber, record)) continue;
 
-    unsigned int uCells = 10;
-    unsigned int vCells = 10;
+            passes[i].samples.push_back(BenchmarkPass::Sample(frameNumber, record.cullTime, record.drawTime, record.gpuTime));
+            depthCullTime += record.cullTime;
+        }
 
-    while (arguments.read("--columns", uCells)) {}
-    while (arguments.read("--rows", vCells)) {}
+        double cullTime = 0.0, drawTime = 0.0, gpuTime = 0.0;
+        osg::Stats* stats = camera->getStats();
+        stats->getAttribute(frameNumber, "Cull traversal time taken", cullTime);
+        stats->getAttribute(frameNumber, "Draw traversal time taken", drawTime);
+        if (!stats->getAttribute(frameNumber, "GPU draw time taken", gpuTime)) gpuTime = -0.001;
 
-    osg::Vec3 baseOrigin = origin;
-    osg::Vec3 topOrigin = baseOrigin+osg::Vec3(0.0,0.0,1.0);
+        if (mainTimer->getRecord(frameNumber, record))
+        {
+            passes[passTimers.size()].samples.push_back(BenchmarkPass::Sample(frameNumber, std::max(0.0, cullTime*1000.0-depthCullTime), record.drawTime, record.gpuTime));
+        }
 
-    bool renderBase = false;
-    bool renderTop = true;
-    bool renderSidewalls = false;
+        passes[passTimers.size()+1].samples.push_back(BenchmarkPass::Sample(frameNumber, cullTime*1000.0, drawTime*1000.0, gpuTime*1000.0));
+    }
 
-    while (arguments.read("--base")) renderBase=true;
-    while (arguments.read("--top")) renderTop=true;
-    while (arguments.read("--walls")) renderSidewalls=true;
-    while (arguments.read("--all")) { renderBase = true; renderTop = true; renderSidewalls = true; }
+    return passes;
+}
 
-    std::string function;
-    while(arguments.read("--Z_FUNCTION", function)) { parametric_group->getOrCreateStateSet()->setDefine("Z_FUNCTION", function); }
-    while(arguments.read("--Z_BASE", function)) { parametric_group->getOrCreateStateSet()->setDefine("Z_BASE", function); }
-    while(arguments.read("--Z_TOP", function)) { parametric_group->getOrCreateStateSet()->setDefine("Z_TOP", function); }
+void writeBenchmarkCSV(const std::string& filename, const BenchmarkPasses& passes)
+{
+    std::ofstream fout(filename.c_str());
+    if (!fout)
+    {
+        OSG_NOTICE<<"Benchmark: unable to write "<<filename<<std::endl;
+        return;
+    }
 
-    std::string name;
-    float value;
-    while(arguments.read("--uniform",name,value))
+    fout<<"frame,pass,cull_ms,draw_ms,gpu_ms"<<std::endl;
+    for(BenchmarkPasses::const_iterator pitr = passes.begin(); pitr != passes.end(); ++pitr)
     {
-        parametric_group->getOrCreateStateSet()->addUniform(new osg::Uniform(name.c_str(), value));
+        for(std::vector<BenchmarkPass::Sample>::const_iterator sitr = pitr->samples.begin(); sitr != pitr->samples.end(); ++sitr)
+        {
+            fout<<sitr->frameNumber<<","<<pitr->name<<","<<sitr->cullTime<<","<<sitr->drawTime<<",";
+            if (sitr->gpuTime>=0.0) fout<<sitr->gpuTime;
+            fout<<std::endl;
+        }
     }
+}
 
+void writeBenchmarkSummary(std::ostream& out, const std::string& commandLine, unsigned int numFrames, unsigned int width, unsigned int height, const BenchmarkPasses& passes)
+{
+    out<<"{"<<std::endl;
 
-    // base
-    if (renderBase)
+    out<<"  \"arguments\": \"";
+    for(std::string::const_iterator itr = commandLine.begin(); itr != commandLine.end(); ++itr)
     {
-        osg::ref_ptr<osg::Geometry> geometry = createMesh(baseOrigin, uAxis, vAxis, uCells, vCells, false);
-        parametric_group->addChild(geometry.get());
+        if (*itr=='"' || *itr=='\\') out<<'\\';
+        out<<*itr;
     }
+    out<<"\","<<std::endl;
 
-    // top
-    if (renderTop)
+    out<<"  \"frames\": "<<numFrames<<","<<std::endl;
+    out<<"  \"width\": "<<width<<","<<std::endl;
+    out<<"  \"height\": "<<height<<","<<std::endl;
+    out<<"  \"passes\": ["<<std::endl;
+
+    for(BenchmarkPasses::const_iterator pitr = passes.begin(); pitr != passes.end(); ++pitr)
     {
-        osg::ref_ptr<osg::Geometry> geometry = createMesh(topOrigin, uAxis, vAxis, uCells, vCells, true);
-        parametric_group->addChild(geometry.get());
+        std::vector<double> cullTimes, drawTimes, gpuTimes;
+        for(std::vector<BenchmarkPass::Sample>::const_iterator sitr = pitr->samples.begin(); sitr != pitr->samples.end(); ++sitr)
+        {
+            cullTimes.push_back(sitr->cullTime);
+            drawTimes.push_back(sitr->drawTime);
+            if (sitr->gpuTime>=0.0) gpuTimes.push_back(sitr->gpuTime);
+        }
+
+        out<<"    {"<<std::endl;
+        out<<"      \"name\": \""<<pitr->name<<"\","<<std::endl;
+        out<<"      \"samples\": "<<pitr->samples.size()<<","<<std::endl;
+        writeStatistics(out, "cull_ms", cullTimes); out<<","<<std::endl;
+        writeStatistics(out, "draw_ms", drawTimes); out<<","<<std::endl;
+        writeStatistics(out, "gpu_ms", gpuTimes); out<<std::endl;
+        out<<"    }"<<((pitr+1)!=passes.end() ? "," : "")<<std::endl;
     }
 
-    // sidewalls
-    if (renderSidewalls)
+    out<<"  ]"<<std::endl;
+    out<<"}"<<std::endl;
+}
+
+class PickHandler : public osgGA::GUIEventHandler
+{
+public:
+
+    PickHandler(osgParametric::ParametricScene* ps):
+        _intersector(new osgParametric::SurfaceIntersector(ps)),
+        _built(false) {}
+
+    virtual bool handle(const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa)
     {
-        osg::ref_ptr<osg::Geometry> geometry = createSideWalls(baseOrigin, topOrigin, uAxis, vAxis, uCells, vCells);
-        parametric_group->addChild(geometry.get());
+        if (ea.getEventType()!=osgGA::GUIEventAdapter::KEYDOWN || ea.getKey()!='i') return false;
+
+        osgViewer::View* view = dynamic_cast<osgViewer::View*>(&aa);
+        osgParametric::ParametricScene* ps = _intersector->getScene();
+        if (!view || !ps || !ps->isSetup()) return false;
+
+        double simulationTime = view->getFrameStamp() ? view->getFrameStamp()->getSimulationTime() : 0.0;
+        if (_built) _intersector->update(simulationTime);
+        else { _intersector->build(simulationTime); _built = true; }
+
+        // segment through the mouse position from the near to the far plane
+        osg::Camera* camera = view->getCamera();
+        osg::Matrixd inverseVP;
+        if (!inverseVP.invert(camera->getViewMatrix()*camera->getProjectionMatrix())) return false;
+
+        osg::Vec3d start = osg::Vec3d(ea.getXnormalized(), ea.getYnormalized(), -1.0) * inverseVP;
+        osg::Vec3d end = osg::Vec3d(ea.getXnormalized(), ea.getYnormalized(), 1.0) * inverseVP;
+
+        osgParametric::SurfaceIntersector::Hit hit;
+        if (_intersector->intersect(start, end, hit))
+        {
+            OSG_NOTICE<<"Picked "<<hit.point<<" normal "<<hit.normal<<" cell "<<hit.column<<", "<<hit.row<<std::endl;
+        }
+        else
+        {
+            OSG_NOTICE<<"Picked nothing"<<std::endl;
+        }
+        return true;
     }
 
-    return parametric_group;
-}
+protected:
+
+    osg::ref_ptr<osgParametric::SurfaceIntersector> _intersector;
+    bool                                            _built;
+};
 
 int main(int argc, char** argv)
 {
     // use an ArgumentParser object to manage the program arguments.
     osg::ArgumentParser arguments(&argc,argv);
 
+    // the arguments are consumed as they're read, so keep a copy to record with the benchmark results
+    std::string commandLine;
+    for(int i=1; i<argc; ++i)
+    {
+        if (i>1) commandLine += " ";
+        commandLine += argv[i];
+    }
+
     osgViewer::Viewer viewer(arguments);
 
-    viewer.addEventHandler(new osgViewer::StatsHandler());
-    viewer.addEventHandler(new osgGA::StateSetManipulator(viewer.getCamera()->getOrCreateStateSet()));
+    // render a fixed camera path offscreen for N frames and report the per pass timings
+    unsigned int benchmarkFrames = 0;
+    while(arguments.read("--benchmark", benchmarkFrames)) {}
+
+    unsigned int benchmarkWidth = 1280;
+    unsigned int benchmarkHeight = 1024;
+    while(arguments.read("--benchmark-size", benchmarkWidth, benchmarkHeight)) {}
+
+    std::string benchmarkCSV;
+    while(arguments.read("--csv", benchmarkCSV)) {}
+
+    std::string benchmarkJSON;
+    while(arguments.read("--json", benchmarkJSON)) {}
+
+    if (benchmarkFrames>0)
+    {
+        if (!setUpBenchmarkContext(viewer, benchmarkWidth, benchmarkHeight))
+        {
+            OSG_NOTICE<<"Benchmark: unable to create a graphics context"<<std::endl;
+            return 1;
+        }
+
+        // keep each frame's cull and draw on the main thread so the timings are repeatable
+        viewer.setThreadingModel(osgViewer::ViewerBase::SingleThreaded);
+    }
+    else
+    {
+        viewer.addEventHandler(new osgViewer::StatsHandler());
+        viewer.addEventHandler(new osgGA::StateSetManipulator(viewer.getCamera()->getOrCreateStateSet()));
+    }
 
     viewer.realize();
 
-    osgViewer::ViewerBase::Windows windows;
-    viewer.getWindows(windows);
-    if (windows.empty())
+    osgViewer::ViewerBase::Contexts contexts;
+    viewer.getContexts(contexts);
+    if (contexts.empty())
     {
-        OSG_NOTICE<<"Warning: no windows created"<<std::endl;
+        OSG_NOTICE<<"Warning: no graphics contexts created"<<std::endl;
         return 0;
     }
 
 
-    osg::ref_ptr<osgParametric::ParametricScene> ps = new osgParametric::ParametricScene;
+    // load a scene written with -o rather than building one from the command line, its passes are set up on the first frame
+    std::string sceneFilename;
+    bool loadScene = arguments.read("--scene", sceneFilename);
+
+    osg::ref_ptr<osgParametric::ParametricScene> ps;
+    if (loadScene)
+    {
+        osg::ref_ptr<osg::Node> node = osgDB::readRefNodeFile(sceneFilename);
+        ps = dynamic_cast<osgParametric::ParametricScene*>(node.get());
+        if (!ps)
+        {
+            OSG_NOTICE<<"Warning: "<<sceneFilename<<" doesn't contain a ParametricScene"<<std::endl;
+            return 1;
+        }
+    }
+    else
+    {
+        ps = new osgParametric::ParametricScene;
+    }
 
-    // provide the ParametricScene node with the dimensions of the window so it can correctly size the textures
-    const osg::GraphicsContext::Traits* traits = windows.front()->getTraits();
+    // provide the ParametricScene node with the initial dimensions of the window, it follows the window when it's resized
+    const osg::GraphicsContext::Traits* traits = contexts.front()->getTraits();
     ps->setDimensions(traits->width, traits->height);
 
-    // aset up the shaders to do the parametric surface placement and depth textures
-    ps->getOrCreateStateSet()->setAttribute(createProgram(arguments));
+    // control how finely the surface functions are sampled when computing the bounds of the displaced surfaces
+    unsigned int boundsSampleDensity;
+    while(arguments.read("--bounds-samples", boundsSampleDensity)) ps->setBoundsSampleDensity(boundsSampleDensity);
 
+    float boundsMargin;
+    while(arguments.read("--bounds-margin", boundsMargin)) ps->setBoundsMargin(boundsMargin);
 
-    // assign the parametric surface
-    ps->addSubgraph(createParametric(arguments), true, true);
+    // render the boundary depths at a fraction of the window resolution, e.g. 0.5 or 0.25
+    float depthScale;
+    while(arguments.read("--depth-scale", depthScale)) ps->setDepthResolutionScale(depthScale);
+
+    // keep the linked shader program variants on disk so later runs can skip compiling them
+    std::string programCacheDirectory;
+    while(arguments.read("--program-cache", programCacheDirectory)) ps->setProgramCache(new osgParametric::ProgramCache(programCacheDirectory));
+
+    bool precompile = false;
+    while(arguments.read("--precompile")) precompile = true;
+
+    // precision of the boundary depth textures, 16, 24 or 32f
+    std::string depthFormat;
+    while(arguments.read("--depth-format", depthFormat))
+    {
+        if (depthFormat=="16") ps->setDepthTextureFormat(GL_DEPTH_COMPONENT16);
+        else if (depthFormat=="24") ps->setDepthTextureFormat(GL_DEPTH_COMPONENT24);
+        else if (depthFormat=="32f") ps->setDepthTextureFormat(GL_DEPTH_COMPONENT32F);
+        else OSG_NOTICE<<"Warning: unsupported --depth-format "<<depthFormat<<", use 16, 24 or 32f"<<std::endl;
+    }
+
+    // cap the memory of the views' depth textures in megabytes, released textures are evicted least recently used first
+    unsigned int depthBudget;
+    while(arguments.read("--depth-budget", depthBudget)) ps->getRenderTargetPool()->setMemoryBudget(static_cast<unsigned long long>(depthBudget)*1024*1024);
+
+    // capture all the boundaries in a single texture array, one pass per boundary and no limit on their number
+    while(arguments.read("--depth-range-array")) ps->setDepthCaptureMode(osgParametric::ParametricScene::DEPTH_RANGE_ARRAY);
+
+    // size in pixels of the screen tiles the boundaries are binned over, 0 tests every boundary on every fragment
+    unsigned int boundaryTileSize;
+    while(arguments.read("--boundary-tile-size", boundaryTileSize)) ps->setBoundaryTileSize(boundaryTileSize);
+
+    // normals are computed from the analytic derivatives of the surface functions unless finite differences are requested
+    while(arguments.read("--finite-difference-normals")) ps->setUseAnalyticNormals(false);
+
+    // time each depth pass and render subgraph, must be set before setup() creates them, 'p' then shows the pass stats page
+    bool passStats = false;
+    while(arguments.read("--pass-stats")) passStats = true;
+    if (passStats || benchmarkFrames>0) ps->setCollectPassTimes(true);
+
+    // a loaded scene already has its shaders and parametric surface, further boundaries can still be added to it
+    if (!loadScene)
+    {
+        // aset up the shaders to do the parametric surface placement and depth textures
+        ps->getOrCreateStateSet()->setAttribute(createProgram(arguments));
+
+        // assign the parametric surface
+        ps->addSubgraph(createParametric(arguments), true, true);
+    }
 
     bool visibleBoundaries = false;
     while(arguments.read("-b")) visibleBoundaries = true;
@@ -388,12 +714,87 @@ int main(int argc, char** argv)
     }
 
 
-    // create the subgraphs that will do all the rendering
-    ps->setup();
+    // create the subgraphs that will do all the rendering, precompiling and benchmarking need them before the first frame
+    if (!loadScene || precompile || benchmarkFrames>0) ps->setup();
 
 
     viewer.setSceneData( ps.get() );
 
+    if (passStats && benchmarkFrames==0) viewer.addEventHandler(new osgParametric::ParametricStatsHandler(ps.get()));
+
+    // press i to print the point of the displaced surface under the mouse
+    bool pick = false;
+    while(arguments.read("--pick")) pick = true;
+    if (pick && benchmarkFrames==0) viewer.addEventHandler(new PickHandler(ps.get()));
+
+    if (precompile)
+    {
+        // compile every program variant up front rather than as each is first drawn
+        osg::Timer_t startTick = osg::Timer::instance()->tick();
+
+        viewer.stopThreading();
+        for(osgViewer::ViewerBase::Contexts::iterator itr = contexts.begin();
+            itr != contexts.end();
+            ++itr)
+        {
+            if (!(*itr)->makeCurrent()) continue;
+
+            osg::ref_ptr<osgParametric::CompileProgramsOperation> operation = new osgParametric::CompileProgramsOperation(ps.get());
+            (*operation)(*itr);
+
+            (*itr)->releaseContext();
+        }
+        viewer.startThreading();
+
+        OSG_NOTICE<<"Precompiled programs in "<<osg::Timer::instance()->delta_m(startTick, osg::Timer::instance()->tick())<<"ms";
+        if (ps->getProgramCache()) OSG_NOTICE<<", "<<ps->getProgramCache()->getNumHits()<<" loaded from the cache, "<<ps->getProgramCache()->getNumMisses()<<" compiled";
+        OSG_NOTICE<<std::endl;
+    }
+
+    unsigned int analyticsSamples = 0;
+    while(arguments.read("--analytics", analyticsSamples)) {}
+    if (analyticsSamples>0)
+    {
+        // report the clipped areas and enclosed volumes rather than rendering
+        if (!ps->isSetup()) ps->setup();
+
+        osg::ref_ptr<osgParametric::SurfaceAnalytics> analytics = new osgParametric::SurfaceAnalytics(ps.get());
+        analytics->setSamplesPerCell(analyticsSamples);
+
+        osg::Timer_t startTick = osg::Timer::instance()->tick();
+        osgParametric::SurfaceAnalytics::Results results = analytics->compute();
+        double duration = osg::Timer::instance()->delta_m(startTick, osg::Timer::instance()->tick());
+
+        unsigned long long numSamples = 0;
+        for(osgParametric::SurfaceAnalytics::Results::const_iterator itr = results.begin(); itr != results.end(); ++itr)
+        {
+            std::cout<<"Subgraph "<<itr->subgraph<<": ";
+            if (itr->base.valid() && itr->top.valid()) std::cout<<"volume "<<itr->volume<<" +/- "<<itr->volumeError<<", ";
+            if (itr->base.valid()) std::cout<<"base area "<<itr->baseArea<<" +/- "<<itr->baseAreaError<<", ";
+            if (itr->top.valid()) std::cout<<"top area "<<itr->topArea<<" +/- "<<itr->topAreaError<<", ";
+            std::cout<<itr->numSamples<<" samples"<<std::endl;
+            numSamples += itr->numSamples;
+        }
+        std::cout<<"Integrated "<<numSamples<<" samples in "<<duration<<"ms"<<std::endl;
+        return 0;
+    }
+
+    std::string exportFilename;
+    if (arguments.read("--export", exportFilename))
+    {
+        // bake the displaced, clipped surfaces into plain triangles for tools that can't run the shaders
+        if (!ps->isSetup()) ps->setup();
+
+        osg::ref_ptr<osgParametric::MeshExporter> exporter = new osgParametric::MeshExporter(ps.get());
+
+        osg::Timer_t startTick = osg::Timer::instance()->tick();
+        bool written = exporter->write(exportFilename);
+        double duration = osg::Timer::instance()->delta_m(startTick, osg::Timer::instance()->tick());
+
+        if (written) std::cout<<"Exported "<<exporter->getNumTriangles()<<" triangles to "<<exportFilename<<" in "<<duration<<"ms"<<std::endl;
+        return written ? 0 : 1;
+    }
+
     std::string filename;
     if (arguments.read("-o",filename))
     {
@@ -401,5 +802,25 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    if (benchmarkFrames>0)
+    {
+        BenchmarkPasses passes = runBenchmark(viewer, ps.get(), contexts.front(), benchmarkFrames);
+
+        if (!benchmarkCSV.empty()) writeBenchmarkCSV(benchmarkCSV, passes);
+
+        if (!benchmarkJSON.empty())
+        {
+            std::ofstream fout(benchmarkJSON.c_str());
+            if (fout) writeBenchmarkSummary(fout, commandLine, benchmarkFrames, benchmarkWidth, benchmarkHeight, passes);
+            else OSG_NOTICE<<"Benchmark: unable to write "<<benchmarkJSON<<std::endl;
+        }
+        else
+        {
+            writeBenchmarkSummary(std::cout, commandLine, benchmarkFrames, benchmarkWidth, benchmarkHeight, passes);
+        }
+
+        return 0;
+    }
+
     return viewer.run();
 }
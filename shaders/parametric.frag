@@ -1,4 +1,8 @@
-#pragma import_defines(NUM_DEPTH_TEXTURES)
+#pragma import_defines(NUM_DEPTH_TEXTURES, DEPTH_RANGE_ARRAY, DEPTH_RANGE_PASS, CONSERVATIVE_DEPTH, BOUNDARY_TILES, DEPTH_ONLY)
+
+#ifdef DEPTH_RANGE_ARRAY
+#extension GL_EXT_texture_array : require
+#endif
 
 #ifndef NUM_DEPTH_TEXTURES
     #define NUM_DEPTH_TEXTURES 0
@@ -10,57 +14,142 @@ varying vec4 color;
 varying vec4 v;
 
 
-#if NUM_DEPTH_TEXTURES>=1
 uniform vec4 viewportDimensions;
+
+#ifdef BOUNDARY_TILES
+uniform sampler2D boundaryTiles; // (number of boundaries whose bounds miss the tile, sum of their indices)
+uniform vec2 boundaryTileScale;
+uniform float excludedBoundary;
+#endif
+
+#ifdef DEPTH_RANGE_ARRAY
+uniform sampler2DArray depthRanges; // (-nearest depth, furthest depth) of each boundary
+uniform int numDepthRanges;
+uniform int excludedDepthRange;
+uniform float depthRangeResolutionScale;
+#endif
+
+#if NUM_DEPTH_TEXTURES>=1
 uniform sampler2D frontDepthTexture0;
 uniform sampler2D backDepthTexture0;
+uniform float depthResolutionScale0;
 #endif
 
 #if NUM_DEPTH_TEXTURES>=2
 uniform sampler2D frontDepthTexture1;
 uniform sampler2D backDepthTexture1;
+uniform float depthResolutionScale1;
 #endif
 
 #if NUM_DEPTH_TEXTURES>=3
 uniform sampler2D frontDepthTexture2;
 uniform sampler2D backDepthTexture2;
+uniform float depthResolutionScale2;
 #endif
 
 #if NUM_DEPTH_TEXTURES>=4
 uniform sampler2D frontDepthTexture3;
 uniform sampler2D backDepthTexture3;
+uniform float depthResolutionScale3;
 #endif
 
-bool outside(vec2 texcoord, float depth, sampler2D backDepthTexture, sampler2D frontDepthTexture)
+#ifdef CONSERVATIVE_DEPTH
+// Offsets to the centres of the 2x2 texels around texcoord, zero for full resolution depth. The boundary's depth at a pixel lies
+// between the depths at the surrounding texel centres, so a fragment is only clipped when it's outside the range of all four.
+vec2 texelOffset(float scale)
 {
+    return (scale<1.0) ? 0.5/(viewportDimensions.zw*scale) : vec2(0.0, 0.0);
+}
+#endif
+
+bool outside(vec2 texcoord, float depth, sampler2D backDepthTexture, sampler2D frontDepthTexture, float scale)
+{
+#ifdef CONSERVATIVE_DEPTH
+    vec2 o = texelOffset(scale);
+    vec2 p = vec2(o.x, -o.y);
+
+    float backDepth0 = max(max(texture2D( backDepthTexture, texcoord-o).s, texture2D( backDepthTexture, texcoord+o).s),
+                           max(texture2D( backDepthTexture, texcoord-p).s, texture2D( backDepthTexture, texcoord+p).s));
+    if (depth>backDepth0) return true;
+
+    float frontDepth0 = min(min(texture2D( frontDepthTexture, texcoord-o).s, texture2D( frontDepthTexture, texcoord+o).s),
+                            min(texture2D( frontDepthTexture, texcoord-p).s, texture2D( frontDepthTexture, texcoord+p).s));
+    return (depth<frontDepth0);
+#else
     float backDepth0 = texture2D( backDepthTexture, texcoord).s;
     if (depth>backDepth0) return true;
 
     float frontDepth0 = texture2D( frontDepthTexture, texcoord).s;
     return (depth<frontDepth0);
+#endif
 }
 
 void main(void)
 {
-#if NUM_DEPTH_TEXTURES>=1
+#if defined(DEPTH_RANGE_PASS)
+
+    // blended with GL_MAX to keep the nearest and furthest depth of the boundary
+    gl_FragColor = vec4(-gl_FragCoord.z, gl_FragCoord.z, 0.0, 0.0);
+
+#elif defined(DEPTH_ONLY)
+
+    // only the depth buffer is attached, and the boundaries aren't clipped while capturing their depths
+    gl_FragColor = color;
+
+#else
+
+#if defined(DEPTH_RANGE_ARRAY) || NUM_DEPTH_TEXTURES>=1
 
     float depth = gl_FragCoord.z;
 
     vec2 texcoord = vec2((gl_FragCoord.x-viewportDimensions[0])/viewportDimensions[2], (gl_FragCoord.y-viewportDimensions[1])/viewportDimensions[3]);
 
-    if (outside(texcoord, depth, backDepthTexture0, frontDepthTexture0)) discard;
+#ifdef BOUNDARY_TILES
+    // outside a boundary that misses the tile, unless it's the only one missing and is this subgraph's own
+    vec2 missing = texture2D(boundaryTiles, texcoord*boundaryTileScale).rg;
+    if (missing.r>1.5 || (missing.r>0.5 && abs(missing.g-excludedBoundary)>0.5)) discard;
+#endif
+
+#endif
+
+#if defined(DEPTH_RANGE_ARRAY)
+
+#ifdef CONSERVATIVE_DEPTH
+    vec2 o = texelOffset(depthRangeResolutionScale);
+    vec2 p = vec2(o.x, -o.y);
+#endif
+
+    for(int i=0; i<numDepthRanges; ++i)
+    {
+        if (i==excludedDepthRange) continue;
+
+        float layer = float(i);
+#ifdef CONSERVATIVE_DEPTH
+        vec2 range = max(max(texture2DArray(depthRanges, vec3(texcoord-o, layer)).rg, texture2DArray(depthRanges, vec3(texcoord+o, layer)).rg),
+                         max(texture2DArray(depthRanges, vec3(texcoord-p, layer)).rg, texture2DArray(depthRanges, vec3(texcoord+p, layer)).rg));
+#else
+        vec2 range = texture2DArray(depthRanges, vec3(texcoord, layer)).rg;
+#endif
+        if (depth<-range.r || depth>range.g) discard;
+    }
+
+#elif NUM_DEPTH_TEXTURES>=1
+
+    if (outside(texcoord, depth, backDepthTexture0, frontDepthTexture0, depthResolutionScale0)) discard;
 
     #if NUM_DEPTH_TEXTURES>=2
-        if (outside(texcoord, depth, backDepthTexture1, frontDepthTexture1)) discard;
+        if (outside(texcoord, depth, backDepthTexture1, frontDepthTexture1, depthResolutionScale1)) discard;
     #endif
 
     #if NUM_DEPTH_TEXTURES>=3
-        if (outside(texcoord, depth, backDepthTexture2, frontDepthTexture2)) discard;
+        if (outside(texcoord, depth, backDepthTexture2, frontDepthTexture2, depthResolutionScale2)) discard;
     #endif
 
     #if NUM_DEPTH_TEXTURES>=4
-        if (outside(texcoord, depth, backDepthTexture3, frontDepthTexture3)) discard;
+        if (outside(texcoord, depth, backDepthTexture3, frontDepthTexture3, depthResolutionScale3)) discard;
     #endif
 #endif
     gl_FragColor = color;
+
+#endif
 }
@@ -1,4 +1,12 @@
-#pragma import_defines(Z_FUNCTION, Z_BASE, Z_TOP)
+#pragma import_defines(Z_FUNCTION, Z_BASE, Z_TOP, Z_DX, Z_DY, Z_BASE_DX, Z_BASE_DY, Z_TOP_DX, Z_TOP_DY, Z_HEIGHTFIELD, GRID_VERTEX_ID, GRID_TOP, SURFACE_INSTANCES, SURFACE_BASE, SURFACE_TOP, SURFACE_WALLS, DEPTH_ONLY)
+
+#if defined(GRID_VERTEX_ID) || defined(SURFACE_INSTANCES)
+#extension GL_EXT_gpu_shader4 : require
+#endif
+
+#ifdef SURFACE_INSTANCES
+#extension GL_ARB_draw_instanced : require
+#endif
 
 uniform vec3 verticalAxis;
 uniform float osg_SimulationTime;
@@ -6,20 +14,121 @@ uniform float osg_SimulationTime;
 varying vec4 color;
 varying vec4 v;
 
+#ifdef SURFACE_INSTANCES
+// origin, u axis, v axis and parameters of each instance drawn by SurfaceInstances
+uniform samplerBuffer surfaceInstances;
+
+// read by the surface functions, set from the instance before evaluating them
+float instanceParameter0;
+float instanceParameter1;
+float instanceParameter2;
+float instanceParameter3;
+#endif
+
+#ifdef Z_HEIGHTFIELD
+// heights sampled from the frame of a HeightFieldTexture replace the surface functions
+uniform sampler2D heightField;
+uniform vec4 heightFieldExtents; // origin and size in x and y of the area the frame covers
+uniform vec2 heightFieldResolution; // number of columns and rows in the frame
+
+float heightFieldZ(float x, float y)
+{
+    // corner samples sit at the corners of the area, so map onto the texel centres
+    vec2 grid = (vec2(x, y)-heightFieldExtents.xy)/heightFieldExtents.zw*(heightFieldResolution-1.0);
+    return texture2DLod(heightField, (grid+0.5)/heightFieldResolution, 0.0).r;
+}
+
+// central differences across one cell of the frame
+float heightFieldDX(float x, float y)
+{
+    float dx = heightFieldExtents.z/max(heightFieldResolution.x-1.0, 1.0);
+    return (heightFieldZ(x+dx, y)-heightFieldZ(x-dx, y))/(2.0*dx);
+}
+
+float heightFieldDY(float x, float y)
+{
+    float dy = heightFieldExtents.w/max(heightFieldResolution.y-1.0, 1.0);
+    return (heightFieldZ(x, y+dy)-heightFieldZ(x, y-dy))/(2.0*dy);
+}
+
+#undef Z_FUNCTION
+#undef Z_DX
+#undef Z_DY
+#define Z_FUNCTION(x,y,z) heightFieldZ(x,y)
+#define Z_DX(x,y,z) heightFieldDX(x,y)
+#define Z_DY(x,y,z) heightFieldDY(x,y)
+#endif
+
+// SurfaceGeometry defines SURFACE_BASE or SURFACE_TOP for grids whose vertices all fall on one side of the z==0.0 selection
 #if !defined(Z_FUNCTION) && defined(Z_BASE) && defined(Z_TOP)
-    #define Z_FUNCTION(x,y,z) ((z==0.0) ? Z_BASE(x,y,z) : Z_TOP(x,y,z))
+    #if defined(SURFACE_BASE)
+        #define Z_FUNCTION(x,y,z) Z_BASE(x,y,z)
+        #if defined(Z_BASE_DX) && defined(Z_BASE_DY)
+            #define Z_DX(x,y,z) Z_BASE_DX(x,y,z)
+            #define Z_DY(x,y,z) Z_BASE_DY(x,y,z)
+        #endif
+    #elif defined(SURFACE_TOP)
+        #define Z_FUNCTION(x,y,z) Z_TOP(x,y,z)
+        #if defined(Z_TOP_DX) && defined(Z_TOP_DY)
+            #define Z_DX(x,y,z) Z_TOP_DX(x,y,z)
+            #define Z_DY(x,y,z) Z_TOP_DY(x,y,z)
+        #endif
+    #else
+        #define Z_FUNCTION(x,y,z) ((z==0.0) ? Z_BASE(x,y,z) : Z_TOP(x,y,z))
+        #if defined(Z_BASE_DX) && defined(Z_BASE_DY) && defined(Z_TOP_DX) && defined(Z_TOP_DY)
+            #define Z_DX(x,y,z) ((z==0.0) ? Z_BASE_DX(x,y,z) : Z_TOP_DX(x,y,z))
+            #define Z_DY(x,y,z) ((z==0.0) ? Z_BASE_DY(x,y,z) : Z_TOP_DY(x,y,z))
+        #endif
+    #endif
+#endif
+
+#ifdef GRID_VERTEX_ID
+uniform vec3 gridOrigin;
+uniform vec3 gridUAxis;
+uniform vec3 gridVAxis;
+uniform ivec2 gridCells;
+uniform ivec4 gridTile; // first column, first row and number of cells of the tile being drawn
+
+// each cell is drawn as the GL_TRIANGLES (p0,p1,p2),(p2,p1,p3), or (p0,p2,p1),(p2,p3,p1) for the top,
+// with p0=(c,r), p1=(c,r+1), p2=(c+1,r), p3=(c+1,r+1). Bit i of the masks is the u/v offset of the i'th corner.
+#ifdef GRID_TOP
+    #define GRID_U_MASK 26
+    #define GRID_V_MASK 52
+#else
+    #define GRID_U_MASK 44
+    #define GRID_V_MASK 50
+#endif
+
+vec4 gridVertex()
+{
+    int cell = gl_VertexID / 6;
+    int corner = gl_VertexID - cell*6;
+    int r = cell / gridTile.z;
+    int c = cell - r*gridTile.z;
+
+    c += gridTile.x + ((GRID_U_MASK >> corner) & 1);
+    r += gridTile.y + ((GRID_V_MASK >> corner) & 1);
+
+    vec3 ua = gridUAxis / float(gridCells.x);
+    vec3 va = gridVAxis / float(gridCells.y);
+    return vec4(gridOrigin + ua*float(c) + va*float(r), 1.0);
+}
 #endif
 
 #ifdef Z_FUNCTION
 vec4 computePosition(float x, float y, float z)
 {
-    vec4 p = gl_Vertex;
+    vec4 p = vec4(x, y, z, 1.0);
     p.xyz += verticalAxis * Z_FUNCTION(x, y, z);
     return p;
 }
 
 vec3 computeNormal(float x, float y, float z)
 {
+#if defined(Z_DX) && defined(Z_DY)
+    // partial derivatives provided by ParametricScene
+    return normalize(vec3(-Z_DX(x, y, z), -Z_DY(x, y, z), 1.0));
+#else
     float delta = 0.001;
 
     float x_left = x-delta;
@@ -37,24 +146,70 @@ vec3 computeNormal(float x, float y, float z)
 
     vec3 norm = cross(x_delta, y_delta);
     return normalize(norm);
+#endif
 }
 #endif
 
+// normal of the displaced surface at an undisplaced vertex, for vertices that don't supply their own
+vec3 functionNormal(vec4 vertex)
+{
+#ifdef Z_FUNCTION
+    return computeNormal( vertex.x, vertex.y, vertex.z );
+#else
+    return verticalAxis;
+#endif
+}
+
 void main(void)
 {
+#ifdef GRID_VERTEX_ID
+    vec4 vertex = gridVertex();
+    vec3 n = vec3(0.0, 0.0, 0.0);
+#else
+    vec4 vertex = gl_Vertex;
     vec3 n = gl_Normal;
+#endif
+
+#ifdef SURFACE_INSTANCES
+    int instance = gl_InstanceIDARB*4;
+    vec3 instanceOrigin = texelFetchBuffer(surfaceInstances, instance).xyz;
+    vec3 instanceUAxis = texelFetchBuffer(surfaceInstances, instance+1).xyz;
+    vec3 instanceVAxis = texelFetchBuffer(surfaceInstances, instance+2).xyz;
+    vec4 instanceParameters = texelFetchBuffer(surfaceInstances, instance+3);
+    instanceParameter0 = instanceParameters.x;
+    instanceParameter1 = instanceParameters.y;
+    instanceParameter2 = instanceParameters.z;
+    instanceParameter3 = instanceParameters.w;
+#endif
 
 #ifdef Z_FUNCTION
-    v = computePosition( gl_Vertex.x, gl_Vertex.y, gl_Vertex.z);
+    v = computePosition( vertex.x, vertex.y, vertex.z);
+#else
+    v = vertex;
+#endif
 
-    if (n.x==0.0 && n.y==0.0 && n.z==0.0)
-    {
-        n = computeNormal( gl_Vertex.x, gl_Vertex.y, gl_Vertex.z );
-    }
+#if defined(DEPTH_ONLY) || defined(SURFACE_WALLS)
+    // depth passes aren't lit, and walls always supply their normals
+#elif defined(SURFACE_BASE) || defined(SURFACE_TOP)
+    // grids always leave their normals to the surface function
+    n = functionNormal(vertex);
 #else
-    v = gl_Vertex;
+    if (n.x==0.0 && n.y==0.0 && n.z==0.0) n = functionNormal(vertex);
+#endif
+
+#ifdef SURFACE_INSTANCES
+    // place the surface on the instance's axes, the normal by the inverse transpose of the axes
+    vec3 instanceWAxis = normalize(cross(instanceUAxis, instanceVAxis));
+    v = vec4(instanceOrigin + instanceUAxis*v.x + instanceVAxis*v.y + instanceWAxis*v.z, 1.0);
+    #ifndef DEPTH_ONLY
+        n = normalize(mat3(cross(instanceVAxis, instanceWAxis), cross(instanceWAxis, instanceUAxis), cross(instanceUAxis, instanceVAxis)) * n);
+    #endif
 #endif
 
+#ifdef DEPTH_ONLY
+    // the depth passes only need the position
+    color = vec4(1.0, 1.0, 1.0, 1.0);
+#else
     n = gl_NormalMatrix * n;
 
     vec4 lpos = gl_LightSource[0].position;
@@ -85,6 +240,7 @@ void main(void)
 #endif
 
     color.a = 1.0;
+#endif
 
     gl_Position = gl_ModelViewProjectionMatrix * v;
 }
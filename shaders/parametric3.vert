@@ -16,6 +16,22 @@ float Z_FUNCTION(float x, float y, float z)
     return ((z==0.0) ? Z_BASE(x,y,z) : Z_TOP(x,y,z));
 }
 
+vec2 Z_BASE_GRADIENT(float x, float y, float z)
+{
+    float d = -0.1*6.28*cos(x*y*6.28+osg_SimulationTime);
+    return vec2(d*y, d*x);
+}
+
+vec2 Z_TOP_GRADIENT(float x, float y, float z)
+{
+    return vec2((1.0-2.0*x)*(y-y*y)*5.0, (x-x*x)*(1.0-2.0*y)*5.0);
+}
+
+vec2 Z_GRADIENT(float x, float y, float z)
+{
+    return ((z==0.0) ? Z_BASE_GRADIENT(x,y,z) : Z_TOP_GRADIENT(x,y,z));
+}
+
 varying vec4 color;
 varying vec4 v;
 
@@ -28,23 +44,8 @@ vec4 computePosition(float x, float y, float z)
 
 vec3 computeNormal(float x, float y, float z)
 {
-    float delta = 0.001;
-
-    float x_left = x-delta;
-    float x_right = x+delta;
-    float y_below = y-delta;
-    float y_above = y+delta;
-
-    float z_left =  Z_FUNCTION(x_left, y, z);
-    float z_right = Z_FUNCTION(x_right, y, z);
-    float z_below = Z_FUNCTION(x, y_below, z);
-    float z_above = Z_FUNCTION(x, y_above, z);
-
-    vec3 x_delta = normalize(vec3(delta*2.0, 0.0, z_right-z_left));
-    vec3 y_delta = normalize(vec3(0.0, delta*2.0, z_above-z_below));
-
-    vec3 norm = cross(x_delta, y_delta);
-    return normalize(norm);
+    vec2 gradient = Z_GRADIENT(x, y, z);
+    return normalize(vec3(-gradient.x, -gradient.y, 1.0));
 }
 
 void main(void)
@@ -0,0 +1,254 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "BoundaryClipper.h"
+#include "ParametricScene.h"
+
+#include <osg/NodeVisitor>
+#include <osg/TriangleFunctor>
+
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+
+using namespace osgParametric;
+
+namespace
+{
+
+struct CollectTriangles
+{
+    CollectTriangles(): triangles(0) {}
+
+    void operator()(const osg::Vec3& v1, const osg::Vec3& v2, const osg::Vec3& v3)
+    {
+        triangles->push_back(osg::Vec3d(v1)*matrix);
+        triangles->push_back(osg::Vec3d(v2)*matrix);
+        triangles->push_back(osg::Vec3d(v3)*matrix);
+    }
+
+    osg::Matrixd                    matrix;
+    BoundaryClipper::Triangles*     triangles;
+};
+
+/** Collect the world coordinate triangles of a boundary, only the active children of LODs and Switches so that each
+  * surface of the solid is only counted once.*/
+class CollectTrianglesVisitor : public osg::NodeVisitor
+{
+public:
+
+    CollectTrianglesVisitor(BoundaryClipper::Triangles& triangles):
+        osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ACTIVE_CHILDREN),
+        _triangles(triangles) {}
+
+    virtual void apply(osg::Drawable& drawable)
+    {
+        if (dynamic_cast<SurfaceGeometry*>(&drawable)) return;
+
+        osg::TriangleFunctor<CollectTriangles> functor;
+        functor.matrix = osg::computeLocalToWorld(getNodePath());
+        functor.triangles = &_triangles;
+        drawable.accept(functor);
+    }
+
+protected:
+
+    BoundaryClipper::Triangles& _triangles;
+};
+
+inline double edgeFunction(const osg::Vec3d& a, const osg::Vec3d& b, double s, double t)
+{
+    return (b.x()-a.x())*(t-a.y()) - (b.y()-a.y())*(s-a.x());
+}
+
+/** Points on an edge shared by two triangles are only counted by the triangle on one side of it, so a line through the edge
+  * isn't counted as crossing the surface twice.*/
+inline bool insideEdge(const osg::Vec3d& a, const osg::Vec3d& b, double s, double t)
+{
+    double e = edgeFunction(a, b, s, t);
+    return e>0.0 || (e==0.0 && (a.y()>b.y() || (a.y()==b.y() && a.x()>b.x())));
+}
+
+/** Intersect the sorted, disjoint intervals of a and b into result.*/
+void intersectIntervals(const BoundaryClipper::Intervals& a, const BoundaryClipper::Intervals& b, BoundaryClipper::Intervals& result)
+{
+    result.clear();
+    BoundaryClipper::Intervals::const_iterator aitr = a.begin();
+    BoundaryClipper::Intervals::const_iterator bitr = b.begin();
+    while(aitr!=a.end() && bitr!=b.end())
+    {
+        double lower = std::max(aitr->x(), bitr->x());
+        double upper = std::min(aitr->y(), bitr->y());
+        if (lower<upper) result.push_back(osg::Vec2d(lower, upper));
+
+        if (aitr->y()<bitr->y()) ++aitr;
+        else ++bitr;
+    }
+}
+
+}
+
+void BoundaryClipper::collectBoundaries(const ParametricScene* scene, std::vector<Triangles>& boundaries)
+{
+    boundaries.clear();
+    boundaries.resize(scene->getNumSubgraphs());
+    for(unsigned int i=0; i<scene->getNumSubgraphs(); ++i)
+    {
+        if (!scene->getSubgraph(i) || !scene->getSubgraphRequiresDepthSubgraph(i)) continue;
+
+        CollectTrianglesVisitor ctv(boundaries[i]);
+        scene->getSubgraph(i)->accept(ctv);
+    }
+}
+
+BoundaryClipper::BoundaryClipper()
+{
+}
+
+BoundaryClipper::~BoundaryClipper()
+{
+}
+
+void BoundaryClipper::build(const std::vector<const Triangles*>& boundaries, const osg::Matrixd& worldToGrid, double width, double height)
+{
+    _worldToGrid = worldToGrid;
+    _boundaries.clear();
+    _boundaries.resize(boundaries.size());
+    for(unsigned int i=0; i<boundaries.size(); ++i)
+    {
+        build(_boundaries[i], *boundaries[i], width, height);
+    }
+}
+
+void BoundaryClipper::build(Bins& bins, const Triangles& triangles, double width, double height)
+{
+    // keep the triangles that overlap the grid, wound counter clockwise when seen from above
+    std::vector<osg::Vec4d> extents;
+    for(unsigned int i=0; i+2<triangles.size(); i+=3)
+    {
+        osg::Vec3d a = triangles[i]*_worldToGrid;
+        osg::Vec3d b = triangles[i+1]*_worldToGrid;
+        osg::Vec3d c = triangles[i+2]*_worldToGrid;
+
+        double area = edgeFunction(a, b, c.x(), c.y());
+        if (area==0.0 || area!=area) continue;
+        if (area<0.0) std::swap(b, c);
+
+        osg::Vec4d extent(std::min(a.x(), std::min(b.x(), c.x())), std::min(a.y(), std::min(b.y(), c.y())),
+                          std::max(a.x(), std::max(b.x(), c.x())), std::max(a.y(), std::max(b.y(), c.y())));
+        if (extent[2]<0.0 || extent[3]<0.0 || extent[0]>width || extent[1]>height) continue;
+
+        bins.vertices.push_back(a);
+        bins.vertices.push_back(b);
+        bins.vertices.push_back(c);
+        extents.push_back(extent);
+    }
+
+    unsigned int numTriangles = static_cast<unsigned int>(extents.size());
+    if (numTriangles==0) return;
+
+    // about one triangle per bin
+    double binSize = std::sqrt(width*height/static_cast<double>(numTriangles));
+    bins.columns = static_cast<unsigned int>(std::min(std::min(1024.0, std::max(1.0, width)), std::max(1.0, std::ceil(width/binSize))));
+    bins.rows = static_cast<unsigned int>(std::min(std::min(1024.0, std::max(1.0, height)), std::max(1.0, std::ceil(height/binSize))));
+    bins.binWidth = width/static_cast<double>(bins.columns);
+    bins.binHeight = height/static_cast<double>(bins.rows);
+
+    // count the triangles in each bin, then fill the bins from their offsets
+    bins.starts.assign(bins.columns*bins.rows+1, 0);
+    for(int pass=0; pass<2; ++pass)
+    {
+        std::vector<unsigned int> offsets;
+        if (pass==1)
+        {
+            for(unsigned int i=1; i<bins.starts.size(); ++i) bins.starts[i] += bins.starts[i-1];
+            offsets.assign(bins.starts.begin(), bins.starts.end()-1);
+            bins.indices.resize(bins.starts.back());
+        }
+
+        for(unsigned int i=0; i<numTriangles; ++i)
+        {
+            unsigned int c0, r0, c1, r1;
+            bins.getBin(extents[i][0], extents[i][1], c0, r0);
+            bins.getBin(extents[i][2], extents[i][3], c1, r1);
+            for(unsigned int r=r0; r<=r1; ++r)
+            {
+                for(unsigned int c=c0; c<=c1; ++c)
+                {
+                    if (pass==0) ++bins.starts[c+r*bins.columns+1];
+                    else bins.indices[offsets[c+r*bins.columns]++] = i;
+                }
+            }
+        }
+    }
+}
+
+void BoundaryClipper::Bins::getBin(double s, double t, unsigned int& c, unsigned int& r) const
+{
+    c = static_cast<unsigned int>(std::max(0.0, std::min(static_cast<double>(columns-1), std::floor(s/binWidth))));
+    r = static_cast<unsigned int>(std::max(0.0, std::min(static_cast<double>(rows-1), std::floor(t/binHeight))));
+}
+
+void BoundaryClipper::getIntervals(double s, double t, Query& query) const
+{
+    query.intervals.clear();
+    query.intervals.push_back(osg::Vec2d(-DBL_MAX, DBL_MAX));
+
+    for(std::vector<Bins>::const_iterator itr = _boundaries.begin();
+        itr != _boundaries.end() && !query.intervals.empty();
+        ++itr)
+    {
+        const Bins& bins = *itr;
+
+        // heights at which the line crosses the boundary, a boundary that it misses leaves nothing inside
+        query.crossings.clear();
+        if (bins.columns>0)
+        {
+            unsigned int c, r;
+            bins.getBin(s, t, c, r);
+
+            unsigned int bin = c+r*bins.columns;
+            for(unsigned int i=bins.starts[bin]; i<bins.starts[bin+1]; ++i)
+            {
+                const osg::Vec3d* v = &bins.vertices[bins.indices[i]*3];
+                if (!insideEdge(v[1], v[2], s, t) || !insideEdge(v[2], v[0], s, t) || !insideEdge(v[0], v[1], s, t)) continue;
+
+                double w0 = edgeFunction(v[1], v[2], s, t);
+                double w1 = edgeFunction(v[2], v[0], s, t);
+                double w2 = edgeFunction(v[0], v[1], s, t);
+                query.crossings.push_back((w0*v[0].z() + w1*v[1].z() + w2*v[2].z())/(w0+w1+w2));
+            }
+        }
+        std::sort(query.crossings.begin(), query.crossings.end());
+
+        query.boundaryIntervals.clear();
+        for(unsigned int i=0; i+1<query.crossings.size(); i+=2)
+        {
+            query.boundaryIntervals.push_back(osg::Vec2d(query.crossings[i], query.crossings[i+1]));
+        }
+
+        intersectIntervals(query.intervals, query.boundaryIntervals, query.combined);
+        query.intervals.swap(query.combined);
+    }
+}
+
+bool BoundaryClipper::isInside(const Intervals& intervals, double h)
+{
+    for(Intervals::const_iterator itr = intervals.begin(); itr != intervals.end(); ++itr)
+    {
+        if (h>=itr->x() && h<=itr->y()) return true;
+    }
+    return false;
+}
+
+double BoundaryClipper::getInsideLength(const Intervals& intervals, double lower, double upper)
+{
+    double length = 0.0;
+    for(Intervals::const_iterator itr = intervals.begin(); itr != intervals.end(); ++itr)
+    {
+        length += std::max(0.0, std::min(upper, itr->y()) - std::max(lower, itr->x()));
+    }
+    return length;
+}
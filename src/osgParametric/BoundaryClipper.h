@@ -0,0 +1,101 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_BOUNDARYCLIPPER
+#define OSGPARAMETRIC_BOUNDARYCLIPPER 1
+
+#include <osgParametric/Export>
+
+#include <osg/Node>
+#include <osg/Matrixd>
+#include <osg/Vec2d>
+#include <osg/Vec3d>
+
+#include <vector>
+
+namespace osgParametric
+{
+
+class ParametricScene;
+
+/** Host side test of whether points lie inside the boundaries that clip a grid, for analysing and exporting the clipped surfaces.
+  * The boundaries' triangles are taken into grid coordinates (column, row, height along the vertical axis) and binned over the
+  * grid's cells, so the parts of the vertical line through any column and row that lie inside every boundary are found from the
+  * few triangles in one bin. The boundaries should be closed meshes, a point counts as inside by the parity of the crossings.*/
+class OSGPARAMETRIC_EXPORT BoundaryClipper : public osg::Referenced
+{
+public:
+
+    /** World coordinate triangles of a boundary, three vertices per triangle.*/
+    typedef std::vector<osg::Vec3d> Triangles;
+
+    /** Ranges of heights along a vertical line.*/
+    typedef std::vector<osg::Vec2d> Intervals;
+
+    /** Collect the triangles of the scene's subgraphs that capture depth, those of the other subgraphs are left empty.
+      * SurfaceGeometry isn't collected as parametric boundaries aren't closed.*/
+    static void collectBoundaries(const ParametricScene* scene, std::vector<Triangles>& boundaries);
+
+    BoundaryClipper();
+
+    /** Bin the triangles of the boundaries over a grid of width by height cells, as seen through worldToGrid.
+      * With no boundaries every point is inside.*/
+    void build(const std::vector<const Triangles*>& boundaries, const osg::Matrixd& worldToGrid, double width, double height);
+
+    const osg::Matrixd& getWorldToGrid() const { return _worldToGrid; }
+
+    /** Working storage for the queries, one per thread.*/
+    struct Query
+    {
+        std::vector<double> crossings;
+        Intervals           intervals;
+        Intervals           boundaryIntervals;
+        Intervals           combined;
+    };
+
+    /** Find the heights of the vertical line through (s, t) inside every boundary, left in query.intervals.*/
+    void getIntervals(double s, double t, Query& query) const;
+
+    /** Return true if the grid coordinate point lies inside every boundary.*/
+    bool isInside(const osg::Vec3d& point, Query& query) const
+    {
+        getIntervals(point.x(), point.y(), query);
+        return isInside(query.intervals, point.z());
+    }
+
+    static bool isInside(const Intervals& intervals, double h);
+
+    /** Length of [lower, upper] that lies within the intervals.*/
+    static double getInsideLength(const Intervals& intervals, double lower, double upper);
+
+protected:
+
+    virtual ~BoundaryClipper();
+
+    /** Triangles of one boundary, wound counter clockwise as seen from above, and the indices of those overlapping each bin.*/
+    struct Bins
+    {
+        Bins(): columns(0), rows(0), binWidth(1.0), binHeight(1.0) {}
+
+        void getBin(double s, double t, unsigned int& c, unsigned int& r) const;
+
+        unsigned int                columns;
+        unsigned int                rows;
+        double                      binWidth;
+        double                      binHeight;
+        std::vector<osg::Vec3d>     vertices;
+        std::vector<unsigned int>   starts;
+        std::vector<unsigned int>   indices;
+    };
+
+    void build(Bins& bins, const Triangles& triangles, double width, double height);
+
+    osg::Matrixd        _worldToGrid;
+    std::vector<Bins>   _boundaries;
+};
+
+}
+
+#endif
@@ -0,0 +1,1538 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "Expression.h"
+
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+
+#if defined(__AVX__)
+    #include <immintrin.h>
+    #define OSGPARAMETRIC_SIMD_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+    #include <emmintrin.h>
+    #if defined(__SSE4_1__)
+        #include <smmintrin.h>
+    #endif
+    #define OSGPARAMETRIC_SIMD_SSE
+#endif
+
+using namespace osgParametric;
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// SIMD wrappers, the kernels are written once against these and compiled for AVX, SSE or plain scalar code
+//
+namespace
+{
+
+const unsigned int BLOCK_SIZE = 64;
+
+#if defined(OSGPARAMETRIC_SIMD_AVX) || defined(OSGPARAMETRIC_SIMD_SSE)
+
+// 2^n for integral n in [-126, 127], built directly in the exponent bits.
+inline __m128 pow2SSE(__m128 n)
+{
+    return _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23));
+}
+
+// split a positive normal x into a mantissa in [0.5, 1) and its exponent.
+inline __m128 frexpSSE(__m128 x, __m128& e)
+{
+    __m128i bits = _mm_castps_si128(x);
+    e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(126)));
+    return _mm_or_ps(_mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x807fffff))), _mm_set1_ps(0.5f));
+}
+
+#endif
+
+#if defined(OSGPARAMETRIC_SIMD_AVX)
+
+struct SIMD
+{
+    typedef __m256 type;
+    typedef __m256 mask;
+    enum { width = 8 };
+
+    static inline type load(const float* p) { return _mm256_loadu_ps(p); }
+    static inline void store(float* p, type v) { _mm256_storeu_ps(p, v); }
+    static inline type set(float v) { return _mm256_set1_ps(v); }
+
+    static inline type add(type a, type b) { return _mm256_add_ps(a, b); }
+    static inline type sub(type a, type b) { return _mm256_sub_ps(a, b); }
+    static inline type mul(type a, type b) { return _mm256_mul_ps(a, b); }
+    static inline type div(type a, type b) { return _mm256_div_ps(a, b); }
+    static inline type min(type a, type b) { return _mm256_min_ps(a, b); }
+    static inline type max(type a, type b) { return _mm256_max_ps(a, b); }
+    static inline type sqrt(type a) { return _mm256_sqrt_ps(a); }
+    static inline type floor(type a) { return _mm256_floor_ps(a); }
+    static inline type ceil(type a) { return _mm256_ceil_ps(a); }
+    static inline type abs(type a) { return _mm256_andnot_ps(set(-0.0f), a); }
+    static inline type neg(type a) { return _mm256_xor_ps(set(-0.0f), a); }
+
+    static inline mask lt(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static inline mask le(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    static inline mask gt(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static inline mask ge(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    static inline mask eq(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+    static inline mask neq(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+    static inline mask maskAnd(mask a, mask b) { return _mm256_and_ps(a, b); }
+    static inline mask maskOr(mask a, mask b) { return _mm256_or_ps(a, b); }
+
+    static inline type select(mask m, type a, type b) { return _mm256_or_ps(_mm256_and_ps(m, a), _mm256_andnot_ps(m, b)); }
+    static inline type toFloat(mask m) { return _mm256_and_ps(m, set(1.0f)); }
+    static inline bool all(mask m) { return _mm256_movemask_ps(m)==0xff; }
+
+    // integer exponent manipulation needs AVX2 at full width, so go through the two SSE halves.
+    static inline type pow2(type n)
+    {
+        __m128 lo = pow2SSE(_mm256_castps256_ps128(n));
+        __m128 hi = pow2SSE(_mm256_extractf128_ps(n, 1));
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+    }
+
+    static inline type frexp(type x, type& e)
+    {
+        __m128 elo, ehi;
+        __m128 lo = frexpSSE(_mm256_castps256_ps128(x), elo);
+        __m128 hi = frexpSSE(_mm256_extractf128_ps(x, 1), ehi);
+        e = _mm256_insertf128_ps(_mm256_castps128_ps256(elo), ehi, 1);
+        return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+    }
+};
+
+#elif defined(OSGPARAMETRIC_SIMD_SSE)
+
+struct SIMD
+{
+    typedef __m128 type;
+    typedef __m128 mask;
+    enum { width = 4 };
+
+    static inline type load(const float* p) { return _mm_loadu_ps(p); }
+    static inline void store(float* p, type v) { _mm_storeu_ps(p, v); }
+    static inline type set(float v) { return _mm_set1_ps(v); }
+
+    static inline type add(type a, type b) { return _mm_add_ps(a, b); }
+    static inline type sub(type a, type b) { return _mm_sub_ps(a, b); }
+    static inline type mul(type a, type b) { return _mm_mul_ps(a, b); }
+    static inline type div(type a, type b) { return _mm_div_ps(a, b); }
+    static inline type min(type a, type b) { return _mm_min_ps(a, b); }
+    static inline type max(type a, type b) { return _mm_max_ps(a, b); }
+    static inline type sqrt(type a) { return _mm_sqrt_ps(a); }
+    static inline type abs(type a) { return _mm_andnot_ps(set(-0.0f), a); }
+    static inline type neg(type a) { return _mm_xor_ps(set(-0.0f), a); }
+
+#if defined(__SSE4_1__)
+    static inline type floor(type a) { return _mm_floor_ps(a); }
+    static inline type ceil(type a) { return _mm_ceil_ps(a); }
+#else
+    static inline type floor(type a)
+    {
+        // truncate and correct for negative values, values beyond 2^23 are already integral and would overflow the conversion,
+        // the unordered compare also passes NaN through unchanged.
+        type t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+        type r = _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a), set(1.0f)));
+        return select(_mm_cmpnlt_ps(abs(a), set(8388608.0f)), a, r);
+    }
+    static inline type ceil(type a) { return neg(floor(neg(a))); }
+#endif
+
+    static inline mask lt(type a, type b) { return _mm_cmplt_ps(a, b); }
+    static inline mask le(type a, type b) { return _mm_cmple_ps(a, b); }
+    static inline mask gt(type a, type b) { return _mm_cmpgt_ps(a, b); }
+    static inline mask ge(type a, type b) { return _mm_cmpge_ps(a, b); }
+    static inline mask eq(type a, type b) { return _mm_cmpeq_ps(a, b); }
+    static inline mask neq(type a, type b) { return _mm_cmpneq_ps(a, b); }
+    static inline mask maskAnd(mask a, mask b) { return _mm_and_ps(a, b); }
+    static inline mask maskOr(mask a, mask b) { return _mm_or_ps(a, b); }
+
+    static inline type select(mask m, type a, type b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+    static inline type toFloat(mask m) { return _mm_and_ps(m, set(1.0f)); }
+    static inline bool all(mask m) { return _mm_movemask_ps(m)==0xf; }
+
+    static inline type pow2(type n) { return pow2SSE(n); }
+    static inline type frexp(type x, type& e) { return frexpSSE(x, e); }
+};
+
+#else
+
+struct SIMD
+{
+    typedef float type;
+    typedef bool mask;
+    enum { width = 1 };
+
+    static inline type load(const float* p) { return *p; }
+    static inline void store(float* p, type v) { *p = v; }
+    static inline type set(float v) { return v; }
+
+    static inline type add(type a, type b) { return a+b; }
+    static inline type sub(type a, type b) { return a-b; }
+    static inline type mul(type a, type b) { return a*b; }
+    static inline type div(type a, type b) { return a/b; }
+    static inline type min(type a, type b) { return (a<b) ? a : b; }
+    static inline type max(type a, type b) { return (a>b) ? a : b; }
+    static inline type sqrt(type a) { return std::sqrt(a); }
+    static inline type floor(type a) { return std::floor(a); }
+    static inline type ceil(type a) { return std::ceil(a); }
+    static inline type abs(type a) { return std::fabs(a); }
+    static inline type neg(type a) { return -a; }
+
+    static inline mask lt(type a, type b) { return a<b; }
+    static inline mask le(type a, type b) { return a<=b; }
+    static inline mask gt(type a, type b) { return a>b; }
+    static inline mask ge(type a, type b) { return a>=b; }
+    static inline mask eq(type a, type b) { return a==b; }
+    static inline mask neq(type a, type b) { return !(a==b); }
+    static inline mask maskAnd(mask a, mask b) { return a && b; }
+    static inline mask maskOr(mask a, mask b) { return a || b; }
+
+    static inline type select(mask m, type a, type b) { return m ? a : b; }
+    static inline type toFloat(mask m) { return m ? 1.0f : 0.0f; }
+    static inline bool all(mask m) { return m; }
+
+    static inline type pow2(type n) { return std::ldexp(1.0f, static_cast<int>(n)); }
+    static inline type frexp(type x, type& e) { int ie; type m = std::frexp(x, &ie); e = static_cast<float>(ie); return m; }
+};
+
+#endif
+
+typedef SIMD::type V;
+
+inline V smoothstep(V edge0, V edge1, V x)
+{
+    V t = SIMD::min(SIMD::max(SIMD::div(SIMD::sub(x, edge0), SIMD::sub(edge1, edge0)), SIMD::set(0.0f)), SIMD::set(1.0f));
+    return SIMD::mul(SIMD::mul(t, t), SIMD::sub(SIMD::set(3.0f), SIMD::mul(SIMD::set(2.0f), t)));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Single precision sin, cos, exp and log after the Cephes library, accurate to a few ulp over the ranges the
+// kernels are used for, samples outside those ranges are recomputed by the C library.
+//
+const float SIN_COS_LIMIT = 8192.0f;
+const float EXP_LOWER = -87.0f;
+const float EXP_UPPER = 88.0f;
+const float EXP2_LOWER = -125.0f;
+const float EXP2_UPPER = 127.0f;
+
+// reduce |x| to z in [-pi/4, pi/4] about an even multiple j of pi/4, j modulo 8 selecting polynomial and sign.
+inline void reduceSinCos(V ax, V& z, V& j)
+{
+    V q = SIMD::floor(SIMD::mul(ax, SIMD::set(1.27323954473516f)));
+    V y = SIMD::mul(SIMD::floor(SIMD::mul(SIMD::add(q, SIMD::set(1.0f)), SIMD::set(0.5f))), SIMD::set(2.0f));
+    z = SIMD::sub(ax, SIMD::mul(y, SIMD::set(0.78515625f)));
+    z = SIMD::sub(z, SIMD::mul(y, SIMD::set(2.4187564849853515625e-4f)));
+    z = SIMD::sub(z, SIMD::mul(y, SIMD::set(3.77489497744594108e-8f)));
+    j = SIMD::sub(y, SIMD::mul(SIMD::floor(SIMD::mul(y, SIMD::set(0.125f))), SIMD::set(8.0f)));
+}
+
+inline V sinPolynomial(V z)
+{
+    V zz = SIMD::mul(z, z);
+    V p = SIMD::add(SIMD::mul(SIMD::set(-1.9515295891e-4f), zz), SIMD::set(8.3321608736e-3f));
+    p = SIMD::add(SIMD::mul(p, zz), SIMD::set(-1.6666654611e-1f));
+    return SIMD::add(SIMD::mul(SIMD::mul(p, zz), z), z);
+}
+
+inline V cosPolynomial(V z)
+{
+    V zz = SIMD::mul(z, z);
+    V p = SIMD::add(SIMD::mul(SIMD::set(2.443315711809948e-5f), zz), SIMD::set(-1.388731625493765e-3f));
+    p = SIMD::add(SIMD::mul(p, zz), SIMD::set(4.166664568298827e-2f));
+    p = SIMD::sub(SIMD::mul(SIMD::mul(p, zz), zz), SIMD::mul(SIMD::set(0.5f), zz));
+    return SIMD::add(p, SIMD::set(1.0f));
+}
+
+inline V simdSin(V x)
+{
+    V z, j;
+    reduceSinCos(SIMD::abs(x), z, j);
+    SIMD::mask swap = SIMD::maskOr(SIMD::eq(j, SIMD::set(2.0f)), SIMD::eq(j, SIMD::set(6.0f)));
+    V r = SIMD::select(swap, cosPolynomial(z), sinPolynomial(z));
+    r = SIMD::select(SIMD::ge(j, SIMD::set(4.0f)), SIMD::neg(r), r);
+    return SIMD::select(SIMD::lt(x, SIMD::set(0.0f)), SIMD::neg(r), r);
+}
+
+inline V simdCos(V x)
+{
+    V z, j;
+    reduceSinCos(SIMD::abs(x), z, j);
+    SIMD::mask swap = SIMD::maskOr(SIMD::eq(j, SIMD::set(2.0f)), SIMD::eq(j, SIMD::set(6.0f)));
+    V r = SIMD::select(swap, sinPolynomial(z), cosPolynomial(z));
+    SIMD::mask negate = SIMD::maskOr(SIMD::eq(j, SIMD::set(2.0f)), SIMD::eq(j, SIMD::set(4.0f)));
+    return SIMD::select(negate, SIMD::neg(r), r);
+}
+
+// e^r for |r| <= ln(2)/2
+inline V expPolynomial(V r)
+{
+    V p = SIMD::add(SIMD::mul(SIMD::set(1.9875691500e-4f), r), SIMD::set(1.3981999507e-3f));
+    p = SIMD::add(SIMD::mul(p, r), SIMD::set(8.3334519073e-3f));
+    p = SIMD::add(SIMD::mul(p, r), SIMD::set(4.1665795894e-2f));
+    p = SIMD::add(SIMD::mul(p, r), SIMD::set(1.6666665459e-1f));
+    p = SIMD::add(SIMD::mul(p, r), SIMD::set(5.0000001201e-1f));
+    return SIMD::add(SIMD::add(SIMD::mul(p, SIMD::mul(r, r)), r), SIMD::set(1.0f));
+}
+
+inline V simdExp(V x)
+{
+    V n = SIMD::floor(SIMD::add(SIMD::mul(x, SIMD::set(1.44269504088896341f)), SIMD::set(0.5f)));
+    V r = SIMD::sub(x, SIMD::mul(n, SIMD::set(0.693359375f)));
+    r = SIMD::sub(r, SIMD::mul(n, SIMD::set(-2.12194440e-4f)));
+    return SIMD::mul(expPolynomial(r), SIMD::pow2(n));
+}
+
+inline V simdExp2(V x)
+{
+    V n = SIMD::floor(SIMD::add(x, SIMD::set(0.5f)));
+    return SIMD::mul(expPolynomial(SIMD::mul(SIMD::sub(x, n), SIMD::set(0.693147180559945309f))), SIMD::pow2(n));
+}
+
+inline V simdLog(V x)
+{
+    V e;
+    V m = SIMD::frexp(x, e);
+
+    // keep the mantissa within [sqrt(0.5), sqrt(2)) so the polynomial argument stays small.
+    SIMD::mask small = SIMD::lt(m, SIMD::set(0.707106781186547524f));
+    e = SIMD::select(small, SIMD::sub(e, SIMD::set(1.0f)), e);
+    m = SIMD::sub(SIMD::select(small, SIMD::add(m, m), m), SIMD::set(1.0f));
+
+    static const float coefficients[] =
+    {
+        -1.1514610310e-1f, 1.1676998740e-1f, -1.2420140846e-1f, 1.4249322787e-1f,
+        -1.6668057665e-1f, 2.0000714765e-1f, -2.4999993993e-1f, 3.3333331174e-1f
+    };
+    V p = SIMD::set(7.0376836292e-2f);
+    for(unsigned int i=0; i<sizeof(coefficients)/sizeof(float); ++i)
+    {
+        p = SIMD::add(SIMD::mul(p, m), SIMD::set(coefficients[i]));
+    }
+
+    V z = SIMD::mul(m, m);
+    V y = SIMD::mul(SIMD::mul(p, m), z);
+    y = SIMD::add(y, SIMD::mul(e, SIMD::set(-2.12194440e-4f)));
+    y = SIMD::sub(y, SIMD::mul(SIMD::set(0.5f), z));
+    return SIMD::add(SIMD::add(m, y), SIMD::mul(e, SIMD::set(0.693359375f)));
+}
+
+inline float scalarExp2(float x) { return std::pow(2.0f, x); }
+inline float scalarLog2(float x) { return std::log(x)*1.4426950408889634f; }
+
+#define SIMD_LOOP(EXPR) \
+    for(unsigned int i=0; i<n; i+=SIMD::width) \
+    { \
+        V x = SIMD::load(a+i); \
+        V y = b ? SIMD::load(b+i) : x; \
+        V z = c ? SIMD::load(c+i) : x; \
+        (void)y; (void)z; \
+        SIMD::store(r+i, EXPR); \
+    }
+
+// vector kernel for samples within [LOWER, UPPER], the rest, including NaN and infinities, fall back to SCALAR.
+#define RANGED_LOOP(EXPR, LOWER, UPPER, SCALAR) \
+    for(unsigned int i=0; i<n; i+=SIMD::width) \
+    { \
+        V x = SIMD::load(a+i); \
+        SIMD::store(r+i, EXPR); \
+        if (!SIMD::all(SIMD::maskAnd(SIMD::ge(x, SIMD::set(LOWER)), SIMD::le(x, SIMD::set(UPPER))))) \
+        { \
+            float xs[SIMD::width]; \
+            SIMD::store(xs, x); \
+            for(unsigned int j=0; j<SIMD::width; ++j) \
+            { \
+                if (!(xs[j]>=(LOWER) && xs[j]<=(UPPER))) r[i+j] = SCALAR(xs[j]); \
+            } \
+        } \
+    }
+
+#define SCALAR_LOOP(EXPR) \
+    for(unsigned int i=0; i<n; ++i) \
+    { \
+        float x = a[i]; \
+        float y = b ? b[i] : x; \
+        (void)y; \
+        r[i] = EXPR; \
+    }
+
+// n must be a multiple of SIMD::width, r may alias any of the arguments.
+void execute(Expression::Operator op, float* r, const float* a, const float* b, const float* c, unsigned int n)
+{
+    const V zero = SIMD::set(0.0f);
+    const V one = SIMD::set(1.0f);
+
+    switch(op)
+    {
+        case(Expression::NEGATE):       SIMD_LOOP(SIMD::neg(x)) break;
+        case(Expression::NOT):          SIMD_LOOP(SIMD::toFloat(SIMD::eq(x, zero))) break;
+        case(Expression::ADD):          SIMD_LOOP(SIMD::add(x, y)) break;
+        case(Expression::SUBTRACT):     SIMD_LOOP(SIMD::sub(x, y)) break;
+        case(Expression::MULTIPLY):     SIMD_LOOP(SIMD::mul(x, y)) break;
+        case(Expression::DIVIDE):       SIMD_LOOP(SIMD::div(x, y)) break;
+        case(Expression::LESS):         SIMD_LOOP(SIMD::toFloat(SIMD::lt(x, y))) break;
+        case(Expression::LEQUAL):       SIMD_LOOP(SIMD::toFloat(SIMD::le(x, y))) break;
+        case(Expression::GREATER):      SIMD_LOOP(SIMD::toFloat(SIMD::gt(x, y))) break;
+        case(Expression::GEQUAL):       SIMD_LOOP(SIMD::toFloat(SIMD::ge(x, y))) break;
+        case(Expression::EQUAL):        SIMD_LOOP(SIMD::toFloat(SIMD::eq(x, y))) break;
+        case(Expression::NOTEQUAL):     SIMD_LOOP(SIMD::toFloat(SIMD::neq(x, y))) break;
+        case(Expression::AND):          SIMD_LOOP(SIMD::toFloat(SIMD::maskAnd(SIMD::neq(x, zero), SIMD::neq(y, zero)))) break;
+        case(Expression::OR):           SIMD_LOOP(SIMD::toFloat(SIMD::maskOr(SIMD::neq(x, zero), SIMD::neq(y, zero)))) break;
+        case(Expression::SELECT):       SIMD_LOOP(SIMD::select(SIMD::neq(x, zero), y, z)) break;
+        case(Expression::SQRT):         SIMD_LOOP(SIMD::sqrt(x)) break;
+        case(Expression::INVERSESQRT):  SIMD_LOOP(SIMD::div(one, SIMD::sqrt(x))) break;
+        case(Expression::ABS):          SIMD_LOOP(SIMD::abs(x)) break;
+        case(Expression::SIGN):         SIMD_LOOP(SIMD::sub(SIMD::toFloat(SIMD::gt(x, zero)), SIMD::toFloat(SIMD::lt(x, zero)))) break;
+        case(Expression::FLOOR):        SIMD_LOOP(SIMD::floor(x)) break;
+        case(Expression::CEIL):         SIMD_LOOP(SIMD::ceil(x)) break;
+        case(Expression::FRACT):        SIMD_LOOP(SIMD::sub(x, SIMD::floor(x))) break;
+        case(Expression::MOD):          SIMD_LOOP(SIMD::sub(x, SIMD::mul(y, SIMD::floor(SIMD::div(x, y))))) break;
+        case(Expression::MIN):          SIMD_LOOP(SIMD::min(x, y)) break;
+        case(Expression::MAX):          SIMD_LOOP(SIMD::max(x, y)) break;
+        case(Expression::CLAMP):        SIMD_LOOP(SIMD::min(SIMD::max(x, y), z)) break;
+        case(Expression::MIX):          SIMD_LOOP(SIMD::add(SIMD::mul(x, SIMD::sub(one, z)), SIMD::mul(y, z))) break;
+        case(Expression::STEP):         SIMD_LOOP(SIMD::toFloat(SIMD::ge(y, x))) break;
+        case(Expression::SMOOTHSTEP):   SIMD_LOOP(smoothstep(x, y, z)) break;
+        case(Expression::RADIANS):      SIMD_LOOP(SIMD::mul(x, SIMD::set(0.017453292519943295f))) break;
+        case(Expression::DEGREES):      SIMD_LOOP(SIMD::mul(x, SIMD::set(57.29577951308232f))) break;
+
+        case(Expression::SIN):          RANGED_LOOP(simdSin(x), -SIN_COS_LIMIT, SIN_COS_LIMIT, std::sin) break;
+        case(Expression::COS):          RANGED_LOOP(simdCos(x), -SIN_COS_LIMIT, SIN_COS_LIMIT, std::cos) break;
+        case(Expression::EXP):          RANGED_LOOP(simdExp(x), EXP_LOWER, EXP_UPPER, std::exp) break;
+        case(Expression::EXP2):         RANGED_LOOP(simdExp2(x), EXP2_LOWER, EXP2_UPPER, scalarExp2) break;
+        case(Expression::LOG):          RANGED_LOOP(simdLog(x), FLT_MIN, FLT_MAX, std::log) break;
+        case(Expression::LOG2):         RANGED_LOOP(SIMD::mul(simdLog(x), SIMD::set(1.4426950408889634f)), FLT_MIN, FLT_MAX, scalarLog2) break;
+
+        // the remaining transcendental functions fall back to the C library one sample at a time.
+        case(Expression::TAN):          SCALAR_LOOP(std::tan(x)) break;
+        case(Expression::ASIN):         SCALAR_LOOP(std::asin(x)) break;
+        case(Expression::ACOS):         SCALAR_LOOP(std::acos(x)) break;
+        case(Expression::ATAN):         SCALAR_LOOP(std::atan(x)) break;
+        case(Expression::ATAN2):        SCALAR_LOOP(std::atan2(x, y)) break;
+        case(Expression::SINH):         SCALAR_LOOP(std::sinh(x)) break;
+        case(Expression::COSH):         SCALAR_LOOP(std::cosh(x)) break;
+        case(Expression::TANH):         SCALAR_LOOP(std::tanh(x)) break;
+        case(Expression::POW):          SCALAR_LOOP(std::pow(x, y)) break;
+
+        default:
+            break;
+    }
+}
+
+#undef SIMD_LOOP
+#undef RANGED_LOOP
+#undef SCALAR_LOOP
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Parser for the GLSL subset used by the macro functions
+//
+struct FunctionEntry
+{
+    const char*             name;
+    unsigned int            numArgs;
+    Expression::Operator    op;
+};
+
+// float(x) is handled as a no-op cast.
+const FunctionEntry s_functions[] =
+{
+    { "sin", 1, Expression::SIN },
+    { "cos", 1, Expression::COS },
+    { "tan", 1, Expression::TAN },
+    { "asin", 1, Expression::ASIN },
+    { "acos", 1, Expression::ACOS },
+    { "atan", 1, Expression::ATAN },
+    { "atan", 2, Expression::ATAN2 },
+    { "sinh", 1, Expression::SINH },
+    { "cosh", 1, Expression::COSH },
+    { "tanh", 1, Expression::TANH },
+    { "exp", 1, Expression::EXP },
+    { "log", 1, Expression::LOG },
+    { "exp2", 1, Expression::EXP2 },
+    { "log2", 1, Expression::LOG2 },
+    { "sqrt", 1, Expression::SQRT },
+    { "inversesqrt", 1, Expression::INVERSESQRT },
+    { "abs", 1, Expression::ABS },
+    { "sign", 1, Expression::SIGN },
+    { "floor", 1, Expression::FLOOR },
+    { "ceil", 1, Expression::CEIL },
+    { "fract", 1, Expression::FRACT },
+    { "mod", 2, Expression::MOD },
+    { "min", 2, Expression::MIN },
+    { "max", 2, Expression::MAX },
+    { "clamp", 3, Expression::CLAMP },
+    { "mix", 3, Expression::MIX },
+    { "step", 2, Expression::STEP },
+    { "smoothstep", 3, Expression::SMOOTHSTEP },
+    { "pow", 2, Expression::POW },
+    { "radians", 1, Expression::RADIANS },
+    { "degrees", 1, Expression::DEGREES },
+    { 0, 0, Expression::CONSTANT }
+};
+
+class Parser
+{
+public:
+
+    Parser(Expression& expression, Expression::Names& parameters, Expression::Names& variables):
+        _expression(expression),
+        _parameters(parameters),
+        _variables(variables),
+        _current(0) {}
+
+    Expression::Node* parseDefinition(const std::string& str)
+    {
+        if (!tokenize(str)) return 0;
+
+        // parameter list
+        if (!expect("(")) return 0;
+        if (!isSymbol(")"))
+        {
+            do
+            {
+                if (_tokens[_current].type!=IDENTIFIER) return error("expected parameter name");
+                _parameters.push_back(_tokens[_current++].text);
+            }
+            while(accept(","));
+        }
+        if (!expect(")")) return 0;
+
+        Expression::Node* node = parseTernary();
+        if (node && _tokens[_current].type!=END) return error("unexpected token after end of expression");
+        return node;
+    }
+
+    const std::string& getErrorMessage() const { return _errorMessage; }
+
+protected:
+
+    enum TokenType
+    {
+        END,
+        NUMBER,
+        IDENTIFIER,
+        SYMBOL
+    };
+
+    struct Token
+    {
+        Token(TokenType t, const std::string& s, float v, std::size_t p): type(t), text(s), value(v), position(p) {}
+
+        TokenType       type;
+        std::string     text;
+        float           value;
+        std::size_t     position;
+    };
+
+    typedef std::vector<Token> Tokens;
+
+    bool tokenize(const std::string& str)
+    {
+        static const char* s_doubleSymbols[] = { "==", "!=", "<=", ">=", "&&", "||", 0 };
+
+        std::size_t pos = 0;
+        while(pos<str.size())
+        {
+            char ch = str[pos];
+            if (ch==' ' || ch=='\t' || ch=='\n' || ch=='\r' || ch=='\\')
+            {
+                ++pos;
+            }
+            else if ((ch>='0' && ch<='9') || (ch=='.' && pos+1<str.size() && str[pos+1]>='0' && str[pos+1]<='9'))
+            {
+                std::size_t start = pos;
+                while(pos<str.size() && ((str[pos]>='0' && str[pos]<='9') || str[pos]=='.')) ++pos;
+                if (pos<str.size() && (str[pos]=='e' || str[pos]=='E'))
+                {
+                    ++pos;
+                    if (pos<str.size() && (str[pos]=='+' || str[pos]=='-')) ++pos;
+                    while(pos<str.size() && str[pos]>='0' && str[pos]<='9') ++pos;
+                }
+
+                std::string text(str, start, pos-start);
+                if (pos<str.size() && (str[pos]=='f' || str[pos]=='F')) ++pos;
+
+                std::istringstream istr(text);
+                double value = 0.0;
+                istr >> value;
+                if (istr.fail())
+                {
+                    _errorMessage = "invalid number '"+text+"'";
+                    return false;
+                }
+                _tokens.push_back(Token(NUMBER, text, static_cast<float>(value), start));
+            }
+            else if ((ch>='a' && ch<='z') || (ch>='A' && ch<='Z') || ch=='_')
+            {
+                std::size_t start = pos;
+                while(pos<str.size() && ((str[pos]>='a' && str[pos]<='z') || (str[pos]>='A' && str[pos]<='Z') || (str[pos]>='0' && str[pos]<='9') || str[pos]=='_')) ++pos;
+                _tokens.push_back(Token(IDENTIFIER, std::string(str, start, pos-start), 0.0f, start));
+            }
+            else
+            {
+                bool matched = false;
+                for(const char** ds = s_doubleSymbols; *ds && !matched; ++ds)
+                {
+                    if (str.compare(pos, 2, *ds)==0)
+                    {
+                        _tokens.push_back(Token(SYMBOL, *ds, 0.0f, pos));
+                        pos += 2;
+                        matched = true;
+                    }
+                }
+
+                if (!matched)
+                {
+                    if (std::strchr("()+-*/<>!?:,", ch)==0)
+                    {
+                        std::ostringstream ostr;
+                        ostr<<"unexpected character '"<<ch<<"' at position "<<pos;
+                        _errorMessage = ostr.str();
+                        return false;
+                    }
+                    _tokens.push_back(Token(SYMBOL, std::string(1, ch), 0.0f, pos));
+                    ++pos;
+                }
+            }
+        }
+
+        _tokens.push_back(Token(END, "", 0.0f, str.size()));
+        return true;
+    }
+
+    Expression::Node* error(const std::string& message)
+    {
+        if (_errorMessage.empty())
+        {
+            std::ostringstream ostr;
+            ostr<<message<<" at position "<<_tokens[_current].position;
+            _errorMessage = ostr.str();
+        }
+        return 0;
+    }
+
+    bool isSymbol(const char* symbol) const
+    {
+        return _tokens[_current].type==SYMBOL && _tokens[_current].text==symbol;
+    }
+
+    bool accept(const char* symbol)
+    {
+        if (!isSymbol(symbol)) return false;
+        ++_current;
+        return true;
+    }
+
+    bool expect(const char* symbol)
+    {
+        if (accept(symbol)) return true;
+        error(std::string("expected '")+symbol+"'");
+        return false;
+    }
+
+    Expression::Node* parseTernary()
+    {
+        Expression::Node* condition = parseOr();
+        if (!condition || !accept("?")) return condition;
+
+        Expression::Node* a = parseTernary();
+        if (!a || !expect(":")) return 0;
+
+        Expression::Node* b = parseTernary();
+        if (!b) return 0;
+
+        return _expression.createNode(Expression::SELECT, condition, a, b);
+    }
+
+    Expression::Node* parseOr()
+    {
+        Expression::Node* node = parseAnd();
+        while(node && accept("||"))
+        {
+            Expression::Node* rhs = parseAnd();
+            node = rhs ? _expression.createNode(Expression::OR, node, rhs) : 0;
+        }
+        return node;
+    }
+
+    Expression::Node* parseAnd()
+    {
+        Expression::Node* node = parseEquality();
+        while(node && accept("&&"))
+        {
+            Expression::Node* rhs = parseEquality();
+            node = rhs ? _expression.createNode(Expression::AND, node, rhs) : 0;
+        }
+        return node;
+    }
+
+    Expression::Node* parseEquality()
+    {
+        Expression::Node* node = parseRelational();
+        while(node)
+        {
+            Expression::Operator op;
+            if (accept("==")) op = Expression::EQUAL;
+            else if (accept("!=")) op = Expression::NOTEQUAL;
+            else break;
+
+            Expression::Node* rhs = parseRelational();
+            node = rhs ? _expression.createNode(op, node, rhs) : 0;
+        }
+        return node;
+    }
+
+    Expression::Node* parseRelational()
+    {
+        Expression::Node* node = parseAdditive();
+        while(node)
+        {
+            Expression::Operator op;
+            if (accept("<=")) op = Expression::LEQUAL;
+            else if (accept(">=")) op = Expression::GEQUAL;
+            else if (accept("<")) op = Expression::LESS;
+            else if (accept(">")) op = Expression::GREATER;
+            else break;
+
+            Expression::Node* rhs = parseAdditive();
+            node = rhs ? _expression.createNode(op, node, rhs) : 0;
+        }
+        return node;
+    }
+
+    Expression::Node* parseAdditive()
+    {
+        Expression::Node* node = parseMultiplicative();
+        while(node)
+        {
+            Expression::Operator op;
+            if (accept("+")) op = Expression::ADD;
+            else if (accept("-")) op = Expression::SUBTRACT;
+            else break;
+
+            Expression::Node* rhs = parseMultiplicative();
+            node = rhs ? _expression.createNode(op, node, rhs) : 0;
+        }
+        return node;
+    }
+
+    Expression::Node* parseMultiplicative()
+    {
+        Expression::Node* node = parseUnary();
+        while(node)
+        {
+            Expression::Operator op;
+            if (accept("*")) op = Expression::MULTIPLY;
+            else if (accept("/")) op = Expression::DIVIDE;
+            else break;
+
+            Expression::Node* rhs = parseUnary();
+            node = rhs ? _expression.createNode(op, node, rhs) : 0;
+        }
+        return node;
+    }
+
+    Expression::Node* parseUnary()
+    {
+        if (accept("+")) return parseUnary();
+
+        if (accept("-"))
+        {
+            Expression::Node* node = parseUnary();
+            return node ? _expression.createNode(Expression::NEGATE, node) : 0;
+        }
+
+        if (accept("!"))
+        {
+            Expression::Node* node = parseUnary();
+            return node ? _expression.createNode(Expression::NOT, node) : 0;
+        }
+
+        return parsePrimary();
+    }
+
+    Expression::Node* parsePrimary()
+    {
+        const Token& token = _tokens[_current];
+
+        if (token.type==NUMBER)
+        {
+            ++_current;
+            return _expression.createConstant(token.value);
+        }
+
+        if (accept("("))
+        {
+            Expression::Node* node = parseTernary();
+            if (!node || !expect(")")) return 0;
+            return node;
+        }
+
+        if (token.type!=IDENTIFIER) return error("expected expression");
+
+        std::string name = token.text;
+        ++_current;
+
+        if (accept("("))
+        {
+            std::vector<Expression::Node*> args;
+            if (!isSymbol(")"))
+            {
+                do
+                {
+                    Expression::Node* arg = parseTernary();
+                    if (!arg) return 0;
+                    args.push_back(arg);
+                }
+                while(accept(","));
+            }
+            if (!expect(")")) return 0;
+
+            if (name=="float" && args.size()==1) return args[0];
+
+            for(const FunctionEntry* fe = s_functions; fe->name; ++fe)
+            {
+                if (name==fe->name && args.size()==fe->numArgs)
+                {
+                    return _expression.createNode(fe->op,
+                                                  args.size()>0 ? args[0] : 0,
+                                                  args.size()>1 ? args[1] : 0,
+                                                  args.size()>2 ? args[2] : 0);
+                }
+            }
+
+            return error("unsupported function '"+name+"'");
+        }
+
+        if (name=="true") return _expression.createConstant(1.0f);
+        if (name=="false") return _expression.createConstant(0.0f);
+
+        for(unsigned int i=0; i<_parameters.size(); ++i)
+        {
+            if (_parameters[i]==name) return _expression.createParameter(i);
+        }
+
+        for(unsigned int i=0; i<_variables.size(); ++i)
+        {
+            if (_variables[i]==name) return _expression.createVariable(i);
+        }
+
+        _variables.push_back(name);
+        return _expression.createVariable(static_cast<unsigned int>(_variables.size()-1));
+    }
+
+    Expression&         _expression;
+    Expression::Names&  _parameters;
+    Expression::Names&  _variables;
+    Tokens              _tokens;
+    std::size_t         _current;
+    std::string         _errorMessage;
+};
+
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Expression
+//
+Expression::Expression():
+    _numTemporaries(0),
+    _resultRegister(0)
+{
+}
+
+Expression::~Expression()
+{
+}
+
+unsigned int Expression::getBlockSize()
+{
+    return BLOCK_SIZE;
+}
+
+bool Expression::parse(const std::string& definition)
+{
+    _errorMessage.clear();
+    _parameters.clear();
+    _variables.clear();
+    _nodeMap.clear();
+    _root = 0;
+
+    Parser parser(*this, _parameters, _variables);
+    osg::ref_ptr<Node> root = parser.parseDefinition(definition);
+    if (!root)
+    {
+        _errorMessage = parser.getErrorMessage();
+        _nodeMap.clear();
+        compile();
+        return false;
+    }
+
+    _root = root;
+    compile();
+    return true;
+}
+
+void Expression::set(const Names& parameters, const Names& variables, Node* root)
+{
+    _errorMessage.clear();
+    _parameters = parameters;
+    _variables = variables;
+    _root = root;
+    compile();
+}
+
+bool Expression::dependsOnVariable(const std::string& name) const
+{
+    return std::find(_variables.begin(), _variables.end(), name)!=_variables.end();
+}
+
+float Expression::apply(Operator op, float a, float b, float c)
+{
+    float args[3][SIMD::width];
+    float result[SIMD::width];
+    for(unsigned int i=0; i<SIMD::width; ++i)
+    {
+        args[0][i] = a;
+        args[1][i] = b;
+        args[2][i] = c;
+    }
+    execute(op, result, args[0], args[1], args[2], SIMD::width);
+    return result[0];
+}
+
+Expression::Node* Expression::intern(Node* node)
+{
+    unsigned int bits = 0;
+    std::memcpy(&bits, &(node->value), sizeof(bits));
+
+    std::ostringstream key;
+    key<<node->op<<':'<<bits<<':'<<node->index<<':'<<node->args[0].get()<<':'<<node->args[1].get()<<':'<<node->args[2].get();
+
+    NodeMap::iterator itr = _nodeMap.find(key.str());
+    if (itr!=_nodeMap.end()) return itr->second.get();
+
+    _nodeMap[key.str()] = node;
+    return node;
+}
+
+Expression::Node* Expression::createConstant(float value)
+{
+    osg::ref_ptr<Node> node = new Node(CONSTANT, value, 0);
+    return intern(node.get());
+}
+
+Expression::Node* Expression::createParameter(unsigned int index)
+{
+    osg::ref_ptr<Node> node = new Node(PARAMETER, 0.0f, index);
+    return intern(node.get());
+}
+
+Expression::Node* Expression::createVariable(unsigned int index)
+{
+    osg::ref_ptr<Node> node = new Node(VARIABLE, 0.0f, index);
+    return intern(node.get());
+}
+
+bool Expression::isConstant(const Node* node, float value)
+{
+    return node && node->op==CONSTANT && node->value==value;
+}
+
+Expression::Node* Expression::createNode(Operator op, Node* a, Node* b, Node* c)
+{
+    if (op==CONSTANT || op==PARAMETER || op==VARIABLE || !a) return 0;
+
+    // a constant condition selects the branch at compile time
+    if (op==SELECT && a->op==CONSTANT) return (a->value!=0.0f) ? b : c;
+
+    bool constant = (a->op==CONSTANT) && (!b || b->op==CONSTANT) && (!c || c->op==CONSTANT);
+    if (constant)
+    {
+        return createConstant(apply(op, a->value, b ? b->value : a->value, c ? c->value : a->value));
+    }
+
+    // algebraic identities that hold for every input, including NaN and infinities, so x*0 and 0/x are left alone
+    switch(op)
+    {
+        case(ADD):
+            if (isConstant(a, 0.0f)) return b;
+            if (isConstant(b, 0.0f)) return a;
+            break;
+        case(SUBTRACT):
+            if (isConstant(b, 0.0f)) return a;
+            if (isConstant(a, 0.0f)) return createNode(NEGATE, b);
+            break;
+        case(MULTIPLY):
+            if (isConstant(a, 1.0f)) return b;
+            if (isConstant(b, 1.0f)) return a;
+            if (isConstant(a, -1.0f)) return createNode(NEGATE, b);
+            if (isConstant(b, -1.0f)) return createNode(NEGATE, a);
+            break;
+        case(DIVIDE):
+            if (isConstant(b, 1.0f)) return a;
+            break;
+        case(NEGATE):
+            if (a->op==NEGATE) return a->args[0].get();
+            break;
+        case(SELECT):
+            if (b==c) return b;
+            break;
+        case(POW):
+            if (isConstant(b, 1.0f)) return a;
+            break;
+        default:
+            break;
+    }
+
+    osg::ref_ptr<Node> node = new Node(op, 0.0f, 0);
+    node->args[0] = a;
+    node->args[1] = b;
+    node->args[2] = c;
+    return intern(node.get());
+}
+
+namespace
+{
+
+typedef std::vector<const Expression::Node*> NodeList;
+typedef std::map<const Expression::Node*, unsigned int> NodeCounts;
+
+void collectNodes(const Expression::Node* node, NodeList& order, NodeCounts& useCounts)
+{
+    NodeCounts::iterator itr = useCounts.find(node);
+    if (itr!=useCounts.end())
+    {
+        ++(itr->second);
+        return;
+    }
+
+    useCounts[node] = 1;
+    for(unsigned int i=0; i<node->getNumArgs(); ++i)
+    {
+        collectNodes(node->args[i].get(), order, useCounts);
+    }
+    order.push_back(node);
+}
+
+}
+
+void Expression::compile()
+{
+    _instructions.clear();
+    _constants.clear();
+    _numTemporaries = 0;
+    _resultRegister = 0;
+
+    if (!_root) return;
+
+    NodeList order;
+    NodeCounts useCounts;
+    collectNodes(_root.get(), order, useCounts);
+
+    unsigned int numParameters = static_cast<unsigned int>(_parameters.size());
+    unsigned int numInputs = getNumInputs();
+
+    typedef std::map<const Node*, unsigned int> RegisterMap;
+    RegisterMap registers;
+
+    // leaves map directly on to the input and constant registers
+    for(NodeList::iterator itr = order.begin(); itr != order.end(); ++itr)
+    {
+        const Node* node = *itr;
+        if (node->op==PARAMETER) registers[node] = node->index;
+        else if (node->op==VARIABLE) registers[node] = numParameters + node->index;
+        else if (node->op==CONSTANT)
+        {
+            registers[node] = numInputs + static_cast<unsigned int>(_constants.size());
+            _constants.push_back(node->value);
+        }
+    }
+
+    unsigned int firstTemporary = numInputs + static_cast<unsigned int>(_constants.size());
+    std::vector<unsigned int> freeRegisters;
+
+    for(NodeList::iterator itr = order.begin(); itr != order.end(); ++itr)
+    {
+        const Node* node = *itr;
+        if (node->op==PARAMETER || node->op==VARIABLE || node->op==CONSTANT) continue;
+
+        Instruction instruction;
+        instruction.op = static_cast<unsigned char>(node->op);
+        instruction.numArgs = static_cast<unsigned char>(node->getNumArgs());
+        instruction.args[0] = instruction.args[1] = instruction.args[2] = 0;
+
+        for(unsigned int i=0; i<instruction.numArgs; ++i)
+        {
+            const Node* arg = node->args[i].get();
+            unsigned int reg = registers[arg];
+            instruction.args[i] = static_cast<unsigned short>(reg);
+
+            // the kernels allow the result to alias an argument, so registers are released before the result is allocated
+            if (--useCounts[arg]==0 && reg>=firstTemporary) freeRegisters.push_back(reg);
+        }
+
+        unsigned int result;
+        if (freeRegisters.empty()) result = firstTemporary + _numTemporaries++;
+        else
+        {
+            result = freeRegisters.back();
+            freeRegisters.pop_back();
+        }
+
+        instruction.result = static_cast<unsigned short>(result);
+        registers[node] = result;
+
+        _instructions.push_back(instruction);
+    }
+
+    _resultRegister = static_cast<unsigned short>(registers[_root.get()]);
+}
+
+float Expression::evaluate(const float* inputs) const
+{
+    unsigned int numInputs = getNumInputs();
+    Inputs blockInputs(numInputs);
+    for(unsigned int i=0; i<numInputs; ++i)
+    {
+        blockInputs[i].value = inputs[i];
+    }
+
+    float result = 0.0f;
+    evaluate(1, blockInputs, &result);
+    return result;
+}
+
+void Expression::evaluate(unsigned int numSamples, const Inputs& inputs, float* results) const
+{
+    if (numSamples==0) return;
+
+    if (!_root)
+    {
+        std::fill(results, results+numSamples, 0.0f);
+        return;
+    }
+
+    unsigned int numInputs = getNumInputs();
+    unsigned int numRegisters = numInputs + static_cast<unsigned int>(_constants.size()) + _numTemporaries;
+
+    std::vector<float> storage(numRegisters*BLOCK_SIZE);
+    std::vector<const float*> registers(numRegisters);
+    for(unsigned int i=0; i<numRegisters; ++i)
+    {
+        registers[i] = &storage[i*BLOCK_SIZE];
+    }
+
+    // uniform inputs and constants are broadcast once for all blocks
+    for(unsigned int i=0; i<numInputs; ++i)
+    {
+        if (i>=inputs.size() || !inputs[i].data)
+        {
+            float value = (i<inputs.size()) ? inputs[i].value : 0.0f;
+            std::fill(storage.begin()+i*BLOCK_SIZE, storage.begin()+(i+1)*BLOCK_SIZE, value);
+        }
+    }
+
+    for(unsigned int i=0; i<_constants.size(); ++i)
+    {
+        unsigned int reg = numInputs+i;
+        std::fill(storage.begin()+reg*BLOCK_SIZE, storage.begin()+(reg+1)*BLOCK_SIZE, _constants[i]);
+    }
+
+    for(unsigned int start=0; start<numSamples; start+=BLOCK_SIZE)
+    {
+        unsigned int count = std::min(BLOCK_SIZE, numSamples-start);
+
+        for(unsigned int i=0; i<numInputs && i<inputs.size(); ++i)
+        {
+            const float* data = inputs[i].data;
+            if (!data) continue;
+
+            if (count==BLOCK_SIZE)
+            {
+                // read full blocks directly from the caller's arrays
+                registers[i] = data+start;
+            }
+            else
+            {
+                // pad the final partial block so the kernels can always work on whole blocks
+                float* buffer = &storage[i*BLOCK_SIZE];
+                std::copy(data+start, data+start+count, buffer);
+                std::fill(buffer+count, buffer+BLOCK_SIZE, data[start+count-1]);
+                registers[i] = buffer;
+            }
+        }
+
+        for(Instructions::const_iterator itr = _instructions.begin();
+            itr != _instructions.end();
+            ++itr)
+        {
+            const Instruction& instruction = *itr;
+            execute(static_cast<Operator>(instruction.op),
+                    &storage[instruction.result*BLOCK_SIZE],
+                    registers[instruction.args[0]],
+                    instruction.numArgs>1 ? registers[instruction.args[1]] : 0,
+                    instruction.numArgs>2 ? registers[instruction.args[2]] : 0,
+                    BLOCK_SIZE);
+        }
+
+        const float* result = registers[_resultRegister];
+        std::copy(result, result+count, results+start);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Symbolic differentiation and writing expressions back out as GLSL
+//
+namespace
+{
+
+class Differentiator
+{
+public:
+
+    typedef Expression::Node Node;
+
+    Differentiator(Expression& target, unsigned int parameter):
+        _target(target),
+        _parameter(parameter) {}
+
+    // copy a node of the source graph into the target expression
+    Node* copy(const Node* node)
+    {
+        NodeMap::iterator itr = _copies.find(node);
+        if (itr!=_copies.end()) return itr->second.get();
+
+        Node* result = 0;
+        switch(node->op)
+        {
+            case(Expression::CONSTANT):     result = _target.createConstant(node->value); break;
+            case(Expression::PARAMETER):    result = _target.createParameter(node->index); break;
+            case(Expression::VARIABLE):     result = _target.createVariable(node->index); break;
+            default:
+                result = _target.createNode(node->op,
+                                            node->args[0].valid() ? copy(node->args[0].get()) : 0,
+                                            node->args[1].valid() ? copy(node->args[1].get()) : 0,
+                                            node->args[2].valid() ? copy(node->args[2].get()) : 0);
+                break;
+        }
+
+        _copies[node] = result;
+        return result;
+    }
+
+    Node* derivative(const Node* node)
+    {
+        NodeMap::iterator itr = _derivatives.find(node);
+        if (itr!=_derivatives.end()) return itr->second.get();
+
+        Node* result = compute(node);
+        _derivatives[node] = result;
+        return result;
+    }
+
+protected:
+
+    typedef std::map<const Node*, osg::ref_ptr<Node> > NodeMap;
+
+    Node* constant(float value) { return _target.createConstant(value); }
+    Node* op(Expression::Operator o, Node* a, Node* b=0, Node* c=0) { return _target.createNode(o, a, b, c); }
+    Node* add(Node* a, Node* b) { return op(Expression::ADD, a, b); }
+    Node* sub(Node* a, Node* b) { return op(Expression::SUBTRACT, a, b); }
+    static bool isZero(const Node* node) { return node->op==Expression::CONSTANT && node->value==0.0f; }
+
+    // terms scaled by a zero derivative drop out of the derivative, createNode() can't fold them as x*0 isn't 0 for NaN and infinite x
+    Node* mul(Node* a, Node* b) { return (isZero(a) || isZero(b)) ? constant(0.0f) : op(Expression::MULTIPLY, a, b); }
+    Node* div(Node* a, Node* b) { return isZero(a) ? constant(0.0f) : op(Expression::DIVIDE, a, b); }
+
+    Node* compute(const Node* node)
+    {
+        unsigned int numArgs = node->getNumArgs();
+        Node* a = numArgs>0 ? copy(node->args[0].get()) : 0;
+        Node* b = numArgs>1 ? copy(node->args[1].get()) : 0;
+        Node* c = numArgs>2 ? copy(node->args[2].get()) : 0;
+        Node* da = numArgs>0 ? derivative(node->args[0].get()) : 0;
+        Node* db = numArgs>1 ? derivative(node->args[1].get()) : 0;
+        Node* dc = numArgs>2 ? derivative(node->args[2].get()) : 0;
+
+        // nothing to do for sub expressions that don't depend on the parameter
+        bool independent = true;
+        for(unsigned int i=0; i<numArgs; ++i)
+        {
+            Node* d = (i==0) ? da : (i==1) ? db : dc;
+            if (!isZero(d)) independent = false;
+        }
+        if (node->op!=Expression::PARAMETER && independent) return constant(0.0f);
+
+        switch(node->op)
+        {
+            case(Expression::PARAMETER):    return constant(node->index==_parameter ? 1.0f : 0.0f);
+            case(Expression::NEGATE):       return op(Expression::NEGATE, da);
+            case(Expression::ADD):          return add(da, db);
+            case(Expression::SUBTRACT):     return sub(da, db);
+            case(Expression::MULTIPLY):     return add(mul(da, b), mul(a, db));
+            case(Expression::DIVIDE):       return sub(div(da, b), div(mul(a, db), mul(b, b)));
+            case(Expression::SELECT):       return op(Expression::SELECT, a, db, dc);
+            case(Expression::SIN):          return mul(op(Expression::COS, a), da);
+            case(Expression::COS):          return op(Expression::NEGATE, mul(op(Expression::SIN, a), da));
+            case(Expression::TAN):
+            {
+                Node* cosine = op(Expression::COS, a);
+                return div(da, mul(cosine, cosine));
+            }
+            case(Expression::ASIN):         return mul(da, op(Expression::INVERSESQRT, sub(constant(1.0f), mul(a, a))));
+            case(Expression::ACOS):         return op(Expression::NEGATE, mul(da, op(Expression::INVERSESQRT, sub(constant(1.0f), mul(a, a)))));
+            case(Expression::ATAN):         return div(da, add(constant(1.0f), mul(a, a)));
+            case(Expression::ATAN2):        return div(sub(mul(b, da), mul(a, db)), add(mul(a, a), mul(b, b)));
+            case(Expression::SINH):         return mul(op(Expression::COSH, a), da);
+            case(Expression::COSH):         return mul(op(Expression::SINH, a), da);
+            case(Expression::TANH):
+            {
+                Node* t = op(Expression::TANH, a);
+                return mul(sub(constant(1.0f), mul(t, t)), da);
+            }
+            case(Expression::EXP):          return mul(op(Expression::EXP, a), da);
+            case(Expression::LOG):          return div(da, a);
+            case(Expression::EXP2):         return mul(mul(op(Expression::EXP2, a), constant(0.6931471805599453f)), da);
+            case(Expression::LOG2):         return div(da, mul(a, constant(0.6931471805599453f)));
+            case(Expression::SQRT):         return mul(mul(constant(0.5f), op(Expression::INVERSESQRT, a)), da);
+            case(Expression::INVERSESQRT):  return mul(div(mul(constant(-0.5f), op(Expression::INVERSESQRT, a)), a), da);
+            case(Expression::ABS):          return mul(op(Expression::SIGN, a), da);
+            case(Expression::FRACT):        return da;
+            case(Expression::MOD):          return sub(da, mul(db, op(Expression::FLOOR, div(a, b))));
+            case(Expression::MIN):          return op(Expression::SELECT, op(Expression::LESS, b, a), db, da);
+            case(Expression::MAX):          return op(Expression::SELECT, op(Expression::LESS, a, b), db, da);
+            case(Expression::CLAMP):        return op(Expression::SELECT, op(Expression::LESS, a, b), db,
+                                                      op(Expression::SELECT, op(Expression::GREATER, a, c), dc, da));
+            case(Expression::MIX):          return add(add(mul(da, sub(constant(1.0f), c)), mul(db, c)), mul(sub(b, a), dc));
+            case(Expression::SMOOTHSTEP):
+            {
+                // 6t(1-t) is zero where t is clamped, so the derivative of the unclamped t can be used
+                Node* range = sub(b, a);
+                Node* offset = sub(c, a);
+                Node* t = op(Expression::CLAMP, div(offset, range), constant(0.0f), constant(1.0f));
+                Node* dt = sub(div(sub(dc, da), range), div(mul(offset, sub(db, da)), mul(range, range)));
+                return mul(mul(mul(constant(6.0f), t), sub(constant(1.0f), t)), dt);
+            }
+            case(Expression::POW):
+            {
+                if (isZero(db))
+                {
+                    return mul(mul(b, op(Expression::POW, a, sub(b, constant(1.0f)))), da);
+                }
+                return mul(op(Expression::POW, a, b), add(mul(db, op(Expression::LOG, a)), div(mul(b, da), a)));
+            }
+            case(Expression::RADIANS):      return mul(da, constant(0.017453292519943295f));
+            case(Expression::DEGREES):      return mul(da, constant(57.29577951308232f));
+
+            // comparisons, logic and the piecewise constant functions
+            default:                        return constant(0.0f);
+        }
+    }
+
+    Expression&     _target;
+    unsigned int    _parameter;
+    NodeMap         _copies;
+    NodeMap         _derivatives;
+};
+
+bool isBoolean(Expression::Operator op)
+{
+    switch(op)
+    {
+        case(Expression::NOT):
+        case(Expression::LESS):
+        case(Expression::LEQUAL):
+        case(Expression::GREATER):
+        case(Expression::GEQUAL):
+        case(Expression::EQUAL):
+        case(Expression::NOTEQUAL):
+        case(Expression::AND):
+        case(Expression::OR):
+            return true;
+        default:
+            return false;
+    }
+}
+
+const char* getOperatorSymbol(Expression::Operator op)
+{
+    switch(op)
+    {
+        case(Expression::ADD):          return " + ";
+        case(Expression::SUBTRACT):     return " - ";
+        case(Expression::MULTIPLY):     return " * ";
+        case(Expression::DIVIDE):       return " / ";
+        case(Expression::LESS):         return " < ";
+        case(Expression::LEQUAL):       return " <= ";
+        case(Expression::GREATER):      return " > ";
+        case(Expression::GEQUAL):       return " >= ";
+        case(Expression::EQUAL):        return " == ";
+        case(Expression::NOTEQUAL):     return " != ";
+        case(Expression::AND):          return " && ";
+        case(Expression::OR):           return " || ";
+        default:                        return 0;
+    }
+}
+
+const char* getFunctionName(Expression::Operator op)
+{
+    for(const FunctionEntry* fe = s_functions; fe->name; ++fe)
+    {
+        if (fe->op==op) return fe->name;
+    }
+    return 0;
+}
+
+class Writer
+{
+public:
+
+    Writer(const Expression::Names& parameters, const Expression::Names& variables, std::string::size_type maxLength):
+        _parameters(parameters),
+        _variables(variables),
+        _maxLength(maxLength) {}
+
+    // write node, as a bool if condition is set and as a float otherwise, returns false once the output is too long
+    bool write(const Expression::Node* node, bool condition)
+    {
+        if (static_cast<std::string::size_type>(_stream.tellp())>_maxLength) return false;
+
+        bool boolean = isBoolean(node->op);
+        if (condition && !boolean)
+        {
+            _stream<<"(";
+            if (!write(node, false)) return false;
+            _stream<<" != 0.0)";
+            return true;
+        }
+        if (!condition && boolean)
+        {
+            _stream<<"float";
+            if (!write(node, true)) return false;
+            return true;
+        }
+
+        switch(node->op)
+        {
+            case(Expression::CONSTANT):     writeConstant(node->value); return true;
+            case(Expression::PARAMETER):    _stream<<_parameters[node->index]; return true;
+            case(Expression::VARIABLE):     _stream<<_variables[node->index]; return true;
+            case(Expression::NEGATE):
+                _stream<<"(-";
+                if (!write(node->args[0].get(), false)) return false;
+                _stream<<")";
+                return true;
+            case(Expression::NOT):
+                _stream<<"(!";
+                if (!write(node->args[0].get(), true)) return false;
+                _stream<<")";
+                return true;
+            case(Expression::SELECT):
+                _stream<<"(";
+                if (!write(node->args[0].get(), true)) return false;
+                _stream<<" ? ";
+                if (!write(node->args[1].get(), false)) return false;
+                _stream<<" : ";
+                if (!write(node->args[2].get(), false)) return false;
+                _stream<<")";
+                return true;
+            default:
+                break;
+        }
+
+        const char* symbol = getOperatorSymbol(node->op);
+        if (symbol)
+        {
+            bool logical = (node->op==Expression::AND || node->op==Expression::OR);
+            _stream<<"(";
+            if (!write(node->args[0].get(), logical)) return false;
+            _stream<<symbol;
+            if (!write(node->args[1].get(), logical)) return false;
+            _stream<<")";
+            return true;
+        }
+
+        const char* name = getFunctionName(node->op);
+        if (!name) return false;
+
+        _stream<<name<<"(";
+        for(unsigned int i=0; i<node->getNumArgs(); ++i)
+        {
+            if (i>0) _stream<<", ";
+            if (!write(node->args[i].get(), false)) return false;
+        }
+        _stream<<")";
+        return true;
+    }
+
+    std::string str() const { return _stream.str(); }
+
+    std::ostringstream& stream() { return _stream; }
+
+protected:
+
+    void writeConstant(float value)
+    {
+        if (value!=value) { _stream<<"(0.0/0.0)"; return; }
+        if (value>FLT_MAX) { _stream<<"(1.0/0.0)"; return; }
+        if (value<-FLT_MAX) { _stream<<"(-1.0/0.0)"; return; }
+
+        // nine significant digits round trip a float, GLSL float literals need a decimal point or exponent
+        std::ostringstream str;
+        str.precision(9);
+        str<<value;
+        std::string text = str.str();
+        if (text.find_first_of(".e")==std::string::npos) text += ".0";
+
+        if (value<0.0f) _stream<<"("<<text<<")";
+        else _stream<<text;
+    }
+
+    const Expression::Names&    _parameters;
+    const Expression::Names&    _variables;
+    std::string::size_type      _maxLength;
+    std::ostringstream          _stream;
+};
+
+}
+
+osg::ref_ptr<Expression> Expression::differentiate(unsigned int parameter) const
+{
+    if (!_root || parameter>=_parameters.size()) return 0;
+
+    osg::ref_ptr<Expression> result = new Expression;
+    Differentiator differentiator(*result, parameter);
+    osg::ref_ptr<Node> root = differentiator.derivative(_root.get());
+    result->set(_parameters, _variables, root.get());
+    return result;
+}
+
+std::string Expression::getDefinition(std::string::size_type maxLength) const
+{
+    if (!_root) return std::string();
+
+    Writer writer(_parameters, _variables, maxLength);
+    writer.stream()<<"(";
+    for(unsigned int i=0; i<_parameters.size(); ++i)
+    {
+        if (i>0) writer.stream()<<", ";
+        writer.stream()<<_parameters[i];
+    }
+    writer.stream()<<") (";
+
+    if (!writer.write(_root.get(), false)) return std::string();
+
+    writer.stream()<<")";
+
+    std::string definition = writer.str();
+    return (definition.size()>maxLength) ? std::string() : definition;
+}
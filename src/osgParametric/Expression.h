@@ -0,0 +1,198 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_EXPRESSION
+#define OSGPARAMETRIC_EXPRESSION 1
+
+#include <osgParametric/Export>
+
+#include <osg/Referenced>
+#include <osg/ref_ptr>
+
+#include <string>
+#include <vector>
+#include <map>
+
+namespace osgParametric
+{
+
+/** Host side version of the GLSL macro functions used by the parametric shaders.
+  * Parses the same "(x, y, z) (expr)" text that is passed to StateSet::setDefine() for Z_FUNCTION, Z_BASE and Z_TOP,
+  * compiles it to a compact register based bytecode and evaluates it on blocks of samples using SSE/AVX where available.
+  * Arithmetic is done in single precision to match the shader. */
+class OSGPARAMETRIC_EXPORT Expression : public osg::Referenced
+{
+public:
+
+    enum Operator
+    {
+        CONSTANT,
+        PARAMETER,
+        VARIABLE,
+        NEGATE,
+        NOT,
+        ADD,
+        SUBTRACT,
+        MULTIPLY,
+        DIVIDE,
+        LESS,
+        LEQUAL,
+        GREATER,
+        GEQUAL,
+        EQUAL,
+        NOTEQUAL,
+        AND,
+        OR,
+        SELECT,
+        SIN,
+        COS,
+        TAN,
+        ASIN,
+        ACOS,
+        ATAN,
+        ATAN2,
+        SINH,
+        COSH,
+        TANH,
+        EXP,
+        LOG,
+        EXP2,
+        LOG2,
+        SQRT,
+        INVERSESQRT,
+        ABS,
+        SIGN,
+        FLOOR,
+        CEIL,
+        FRACT,
+        MOD,
+        MIN,
+        MAX,
+        CLAMP,
+        MIX,
+        STEP,
+        SMOOTHSTEP,
+        POW,
+        RADIANS,
+        DEGREES
+    };
+
+    /** Node of the expression graph, identical sub expressions are shared so the graph is a DAG rather than a tree.*/
+    struct Node : public osg::Referenced
+    {
+        Node(Operator o, float v, unsigned int i):
+            op(o), value(v), index(i) {}
+
+        unsigned int getNumArgs() const { return args[2].valid() ? 3 : args[1].valid() ? 2 : args[0].valid() ? 1 : 0; }
+
+        Operator            op;
+        float               value;      // CONSTANT
+        unsigned int        index;      // PARAMETER and VARIABLE
+        osg::ref_ptr<Node>  args[3];
+    };
+
+    /** Input for one parameter or variable, either a per sample array or a single value used for every sample. */
+    struct Input
+    {
+        Input(): data(0), value(0.0f) {}
+        Input(const float* d): data(d), value(0.0f) {}
+        Input(float v): data(0), value(v) {}
+
+        const float*    data;
+        float           value;
+    };
+
+    typedef std::vector<Input> Inputs;
+    typedef std::vector<std::string> Names;
+
+    Expression();
+
+    /** Parse the body of a macro definition of the form "(x, y, z) (expr)", return false and set the error message on failure.*/
+    bool parse(const std::string& definition);
+
+    const std::string& getErrorMessage() const { return _errorMessage; }
+
+    bool valid() const { return _root.valid(); }
+
+    /** Names of the macro parameters, in declaration order.*/
+    const Names& getParameters() const { return _parameters; }
+
+    /** Names of identifiers that aren't parameters, such as osg_SimulationTime and uniforms, in order of first use.*/
+    const Names& getVariables() const { return _variables; }
+
+    bool dependsOnVariable(const std::string& name) const;
+
+    /** Number of inputs that evaluate() expects, the parameters followed by the variables.*/
+    unsigned int getNumInputs() const { return static_cast<unsigned int>(_parameters.size()+_variables.size()); }
+
+    const Node* getRoot() const { return _root.get(); }
+
+    /** Replace the expression by one built from an existing graph, used to combine and transform expressions.*/
+    void set(const Names& parameters, const Names& variables, Node* root);
+
+    /** Create a node, folding constants and sharing it with any identical node already created by this Expression.*/
+    Node* createNode(Operator op, Node* a=0, Node* b=0, Node* c=0);
+    Node* createConstant(float value);
+    Node* createParameter(unsigned int index);
+    Node* createVariable(unsigned int index);
+
+    /** Create the partial derivative of the expression with respect to a parameter, taking the same parameters and variables.
+      * Piecewise constant functions such as floor() and step() are treated as having zero derivative. Returns 0 if the expression isn't valid.*/
+    osg::ref_ptr<Expression> differentiate(unsigned int parameter) const;
+
+    /** Write the expression as a "(x, y, z) (expr)" macro definition. Shared sub expressions are written in full wherever they are used,
+      * so an empty string is returned if the definition would exceed maxLength characters.*/
+    std::string getDefinition(std::string::size_type maxLength=std::string::npos) const;
+
+    /** Evaluate a single sample, inputs holds getNumInputs() values.*/
+    float evaluate(const float* inputs) const;
+
+    /** Evaluate numSamples samples writing to results. Runs on the calling thread, see SurfaceFunction for multi-threaded batches.*/
+    void evaluate(unsigned int numSamples, const Inputs& inputs, float* results) const;
+
+    /** Number of samples processed by each pass over the bytecode.*/
+    static unsigned int getBlockSize();
+
+    /** Apply op to scalar arguments, used for constant folding and matches the batch evaluation exactly.*/
+    static float apply(Operator op, float a, float b, float c);
+
+protected:
+
+    virtual ~Expression();
+
+    struct Instruction
+    {
+        unsigned char   op;
+        unsigned char   numArgs;
+        unsigned short  result;
+        unsigned short  args[3];
+    };
+
+    typedef std::vector<Instruction> Instructions;
+    typedef std::vector<float> Constants;
+    typedef std::map<std::string, osg::ref_ptr<Node> > NodeMap;
+
+    Node* intern(Node* node);
+
+    static bool isConstant(const Node* node, float value);
+
+    void compile();
+
+    std::string                 _errorMessage;
+    Names                       _parameters;
+    Names                       _variables;
+    osg::ref_ptr<Node>          _root;
+    NodeMap                     _nodeMap;
+
+    // bytecode, registers are numbered inputs first, then constants, then temporaries
+    Instructions                _instructions;
+    Constants                   _constants;
+    unsigned int                _numTemporaries;
+    unsigned short              _resultRegister;
+};
+
+}
+
+#endif
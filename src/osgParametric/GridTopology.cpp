@@ -0,0 +1,228 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "GridTopology.h"
+
+#include <osg/BufferObject>
+#include <OpenThreads/ScopedLock>
+
+using namespace osgParametric;
+
+namespace
+{
+
+template<class DE, typename T>
+osg::ref_ptr<osg::DrawElements> fillTriangles(unsigned int uCells, unsigned int vCells, bool top)
+{
+    osg::ref_ptr<DE> primitives = new DE(GL_TRIANGLES);
+    primitives->resize(6*uCells*vCells);
+    if (primitives->empty()) return primitives.get();
+
+    T* indices = &(primitives->front());
+    for(unsigned int r=0; r<vCells; ++r)
+    {
+        for(unsigned int c=0; c<uCells; ++c)
+        {
+            T p0 = static_cast<T>(c+r*(uCells+1));
+            T p1 = static_cast<T>(p0+(uCells+1));
+            T p2 = static_cast<T>(p0+1);
+            T p3 = static_cast<T>(p1+1);
+            if (top)
+            {
+                *(indices++) = p0;
+                *(indices++) = p2;
+                *(indices++) = p1;
+                *(indices++) = p2;
+                *(indices++) = p3;
+                *(indices++) = p1;
+            }
+            else
+            {
+                *(indices++) = p0;
+                *(indices++) = p1;
+                *(indices++) = p2;
+                *(indices++) = p2;
+                *(indices++) = p1;
+                *(indices++) = p3;
+            }
+        }
+    }
+    return primitives.get();
+}
+
+template<class DE, typename T>
+osg::ref_ptr<osg::DrawElements> fillTriangleStrips(unsigned int uCells, unsigned int vCells, bool top, T restartIndex)
+{
+    osg::ref_ptr<DE> primitives = new DE(GL_TRIANGLE_STRIP);
+    if (uCells==0 || vCells==0) return primitives.get();
+
+    primitives->resize(vCells*2*(uCells+1) + (vCells-1));
+
+    // a strip of (c,r),(c,r+1) pairs gives the base winding, swapping the pairs gives the top winding
+    T* indices = &(primitives->front());
+    for(unsigned int r=0; r<vCells; ++r)
+    {
+        if (r>0) *(indices++) = restartIndex;
+
+        for(unsigned int c=0; c<=uCells; ++c)
+        {
+            T lower = static_cast<T>(c+r*(uCells+1));
+            T upper = static_cast<T>(lower+(uCells+1));
+            if (top)
+            {
+                *(indices++) = upper;
+                *(indices++) = lower;
+            }
+            else
+            {
+                *(indices++) = lower;
+                *(indices++) = upper;
+            }
+        }
+    }
+    return primitives.get();
+}
+
+template<class DE, typename T>
+osg::ref_ptr<osg::DrawElements> stitch(const DE& source, unsigned int uCells, unsigned int vCells, unsigned int stitchEdges)
+{
+    osg::ref_ptr<DE> primitives = new DE(source.getMode());
+    primitives->reserve(source.size());
+
+    unsigned int rowLength = uCells+1;
+    unsigned int restartIndex = GridTopologyCache::getRestartIndex(rowLength*(vCells+1));
+
+    // moving each odd vertex along a stitched edge onto the previous even vertex turns the triangles either side of it into
+    // one triangle spanning the pair of cells and a degenerate one, leaving the edge with the vertices of a half resolution grid
+    for(typename DE::const_iterator itr = source.begin(); itr != source.end(); ++itr)
+    {
+        unsigned int index = *itr;
+        if (index!=restartIndex)
+        {
+            unsigned int c = index%rowLength;
+            unsigned int r = index/rowLength;
+            if ((r & 1)!=0 && (((stitchEdges & GridTopologyCache::STITCH_U_MIN)!=0 && c==0) || ((stitchEdges & GridTopologyCache::STITCH_U_MAX)!=0 && c==uCells))) --r;
+            if ((c & 1)!=0 && (((stitchEdges & GridTopologyCache::STITCH_V_MIN)!=0 && r==0) || ((stitchEdges & GridTopologyCache::STITCH_V_MAX)!=0 && r==vCells))) --c;
+            index = c + r*rowLength;
+        }
+        primitives->push_back(static_cast<T>(index));
+    }
+
+    // degenerate triangles can simply be dropped from triangle lists, strips keep them to stay connected
+    if (primitives->getMode()==GL_TRIANGLES)
+    {
+        typename DE::iterator write = primitives->begin();
+        for(typename DE::iterator read = primitives->begin(); read != primitives->end(); read += 3)
+        {
+            if (read[0]==read[1] || read[1]==read[2] || read[0]==read[2]) continue;
+            *(write++) = read[0];
+            *(write++) = read[1];
+            *(write++) = read[2];
+        }
+        primitives->erase(write, primitives->end());
+    }
+
+    return primitives.get();
+}
+
+}
+
+GridTopologyCache::GridTopologyCache()
+{
+}
+
+GridTopologyCache::~GridTopologyCache()
+{
+}
+
+GridTopologyCache* GridTopologyCache::instance()
+{
+    static osg::ref_ptr<GridTopologyCache> s_cache = new GridTopologyCache;
+    return s_cache.get();
+}
+
+unsigned int GridTopologyCache::getRestartIndex(unsigned int numVertices)
+{
+    return (numVertices>0xffff) ? 0xffffffff : 0xffff;
+}
+
+osg::DrawElements* GridTopologyCache::getDrawElements(unsigned int uCells, unsigned int vCells, bool top, Encoding encoding, unsigned int stitchEdges)
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    Key key(uCells, vCells, top, encoding, stitchEdges);
+    DrawElementsMap::iterator itr = _drawElementsMap.find(key);
+    if (itr!=_drawElementsMap.end()) return itr->second.get();
+
+    osg::ref_ptr<osg::DrawElements> primitives = (encoding==TRIANGLE_STRIPS) ?
+        createTriangleStrips(uCells, vCells, top) :
+        createTriangles(uCells, vCells, top);
+
+    if (stitchEdges!=0) primitives = createStitched(*primitives, uCells, vCells, stitchEdges);
+
+    // give the shared indices their own buffer object so that no geometry appends its own data to it
+    primitives->setElementBufferObject(new osg::ElementBufferObject);
+
+    _drawElementsMap[key] = primitives;
+    return primitives.get();
+}
+
+osg::ref_ptr<osg::DrawElements> GridTopologyCache::createTriangles(unsigned int uCells, unsigned int vCells, bool top)
+{
+    unsigned int numVertices = (uCells+1)*(vCells+1);
+    if ((numVertices>>16)==0) return fillTriangles<osg::DrawElementsUShort, GLushort>(uCells, vCells, top);
+    else return fillTriangles<osg::DrawElementsUInt, GLuint>(uCells, vCells, top);
+}
+
+osg::ref_ptr<osg::DrawElements> GridTopologyCache::createTriangleStrips(unsigned int uCells, unsigned int vCells, bool top)
+{
+    unsigned int numVertices = (uCells+1)*(vCells+1);
+    unsigned int restartIndex = getRestartIndex(numVertices);
+    if (restartIndex==0xffff) return fillTriangleStrips<osg::DrawElementsUShort, GLushort>(uCells, vCells, top, static_cast<GLushort>(restartIndex));
+    else return fillTriangleStrips<osg::DrawElementsUInt, GLuint>(uCells, vCells, top, static_cast<GLuint>(restartIndex));
+}
+
+osg::ref_ptr<osg::DrawElements> GridTopologyCache::createStitched(const osg::DrawElements& primitives, unsigned int uCells, unsigned int vCells, unsigned int stitchEdges)
+{
+    const osg::DrawElementsUShort* ushortElements = dynamic_cast<const osg::DrawElementsUShort*>(&primitives);
+    if (ushortElements) return stitch<osg::DrawElementsUShort, GLushort>(*ushortElements, uCells, vCells, stitchEdges);
+
+    const osg::DrawElementsUInt* uintElements = dynamic_cast<const osg::DrawElementsUInt*>(&primitives);
+    if (uintElements) return stitch<osg::DrawElementsUInt, GLuint>(*uintElements, uCells, vCells, stitchEdges);
+
+    return const_cast<osg::DrawElements*>(&primitives);
+}
+
+void GridTopologyCache::pruneUnused()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    DrawElementsMap::iterator itr = _drawElementsMap.begin();
+    while(itr != _drawElementsMap.end())
+    {
+        if (itr->second->referenceCount()==1) _drawElementsMap.erase(itr++);
+        else ++itr;
+    }
+}
+
+unsigned int GridTopologyCache::getNumEntries() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    return static_cast<unsigned int>(_drawElementsMap.size());
+}
+
+unsigned int GridTopologyCache::getIndexMemory() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    unsigned int total = 0;
+    for(DrawElementsMap::const_iterator itr = _drawElementsMap.begin();
+        itr != _drawElementsMap.end();
+        ++itr)
+    {
+        total += itr->second->getTotalDataSize();
+    }
+    return total;
+}
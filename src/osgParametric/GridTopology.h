@@ -0,0 +1,100 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_GRIDTOPOLOGY
+#define OSGPARAMETRIC_GRIDTOPOLOGY 1
+
+#include <osgParametric/Export>
+
+#include <osg/PrimitiveSet>
+#include <OpenThreads/Mutex>
+
+#include <map>
+
+namespace osgParametric
+{
+
+/** Cache of the index lists used to draw grids. Every grid with the same number of cells and winding has the same topology,
+  * whatever its origin and axes, so all the surfaces of a given resolution share one DrawElements and one element buffer object.*/
+class OSGPARAMETRIC_EXPORT GridTopologyCache : public osg::Referenced
+{
+public:
+
+    enum Encoding
+    {
+        /** six indices per cell.*/
+        TRIANGLES,
+        /** one triangle strip per row of cells, separated by the primitive restart index, roughly a third of the indices of TRIANGLES.*/
+        TRIANGLE_STRIPS
+    };
+
+    /** Grid edges whose odd vertices are collapsed onto their even neighbours, so that the edge matches a neighbouring grid of half the resolution.*/
+    enum StitchEdges
+    {
+        STITCH_U_MIN = 1,
+        STITCH_U_MAX = 2,
+        STITCH_V_MIN = 4,
+        STITCH_V_MAX = 8,
+        NUM_STITCH_MASKS = 16
+    };
+
+    GridTopologyCache();
+
+    /** Get the process wide cache.*/
+    static GridTopologyCache* instance();
+
+    /** Get the index list for a grid of (uCells+1)*(vCells+1) vertices laid out row by row, creating it on first use.
+      * top selects the winding used by the top surface, base surfaces have the opposite winding. stitchEdges is a mask of StitchEdges,
+      * stitched edges need an even number of cells.*/
+    osg::DrawElements* getDrawElements(unsigned int uCells, unsigned int vCells, bool top, Encoding encoding, unsigned int stitchEdges=0);
+
+    /** Restart index used by TRIANGLE_STRIPS index lists for a grid with numVertices vertices.*/
+    static unsigned int getRestartIndex(unsigned int numVertices);
+
+    /** Remove the index lists that are no longer used by any geometry.*/
+    void pruneUnused();
+
+    unsigned int getNumEntries() const;
+
+    /** Total size in bytes of the cached indices.*/
+    unsigned int getIndexMemory() const;
+
+protected:
+
+    virtual ~GridTopologyCache();
+
+    struct Key
+    {
+        Key(unsigned int u, unsigned int v, bool t, Encoding e, unsigned int s): uCells(u), vCells(v), top(t), encoding(e), stitchEdges(s) {}
+
+        bool operator < (const Key& rhs) const
+        {
+            if (uCells!=rhs.uCells) return uCells<rhs.uCells;
+            if (vCells!=rhs.vCells) return vCells<rhs.vCells;
+            if (top!=rhs.top) return rhs.top;
+            if (encoding!=rhs.encoding) return encoding<rhs.encoding;
+            return stitchEdges<rhs.stitchEdges;
+        }
+
+        unsigned int    uCells;
+        unsigned int    vCells;
+        bool            top;
+        Encoding        encoding;
+        unsigned int    stitchEdges;
+    };
+
+    typedef std::map< Key, osg::ref_ptr<osg::DrawElements> > DrawElementsMap;
+
+    static osg::ref_ptr<osg::DrawElements> createTriangles(unsigned int uCells, unsigned int vCells, bool top);
+    static osg::ref_ptr<osg::DrawElements> createTriangleStrips(unsigned int uCells, unsigned int vCells, bool top);
+    static osg::ref_ptr<osg::DrawElements> createStitched(const osg::DrawElements& primitives, unsigned int uCells, unsigned int vCells, unsigned int stitchEdges);
+
+    mutable OpenThreads::Mutex  _mutex;
+    DrawElementsMap             _drawElementsMap;
+};
+
+}
+
+#endif
@@ -0,0 +1,554 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "HeightFieldTexture.h"
+#include "ThreadPool.h"
+
+#include <osg/State>
+#include <osg/FrameStamp>
+#include <osg/BufferObject>
+#include <osg/ContextData>
+#include <osg/Notify>
+#include <OpenThreads/ScopedLock>
+
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+#ifndef GL_MAP_WRITE_BIT
+    #define GL_MAP_WRITE_BIT 0x0002
+#endif
+
+#ifndef GL_MAP_INVALIDATE_BUFFER_BIT
+    #define GL_MAP_INVALIDATE_BUFFER_BIT 0x0008
+#endif
+
+#ifndef GL_MAP_UNSYNCHRONIZED_BIT
+    #define GL_MAP_UNSYNCHRONIZED_BIT 0x0020
+#endif
+
+using namespace osgParametric;
+
+namespace
+{
+
+/** Deletes the pixel buffers of a context the next time the context flushes its deleted GL objects. Deleting a buffer that
+  * is still mapped unmaps it.*/
+class PixelBufferManager : public osg::GLObjectManager
+{
+public:
+
+    PixelBufferManager(unsigned int contextID): osg::GLObjectManager("PixelBufferManager", contextID) {}
+
+    virtual void deleteGLObject(GLuint globj)
+    {
+        const osg::GLExtensions* extensions = osg::GLExtensions::Get(_contextID, true);
+        extensions->glDeleteBuffers(1, &globj);
+    }
+};
+
+// Finds the range of heights of each frame, frames are handed out in order so the threads read the mapping front to back.
+class HeightRangeTask : public ThreadPool::Task
+{
+public:
+
+    HeightRangeTask(const HeightFieldStream& stream):
+        _stream(stream),
+        _minimums(stream.getNumFrames(), FLT_MAX),
+        _maximums(stream.getNumFrames(), -FLT_MAX) {}
+
+    virtual void operator()(unsigned int begin, unsigned int end)
+    {
+        size_t numHeights = _stream.getFrameSize()/sizeof(float);
+        for(unsigned int i=begin; i<end; ++i)
+        {
+            const float* heights = _stream.getFrame(i);
+            float minimum = FLT_MAX;
+            float maximum = -FLT_MAX;
+            for(size_t j=0; j<numHeights; ++j)
+            {
+                float h = heights[j];
+                if (h!=h) continue;
+
+                minimum = std::min(minimum, h);
+                maximum = std::max(maximum, h);
+            }
+
+            _minimums[i] = minimum;
+            _maximums[i] = maximum;
+        }
+    }
+
+    osg::Vec2 getRange() const
+    {
+        osg::Vec2 range(FLT_MAX, -FLT_MAX);
+        for(unsigned int i=0; i<_minimums.size(); ++i)
+        {
+            range.x() = std::min(range.x(), _minimums[i]);
+            range.y() = std::max(range.y(), _maximums[i]);
+        }
+        return range.x()<=range.y() ? range : osg::Vec2(0.0f, 0.0f);
+    }
+
+protected:
+
+    const HeightFieldStream&    _stream;
+    std::vector<float>          _minimums;
+    std::vector<float>          _maximums;
+};
+
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  HeightFieldStream
+//
+HeightFieldStream::HeightFieldStream():
+    _file(new MappedFile),
+    _columns(0),
+    _rows(0),
+    _numFrames(0),
+    _data(0),
+    _numCopying(0),
+    _done(false),
+    _loader(0)
+{
+}
+
+HeightFieldStream::~HeightFieldStream()
+{
+    close();
+}
+
+bool HeightFieldStream::open(const std::string& filename, unsigned int columns, unsigned int rows)
+{
+    close();
+
+    if (columns==0 || rows==0 || !_file->open(filename)) return false;
+
+    _file->adviseSequential();
+
+    _columns = columns;
+    _rows = rows;
+    _data = reinterpret_cast<const float*>(_file->getData());
+    _numFrames = static_cast<unsigned int>(_file->getSize()/getFrameSize());
+
+    if (_numFrames==0)
+    {
+        OSG_NOTICE<<"HeightFieldStream::open() "<<filename<<" is smaller than a "<<columns<<" x "<<rows<<" frame"<<std::endl;
+        close();
+        return false;
+    }
+
+    computeHeightRange();
+    return true;
+}
+
+void HeightFieldStream::close()
+{
+    if (_loader)
+    {
+        waitForCopies();
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_requestMutex);
+            _done = true;
+            _requestCondition.broadcast();
+        }
+        _loader->join();
+        delete _loader;
+        _loader = 0;
+        _done = false;
+    }
+
+    _file->close();
+    _data = 0;
+    _numFrames = 0;
+}
+
+void HeightFieldStream::computeHeightRange()
+{
+    // every frame is scanned, as a sample can miss the extremes and the bounds of the surfaces would then cull them while visible.
+    // this reads the whole file once, in a single pass over the mapping.
+    HeightRangeTask task(*this);
+    ThreadPool::instance()->run(_numFrames, 1, task);
+    _heightRange = task.getRange();
+}
+
+void HeightFieldStream::copy(unsigned int frame, void* destination) const
+{
+    std::memcpy(destination, getFrame(frame), getFrameSize());
+}
+
+void HeightFieldStream::requestCopy(unsigned int frame, void* destination, Completion* completion)
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_requestMutex);
+
+    if (!_loader)
+    {
+        _loader = new Loader(this);
+        _loader->start();
+    }
+
+    Request request;
+    request.frame = frame;
+    request.destination = destination;
+    request.completion = completion;
+    _requests.push_back(request);
+
+    _requestCondition.signal();
+}
+
+void HeightFieldStream::waitForCopies()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_requestMutex);
+    while(!_requests.empty() || _numCopying>0)
+    {
+        _idleCondition.wait(&_requestMutex);
+    }
+}
+
+void HeightFieldStream::Loader::run()
+{
+    while(true)
+    {
+        Request request;
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_stream->_requestMutex);
+            while(_stream->_requests.empty() && !_stream->_done)
+            {
+                _stream->_requestCondition.wait(&_stream->_requestMutex);
+            }
+            if (_stream->_done) return;
+
+            request = _stream->_requests.front();
+            _stream->_requests.pop_front();
+            ++_stream->_numCopying;
+        }
+
+        _stream->copy(request.frame, request.destination);
+        request.completion->exchange(1);
+
+        // start reading the following frame from disk while this one is drawn
+        size_t frameSize = _stream->getFrameSize();
+        _stream->_file->prefetch(static_cast<size_t>((request.frame+1)%_stream->_numFrames)*frameSize, frameSize);
+
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_stream->_requestMutex);
+            --_stream->_numCopying;
+            if (_stream->_requests.empty() && _stream->_numCopying==0) _stream->_idleCondition.broadcast();
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  HeightFieldTexture
+//
+HeightFieldTexture::HeightFieldTexture(HeightFieldStream* stream):
+    _frameRate(60.0),
+    _numPixelBuffers(2),
+    _extents(0.0f, 0.0f, 1.0f, 1.0f),
+    _textureUnit(15)
+{
+    setDataVariance(osg::Object::DYNAMIC);
+    setInternalFormat(GL_R32F);
+    setSourceFormat(GL_RED);
+    setSourceType(GL_FLOAT);
+    setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR);
+    setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+    setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
+    setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+    setResizeNonPowerOfTwoHint(false);
+
+    setStream(stream);
+}
+
+HeightFieldTexture::HeightFieldTexture(const HeightFieldTexture& rhs, const osg::CopyOp& copyop):
+    osg::Texture2D(rhs, copyop),
+    _stream(rhs._stream),
+    _frameRate(rhs._frameRate),
+    _numPixelBuffers(rhs._numPixelBuffers),
+    _extents(rhs._extents),
+    _textureUnit(rhs._textureUnit)
+{
+}
+
+HeightFieldTexture::~HeightFieldTexture()
+{
+    for(ContextDataMap::iterator itr = _contextData.begin();
+        itr != _contextData.end();
+        ++itr)
+    {
+        releasePixelBuffers(itr->first, 0, itr->second);
+    }
+}
+
+void HeightFieldTexture::setStream(HeightFieldStream* stream)
+{
+    _stream = stream;
+
+    if (_stream.valid() && _stream->valid()) setTextureSize(_stream->getColumns(), _stream->getRows());
+    dirtyTextureObject();
+}
+
+unsigned int HeightFieldTexture::getSequence(double time) const
+{
+    if (time<=0.0 || _frameRate<=0.0) return 0;
+    return static_cast<unsigned int>(std::floor(time*_frameRate));
+}
+
+void HeightFieldTexture::addToStateSet(osg::StateSet* stateset)
+{
+    osg::Vec2 resolution(1.0f, 1.0f);
+    osg::Vec2 range(0.0f, 0.0f);
+    if (_stream.valid() && _stream->valid())
+    {
+        resolution.set(static_cast<float>(_stream->getColumns()), static_cast<float>(_stream->getRows()));
+        range = _stream->getHeightRange();
+    }
+
+    stateset->setTextureAttribute(_textureUnit, this, osg::StateAttribute::ON);
+    stateset->setDefine("Z_HEIGHTFIELD");
+    stateset->addUniform(new osg::Uniform("heightField", static_cast<int>(_textureUnit)));
+    stateset->addUniform(new osg::Uniform("heightFieldExtents", _extents));
+    stateset->addUniform(new osg::Uniform("heightFieldResolution", resolution));
+    stateset->addUniform(new osg::Uniform("heightFieldRange", range));
+}
+
+void HeightFieldTexture::apply(osg::State& state) const
+{
+    // allocates the texture on first use and binds it
+    osg::Texture2D::apply(state);
+
+    if (!_stream.valid() || !_stream->valid()) return;
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    update(state, _contextData[state.getContextID()]);
+}
+
+void HeightFieldTexture::update(osg::State& state, ContextData& data) const
+{
+    const osg::FrameStamp* frameStamp = state.getFrameStamp();
+    unsigned int frameNumber = frameStamp ? frameStamp->getFrameNumber() : 0;
+    unsigned int sequence = getSequence(frameStamp ? frameStamp->getSimulationTime() : 0.0);
+
+    // a new texture object, e.g. after a resize, has undefined contents so needs the current frame whatever the frame number
+    const void* textureObject = getTextureObject(state.getContextID());
+    bool fresh = !data.uploaded || textureObject!=data.textureObject;
+    if (!fresh && data.frameNumber==frameNumber) return;
+
+    data.frameNumber = frameNumber;
+    data.textureObject = textureObject;
+
+    const osg::GLExtensions* extensions = state.get<osg::GLExtensions>();
+    bool usePixelBuffers = extensions && extensions->isPBOSupported && extensions->glMapBufferRange!=0;
+
+    // osg::State tracks the bound pixel buffer, so have it unbound before binding them directly
+    state.unbindPixelBufferObject();
+
+    // the first frame, a rewind and drivers without pixel buffer objects upload directly from the mapping
+    if (fresh || sequence<data.sequence || !usePixelBuffers)
+    {
+        if (fresh || sequence!=data.sequence) uploadFromStream(data, sequence);
+        if (usePixelBuffers) requestPixelBuffers(extensions, data, sequence);
+        return;
+    }
+
+    // the latest copied frame that's due, later ones are kept for the frames they're due in
+    PixelBuffer* latest = 0;
+    for(std::vector<PixelBuffer*>::iterator itr = data.pixelBuffers.begin();
+        itr != data.pixelBuffers.end();
+        ++itr)
+    {
+        PixelBuffer* pixelBuffer = *itr;
+        if (!pixelBuffer->mapped || pixelBuffer->copied==0 || pixelBuffer->sequence>sequence) continue;
+        if (!latest || pixelBuffer->sequence>latest->sequence) latest = pixelBuffer;
+    }
+
+    if (latest && latest->sequence>data.sequence)
+    {
+        uploadFromPixelBuffer(extensions, data, latest);
+    }
+
+    requestPixelBuffers(extensions, data, sequence);
+}
+
+void HeightFieldTexture::uploadFromStream(ContextData& data, unsigned int sequence) const
+{
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, _stream->getColumns(), _stream->getRows(), GL_RED, GL_FLOAT, _stream->getFrame(sequence));
+
+    if (data.uploaded && sequence>data.sequence) data.step = sequence-data.sequence;
+    data.sequence = sequence;
+    data.uploaded = true;
+}
+
+void HeightFieldTexture::uploadFromPixelBuffer(const osg::GLExtensions* extensions, ContextData& data, PixelBuffer* pixelBuffer) const
+{
+    extensions->glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, pixelBuffer->id);
+    extensions->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER_ARB);
+    pixelBuffer->mapped = 0;
+
+    // sourced from the bound buffer, so the driver can schedule the copy without the draw thread waiting on it
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, _stream->getColumns(), _stream->getRows(), GL_RED, GL_FLOAT, 0);
+
+    extensions->glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+
+    data.step = std::max(1u, pixelBuffer->sequence-data.sequence);
+    data.sequence = pixelBuffer->sequence;
+}
+
+void HeightFieldTexture::requestPixelBuffers(const osg::GLExtensions* extensions, ContextData& data, unsigned int sequence) const
+{
+    while(data.pixelBuffers.size()<_numPixelBuffers)
+    {
+        PixelBuffer* pixelBuffer = new PixelBuffer;
+        extensions->glGenBuffers(1, &(pixelBuffer->id));
+        data.pixelBuffers.push_back(pixelBuffer);
+    }
+
+    // after a rewind or a jump the frames requested ahead of the old position are recycled
+    if (data.requested<sequence || data.requested>sequence+data.step*_numPixelBuffers) data.requested = sequence;
+
+    GLsizeiptr size = static_cast<GLsizeiptr>(_stream->getFrameSize());
+    for(std::vector<PixelBuffer*>::iterator itr = data.pixelBuffers.begin();
+        itr != data.pixelBuffers.end();
+        ++itr)
+    {
+        PixelBuffer* pixelBuffer = *itr;
+        if (pixelBuffer->mapped)
+        {
+            // buffers still being copied to, or copied and due in the frames ahead, are left mapped
+            if (pixelBuffer->copied==0 || (pixelBuffer->sequence>data.sequence && pixelBuffer->sequence<=data.requested)) continue;
+
+            extensions->glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, pixelBuffer->id);
+            extensions->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER_ARB);
+            pixelBuffer->mapped = 0;
+        }
+
+        // orphan the buffer so mapping it doesn't wait on an upload from it that's still pending
+        extensions->glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, pixelBuffer->id);
+        extensions->glBufferData(GL_PIXEL_UNPACK_BUFFER_ARB, size, 0, GL_STREAM_DRAW_ARB);
+        pixelBuffer->mapped = extensions->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER_ARB, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        if (!pixelBuffer->mapped) continue;
+
+        // step ahead at the rate playback is advancing, so a slow draw doesn't copy frames it will skip
+        data.requested += data.step;
+        pixelBuffer->sequence = data.requested;
+        pixelBuffer->copied.exchange(0);
+        _stream->requestCopy(pixelBuffer->sequence, pixelBuffer->mapped, &(pixelBuffer->copied));
+    }
+
+    extensions->glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+}
+
+void HeightFieldTexture::releasePixelBuffers(unsigned int contextID, osg::State* state, ContextData& data) const
+{
+    // the loader thread may still be writing to a mapped buffer
+    if (_stream.valid()) _stream->waitForCopies();
+
+    const osg::GLExtensions* extensions = state ? state->get<osg::GLExtensions>() : 0;
+    if (extensions) state->unbindPixelBufferObject();
+
+    for(std::vector<PixelBuffer*>::iterator itr = data.pixelBuffers.begin();
+        itr != data.pixelBuffers.end();
+        ++itr)
+    {
+        PixelBuffer* pixelBuffer = *itr;
+        if (extensions && pixelBuffer->id!=0)
+        {
+            if (pixelBuffer->mapped)
+            {
+                extensions->glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, pixelBuffer->id);
+                extensions->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER_ARB);
+            }
+            extensions->glDeleteBuffers(1, &(pixelBuffer->id));
+        }
+        else if (pixelBuffer->id!=0)
+        {
+            // without the context current the buffers are deleted, and so unmapped, when it next flushes its deleted GL objects
+            osg::get<PixelBufferManager>(contextID)->scheduleGLObjectForDeletion(pixelBuffer->id);
+        }
+        delete pixelBuffer;
+    }
+
+    if (extensions) extensions->glBindBuffer(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+
+    data = ContextData();
+}
+
+void HeightFieldTexture::releaseGLObjects(osg::State* state) const
+{
+    osg::Texture2D::releaseGLObjects(state);
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    if (state)
+    {
+        ContextDataMap::iterator itr = _contextData.find(state->getContextID());
+        if (itr==_contextData.end()) return;
+
+        releasePixelBuffers(itr->first, state, itr->second);
+        _contextData.erase(itr);
+    }
+    else
+    {
+        for(ContextDataMap::iterator itr = _contextData.begin();
+            itr != _contextData.end();
+            ++itr)
+        {
+            releasePixelBuffers(itr->first, 0, itr->second);
+        }
+        _contextData.clear();
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  Serializers for HeightFieldTexture
+//
+#include <osgDB/ObjectWrapper>
+#include <osgDB/InputStream>
+#include <osgDB/OutputStream>
+
+// the frames stay in their file, only its name and grid size are written and the stream is reopened on reading
+static bool checkStream( const osgParametric::HeightFieldTexture& texture )
+{
+    return texture.getStream()!=0;
+}
+
+static bool readStream( osgDB::InputStream& is, osgParametric::HeightFieldTexture& texture )
+{
+    std::string filename;
+    unsigned int columns = 0, rows = 0;
+    is.readWrappedString( filename );
+    is >> columns >> rows;
+
+    osg::ref_ptr<osgParametric::HeightFieldStream> stream = new osgParametric::HeightFieldStream;
+    if ( stream->open(filename, columns, rows) ) texture.setStream( stream.get() );
+    return true;
+}
+
+static bool writeStream( osgDB::OutputStream& os, const osgParametric::HeightFieldTexture& texture )
+{
+    const osgParametric::HeightFieldStream* stream = texture.getStream();
+    os.writeWrappedString( stream->getFileName() );
+    os << stream->getColumns() << stream->getRows() << std::endl;
+    return true;
+}
+
+REGISTER_OBJECT_WRAPPER( HeightFieldTexture,
+                         new osgParametric::HeightFieldTexture,
+                         osgParametric::HeightFieldTexture,
+                         "osg::Object osg::StateAttribute osg::Texture osgParametric::HeightFieldTexture" )
+{
+    ADD_USER_SERIALIZER( Stream );
+    ADD_DOUBLE_SERIALIZER( FrameRate, 60.0 );
+    ADD_UINT_SERIALIZER( NumPixelBuffers, 2 );
+    ADD_VEC4_SERIALIZER( Extents, osg::Vec4(0.0f, 0.0f, 1.0f, 1.0f) );
+    ADD_UINT_SERIALIZER( TextureUnit, 15 );
+}
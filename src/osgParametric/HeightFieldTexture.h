@@ -0,0 +1,224 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_HEIGHTFIELDTEXTURE
+#define OSGPARAMETRIC_HEIGHTFIELDTEXTURE 1
+
+#include <osgParametric/Export>
+#include <osgParametric/MappedFile.h>
+
+#include <osg/Texture2D>
+#include <osg/GLExtensions>
+#include <osg/StateSet>
+#include <osg/Vec2>
+#include <osg/Vec4>
+#include <OpenThreads/Thread>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/Condition>
+#include <OpenThreads/Atomic>
+
+#include <map>
+#include <list>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+namespace osgParametric
+{
+
+/** Memory mapped file of heightfield frames, each a grid of columns by rows 32 bit floats stored row by row with no header,
+  * and the frames one after another. A background thread copies frames out of the mapping on request, so the reads from disk
+  * that the first touch of a frame's pages triggers are kept off the threads that draw.*/
+class OSGPARAMETRIC_EXPORT HeightFieldStream : public osg::Referenced
+{
+public:
+
+    HeightFieldStream();
+
+    /** Map filename, the number of frames is the size of the file divided by the size of a frame, returns false if it can't be mapped
+      * or is smaller than one frame. The height range is computed from all the frames, in one pass over the file, and may be
+      * replaced with setHeightRange().*/
+    bool open(const std::string& filename, unsigned int columns, unsigned int rows);
+
+    void close();
+
+    bool valid() const { return _data!=0; }
+
+    const std::string& getFileName() const { return _file->getFileName(); }
+    unsigned int getColumns() const { return _columns; }
+    unsigned int getRows() const { return _rows; }
+    unsigned int getNumFrames() const { return _numFrames; }
+
+    /** Size of a frame in bytes.*/
+    size_t getFrameSize() const { return static_cast<size_t>(_columns)*_rows*sizeof(float); }
+
+    const float* getFrame(unsigned int frame) const { return _data+static_cast<size_t>(frame%_numFrames)*_columns*_rows; }
+
+    /** Set the minimum and maximum heights of all the frames, used to bound the displaced surfaces.*/
+    void setHeightRange(const osg::Vec2& range) { _heightRange = range; }
+    const osg::Vec2& getHeightRange() const { return _heightRange; }
+
+    /** Set once a requested copy has completed.*/
+    typedef OpenThreads::Atomic Completion;
+
+    /** Have the loader thread copy frame to destination, which must stay valid until completion is set.*/
+    void requestCopy(unsigned int frame, void* destination, Completion* completion);
+
+    /** Block until all the requested copies have completed.*/
+    void waitForCopies();
+
+    /** Copy frame to destination on the calling thread.*/
+    void copy(unsigned int frame, void* destination) const;
+
+protected:
+
+    virtual ~HeightFieldStream();
+
+    void computeHeightRange();
+
+    struct Request
+    {
+        unsigned int    frame;
+        void*           destination;
+        Completion*     completion;
+    };
+
+    typedef std::list<Request> Requests;
+
+    class Loader : public OpenThreads::Thread
+    {
+    public:
+
+        Loader(HeightFieldStream* stream): _stream(stream) {}
+
+        virtual void run();
+
+    protected:
+
+        HeightFieldStream* _stream;
+    };
+
+    friend class Loader;
+
+    osg::ref_ptr<MappedFile>    _file;
+    unsigned int                _columns;
+    unsigned int                _rows;
+    unsigned int                _numFrames;
+    osg::Vec2                   _heightRange;
+    const float*                _data;
+
+    OpenThreads::Mutex          _requestMutex;
+    OpenThreads::Condition      _requestCondition;
+    OpenThreads::Condition      _idleCondition;
+    Requests                    _requests;
+    unsigned int                _numCopying;
+    bool                        _done;
+    Loader*                     _loader;
+};
+
+/** Texture holding the frame of a HeightFieldStream due at the current simulation time, for parametric.vert's Z_HEIGHTFIELD mode.
+  * Frames are uploaded on the first apply() of each frame by each graphics context, so all the passes of a frame see the same one.
+  * With pixel buffer object support the frames after the current one are copied by the stream's loader thread into mapped
+  * buffers while earlier frames are drawn, so the upload only has to hand a filled buffer to the driver. A frame that hasn't
+  * been copied in time is skipped and the previous one kept, rather than stalling the draw.*/
+class OSGPARAMETRIC_EXPORT HeightFieldTexture : public osg::Texture2D
+{
+public:
+
+    HeightFieldTexture(HeightFieldStream* stream=0);
+
+    HeightFieldTexture(const HeightFieldTexture& rhs, const osg::CopyOp& copyop=osg::CopyOp::SHALLOW_COPY);
+
+    META_StateAttribute(osgParametric, HeightFieldTexture, TEXTURE);
+
+    /** Set the stream, sizing the texture to its frames.*/
+    void setStream(HeightFieldStream* stream);
+    HeightFieldStream* getStream() { return _stream.get(); }
+    const HeightFieldStream* getStream() const { return _stream.get(); }
+
+    /** Set the number of frames shown per second of simulation time, playback loops at the end of the stream.*/
+    void setFrameRate(double fps) { _frameRate = fps; }
+    double getFrameRate() const { return _frameRate; }
+
+    /** Set the number of pixel buffers frames are copied ahead into, 2 by default.*/
+    void setNumPixelBuffers(unsigned int num) { _numPixelBuffers = std::max(1u, num); }
+    unsigned int getNumPixelBuffers() const { return _numPixelBuffers; }
+
+    /** Set the origin and size in x and y of the area a frame covers, its corner samples are placed at the corners of the area.*/
+    void setExtents(const osg::Vec4& extents) { _extents = extents; }
+    const osg::Vec4& getExtents() const { return _extents; }
+
+    /** Set the texture unit used by addToStateSet(), 15 by default to keep clear of the depth textures bound from unit 0.*/
+    void setTextureUnit(unsigned int unit) { _textureUnit = unit; }
+    unsigned int getTextureUnit() const { return _textureUnit; }
+
+    /** Assign the texture, the Z_HEIGHTFIELD define and the heightField, heightFieldExtents, heightFieldResolution and
+      * heightFieldRange uniforms that parametric.vert and ParametricScene's bounds use.*/
+    void addToStateSet(osg::StateSet* stateset);
+
+    /** Sequence number of the frame due at time, the frame shown is the sequence modulo the number of frames.*/
+    unsigned int getSequence(double time) const;
+
+    virtual void apply(osg::State& state) const;
+
+    virtual void releaseGLObjects(osg::State* state=0) const;
+
+protected:
+
+    virtual ~HeightFieldTexture();
+
+    struct PixelBuffer
+    {
+        PixelBuffer(): id(0), mapped(0), sequence(0) {}
+
+        GLuint                          id;
+        void*                           mapped;
+        unsigned int                    sequence;
+        HeightFieldStream::Completion   copied;
+    };
+
+    struct ContextData
+    {
+        ContextData(): textureObject(0), frameNumber(0), uploaded(false), sequence(0), step(1), requested(0) {}
+
+        const void*                 textureObject;
+        unsigned int                frameNumber;
+        bool                        uploaded;
+
+        // sequence of the frame in the texture, the number of sequences it last advanced by and the last requested
+        unsigned int                sequence;
+        unsigned int                step;
+        unsigned int                requested;
+
+        // owned by the context data, deleted by releasePixelBuffers()
+        std::vector<PixelBuffer*>   pixelBuffers;
+    };
+
+    typedef std::map<unsigned int, ContextData> ContextDataMap;
+
+    void update(osg::State& state, ContextData& data) const;
+
+    void uploadFromStream(ContextData& data, unsigned int sequence) const;
+
+    void uploadFromPixelBuffer(const osg::GLExtensions* extensions, ContextData& data, PixelBuffer* pixelBuffer) const;
+
+    void requestPixelBuffers(const osg::GLExtensions* extensions, ContextData& data, unsigned int sequence) const;
+
+    /** Unmap and delete the context's pixel buffers, with no state their deletion is left to the context's next flush of deleted GL objects.*/
+    void releasePixelBuffers(unsigned int contextID, osg::State* state, ContextData& data) const;
+
+    osg::ref_ptr<HeightFieldStream> _stream;
+    double                          _frameRate;
+    unsigned int                    _numPixelBuffers;
+    osg::Vec4                       _extents;
+    unsigned int                    _textureUnit;
+
+    mutable OpenThreads::Mutex      _mutex;
+    mutable ContextDataMap          _contextData;
+};
+
+}
+
+#endif
@@ -0,0 +1,140 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "MappedFile.h"
+
+#include <osg/Notify>
+
+#include <algorithm>
+
+#ifdef _WIN32
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+using namespace osgParametric;
+
+MappedFile::MappedFile():
+    _data(0),
+    _size(0)
+#ifdef _WIN32
+    ,_fileHandle(0),
+    _mappingHandle(0)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const std::string& filename)
+{
+    close();
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file==INVALID_HANDLE_VALUE)
+    {
+        OSG_NOTICE<<"MappedFile::open() unable to open "<<filename<<std::endl;
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    HANDLE mapping = (GetFileSizeEx(file, &size) && size.QuadPart>0) ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    const void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!data)
+    {
+        OSG_NOTICE<<"MappedFile::open() unable to map "<<filename<<std::endl;
+        if (mapping) CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    _size = static_cast<size_t>(size.QuadPart);
+    _fileHandle = file;
+    _mappingHandle = mapping;
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd<0)
+    {
+        OSG_NOTICE<<"MappedFile::open() unable to open "<<filename<<std::endl;
+        return false;
+    }
+
+    struct stat status;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &status)==0 && status.st_size>0)
+    {
+        _size = static_cast<size_t>(status.st_size);
+        data = mmap(0, _size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+
+    // the mapping keeps the file open
+    ::close(fd);
+
+    if (data==MAP_FAILED)
+    {
+        OSG_NOTICE<<"MappedFile::open() unable to map "<<filename<<std::endl;
+        _size = 0;
+        return false;
+    }
+#endif
+
+    _filename = filename;
+    _data = static_cast<const unsigned char*>(data);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (_data)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(_data);
+        CloseHandle(static_cast<HANDLE>(_mappingHandle));
+        CloseHandle(static_cast<HANDLE>(_fileHandle));
+        _mappingHandle = 0;
+        _fileHandle = 0;
+#else
+        munmap(const_cast<unsigned char*>(_data), _size);
+#endif
+    }
+
+    _data = 0;
+    _size = 0;
+}
+
+void MappedFile::adviseSequential() const
+{
+#ifndef _WIN32
+    if (_data) posix_madvise(const_cast<unsigned char*>(_data), _size, POSIX_MADV_SEQUENTIAL);
+#endif
+}
+
+void MappedFile::prefetch(size_t offset, size_t size) const
+{
+#ifndef _WIN32
+    if (!_data || offset>=_size) return;
+
+    static const size_t s_pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+    // the range has to start on a page boundary
+    size_t aligned = offset - offset%s_pageSize;
+    size = std::min(size+(offset-aligned), _size-aligned);
+    posix_madvise(const_cast<unsigned char*>(_data+aligned), size, POSIX_MADV_WILLNEED);
+#else
+    (void)offset;
+    (void)size;
+#endif
+}
@@ -0,0 +1,59 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_MAPPEDFILE
+#define OSGPARAMETRIC_MAPPEDFILE 1
+
+#include <osgParametric/Export>
+
+#include <osg/Referenced>
+
+#include <string>
+
+namespace osgParametric
+{
+
+/** Read only memory mapping of a whole file, pages are read from disk by the operating system as they're first touched
+  * so files far larger than memory can be mapped.*/
+class OSGPARAMETRIC_EXPORT MappedFile : public osg::Referenced
+{
+public:
+
+    MappedFile();
+
+    /** Map filename, returns false and leaves the file closed if it can't be opened or is empty.*/
+    bool open(const std::string& filename);
+
+    void close();
+
+    bool valid() const { return _data!=0; }
+
+    const std::string& getFileName() const { return _filename; }
+
+    const unsigned char* getData() const { return _data; }
+    size_t getSize() const { return _size; }
+
+    /** Hint that the file will be read from start to end.*/
+    void adviseSequential() const;
+
+    /** Hint that [offset, offset+size) will be read soon, so its pages are read ahead in the background.*/
+    void prefetch(size_t offset, size_t size) const;
+
+protected:
+
+    virtual ~MappedFile();
+
+    std::string             _filename;
+    const unsigned char*    _data;
+    size_t                  _size;
+#ifdef _WIN32
+    void*                   _fileHandle;
+    void*                   _mappingHandle;
+#endif
+};
+
+}
+
+#endif
@@ -0,0 +1,708 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "MeshExporter.h"
+#include "ThreadPool.h"
+
+#include <osg/NodeVisitor>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/ProxyNode>
+#include <osg/Endian>
+#include <osg/Notify>
+#include <osgDB/FileNameUtils>
+#include <osgDB/WriteFile>
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <climits>
+#include <cstdio>
+#include <algorithm>
+
+using namespace osgParametric;
+
+namespace
+{
+
+// bisections used to find where an edge leaves a boundary, enough to place the cut within 1/65536th of the edge
+const unsigned int s_numBisections = 16;
+
+class CollectSurfacesVisitor : public osg::NodeVisitor
+{
+public:
+
+    struct Entry
+    {
+        osg::ref_ptr<SurfaceGeometry>   geometry;
+        osg::Matrixd                    localToWorld;
+    };
+
+    CollectSurfacesVisitor():
+        osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN) {}
+
+    virtual void apply(osg::Drawable& drawable)
+    {
+        SurfaceGeometry* geometry = dynamic_cast<SurfaceGeometry*>(&drawable);
+        if (!geometry || geometry->getUCells()==0 || geometry->getVCells()==0) return;
+
+        Entry entry;
+        entry.geometry = geometry;
+        entry.localToWorld = osg::computeLocalToWorld(getNodePath());
+        entries.push_back(entry);
+    }
+
+    std::vector<Entry> entries;
+};
+
+template<typename T>
+void appendLittleEndian(std::vector<char>& buffer, T value)
+{
+    if (osg::getCpuByteOrder()==osg::BigEndian) osg::swapBytes(reinterpret_cast<char*>(&value), sizeof(T));
+
+    const char* bytes = reinterpret_cast<const char*>(&value);
+    buffer.insert(buffer.end(), bytes, bytes+sizeof(T));
+}
+
+/** Binary little endian PLY. The faces have to follow all the vertices, so they're streamed to a second file that's appended
+  * once the vertices are complete, and the counts in the header are written as fixed width placeholders filled in on closing.*/
+class PLYWriter : public MeshExporter::Writer
+{
+public:
+
+    PLYWriter(): _numVertices(0), _numFaces(0) {}
+
+    virtual bool open(const std::string& filename)
+    {
+        _facesFilename = filename+".faces";
+        _out.open(filename.c_str(), std::ios::out | std::ios::binary);
+        _faces.open(_facesFilename.c_str(), std::ios::out | std::ios::binary);
+        if (!_out || !_faces) return false;
+
+        _out<<"ply\n";
+        _out<<"format binary_little_endian 1.0\n";
+        _out<<"comment written by osgParametric::MeshExporter\n";
+        _out<<"element vertex ";
+        _vertexCountPosition = _out.tellp();
+        _out<<formatCount(0)<<"\n";
+        _out<<"property float x\n";
+        _out<<"property float y\n";
+        _out<<"property float z\n";
+        _out<<"element face ";
+        _faceCountPosition = _out.tellp();
+        _out<<formatCount(0)<<"\n";
+        _out<<"property list uchar uint vertex_indices\n";
+        _out<<"end_header\n";
+        return _out.good();
+    }
+
+    virtual bool write(const MeshExporter::Chunk& chunk)
+    {
+        if (_numVertices+chunk.vertices.size()>UINT_MAX)
+        {
+            OSG_NOTICE<<"MeshExporter: too many vertices for the 32 bit indices of a PLY file"<<std::endl;
+            return false;
+        }
+
+        _buffer.clear();
+        for(std::vector<osg::Vec3>::const_iterator itr = chunk.vertices.begin(); itr != chunk.vertices.end(); ++itr)
+        {
+            appendLittleEndian(_buffer, itr->x());
+            appendLittleEndian(_buffer, itr->y());
+            appendLittleEndian(_buffer, itr->z());
+        }
+        if (!_buffer.empty()) _out.write(&_buffer.front(), _buffer.size());
+
+        _buffer.clear();
+        unsigned int offset = static_cast<unsigned int>(_numVertices);
+        for(unsigned int i=0; i+2<chunk.indices.size(); i+=3)
+        {
+            appendLittleEndian(_buffer, static_cast<unsigned char>(3));
+            appendLittleEndian(_buffer, chunk.indices[i]+offset);
+            appendLittleEndian(_buffer, chunk.indices[i+1]+offset);
+            appendLittleEndian(_buffer, chunk.indices[i+2]+offset);
+        }
+        if (!_buffer.empty()) _faces.write(&_buffer.front(), _buffer.size());
+
+        _numVertices += chunk.vertices.size();
+        _numFaces += chunk.indices.size()/3;
+        return _out.good() && _faces.good();
+    }
+
+    virtual bool close()
+    {
+        _faces.close();
+
+        _out.seekp(_vertexCountPosition);
+        _out<<formatCount(_numVertices);
+        _out.seekp(_faceCountPosition);
+        _out<<formatCount(_numFaces);
+        _out.seekp(0, std::ios::end);
+
+        std::ifstream faces(_facesFilename.c_str(), std::ios::in | std::ios::binary);
+        std::vector<char> block(1<<20);
+        while(faces && _out)
+        {
+            faces.read(&block.front(), block.size());
+            if (faces.gcount()>0) _out.write(&block.front(), faces.gcount());
+        }
+        faces.close();
+        std::remove(_facesFilename.c_str());
+
+        bool result = _out.good();
+        _out.close();
+        return result;
+    }
+
+protected:
+
+    static std::string formatCount(unsigned long long count)
+    {
+        std::ostringstream str;
+        str<<std::setw(20)<<std::setfill('0')<<count;
+        return str.str();
+    }
+
+    std::ofstream       _out;
+    std::ofstream       _faces;
+    std::string         _facesFilename;
+    std::streampos      _vertexCountPosition;
+    std::streampos      _faceCountPosition;
+    unsigned long long  _numVertices;
+    unsigned long long  _numFaces;
+    std::vector<char>   _buffer;
+};
+
+/** Binary STL, the triangle count following the 80 byte header is filled in on closing.*/
+class STLWriter : public MeshExporter::Writer
+{
+public:
+
+    STLWriter(): _numTriangles(0) {}
+
+    virtual bool open(const std::string& filename)
+    {
+        _out.open(filename.c_str(), std::ios::out | std::ios::binary);
+        if (!_out) return false;
+
+        std::string header("written by osgParametric::MeshExporter");
+        header.resize(80, ' ');
+        _out.write(header.c_str(), header.size());
+
+        _buffer.clear();
+        appendLittleEndian(_buffer, static_cast<unsigned int>(0));
+        _out.write(&_buffer.front(), _buffer.size());
+        return _out.good();
+    }
+
+    virtual bool write(const MeshExporter::Chunk& chunk)
+    {
+        if (_numTriangles+chunk.indices.size()/3>UINT_MAX)
+        {
+            OSG_NOTICE<<"MeshExporter: too many triangles for the 32 bit count of an STL file"<<std::endl;
+            return false;
+        }
+
+        _buffer.clear();
+        for(unsigned int i=0; i+2<chunk.indices.size(); i+=3)
+        {
+            const osg::Vec3& v0 = chunk.vertices[chunk.indices[i]];
+            const osg::Vec3& v1 = chunk.vertices[chunk.indices[i+1]];
+            const osg::Vec3& v2 = chunk.vertices[chunk.indices[i+2]];
+            osg::Vec3 normal = (v1-v0) ^ (v2-v0);
+            normal.normalize();
+
+            appendLittleEndian(_buffer, normal.x()); appendLittleEndian(_buffer, normal.y()); appendLittleEndian(_buffer, normal.z());
+            appendLittleEndian(_buffer, v0.x()); appendLittleEndian(_buffer, v0.y()); appendLittleEndian(_buffer, v0.z());
+            appendLittleEndian(_buffer, v1.x()); appendLittleEndian(_buffer, v1.y()); appendLittleEndian(_buffer, v1.z());
+            appendLittleEndian(_buffer, v2.x()); appendLittleEndian(_buffer, v2.y()); appendLittleEndian(_buffer, v2.z());
+            appendLittleEndian(_buffer, static_cast<unsigned short>(0));
+        }
+        if (!_buffer.empty()) _out.write(&_buffer.front(), _buffer.size());
+
+        _numTriangles += chunk.indices.size()/3;
+        return _out.good();
+    }
+
+    virtual bool close()
+    {
+        _buffer.clear();
+        appendLittleEndian(_buffer, static_cast<unsigned int>(_numTriangles));
+        _out.seekp(80);
+        _out.write(&_buffer.front(), _buffer.size());
+
+        bool result = _out.good();
+        _out.close();
+        return result;
+    }
+
+protected:
+
+    std::ofstream       _out;
+    unsigned long long  _numTriangles;
+    std::vector<char>   _buffer;
+};
+
+/** Scene graph of ProxyNodes, each referencing an .osgb file of the triangles written since the last, so no more than one file's
+  * worth of triangles is held in memory.*/
+class OSGBWriter : public MeshExporter::Writer
+{
+public:
+
+    OSGBWriter(unsigned int trianglesPerFile): _trianglesPerFile(trianglesPerFile) {}
+
+    virtual bool open(const std::string& filename)
+    {
+        _filename = filename;
+        _root = new osg::Group;
+        _root->setName(osgDB::getSimpleFileName(filename));
+        return true;
+    }
+
+    virtual bool write(const MeshExporter::Chunk& chunk)
+    {
+        if (!_vertices)
+        {
+            _vertices = new osg::Vec3Array;
+            _indices = new osg::DrawElementsUInt(GL_TRIANGLES);
+        }
+
+        unsigned int offset = static_cast<unsigned int>(_vertices->size());
+        _vertices->insert(_vertices->end(), chunk.vertices.begin(), chunk.vertices.end());
+        for(std::vector<unsigned int>::const_iterator itr = chunk.indices.begin(); itr != chunk.indices.end(); ++itr)
+        {
+            _indices->push_back(*itr+offset);
+        }
+
+        return _indices->size()/3<_trianglesPerFile || flush();
+    }
+
+    virtual bool close()
+    {
+        if (!flush()) return false;
+        return osgDB::writeNodeFile(*_root, _filename);
+    }
+
+protected:
+
+    bool flush()
+    {
+        if (!_vertices || _indices->empty()) return true;
+
+        osg::ref_ptr<osg::Geometry> geometry = new osg::Geometry;
+        geometry->setVertexArray(_vertices.get());
+        geometry->addPrimitiveSet(_indices.get());
+
+        osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+        geode->addDrawable(geometry.get());
+
+        _vertices = 0;
+        _indices = 0;
+
+        std::ostringstream str;
+        str<<osgDB::getNameLessExtension(_filename)<<"_"<<_root->getNumChildren()<<".osgb";
+        std::string filename = str.str();
+        if (!osgDB::writeNodeFile(*geode, filename)) return false;
+
+        // the bound lets the proxy be culled before its file is loaded
+        const osg::BoundingSphere& bs = geode->getBound();
+        osg::ref_ptr<osg::ProxyNode> proxy = new osg::ProxyNode;
+        proxy->setFileName(0, osgDB::getSimpleFileName(filename));
+        proxy->setCenterMode(osg::ProxyNode::USER_DEFINED_CENTER);
+        proxy->setCenter(bs.center());
+        proxy->setRadius(bs.radius());
+        _root->addChild(proxy.get());
+        return true;
+    }
+
+    unsigned int                            _trianglesPerFile;
+    std::string                             _filename;
+    osg::ref_ptr<osg::Group>                _root;
+    osg::ref_ptr<osg::Vec3Array>            _vertices;
+    osg::ref_ptr<osg::DrawElementsUInt>     _indices;
+};
+
+}
+
+class MeshExporter::TriangulateRowsTask : public ThreadPool::Task
+{
+public:
+
+    TriangulateRowsTask(const Surface& surface, unsigned int grainSize, float simulationTime, std::vector<Chunk>& chunks):
+        _surface(surface),
+        _grainSize(grainSize),
+        _simulationTime(simulationTime),
+        _chunks(chunks),
+        _firstChunk(0) {}
+
+    void setFirstChunk(unsigned int chunk) { _firstChunk = chunk; }
+
+    virtual void operator()(unsigned int begin, unsigned int end)
+    {
+        const SurfaceGeometry* geometry = _surface.geometry.get();
+        unsigned int columns = geometry->getNumTileUCells();
+        unsigned int rows = geometry->getNumTileVCells();
+        unsigned int numColumns = columns+1;
+
+        osg::Vec3 ua = geometry->getUAxis()/static_cast<float>(geometry->getUCells());
+        osg::Vec3 va = geometry->getVAxis()/static_cast<float>(geometry->getVCells());
+        osg::Vec3d n = geometry->getVerticalAxis();
+
+        Triangles triangles;
+        BoundaryClipper::Query query;
+        std::vector<float> x, y, z, heights;
+
+        for(unsigned int i=begin; i<end; ++i)
+        {
+            unsigned int firstRow = (_firstChunk+i)*_grainSize;
+            unsigned int lastRow = std::min(firstRow+_grainSize, rows);
+            unsigned int numVertices = (lastRow-firstRow+1)*numColumns;
+
+            // the same single precision positions parametric.vert displaces
+            x.resize(numVertices); y.resize(numVertices); z.resize(numVertices);
+            for(unsigned int v=0; v<numVertices; ++v)
+            {
+                unsigned int c = geometry->getTileColumn()+v%numColumns;
+                unsigned int r = geometry->getTileRow()+firstRow+v/numColumns;
+                osg::Vec3 p = _surface.origin + ua*static_cast<float>(c) + va*static_cast<float>(r);
+                x[v] = p.x(); y[v] = p.y(); z[v] = p.z();
+            }
+
+            heights.assign(numVertices, 0.0f);
+            if (_surface.function) _surface.function->evaluate(numVertices, &x.front(), &y.front(), &z.front(), _simulationTime, &heights.front());
+
+            triangles.vertices.resize(numVertices);
+            for(unsigned int v=0; v<numVertices; ++v)
+            {
+                triangles.vertices[v] = osg::Vec3d(x[v], y[v], z[v]) + n*static_cast<double>(heights[v]);
+            }
+
+            // each cell as GridTopology splits it, p0=(c,r), p1=(c,r+1), p2=(c+1,r), p3=(c+1,r+1), wound the other way for the top
+            bool top = _surface.top;
+            triangles.indices.clear();
+            for(unsigned int r=0; r<lastRow-firstRow; ++r)
+            {
+                for(unsigned int c=0; c<columns; ++c)
+                {
+                    unsigned int p0 = c+r*numColumns;
+                    unsigned int p1 = p0+numColumns;
+                    unsigned int p2 = p0+1;
+                    unsigned int p3 = p1+1;
+                    if (top)
+                    {
+                        unsigned int cell[6] = { p0, p2, p1, p2, p3, p1 };
+                        triangles.indices.insert(triangles.indices.end(), cell, cell+6);
+                    }
+                    else
+                    {
+                        unsigned int cell[6] = { p0, p1, p2, p2, p1, p3 };
+                        triangles.indices.insert(triangles.indices.end(), cell, cell+6);
+                    }
+                }
+            }
+
+            clip(_surface, triangles, query, _chunks[i]);
+        }
+    }
+
+protected:
+
+    const Surface&          _surface;
+    unsigned int            _grainSize;
+    float                   _simulationTime;
+    std::vector<Chunk>&     _chunks;
+    unsigned int            _firstChunk;
+};
+
+MeshExporter::MeshExporter(ParametricScene* scene):
+    _scene(scene),
+    _clipToBoundaries(true),
+    _trianglesPerFile(1000000),
+    _numTriangles(0)
+{
+}
+
+MeshExporter::~MeshExporter()
+{
+}
+
+bool MeshExporter::write(const std::string& filename, double simulationTime)
+{
+    _numTriangles = 0;
+
+    osg::ref_ptr<ParametricScene> scene;
+    if (!_scene.lock(scene)) return false;
+
+    if (!scene->isSetup())
+    {
+        OSG_NOTICE<<"MeshExporter::write() scene must be set up first"<<std::endl;
+        return false;
+    }
+
+    osg::ref_ptr<Writer> writer;
+    std::string extension = osgDB::getLowerCaseFileExtension(filename);
+    if (extension=="ply") writer = new PLYWriter;
+    else if (extension=="stl") writer = new STLWriter;
+    else if (extension=="osgb") writer = new OSGBWriter(_trianglesPerFile);
+    else
+    {
+        OSG_NOTICE<<"MeshExporter::write() unsupported extension "<<extension<<", use .ply, .stl or .osgb"<<std::endl;
+        return false;
+    }
+
+    if (!writer->open(filename))
+    {
+        OSG_NOTICE<<"MeshExporter::write() unable to open "<<filename<<std::endl;
+        return false;
+    }
+
+    // the triangles of each subgraph that captures depth
+    std::vector<BoundaryClipper::Triangles> boundaries;
+    if (_clipToBoundaries) BoundaryClipper::collectBoundaries(scene.get(), boundaries);
+
+    bool result = true;
+    for(unsigned int i=0; i<scene->getNumSubgraphs() && result; ++i)
+    {
+        if (!scene->getSubgraph(i) || !scene->getSubgraphRequiresRenderSubgraph(i)) continue;
+
+        std::vector<const BoundaryClipper::Triangles*> clippingBoundaries;
+        for(unsigned int b=0; b<boundaries.size(); ++b)
+        {
+            // a subgraph isn't clipped by its own depth
+            if (b!=i && !boundaries[b].empty()) clippingBoundaries.push_back(&boundaries[b]);
+        }
+
+        CollectSurfacesVisitor csv;
+        scene->getSubgraph(i)->accept(csv);
+
+        for(std::vector<CollectSurfacesVisitor::Entry>::iterator itr = csv.entries.begin();
+            itr != csv.entries.end() && result;
+            ++itr)
+        {
+            osg::ref_ptr<SurfaceFunction> function;
+            if (!scene->findSurfaceFunction(itr->geometry.get(), function)) continue;
+
+            Surface surface;
+            surface.geometry = itr->geometry;
+            surface.function = function.get();
+            surface.localToWorld = itr->localToWorld;
+            surface.origin = itr->geometry->getOrigin();
+            surface.top = itr->geometry->getType()==SurfaceGeometry::TOP;
+
+            // clip in the grid coordinates of the tile, or of the whole grid for the side walls around it
+            const SurfaceGeometry* geometry = itr->geometry.get();
+            bool solid = geometry->getType()==SurfaceGeometry::SOLID;
+            bool sideWalls = solid || geometry->getType()==SurfaceGeometry::SIDE_WALLS;
+            unsigned int firstColumn = sideWalls ? 0 : geometry->getTileColumn();
+            unsigned int firstRow = sideWalls ? 0 : geometry->getTileRow();
+            unsigned int width = sideWalls ? geometry->getUCells() : geometry->getNumTileUCells();
+            unsigned int height = sideWalls ? geometry->getVCells() : geometry->getNumTileVCells();
+            if (width==0 || height==0) continue;
+
+            osg::Vec3d du = osg::Vec3d(geometry->getUAxis())/static_cast<double>(geometry->getUCells());
+            osg::Vec3d dv = osg::Vec3d(geometry->getVAxis())/static_cast<double>(geometry->getVCells());
+            osg::Vec3d n = geometry->getVerticalAxis();
+            osg::Vec3d o = osg::Vec3d(geometry->getOrigin()) + du*static_cast<double>(firstColumn) + dv*static_cast<double>(firstRow);
+            osg::Matrixd gridToLocal(du.x(), du.y(), du.z(), 0.0,
+                                     dv.x(), dv.y(), dv.z(), 0.0,
+                                     n.x(),  n.y(),  n.z(),  0.0,
+                                     o.x(),  o.y(),  o.z(),  1.0);
+
+            osg::Matrixd worldToLocal;
+            if (!surface.localToGrid.invert(gridToLocal) || !worldToLocal.invert(surface.localToWorld)) continue;
+
+            osg::ref_ptr<BoundaryClipper> clipper;
+            if (!clippingBoundaries.empty())
+            {
+                clipper = new BoundaryClipper;
+                clipper->build(clippingBoundaries, worldToLocal*surface.localToGrid, static_cast<double>(width), static_cast<double>(height));
+                surface.clipper = clipper.get();
+            }
+
+            if (solid)
+            {
+                // the walls, then the base and top grids, all clipped in the base grid's coordinates
+                result = writeSideWalls(*writer, surface, static_cast<float>(simulationTime)) &&
+                         writeGrid(*writer, surface, static_cast<float>(simulationTime));
+
+                surface.origin = geometry->getTopOrigin();
+                surface.top = true;
+                result = result && writeGrid(*writer, surface, static_cast<float>(simulationTime));
+            }
+            else
+            {
+                result = sideWalls ? writeSideWalls(*writer, surface, static_cast<float>(simulationTime)) :
+                                     writeGrid(*writer, surface, static_cast<float>(simulationTime));
+            }
+        }
+    }
+
+    if (!writer->close()) result = false;
+    if (!result) OSG_NOTICE<<"MeshExporter::write() failed writing "<<filename<<std::endl;
+    return result;
+}
+
+bool MeshExporter::writeGrid(Writer& writer, const Surface& surface, float simulationTime)
+{
+    unsigned int columns = surface.geometry->getNumTileUCells();
+    unsigned int rows = surface.geometry->getNumTileVCells();
+    unsigned int grainSize = std::max(1u, 65536u/(columns+1));
+    unsigned int numChunks = (rows+grainSize-1)/grainSize;
+
+    // a few chunks per thread are triangulated at a time, then written in order while their buffers are reused for the next
+    unsigned int batchSize = 2*(ThreadPool::instance()->getNumThreads()+1);
+    std::vector<Chunk> chunks(std::min(batchSize, numChunks));
+
+    TriangulateRowsTask task(surface, grainSize, simulationTime, chunks);
+    for(unsigned int first=0; first<numChunks; first+=batchSize)
+    {
+        unsigned int num = std::min(batchSize, numChunks-first);
+        task.setFirstChunk(first);
+        ThreadPool::instance()->run(num, 1, task);
+
+        for(unsigned int i=0; i<num; ++i)
+        {
+            if (!writer.write(chunks[i])) return false;
+            _numTriangles += chunks[i].indices.size()/3;
+            chunks[i].clear();
+        }
+    }
+    return true;
+}
+
+bool MeshExporter::writeSideWalls(Writer& writer, const Surface& surface, float simulationTime)
+{
+    const SurfaceGeometry* geometry = surface.geometry.get();
+    unsigned int uCells = geometry->getUCells();
+    unsigned int vCells = geometry->getVCells();
+    osg::Vec3 ua = geometry->getUAxis()/static_cast<float>(uCells);
+    osg::Vec3 va = geometry->getVAxis()/static_cast<float>(vCells);
+    osg::Vec3d n = geometry->getVerticalAxis();
+
+    // the four strips of base and top vertex pairs that SurfaceGeometry builds the walls from
+    std::vector<osg::Vec3> positions;
+    std::vector<unsigned int> stripStarts;
+    for(unsigned int side=0; side<4; ++side)
+    {
+        stripStarts.push_back(static_cast<unsigned int>(positions.size()));
+
+        unsigned int numCells = (side%2)==0 ? vCells : uCells;
+        for(unsigned int i=0; i<=numCells; ++i)
+        {
+            unsigned int c = side==0 ? 0 : (side==1 ? i : (side==2 ? uCells : uCells-i));
+            unsigned int r = side==0 ? i : (side==1 ? vCells : (side==2 ? vCells-i : 0));
+            osg::Vec3 offset = ua*static_cast<float>(c) + va*static_cast<float>(r);
+            positions.push_back(geometry->getOrigin() + offset);
+            positions.push_back(geometry->getTopOrigin() + offset);
+        }
+    }
+    stripStarts.push_back(static_cast<unsigned int>(positions.size()));
+
+    unsigned int numVertices = static_cast<unsigned int>(positions.size());
+    std::vector<float> x(numVertices), y(numVertices), z(numVertices), heights(numVertices, 0.0f);
+    for(unsigned int i=0; i<numVertices; ++i)
+    {
+        x[i] = positions[i].x(); y[i] = positions[i].y(); z[i] = positions[i].z();
+    }
+    if (surface.function) surface.function->evaluate(numVertices, &x.front(), &y.front(), &z.front(), simulationTime, &heights.front());
+
+    Triangles triangles;
+    triangles.vertices.resize(numVertices);
+    for(unsigned int i=0; i<numVertices; ++i)
+    {
+        triangles.vertices[i] = osg::Vec3d(positions[i]) + n*static_cast<double>(heights[i]);
+    }
+
+    // GL_TRIANGLE_STRIP order, every other triangle swapping its first two vertices to keep the winding
+    for(unsigned int s=0; s+1<stripStarts.size(); ++s)
+    {
+        for(unsigned int i=stripStarts[s]; i+2<stripStarts[s+1]; ++i)
+        {
+            bool odd = ((i-stripStarts[s])%2)==1;
+            triangles.indices.push_back(odd ? i+1 : i);
+            triangles.indices.push_back(odd ? i : i+1);
+            triangles.indices.push_back(i+2);
+        }
+    }
+
+    Chunk chunk;
+    BoundaryClipper::Query query;
+    clip(surface, triangles, query, chunk);
+    if (!writer.write(chunk)) return false;
+
+    _numTriangles += chunk.indices.size()/3;
+    return true;
+}
+
+void MeshExporter::clip(const Surface& surface, Triangles& triangles, BoundaryClipper::Query& query, Chunk& chunk)
+{
+    enum { OUTSIDE=0, INSIDE=1, INVALID=2 };
+
+    // vertices with a NaN height aren't drawn so neither are their triangles
+    unsigned int numVertices = static_cast<unsigned int>(triangles.vertices.size());
+    triangles.inside.resize(numVertices);
+    for(unsigned int i=0; i<numVertices; ++i)
+    {
+        const osg::Vec3d& v = triangles.vertices[i];
+        if (v.isNaN()) triangles.inside[i] = INVALID;
+        else if (!surface.clipper) triangles.inside[i] = INSIDE;
+        else triangles.inside[i] = surface.clipper->isInside(v*surface.localToGrid, query) ? INSIDE : OUTSIDE;
+    }
+
+    // only the vertices of the triangles kept are written
+    std::vector<unsigned int> remap(numVertices, UINT_MAX);
+
+    for(unsigned int t=0; t+2<triangles.indices.size(); t+=3)
+    {
+        const unsigned int* indices = &triangles.indices[t];
+        unsigned char inside[3] = { triangles.inside[indices[0]], triangles.inside[indices[1]], triangles.inside[indices[2]] };
+        if (inside[0]==INVALID || inside[1]==INVALID || inside[2]==INVALID) continue;
+
+        unsigned int numInside = inside[0] + inside[1] + inside[2];
+        if (numInside==0) continue;
+
+        // walk the edges keeping the inside vertices and adding the points where the edges leave the boundaries
+        unsigned int polygon[4];
+        unsigned int numPolygon = 0;
+        for(unsigned int k=0; k<3; ++k)
+        {
+            unsigned int a = indices[k];
+            unsigned int b = indices[(k+1)%3];
+
+            if (triangles.inside[a]==INSIDE)
+            {
+                if (remap[a]==UINT_MAX)
+                {
+                    remap[a] = static_cast<unsigned int>(chunk.vertices.size());
+                    chunk.vertices.push_back(triangles.vertices[a]*surface.localToWorld);
+                }
+                polygon[numPolygon++] = remap[a];
+            }
+
+            if (numInside<3 && triangles.inside[a]!=triangles.inside[b])
+            {
+                // always bisect from the inside end, so the triangles either side of the edge cut it at the same point
+                osg::Vec3d in = triangles.vertices[triangles.inside[a]==INSIDE ? a : b];
+                osg::Vec3d out = triangles.vertices[triangles.inside[a]==INSIDE ? b : a];
+                for(unsigned int i=0; i<s_numBisections; ++i)
+                {
+                    osg::Vec3d mid = (in+out)*0.5;
+                    if (surface.clipper->isInside(mid*surface.localToGrid, query)) in = mid;
+                    else out = mid;
+                }
+
+                polygon[numPolygon++] = static_cast<unsigned int>(chunk.vertices.size());
+                chunk.vertices.push_back(in*surface.localToWorld);
+            }
+        }
+
+        for(unsigned int k=1; k+1<numPolygon; ++k)
+        {
+            chunk.indices.push_back(polygon[0]);
+            chunk.indices.push_back(polygon[k]);
+            chunk.indices.push_back(polygon[k+1]);
+        }
+    }
+}
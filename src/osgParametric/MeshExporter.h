@@ -0,0 +1,118 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_MESHEXPORTER
+#define OSGPARAMETRIC_MESHEXPORTER 1
+
+#include <osgParametric/Export>
+#include <osgParametric/ParametricScene.h>
+#include <osgParametric/BoundaryClipper.h>
+
+#include <osg/Matrixd>
+#include <osg/Vec3>
+#include <osg/Vec3d>
+
+#include <string>
+#include <vector>
+
+namespace osgParametric
+{
+
+/** Bakes the surfaces of a ParametricScene into plain triangles for tools that can't run the shaders. Each SurfaceGeometry of the
+  * rendered subgraphs, side walls and solids included, is displaced by evaluating its surface function on the host, a block of rows at a
+  * time across the ThreadPool, and clipped against the boundaries with a BoundaryClipper. Triangles that cross a boundary are cut
+  * where their edges leave it. The blocks are written in order as they're completed, so only a few blocks are ever held in memory.
+  * The format is chosen by the extension, binary .ply and .stl are written as a single file, while .osgb writes a Group of
+  * ProxyNodes referencing files of about getTrianglesPerFile() triangles alongside it. Coordinates are in world space.
+  * SurfaceLOD patches, instanced and heightfield surfaces aren't exported.*/
+class OSGPARAMETRIC_EXPORT MeshExporter : public osg::Referenced
+{
+public:
+
+    MeshExporter(ParametricScene* scene=0);
+
+    void setScene(ParametricScene* scene) { _scene = scene; }
+    ParametricScene* getScene() const { return _scene.get(); }
+
+    /** Set whether the triangles are clipped by the scene's boundaries, true by default.*/
+    void setClipToBoundaries(bool flag) { _clipToBoundaries = flag; }
+    bool getClipToBoundaries() const { return _clipToBoundaries; }
+
+    /** Set the number of triangles in each of the files an .osgb export is split into, 1000000 by default.*/
+    void setTrianglesPerFile(unsigned int num) { _trianglesPerFile = num>0 ? num : 1; }
+    unsigned int getTrianglesPerFile() const { return _trianglesPerFile; }
+
+    /** Write the surfaces of the scene, which must have been set up, at simulationTime. Returns false if it couldn't be written.*/
+    bool write(const std::string& filename, double simulationTime=0.0);
+
+    /** Number of triangles written by the last write().*/
+    unsigned long long getNumTriangles() const { return _numTriangles; }
+
+    /** Block of triangles, written out in the order the blocks are created.*/
+    struct Chunk
+    {
+        std::vector<osg::Vec3>      vertices;
+        std::vector<unsigned int>   indices;
+
+        void clear() { vertices.clear(); indices.clear(); }
+    };
+
+    /** Destination of the chunks, one for each format.*/
+    class Writer : public osg::Referenced
+    {
+    public:
+
+        virtual bool open(const std::string& filename) = 0;
+        virtual bool write(const Chunk& chunk) = 0;
+        virtual bool close() = 0;
+    };
+
+protected:
+
+    virtual ~MeshExporter();
+
+    /** Surface as displaced and clipped, with the geometry's local coordinates taken to the grid coordinates of its clipper.*/
+    struct Surface
+    {
+        Surface(): top(false), function(0), clipper(0) {}
+
+        osg::ref_ptr<SurfaceGeometry>   geometry;
+
+        /** Origin and winding of the grid written by writeGrid(), a SOLID writes both its grids.*/
+        osg::Vec3                       origin;
+        bool                            top;
+
+        const SurfaceFunction*          function;
+        osg::Matrixd                    localToWorld;
+        osg::Matrixd                    localToGrid;
+        const BoundaryClipper*          clipper;
+    };
+
+    /** Vertices in the surface's local coordinates and triples of indices of the triangles between them.*/
+    struct Triangles
+    {
+        std::vector<osg::Vec3d>     vertices;
+        std::vector<unsigned char>  inside;
+        std::vector<unsigned int>   indices;
+    };
+
+    bool writeGrid(Writer& writer, const Surface& surface, float simulationTime);
+
+    bool writeSideWalls(Writer& writer, const Surface& surface, float simulationTime);
+
+    /** Add the parts of the triangles inside the boundaries to chunk, in world coordinates.*/
+    static void clip(const Surface& surface, Triangles& triangles, BoundaryClipper::Query& query, Chunk& chunk);
+
+    class TriangulateRowsTask;
+
+    osg::observer_ptr<ParametricScene>  _scene;
+    bool                                _clipToBoundaries;
+    unsigned int                        _trianglesPerFile;
+    unsigned long long                  _numTriangles;
+};
+
+}
+
+#endif
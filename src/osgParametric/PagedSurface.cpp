@@ -0,0 +1,412 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "PagedSurface.h"
+#include "SurfaceGeometry.h"
+#include "GridTopology.h"
+#include "PassTimer.h"
+
+#include <osg/PagedLOD>
+#include <osg/Texture2D>
+#include <osg/Notify>
+#include <osgUtil/CullVisitor>
+#include <osgDB/ReaderWriter>
+#include <osgDB/Registry>
+#include <osgDB/FileNameUtils>
+
+#include <OpenThreads/ScopedLock>
+
+#include <cfloat>
+#include <cstdio>
+#include <sstream>
+
+using namespace osgParametric;
+
+namespace
+{
+
+std::string getChildrenFileName(unsigned int level, unsigned int column, unsigned int row)
+{
+    std::ostringstream str;
+    str<<level<<"_"<<column<<"_"<<row<<".parametric_tile";
+    return str.str();
+}
+
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  PagedSurface::TileCullCallback
+//
+// Hands the tiles reached through the root to its RootCullCallback rather than drawing them, and keeps the stitched copies of the tile.
+class PagedSurface::TileCullCallback : public osg::DrawableCullCallback
+{
+public:
+
+    TileCullCallback(const PagedSurface* surface, const TileKey& key):
+        _surface(surface),
+        _key(key) {}
+
+    virtual bool cull(osg::NodeVisitor* nv, osg::Drawable* drawable, osg::RenderInfo* renderInfo) const
+    {
+        // tiles drawn unstitched by the RootCullCallback come back through here, and are counted for the pass timers
+        if (_surface->addCulledTile(nv, _key, drawable)) return true;
+        return CountTrianglesCallback::instance()->cull(nv, drawable, renderInfo);
+    }
+
+    /** Return the copy of tile joined to coarser neighbours along stitchEdges, sharing its vertex arrays and StateSet.*/
+    osg::Drawable* getStitchedTile(osg::Drawable* tile, unsigned int stitchEdges) const
+    {
+        SurfaceGeometry* geometry = dynamic_cast<SurfaceGeometry*>(tile);
+        if (stitchEdges==0 || !geometry || geometry->getUseVertexID()) return tile;
+
+        // stitched edges need an even number of cells, which the edge tiles overhanging the grid may not have
+        if ((geometry->getNumTileUCells()&1)!=0 || (geometry->getNumTileVCells()&1)!=0) return tile;
+
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+        osg::ref_ptr<SurfaceGeometry>& stitched = _stitchedTiles[stitchEdges];
+        if (!stitched)
+        {
+            stitched = new SurfaceGeometry(*geometry, osg::CopyOp::SHALLOW_COPY);
+            stitched->setCullCallback(CountTrianglesCallback::instance());
+            stitched->setStitchEdges(stitchEdges);
+            stitched->buildPrimitives();
+        }
+        return stitched.get();
+    }
+
+protected:
+
+    virtual ~TileCullCallback() {}
+
+    osg::ref_ptr<const PagedSurface>        _surface;
+    TileKey                                 _key;
+
+    mutable OpenThreads::Mutex              _mutex;
+    mutable osg::ref_ptr<SurfaceGeometry>   _stitchedTiles[GridTopologyCache::NUM_STITCH_MASKS];
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  PagedSurface::RootCullCallback
+//
+// Collects the tiles the PagedLODs select, then draws each stitched to the coarser tiles around it.
+class PagedSurface::RootCullCallback : public osg::NodeCallback
+{
+public:
+
+    RootCullCallback(const PagedSurface* surface): _surface(surface) {}
+
+    virtual void operator()(osg::Node* node, osg::NodeVisitor* nv)
+    {
+        osgUtil::CullVisitor* cv = dynamic_cast<osgUtil::CullVisitor*>(nv);
+        if (!cv)
+        {
+            traverse(node, nv);
+            return;
+        }
+
+        CulledTiles tiles;
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_surface->_cullMutex);
+            _surface->_cullTraversals[nv] = &tiles;
+        }
+
+        traverse(node, nv);
+
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_surface->_cullMutex);
+            _surface->_cullTraversals.erase(nv);
+        }
+
+        // the tiles go through the CullVisitor like any other drawable, picking up the small feature and view frustum culling
+        for(CulledTiles::iterator itr = tiles.begin(); itr != tiles.end(); ++itr)
+        {
+            osg::Drawable* tile = itr->second;
+            const TileCullCallback* callback = dynamic_cast<const TileCullCallback*>(tile->getCullCallback());
+            if (callback) tile = callback->getStitchedTile(tile, computeStitchEdges(itr->first, tiles));
+
+            tile->accept(*nv);
+        }
+    }
+
+protected:
+
+    virtual ~RootCullCallback() {}
+
+    static CulledTiles::const_iterator findCoveringTile(unsigned int level, unsigned int column, unsigned int row, const CulledTiles& tiles)
+    {
+        for(unsigned int shift=0; shift<=level; ++shift)
+        {
+            CulledTiles::const_iterator itr = tiles.find(TileKey(level-shift, column>>shift, row>>shift));
+            if (itr!=tiles.end()) return itr;
+        }
+        return tiles.end();
+    }
+
+    static bool isCoarser(const TileKey& key, unsigned int column, unsigned int row, const CulledTiles& tiles)
+    {
+        CulledTiles::const_iterator itr = findCoveringTile(key.level, column, row, tiles);
+        return itr!=tiles.end() && itr->first.level<key.level;
+    }
+
+    // tiles outside the grid are never selected, so only the first column and row need guarding
+    static unsigned int computeStitchEdges(const TileKey& key, const CulledTiles& tiles)
+    {
+        if (key.level==0) return 0;
+
+        unsigned int stitchEdges = 0;
+        if (key.column>0 && isCoarser(key, key.column-1, key.row, tiles)) stitchEdges |= GridTopologyCache::STITCH_U_MIN;
+        if (isCoarser(key, key.column+1, key.row, tiles)) stitchEdges |= GridTopologyCache::STITCH_U_MAX;
+        if (key.row>0 && isCoarser(key, key.column, key.row-1, tiles)) stitchEdges |= GridTopologyCache::STITCH_V_MIN;
+        if (isCoarser(key, key.column, key.row+1, tiles)) stitchEdges |= GridTopologyCache::STITCH_V_MAX;
+        return stitchEdges;
+    }
+
+    osg::ref_ptr<const PagedSurface>    _surface;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  PagedSurface
+//
+
+PagedSurface::PagedSurface():
+    _file(new MappedFile),
+    _heights(0),
+    _columns(0),
+    _rows(0),
+    _uAxis(1.0f, 0.0f, 0.0f),
+    _vAxis(0.0f, 1.0f, 0.0f),
+    _tileCells(256),
+    _maxCellPixels(2.0f),
+    _boundsMargin(0.05f),
+    _textureUnit(15),
+    _useVertexID(false)
+{
+}
+
+PagedSurface::~PagedSurface()
+{
+}
+
+bool PagedSurface::open(const std::string& filename, unsigned int columns, unsigned int rows)
+{
+    _heights = 0;
+    _columns = 0;
+    _rows = 0;
+
+    if (columns<2 || rows<2 || !_file->open(filename)) return false;
+
+    if (_file->getSize()<static_cast<size_t>(columns)*rows*sizeof(float))
+    {
+        OSG_NOTICE<<"PagedSurface::open() "<<filename<<" is smaller than a "<<columns<<" x "<<rows<<" grid"<<std::endl;
+        _file->close();
+        return false;
+    }
+
+    _heights = reinterpret_cast<const float*>(_file->getData());
+    _columns = columns;
+    _rows = rows;
+    return true;
+}
+
+bool PagedSurface::addCulledTile(const osg::NodeVisitor* nv, const TileKey& key, osg::Drawable* tile) const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_cullMutex);
+
+    CullTraversals::iterator itr = _cullTraversals.find(nv);
+    if (itr==_cullTraversals.end()) return false;
+
+    (*itr->second)[key] = tile;
+    return true;
+}
+
+unsigned int PagedSurface::getMaxLevel() const
+{
+    unsigned int cells = std::max(_columns, _rows)-1;
+    unsigned int level = 0;
+    while((static_cast<unsigned long long>(_tileCells)<<level)<cells) ++level;
+    return level;
+}
+
+bool PagedSurface::isAxisAligned() const
+{
+    return _uAxis.x()!=0.0f && _uAxis.y()==0.0f && _uAxis.z()==0.0f &&
+           _vAxis.x()==0.0f && _vAxis.y()!=0.0f && _vAxis.z()==0.0f;
+}
+
+osg::ref_ptr<osg::Node> PagedSurface::createRoot()
+{
+    if (!valid()) return 0;
+
+    if (!isAxisAligned())
+    {
+        OSG_NOTICE<<"PagedSurface::createRoot() the u and v axes must lie along the x and y axes"<<std::endl;
+        return 0;
+    }
+
+    // the tiles find the surface through the options they're loaded with, the surface doesn't keep the options so there's no cycle
+    osg::ref_ptr<osgDB::Options> options = new osgDB::Options;
+    options->setUserData(this);
+    options->setObjectCacheHint(osgDB::Options::CACHE_NONE);
+
+    osg::ref_ptr<osg::Group> root = new osg::Group;
+    root->setName("PagedSurface");
+
+    osg::StateSet* stateset = root->getOrCreateStateSet();
+    stateset->setDefine("Z_HEIGHTFIELD");
+    stateset->addUniform(new osg::Uniform("heightField", static_cast<int>(_textureUnit)));
+
+    root->setCullCallback(new RootCullCallback(this));
+
+    osg::ref_ptr<osg::Node> tile = createTile(0, 0, 0, options.get());
+    if (tile.valid()) root->addChild(tile.get());
+    return root;
+}
+
+osg::ref_ptr<osg::Node> PagedSurface::createChildren(unsigned int level, unsigned int column, unsigned int row, const osgDB::Options* options) const
+{
+    if (!valid() || level>=getMaxLevel()) return 0;
+
+    osg::ref_ptr<osg::Group> group = new osg::Group;
+    for(unsigned int j=0; j<2; ++j)
+    {
+        for(unsigned int i=0; i<2; ++i)
+        {
+            osg::ref_ptr<osg::Node> tile = createTile(level+1, column*2+i, row*2+j, options);
+            if (tile.valid()) group->addChild(tile.get());
+        }
+    }
+    return group;
+}
+
+osg::ref_ptr<osg::Node> PagedSurface::createTile(unsigned int level, unsigned int column, unsigned int row, const osgDB::Options* options) const
+{
+    unsigned int maxLevel = getMaxLevel();
+    unsigned int stride = 1u<<(maxLevel-level);
+
+    // first height of the tile and the number of cells that reach the last column and row, the edge cells of coarse
+    // levels may overhang the grid with the last heights repeated
+    unsigned long long firstColumn = static_cast<unsigned long long>(column)*_tileCells*stride;
+    unsigned long long firstRow = static_cast<unsigned long long>(row)*_tileCells*stride;
+    if (firstColumn>=_columns-1 || firstRow>=_rows-1) return 0;
+
+    unsigned int uCells = static_cast<unsigned int>(std::min<unsigned long long>(_tileCells, (_columns-1-firstColumn+stride-1)/stride));
+    unsigned int vCells = static_cast<unsigned int>(std::min<unsigned long long>(_tileCells, (_rows-1-firstRow+stride-1)/stride));
+
+    // heights of the tile, read from the mapping so only the pages under this tile are touched
+    osg::ref_ptr<osg::Image> image = new osg::Image;
+    image->allocateImage(uCells+1, vCells+1, 1, GL_RED, GL_FLOAT);
+    image->setInternalTextureFormat(GL_R32F);
+
+    float minHeight = FLT_MAX;
+    float maxHeight = -FLT_MAX;
+    for(unsigned int j=0; j<=vCells; ++j)
+    {
+        float* heights = reinterpret_cast<float*>(image->data(0, j));
+        unsigned int r = static_cast<unsigned int>(std::min<unsigned long long>(firstRow+static_cast<unsigned long long>(j)*stride, _rows-1));
+        for(unsigned int i=0; i<=uCells; ++i)
+        {
+            unsigned int c = static_cast<unsigned int>(std::min<unsigned long long>(firstColumn+static_cast<unsigned long long>(i)*stride, _columns-1));
+            float h = getHeight(c, r);
+            heights[i] = h;
+            if (h!=h) continue;
+
+            minHeight = std::min(minHeight, h);
+            maxHeight = std::max(maxHeight, h);
+        }
+    }
+    if (minHeight>maxHeight) minHeight = maxHeight = 0.0f;
+
+    osg::Vec3 du = _uAxis/static_cast<float>(_columns-1);
+    osg::Vec3 dv = _vAxis/static_cast<float>(_rows-1);
+    osg::Vec3 tileOrigin = _origin + du*static_cast<float>(firstColumn) + dv*static_cast<float>(firstRow);
+    osg::Vec3 tileUAxis = du*static_cast<float>(uCells*stride);
+    osg::Vec3 tileVAxis = dv*static_cast<float>(vCells*stride);
+
+    osg::ref_ptr<SurfaceGeometry> geometry = createMesh(tileOrigin, tileUAxis, tileVAxis, uCells, vCells, true, false, _useVertexID);
+    geometry->setCullCallback(new TileCullCallback(this, TileKey(level, column, row)));
+
+    osg::Vec3 verticalAxis = geometry->getVerticalAxis();
+    float margin = (maxHeight-minHeight)*_boundsMargin;
+    osg::BoundingBox bb;
+    for(unsigned int i=0; i<4; ++i)
+    {
+        osg::Vec3 corner = tileOrigin + ((i&1) ? tileUAxis : osg::Vec3()) + ((i&2) ? tileVAxis : osg::Vec3());
+        bb.expandBy(corner + verticalAxis*(minHeight-margin));
+        bb.expandBy(corner + verticalAxis*(maxHeight+margin));
+    }
+    geometry->setDisplacedBound(bb);
+
+    osg::ref_ptr<osg::Texture2D> texture = new osg::Texture2D(image.get());
+    texture->setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR);
+    texture->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+    texture->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
+    texture->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+    texture->setResizeNonPowerOfTwoHint(false);
+    texture->setUnRefImageDataAfterApply(true);
+
+    osg::StateSet* stateset = geometry->getOrCreateStateSet();
+    stateset->setTextureAttribute(_textureUnit, texture.get(), osg::StateAttribute::ON);
+    // sizes keep their sign, so axes pointing down x or y look up the heights from the far side
+    stateset->addUniform(new osg::Uniform("heightFieldExtents", osg::Vec4(tileOrigin.x(), tileOrigin.y(), tileUAxis.x(), tileVAxis.y())));
+    stateset->addUniform(new osg::Uniform("heightFieldResolution", osg::Vec2(static_cast<float>(uCells+1), static_cast<float>(vCells+1))));
+    stateset->addUniform(new osg::Uniform("heightFieldRange", osg::Vec2(minHeight, maxHeight)));
+
+    if (level>=maxLevel) return geometry;
+
+    // switch to the children once the tile's cells would cover more than _maxCellPixels, keeping this tile until they're loaded
+    float pixelSize = static_cast<float>(std::max(uCells, vCells))*_maxCellPixels;
+    osg::BoundingSphere bs(bb);
+
+    osg::ref_ptr<osg::PagedLOD> plod = new osg::PagedLOD;
+    plod->setDatabaseOptions(const_cast<osgDB::Options*>(options));
+    plod->setRangeMode(osg::LOD::PIXEL_SIZE_ON_SCREEN);
+    plod->setCenterMode(osg::LOD::UNION_OF_BOUNDING_SPHERE_AND_USER_DEFINED);
+    plod->setCenter(bs.center());
+    plod->setRadius(bs.radius());
+    plod->addChild(geometry.get(), 0.0f, pixelSize);
+    plod->setFileName(1, getChildrenFileName(level, column, row));
+    plod->setRange(1, pixelSize, FLT_MAX);
+    return plod;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  Pseudo loader for the tiles of a PagedSurface
+//
+class ReaderWriterParametricTile : public osgDB::ReaderWriter
+{
+public:
+
+    ReaderWriterParametricTile()
+    {
+        supportsExtension("parametric_tile", "Tiles of an osgParametric::PagedSurface, named level_column_row of the parent tile");
+    }
+
+    virtual const char* className() const { return "osgParametric PagedSurface tile pseudo loader"; }
+
+    virtual ReadResult readNode(const std::string& filename, const osgDB::Options* options) const
+    {
+        if (!acceptsExtension(osgDB::getLowerCaseFileExtension(filename))) return ReadResult::FILE_NOT_HANDLED;
+
+        const PagedSurface* surface = options ? dynamic_cast<const PagedSurface*>(options->getUserData()) : 0;
+        if (!surface) return ReadResult::FILE_NOT_HANDLED;
+
+        unsigned int level = 0, column = 0, row = 0;
+        std::string name = osgDB::getSimpleFileName(osgDB::getNameLessExtension(filename));
+        if (sscanf(name.c_str(), "%u_%u_%u", &level, &column, &row)!=3) return ReadResult::FILE_NOT_HANDLED;
+
+        osg::ref_ptr<osg::Node> children = surface->createChildren(level, column, row, options);
+        if (!children) return ReadResult::ERROR_IN_READING_FILE;
+        return children.release();
+    }
+};
+
+// registered here rather than as a plugin, so linking the library is enough for the DatabasePager to find it
+static osgDB::RegisterReaderWriterProxy<ReaderWriterParametricTile> g_readerWriter_ParametricTile_Proxy;
@@ -0,0 +1,150 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_PAGEDSURFACE
+#define OSGPARAMETRIC_PAGEDSURFACE 1
+
+#include <osgParametric/Export>
+#include <osgParametric/MappedFile.h>
+
+#include <osg/Node>
+#include <osg/NodeVisitor>
+#include <osg/BoundingBox>
+#include <osg/Vec3>
+#include <osgDB/Options>
+#include <OpenThreads/Mutex>
+
+#include <map>
+#include <string>
+#include <algorithm>
+
+namespace osgParametric
+{
+
+/** Grid of heights too large to hold in memory, columns by rows 32 bit floats stored row by row in a memory mapped file, drawn as a
+  * quadtree of osg::PagedLOD tiles that the DatabasePager loads and expires as the view moves. Each tile is a grid mesh displaced
+  * by parametric.vert's Z_HEIGHTFIELD mode from a texture of the heights it covers, sampled every 2^n'th height n levels above the
+  * finest, so only the parts of the file under the loaded tiles are ever read. The tiles are ordinary surfaces to ParametricScene,
+  * so the boundaries clip them as they do any other surface. Tiles are created by a pseudo loader for the .parametric_tile
+  * extension, which finds the surface in the database options the PagedLODs are given.
+  *
+  * The root's cull callback collects the tiles the PagedLODs select before drawing them, and as in SurfaceLOD a tile next to one
+  * a level coarser stitches its edge to it. Neighbours two or more levels apart, and tiles using vertex IDs, aren't stitched.*/
+class OSGPARAMETRIC_EXPORT PagedSurface : public osg::Referenced
+{
+public:
+
+    PagedSurface();
+
+    /** Map the grid in filename, returns false if it can't be mapped or holds fewer than columns*rows heights.*/
+    bool open(const std::string& filename, unsigned int columns, unsigned int rows);
+
+    bool valid() const { return _heights!=0; }
+
+    unsigned int getColumns() const { return _columns; }
+    unsigned int getRows() const { return _rows; }
+
+    /** Set the area the grid covers, its first height is placed at origin and the last of the first row at origin+uAxis.
+      * parametric.vert looks the heights up by world x and y, so uAxis must lie along the x axis and vAxis along the y axis,
+      * either way round, see isAxisAligned().*/
+    void setOrigin(const osg::Vec3& origin) { _origin = origin; }
+    const osg::Vec3& getOrigin() const { return _origin; }
+
+    void setUAxis(const osg::Vec3& axis) { _uAxis = axis; }
+    const osg::Vec3& getUAxis() const { return _uAxis; }
+
+    void setVAxis(const osg::Vec3& axis) { _vAxis = axis; }
+    const osg::Vec3& getVAxis() const { return _vAxis; }
+
+    /** Set the number of cells along each side of a tile, 256 by default, rounded up to an even number so that tiles can be stitched.*/
+    void setTileCells(unsigned int cells) { _tileCells = std::max(2u, cells+(cells&1)); }
+    unsigned int getTileCells() const { return _tileCells; }
+
+    /** Set the size in pixels a tile's cells can reach on screen before its children are loaded in its place, 2 by default.*/
+    void setMaxCellPixels(float pixels) { _maxCellPixels = pixels; }
+    float getMaxCellPixels() const { return _maxCellPixels; }
+
+    /** Set the fraction of a tile's height range its bound is expanded by, covering peaks missed by the coarser levels' sampling.*/
+    void setBoundsMargin(float margin) { _boundsMargin = margin; }
+    float getBoundsMargin() const { return _boundsMargin; }
+
+    /** Set the texture unit the tiles' heights are bound to, 15 by default to keep clear of the depth textures bound from unit 0.*/
+    void setTextureUnit(unsigned int unit) { _textureUnit = unit; }
+    unsigned int getTextureUnit() const { return _textureUnit; }
+
+    void setUseVertexID(bool flag) { _useVertexID = flag; }
+    bool getUseVertexID() const { return _useVertexID; }
+
+    /** Level of the tiles that use every height, level 0 being the single tile covering the whole grid.*/
+    unsigned int getMaxLevel() const;
+
+    /** Return true if uAxis lies along the x axis and vAxis along the y axis, which createRoot() requires.*/
+    bool isAxisAligned() const;
+
+    /** Create the root of the quadtree, holding the level 0 tile and the Z_HEIGHTFIELD define the tiles share.*/
+    osg::ref_ptr<osg::Node> createRoot();
+
+    /** Create the tiles of the next level covering the tile at level, column, row, as loaded by the DatabasePager.*/
+    osg::ref_ptr<osg::Node> createChildren(unsigned int level, unsigned int column, unsigned int row, const osgDB::Options* options) const;
+
+protected:
+
+    virtual ~PagedSurface();
+
+    /** Create the tile, a PagedLOD with the file of its children unless it's at the finest level, or 0 if it's outside the grid.*/
+    osg::ref_ptr<osg::Node> createTile(unsigned int level, unsigned int column, unsigned int row, const osgDB::Options* options) const;
+
+    float getHeight(unsigned int column, unsigned int row) const
+    {
+        return _heights[static_cast<size_t>(std::min(row, _rows-1))*_columns + std::min(column, _columns-1)];
+    }
+
+    struct TileKey
+    {
+        TileKey(unsigned int l, unsigned int c, unsigned int r): level(l), column(c), row(r) {}
+
+        bool operator < (const TileKey& rhs) const
+        {
+            if (level!=rhs.level) return level<rhs.level;
+            if (row!=rhs.row) return row<rhs.row;
+            return column<rhs.column;
+        }
+
+        unsigned int level;
+        unsigned int column;
+        unsigned int row;
+    };
+
+    class RootCullCallback;
+    class TileCullCallback;
+
+    // the tile geometries selected by a cull traversal of the root, keyed by the CullVisitor while it traverses the root
+    typedef std::map<TileKey, osg::Drawable*> CulledTiles;
+    typedef std::map<const osg::NodeVisitor*, CulledTiles*> CullTraversals;
+
+    /** Record a tile reached by the cull traversal nv, returns false if nv isn't traversing a root so the tile is drawn directly.*/
+    bool addCulledTile(const osg::NodeVisitor* nv, const TileKey& key, osg::Drawable* tile) const;
+
+    osg::ref_ptr<MappedFile>    _file;
+    const float*                _heights;
+    unsigned int                _columns;
+    unsigned int                _rows;
+
+    osg::Vec3                   _origin;
+    osg::Vec3                   _uAxis;
+    osg::Vec3                   _vAxis;
+    unsigned int                _tileCells;
+    float                       _maxCellPixels;
+    float                       _boundsMargin;
+    unsigned int                _textureUnit;
+    bool                        _useVertexID;
+
+    mutable OpenThreads::Mutex  _cullMutex;
+    mutable CullTraversals      _cullTraversals;
+};
+
+}
+
+#endif
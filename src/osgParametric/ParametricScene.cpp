@@ -7,10 +7,111 @@
 
 #include <osgUtil/CullVisitor>
 
+#include <osg/ComputeBoundsVisitor>
+#include <osg/ValueObject>
+
+#include <osgGA/EventVisitor>
+
 #include <sstream>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <algorithm>
+#include <set>
 
 using namespace osgParametric;
 
+namespace
+{
+
+std::string toString(unsigned int value)
+{
+    std::ostringstream str;
+    str<<value;
+    return str.str();
+}
+
+GLenum getDepthSourceType(GLenum format)
+{
+    switch(format)
+    {
+        case(GL_DEPTH_COMPONENT16): return GL_UNSIGNED_SHORT;
+        case(GL_DEPTH_COMPONENT32F): return GL_FLOAT;
+        default: return GL_UNSIGNED_INT;
+    }
+}
+
+void setDepthFormat(osg::Texture* texture, GLenum format)
+{
+    // without an image OSG allocates the texture with the source format and type, which have to be valid for a sized depth format
+    texture->setInternalFormat(format);
+    texture->setSourceFormat(GL_DEPTH_COMPONENT);
+    texture->setSourceType(getDepthSourceType(format));
+}
+
+// parametric.frag declares the front and back depth textures of at most this many boundaries, later ones don't clip
+const unsigned int s_maxDepthTexturePairs = 4;
+
+// depth ranges hold the negated nearest depth and the furthest depth, the empty range clips everything and the full range nothing
+const osg::Vec4 s_emptyDepthRange(-1.0f, 0.0f, 0.0f, 0.0f);
+const osg::Vec4 s_fullDepthRange(0.0f, 1.0f, 0.0f, 0.0f);
+
+/** Find the first callback of type T in a chain of nested callbacks.*/
+template<class T>
+T* findCallback(osg::Callback* callback)
+{
+    for(; callback; callback = callback->getNestedCallback())
+    {
+        T* found = dynamic_cast<T*>(callback);
+        if (found) return found;
+    }
+    return 0;
+}
+
+typedef std::map<const osg::Texture*, osg::Texture*> TextureMap;
+
+void remapTextures(osg::StateSet* stateset, const TextureMap& textureMap)
+{
+    osg::StateSet::TextureAttributeList& textureAttributes = stateset->getTextureAttributeList();
+    for(unsigned int unit=0; unit<textureAttributes.size(); ++unit)
+    {
+        osg::StateSet::AttributeList::iterator itr = textureAttributes[unit].find(osg::StateAttribute::TypeMemberPair(osg::StateAttribute::TEXTURE, 0));
+        if (itr==textureAttributes[unit].end()) continue;
+
+        TextureMap::const_iterator mitr = textureMap.find(itr->second.first->asTexture());
+        if (mitr!=textureMap.end()) stateset->setTextureAttribute(unit, mitr->second, itr->second.second);
+    }
+}
+
+/** Give the drawables without a cull callback of their own the CountTrianglesCallback, so that the passes drawing them count their triangles.*/
+class CountTrianglesVisitor : public osg::NodeVisitor
+{
+public:
+
+    CountTrianglesVisitor():
+        osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN) {}
+
+    virtual void apply(osg::Drawable& drawable)
+    {
+        if (!drawable.getCullCallback()) drawable.setCullCallback(CountTrianglesCallback::instance());
+    }
+};
+
+/** Traverse node with the pass's callback, returning the triangles of the drawables the CullVisitor accepted.*/
+unsigned int traverseCountingTriangles(osg::NodeCallback* callback, osg::Node* node, osg::NodeVisitor* nv)
+{
+    osg::ref_ptr<osg::Referenced> userData = nv->getUserData();
+    osg::ref_ptr<TriangleCount> count = new TriangleCount;
+
+    nv->setUserData(count.get());
+    callback->traverse(node, nv);
+    nv->setUserData(userData.get());
+
+    return count->getNumTriangles();
+}
+
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////
 //
 // Callback implementations
@@ -19,184 +120,1763 @@ void RTTCameraCullCallback::operator()(osg::Node* node, osg::NodeVisitor* nv)
 {
     osgUtil::CullVisitor* cv = dynamic_cast<osgUtil::CullVisitor*>(nv);
 
-    osg::UserDataContainer* udc = cv->getOrCreateUserDataContainer();
-    unsigned int i = udc->getUserObjectIndex("ProjectionMatrix");
-    osg::RefMatrix* pm = (i<udc->getNumUserObjects()) ? dynamic_cast<osg::RefMatrix*>(udc->getUserObject(i)) : 0;
+    osg::RefMatrix* pm = _slot ? _slot->projectionMatrix : 0;
+
+    if (pm) cv->pushProjectionMatrix( pm );
+
+    if (_timer.valid() && nv->getFrameStamp())
+    {
+        osg::Timer_t startTick = osg::Timer::instance()->tick();
+
+        unsigned int numTriangles = traverseCountingTriangles(this, node, nv);
+
+        unsigned int frameNumber = nv->getFrameStamp()->getFrameNumber();
+        _timer->addCullTime(frameNumber, osg::Timer::instance()->delta_m(startTick, osg::Timer::instance()->tick()));
+        _timer->addTriangles(frameNumber, numTriangles);
+    }
+    else
+    {
+        traverse(node, nv);
+    }
+
+    if (pm) cv->popProjectionMatrix();
+}
+
+void RenderSubgraphCullCallback::operator()(osg::Node* node, osg::NodeVisitor* nv)
+{
+    osgUtil::CullVisitor* cv = dynamic_cast<osgUtil::CullVisitor*>(nv);
+    if (!cv || !nv->getFrameStamp())
+    {
+        traverse(node, nv);
+        return;
+    }
+
+    osg::Timer_t startTick = osg::Timer::instance()->tick();
+
+    // the render stage is shared with the rest of the scene, so only the drawables accepted while culling the subgraph are counted
+    unsigned int numTriangles = traverseCountingTriangles(this, node, nv);
+
+    unsigned int frameNumber = nv->getFrameStamp()->getFrameNumber();
+    _timer->addCullTime(frameNumber, osg::Timer::instance()->delta_m(startTick, osg::Timer::instance()->tick()));
+    _timer->addTriangles(frameNumber, numTriangles);
+}
+
+void NearFarCallback::operator()(osg::Node* node, osg::NodeVisitor* nv)
+{
+    osgUtil::CullVisitor* cv = dynamic_cast<osgUtil::CullVisitor*>(nv);
+
+    ParametricScene* ps = dynamic_cast<ParametricScene*>(node);
+    ViewSlot* slot = ps ? ps->getOrCreateViewSlot(cv) : 0;
+
+    if (slot) ps->cull(cv, slot);
+    else traverse(node, nv);
+
+    cv->updateCalculatedNearFar(*(cv->getModelViewMatrix()), _bb);
+}
+
+void ViewportResizeCallback::operator()(osg::Node* node, osg::NodeVisitor* nv)
+{
+    ParametricScene* ps = dynamic_cast<ParametricScene*>(node);
+    osgGA::EventVisitor* ev = nv->asEventVisitor();
+    if (ps && ev)
+    {
+        for(osgGA::EventQueue::Events::iterator itr = ev->getEvents().begin();
+            itr != ev->getEvents().end();
+            ++itr)
+        {
+            osgGA::GUIEventAdapter* ea = (*itr)->asGUIEventAdapter();
+            if (ea && ea->getEventType()==osgGA::GUIEventAdapter::RESIZE && ea->getWindowWidth()>0 && ea->getWindowHeight()>0)
+            {
+                ps->resize(ea->getWindowWidth(), ea->getWindowHeight());
+            }
+        }
+    }
+
+    traverse(node, nv);
+}
+
+void SetupCallback::operator()(osg::Node* node, osg::NodeVisitor* nv)
+{
+    ParametricScene* ps = dynamic_cast<ParametricScene*>(node);
+    if (!ps)
+    {
+        traverse(node, nv);
+        return;
+    }
+
+    if (!ps->isSetup()) ps->setup();
+
+    // only needed once, removing it detaches the callbacks nested within it so they're run from here for this traversal
+    osg::ref_ptr<SetupCallback> keepAlive = this;
+    osg::ref_ptr<osg::Callback> nested = getNestedCallback();
+    ps->removeUpdateCallback(this);
+
+    if (nested.valid()) nested->run(node, nv);
+    else nv->traverse(*node);
+}
+
+void ApplyChangesCallback::operator()(osg::Node* node, osg::NodeVisitor* nv)
+{
+    ParametricScene* ps = dynamic_cast<ParametricScene*>(node);
+    if (ps)
+    {
+        ps->applyChanges();
+        if (nv->getFrameStamp()) ps->releaseIdleViewSlots(nv->getFrameStamp()->getFrameNumber());
+    }
+
+    traverse(node, nv);
+}
+
+void PublishStatsCallback::operator()(osg::Node* node, osg::NodeVisitor* nv)
+{
+    ParametricScene* ps = dynamic_cast<ParametricScene*>(node);
+    if (ps && nv->getFrameStamp())
+    {
+        ps->publishStats(nv->getFrameStamp()->getFrameNumber());
+    }
+
+    traverse(node, nv);
+}
+
+void SurfaceBoundsCallback::operator()(osg::Node* node, osg::NodeVisitor* nv)
+{
+    ParametricScene* ps = dynamic_cast<ParametricScene*>(node);
+    if (ps && nv->getFrameStamp())
+    {
+        ps->updateSurfaceBounds(nv->getFrameStamp()->getSimulationTime(), true);
+    }
+
+    traverse(node, nv);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CollectSurfacesVisitor
+//
+namespace
+{
+
+// Collects the SurfaceGeometry and SurfaceLOD in a subgraph along with the defines and uniforms they inherit.
+class CollectSurfacesVisitor : public osg::NodeVisitor
+{
+public:
+
+    struct Surface
+    {
+        osg::ref_ptr<osgParametric::SurfaceGeometry>    geometry;
+        osg::StateSet::DefineList                       defines;
+        osg::StateSet::UniformList                      uniforms;
+    };
+
+    typedef std::vector<Surface> Surfaces;
+
+    struct LOD
+    {
+        osg::ref_ptr<osgParametric::SurfaceLOD>         lod;
+        osg::StateSet::DefineList                       defines;
+        osg::StateSet::UniformList                      uniforms;
+    };
+
+    typedef std::vector<LOD> LODs;
+
+    CollectSurfacesVisitor(const osg::StateSet* rootStateSet):
+        osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN)
+    {
+        _defineStack.push_back(osg::StateSet::DefineList());
+        _uniformStack.push_back(osg::StateSet::UniformList());
+        pushStateSet(rootStateSet);
+    }
+
+    virtual void apply(osg::Node& node)
+    {
+        pushStateSet(node.getStateSet());
+
+        osgParametric::SurfaceLOD* lod = dynamic_cast<osgParametric::SurfaceLOD*>(&node);
+        if (lod)
+        {
+            LOD entry;
+            entry.lod = lod;
+            entry.defines = _defineStack.back();
+            entry.uniforms = _uniformStack.back();
+            lods.push_back(entry);
+        }
+
+        traverse(node);
+        popStateSet(node.getStateSet());
+    }
+
+    virtual void apply(osg::Drawable& drawable)
+    {
+        osgParametric::SurfaceGeometry* geometry = dynamic_cast<osgParametric::SurfaceGeometry*>(&drawable);
+        if (!geometry) return;
+
+        pushStateSet(drawable.getStateSet());
+
+        Surface surface;
+        surface.geometry = geometry;
+        surface.defines = _defineStack.back();
+        surface.uniforms = _uniformStack.back();
+        surfaces.push_back(surface);
+
+        popStateSet(drawable.getStateSet());
+    }
+
+    Surfaces surfaces;
+    LODs lods;
+
+protected:
+
+    template<typename T>
+    static void inherit(T& current, const T& list)
+    {
+        for(typename T::const_iterator itr = list.begin(); itr != list.end(); ++itr)
+        {
+            typename T::iterator citr = current.find(itr->first);
+            bool parentOverrides = citr!=current.end() &&
+                                   (citr->second.second & osg::StateAttribute::OVERRIDE)!=0 &&
+                                   (itr->second.second & osg::StateAttribute::PROTECTED)==0;
+            if (!parentOverrides) current[itr->first] = itr->second;
+        }
+    }
+
+    void pushStateSet(const osg::StateSet* stateset)
+    {
+        if (!stateset) return;
+
+        _defineStack.push_back(_defineStack.back());
+        inherit(_defineStack.back(), stateset->getDefineList());
+
+        _uniformStack.push_back(_uniformStack.back());
+        inherit(_uniformStack.back(), stateset->getUniformList());
+    }
+
+    void popStateSet(const osg::StateSet* stateset)
+    {
+        if (!stateset) return;
+
+        _defineStack.pop_back();
+        _uniformStack.pop_back();
+    }
+
+    std::vector<osg::StateSet::DefineList>  _defineStack;
+    std::vector<osg::StateSet::UniformList> _uniformStack;
+};
+
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// DerivativeDefinesVisitor
+//
+namespace
+{
+
+// longest derivative definition passed to the shaders, beyond this the shader keeps its finite difference normals
+const std::string::size_type s_maxDerivativeLength = 16384;
+
+// Adds the Z_DX/Z_DY style partial derivatives of the Z_FUNCTION, Z_BASE and Z_TOP defines found in a subgraph,
+// so the shaders can compute normals analytically rather than with four extra evaluations of the surface function.
+// Each generated pair is tagged with a user value holding the definition it was differentiated from, which tells it apart
+// from derivatives set by the application, including in files, and lets it be regenerated when that definition changes.
+class DerivativeDefinesVisitor : public osg::NodeVisitor
+{
+public:
+
+    DerivativeDefinesVisitor(bool remove=false):
+        osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN),
+        _remove(remove) {}
+
+    virtual void apply(osg::Node& node)
+    {
+        addDerivatives(node.getStateSet());
+        traverse(node);
+    }
+
+    virtual void apply(osg::Drawable& drawable)
+    {
+        addDerivatives(drawable.getStateSet());
+    }
+
+    void addDerivatives(osg::StateSet* stateset)
+    {
+        if (!stateset || !_visited.insert(stateset).second) return;
+
+        addDerivatives(*stateset, "Z_FUNCTION", "Z_DX", "Z_DY");
+        addDerivatives(*stateset, "Z_BASE", "Z_BASE_DX", "Z_BASE_DY");
+        addDerivatives(*stateset, "Z_TOP", "Z_TOP_DX", "Z_TOP_DY");
+    }
+
+protected:
+
+    static std::string getTagName(const std::string& name) { return name+"_DERIVATIVES_SOURCE"; }
+
+    static void removeDerivatives(osg::StateSet& stateset, const std::string& tagName, const std::string& dxName, const std::string& dyName)
+    {
+        stateset.removeDefine(dxName);
+        stateset.removeDefine(dyName);
+
+        osg::UserDataContainer* udc = stateset.getUserDataContainer();
+        if (udc) udc->removeUserObject(udc->getUserObjectIndex(tagName));
+    }
+
+    void addDerivatives(osg::StateSet& stateset, const std::string& name, const std::string& dxName, const std::string& dyName)
+    {
+        const osg::StateSet::DefineList& defines = stateset.getDefineList();
+        osg::StateSet::DefineList::const_iterator itr = defines.find(name);
+
+        std::string tagName = getTagName(name);
+        std::string source;
+        bool generated = stateset.getUserValue(tagName, source);
+
+        // derivatives set explicitly by the application are left alone
+        if (!generated && (defines.count(dxName)!=0 || defines.count(dyName)!=0)) return;
+
+        // generated derivatives are kept while the definition they came from is unchanged
+        if (generated)
+        {
+            if (!_remove && itr!=defines.end() && itr->second.first==source && defines.count(dxName)!=0 && defines.count(dyName)!=0) return;
+            removeDerivatives(stateset, tagName, dxName, dyName);
+        }
+
+        if (_remove || itr==defines.end()) return;
+
+        osg::ref_ptr<osgParametric::Expression> expression = new osgParametric::Expression;
+        if (!expression->parse(itr->second.first) || expression->getParameters().size()<2)
+        {
+            OSG_INFO<<"ParametricScene : unable to differentiate "<<name<<", using finite difference normals"<<std::endl;
+            return;
+        }
+
+        osg::ref_ptr<osgParametric::Expression> dx = expression->differentiate(0);
+        osg::ref_ptr<osgParametric::Expression> dy = expression->differentiate(1);
+        std::string dxDefinition = dx.valid() ? dx->getDefinition(s_maxDerivativeLength) : std::string();
+        std::string dyDefinition = dy.valid() ? dy->getDefinition(s_maxDerivativeLength) : std::string();
+        if (dxDefinition.empty() || dyDefinition.empty())
+        {
+            OSG_INFO<<"ParametricScene : derivatives of "<<name<<" too long, using finite difference normals"<<std::endl;
+            return;
+        }
+
+        stateset.setDefine(dxName, dxDefinition, itr->second.second);
+        stateset.setDefine(dyName, dyDefinition, itr->second.second);
+        stateset.setUserValue(tagName, itr->second.first);
+    }
+
+    bool                        _remove;
+    std::set<osg::StateSet*> _visited;
+};
+
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ParametricScene::Subgraph
+//
+ParametricScene::Subgraph::Subgraph(parameter_ptr<osg::Node> sg, bool rrs, bool rds, float drs):
+    subgraph(sg.get()),
+    requiresRenderSubgraph(rrs),
+    requiresDepthSubgraph(rds),
+    depthResolutionScale(drs),
+    depthFormat(0),
+    depthRangeLayer(-1),
+    id(0)
+{
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ParametricScene
+//
+ParametricScene::ParametricScene()
+{
+    init();
+}
+
+ParametricScene::ParametricScene(const ParametricScene& ps,const osg::CopyOp& copyop)
+{
+    init();
+
+    _boundsSampleDensity = ps._boundsSampleDensity;
+    _boundsMargin = ps._boundsMargin;
+    _useAnalyticNormals = ps._useAnalyticNormals;
+    _depthCaptureMode = ps._depthCaptureMode;
+    _depthResolutionScale = ps._depthResolutionScale;
+    _boundaryTileSize = ps._boundaryTileSize;
+    _boundaryTileTextureUnit = ps._boundaryTileTextureUnit;
+    _collectPassTimes = ps._collectPassTimes;
+    _stats = ps._stats;
+    _maxNumViewSlots = ps._maxNumViewSlots;
+    _viewSlotIdleFrames = ps._viewSlotIdleFrames;
+    _renderTargetPool = ps._renderTargetPool;
+    _depthTextureFormat = ps._depthTextureFormat;
+}
+
+ParametricScene::~ParametricScene()
+{
+    // the pool may be shared with other scenes, which can reuse the targets
+    releaseViewSlots();
+}
+
+void ParametricScene::init()
+{
+    _width = 1280;
+    _height = 1024;
+
+    _boundsSampleDensity = 256;
+    _boundsMargin = 0.05f;
+    _useAnalyticNormals = true;
+    _depthCaptureMode = DEPTH_TEXTURE_PAIRS;
+    _depthResolutionScale = 1.0f;
+    _boundaryTileSize = 16;
+    _boundaryTileTextureUnit = 14;
+    _collectPassTimes = false;
+    _maxNumViewSlots = 16;
+    _viewSlotIdleFrames = 60;
+    _renderTargetPool = new RenderTargetPool;
+    _depthTextureFormat = GL_DEPTH_COMPONENT24;
+
+    _nextSubgraphId = 0;
+    _isSetup = false;
+    _dirtyMask = 0;
+    _generation = 0;
+    _simulationTime = 0.0;
+
+    // shared by all the render subgraphs and updated on resize
+    _viewportDimensions = new osg::Uniform("viewportDimensions", osg::Vec4(0.0f, 0.0f, static_cast<float>(_width), static_cast<float>(_height)));
+    _viewportDimensions->setDataVariance(osg::Object::DYNAMIC);
+
+    _renderSubgraph = new osg::Group;
+    _renderSubgraph->setName("RenderSubgraph");
+    addChild(_renderSubgraph.get());
+
+    _depthSubgraph = new osg::Group;
+    _depthSubgraph->setName("DepthSubgraph");
+    addChild(_depthSubgraph.get());
+}
+
+void ParametricScene::addSubgraph(parameter_ptr<osg::Node> subgraph, bool requiresRenderSubgraph, bool requiresDepthSubgraph, float depthResolutionScale)
+{
+    osg::ref_ptr<Subgraph> sg = new Subgraph(subgraph, requiresRenderSubgraph, requiresDepthSubgraph, depthResolutionScale);
+    sg->id = _nextSubgraphId++;
+    _subgraphs.push_back(sg);
+
+    if (!_isSetup) return;
+
+    // prepare the new subgraph the way setup() prepares all of them, leaving the passes of the other subgraphs untouched
+    if (_useAnalyticNormals && sg->subgraph.valid())
+    {
+        DerivativeDefinesVisitor visitor;
+        sg->subgraph->accept(visitor);
+    }
+
+    if (_programCache.valid() && sg->subgraph.valid())
+    {
+        UseProgramCacheVisitor upcv(_programCache.get());
+        sg->subgraph->accept(upcv);
+    }
+
+    if (_collectPassTimes && sg->subgraph.valid())
+    {
+        CountTrianglesVisitor ctv;
+        sg->subgraph->accept(ctv);
+    }
+
+    if (sg->requiresDepthSubgraph)
+    {
+        addDepthPasses(sg.get());
+        _dirtyMask |= DIRTY_RENDER_STATESETS;
+    }
+
+    if (sg->requiresRenderSubgraph) addRenderPass(sg.get());
+
+    _dirtyMask |= DIRTY_SURFACES | DIRTY_BOUNDS | DIRTY_PASS_TIMERS | DIRTY_VIEW_SLOTS;
+}
+
+bool ParametricScene::removeSubgraph(osg::Node* subgraph)
+{
+    for(Subgraphs::iterator itr = _subgraphs.begin();
+        itr != _subgraphs.end();
+        ++itr)
+    {
+        Subgraph* sg = itr->get();
+        if (sg->subgraph.get()!=subgraph) continue;
+
+        bool boundary = sg->requiresDepthSubgraph;
+        if (_isSetup)
+        {
+            if (boundary) removeDepthPasses(sg);
+            removeRenderPass(sg);
+        }
+
+        _subgraphs.erase(itr);
+
+        if (_isSetup)
+        {
+            if (boundary)
+            {
+                // the depth range array keeps its layers but follows the largest scale of the remaining boundaries
+                updateDepthTextureSizes();
+                _dirtyMask |= DIRTY_RENDER_STATESETS;
+            }
+
+            _dirtyMask |= DIRTY_SURFACES | DIRTY_BOUNDS | DIRTY_PASS_TIMERS | DIRTY_VIEW_SLOTS;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool ParametricScene::updateSubgraph(osg::Node* subgraph, bool requiresRenderSubgraph, bool requiresDepthSubgraph, float depthResolutionScale)
+{
+    Subgraph* sg = 0;
+    for(Subgraphs::iterator itr = _subgraphs.begin(); itr != _subgraphs.end() && !sg; ++itr)
+    {
+        if ((*itr)->subgraph.get()==subgraph) sg = itr->get();
+    }
+    if (!sg) return false;
+
+    if (!_isSetup)
+    {
+        sg->requiresRenderSubgraph = requiresRenderSubgraph;
+        sg->requiresDepthSubgraph = requiresDepthSubgraph;
+        sg->depthResolutionScale = depthResolutionScale;
+        return true;
+    }
+
+    if (requiresDepthSubgraph!=sg->requiresDepthSubgraph)
+    {
+        if (sg->requiresDepthSubgraph) removeDepthPasses(sg);
+
+        sg->requiresDepthSubgraph = requiresDepthSubgraph;
+        sg->depthResolutionScale = depthResolutionScale;
+
+        if (sg->requiresDepthSubgraph) addDepthPasses(sg);
+        else updateDepthTextureSizes();
+
+        // every other render subgraph clips against the boundaries
+        _dirtyMask |= DIRTY_RENDER_STATESETS | DIRTY_PASS_TIMERS | DIRTY_VIEW_SLOTS;
+    }
+    else if (depthResolutionScale!=sg->depthResolutionScale)
+    {
+        sg->depthResolutionScale = depthResolutionScale;
+
+        // the existing textures are resized rather than replaced
+        if (sg->requiresDepthSubgraph)
+        {
+            updateDepthTextureSizes();
+            _dirtyMask |= DIRTY_RENDER_STATESETS | DIRTY_VIEW_SLOTS;
+        }
+    }
+
+    if (requiresRenderSubgraph!=sg->requiresRenderSubgraph)
+    {
+        sg->requiresRenderSubgraph = requiresRenderSubgraph;
+
+        if (sg->requiresRenderSubgraph) addRenderPass(sg);
+        else removeRenderPass(sg);
+
+        _dirtyMask |= DIRTY_SURFACES | DIRTY_PASS_TIMERS | DIRTY_VIEW_SLOTS;
+    }
+
+    _dirtyMask |= DIRTY_BOUNDS;
+    return true;
+}
+
+bool ParametricScene::setSubgraphDepthFormat(osg::Node* subgraph, GLenum format)
+{
+    for(Subgraphs::iterator itr = _subgraphs.begin();
+        itr != _subgraphs.end();
+        ++itr)
+    {
+        Subgraph* sg = itr->get();
+        if (sg->subgraph.get()!=subgraph) continue;
+
+        sg->depthFormat = format;
+
+        // the scene's textures are only templates, the views acquire targets of the new format on their next cull
+        if (sg->frontTexture.valid()) setDepthFormat(sg->frontTexture.get(), getDepthFormat(sg));
+        if (sg->backTexture.valid()) setDepthFormat(sg->backTexture.get(), getDepthFormat(sg));
+        if (_isSetup) _dirtyMask |= DIRTY_VIEW_SLOTS;
+        return true;
+    }
+    return false;
+}
+
+GLenum ParametricScene::getDepthFormat(const Subgraph* sg) const
+{
+    return sg->depthFormat ? sg->depthFormat : _depthTextureFormat;
+}
+
+void ParametricScene::setBoundaryTileSize(unsigned int size)
+{
+    if (size==_boundaryTileSize) return;
+
+    // switching the binning on or off changes the render StateSets, any change resizes the views' tiles
+    _boundaryTileSize = size;
+    if (_isSetup) _dirtyMask |= DIRTY_RENDER_STATESETS | DIRTY_VIEW_SLOTS;
+}
+
+void ParametricScene::setBoundaryTileTextureUnit(unsigned int unit)
+{
+    if (unit==_boundaryTileTextureUnit) return;
+
+    _boundaryTileTextureUnit = unit;
+    if (_isSetup) _dirtyMask |= DIRTY_RENDER_STATESETS | DIRTY_VIEW_SLOTS;
+}
+
+void ParametricScene::dirtySubgraph(osg::Node* /*subgraph*/)
+{
+    _dirtyMask |= DIRTY_BOUNDS;
+}
+
+void ParametricScene::dirtySurfaceFunctions()
+{
+    _dirtyMask |= DIRTY_SURFACE_FUNCTIONS | DIRTY_SURFACES | DIRTY_BOUNDS;
+}
+
+void ParametricScene::applyChanges()
+{
+    if (_dirtyMask==0) return;
+
+    if (_dirtyMask & DIRTY_SURFACE_FUNCTIONS) setupDerivativeDefines();
+
+    if (_dirtyMask & DIRTY_RENDER_STATESETS) setupRenderStateSets();
+
+    if (_dirtyMask & DIRTY_PASS_TIMERS) collectPassTimers();
+
+    if (_dirtyMask & DIRTY_SURFACES)
+    {
+        setupSurfaceBounds();
+        updateSurfaceBounds(_simulationTime, false);
+        setupUpdateCallbacks();
+    }
+
+    if (_dirtyMask & DIRTY_BOUNDS) updateNearFarBound();
+
+    // have the views copy the changed passes on their next cull
+    if (_dirtyMask & DIRTY_VIEW_SLOTS) ++_generation;
+
+    _dirtyMask = 0;
+}
+
+void ParametricScene::setup()
+{
+    setupDerivativeDefines();
+
+    _viewportDimensions->set(osg::Vec4(0.0f, 0.0f, static_cast<float>(_width), static_cast<float>(_height)));
+
+    setupDepthSubgraphs();
+    setupRenderSubgraphs();
+    collectPassTimers();
+
+    if (_programCache.valid())
+    {
+        UseProgramCacheVisitor upcv(_programCache.get());
+        accept(upcv);
+    }
+
+    if (_collectPassTimes)
+    {
+        CountTrianglesVisitor ctv;
+        accept(ctv);
+    }
+
+    setupSurfaceBounds();
+    updateSurfaceBounds(0.0, false);
+
+    // the application's own cull callbacks are kept, only the one added by an earlier setup() is replaced
+    if (_nearFarCallback.valid()) removeCullCallback(_nearFarCallback.get());
+    _nearFarCallback = new osgParametric::NearFarCallback(osg::BoundingBox());
+    addCullCallback(_nearFarCallback.get());
+    updateNearFarBound();
+
+    // the application's own update callbacks are kept, only those added by an earlier setup() are skipped
+    if (!findCallback<ApplyChangesCallback>(getUpdateCallback())) addUpdateCallback(new osgParametric::ApplyChangesCallback);
+
+    PublishStatsCallback* publishStatsCallback = findCallback<PublishStatsCallback>(getUpdateCallback());
+    if (_collectPassTimes && !publishStatsCallback) addUpdateCallback(new osgParametric::PublishStatsCallback);
+    else if (!_collectPassTimes && publishStatsCallback) removeUpdateCallback(publishStatsCallback);
+
+    setupUpdateCallbacks();
+
+    if (!findCallback<ViewportResizeCallback>(getEventCallback())) addEventCallback(new osgParametric::ViewportResizeCallback);
+
+    // each view is given copies of the render and depth subgraphs on its first cull
+    releaseViewSlots();
+    _viewSlots.clear();
+    _viewSlotsExhausted.exchange(0);
+    for(unsigned int i=0; i<_maxNumViewSlots; ++i)
+    {
+        _viewSlots.push_back(new ViewSlot);
+    }
+
+    _dirtyMask = 0;
+    ++_generation;
+    _isSetup = true;
+}
+
+void ParametricScene::setupUpdateCallbacks()
+{
+    // only surfaces animated by osg_SimulationTime need their bounds updating each frame
+    bool timeDependent = false;
+    for(SurfaceBounds::iterator itr = _surfaceBounds.begin();
+        itr != _surfaceBounds.end() && !timeDependent;
+        ++itr)
+    {
+        if ((*itr)->function.valid() && (*itr)->function->isTimeDependent()) timeDependent = true;
+    }
+    if (!timeDependent) return;
+
+    // callbacks are only ever added, as this may be called from within the update callbacks
+    if (!findCallback<SurfaceBoundsCallback>(getUpdateCallback())) addUpdateCallback(new osgParametric::SurfaceBoundsCallback);
+}
+
+ViewSlot* ParametricScene::getOrCreateViewSlot(osgUtil::CullVisitor* cv)
+{
+    for(ViewSlots::iterator itr = _viewSlots.begin();
+        itr != _viewSlots.end();
+        ++itr)
+    {
+        if ((*itr)->owner.get()==cv) return itr->get();
+    }
+
+    // first cull by cv, claim the first free slot
+    for(ViewSlots::iterator itr = _viewSlots.begin();
+        itr != _viewSlots.end();
+        ++itr)
+    {
+        ViewSlot* slot = itr->get();
+        if (slot->owner.get()==0 && slot->owner.assign(cv, 0)) return slot;
+    }
+
+    if (_viewSlotsExhausted.exchange(1)==0)
+    {
+        OSG_NOTICE<<"ParametricScene : all "<<_viewSlots.size()<<" view slots are in use, increase MaxNumViewSlots"<<std::endl;
+    }
+    return 0;
+}
+
+void ParametricScene::cull(osgUtil::CullVisitor* cv, ViewSlot* slot)
+{
+    // follow the viewport of the view
+    unsigned int width = slot->width ? slot->width : _width;
+    unsigned int height = slot->height ? slot->height : _height;
+    const osg::Viewport* viewport = cv->getViewport();
+    if (viewport && viewport->width()>0 && viewport->height()>0)
+    {
+        width = static_cast<unsigned int>(viewport->width());
+        height = static_cast<unsigned int>(viewport->height());
+    }
+
+    // new slots, slots copied before the last change to the passes and resized views are brought up to date
+    if (slot->generation!=_generation || width!=slot->width || height!=slot->height) setupViewSlot(slot, width, height);
+
+    slot->projectionMatrix = cv->getProjectionMatrix();
+    if (cv->getFrameStamp()) slot->lastCullFrame = cv->getFrameStamp()->getFrameNumber();
+
+    if (slot->boundaryTiles.valid()) updateBoundaryTiles(cv, slot);
+
+    for(unsigned int i=0; i<getNumChildren(); ++i)
+    {
+        osg::Node* child = getChild(i);
+        if (child==_renderSubgraph.get()) slot->renderSubgraph->accept(*cv);
+        else if (child==_depthSubgraph.get()) slot->depthSubgraph->accept(*cv);
+        else child->accept(*cv);
+    }
+
+    slot->projectionMatrix = 0;
+}
+
+float ParametricScene::getTextureScale(const osg::Texture* texture) const
+{
+    if (texture==_depthRangeTexture.get()) return getDepthRangeResolutionScale();
+
+    for(Subgraphs::const_iterator itr = _subgraphs.begin();
+        itr != _subgraphs.end();
+        ++itr)
+    {
+        const Subgraph* sg = itr->get();
+        if (texture==sg->frontTexture.get() || texture==sg->backTexture.get()) return _depthResolutionScale*sg->depthResolutionScale;
+    }
+    return 1.0f;
+}
+
+void ParametricScene::setupViewSlot(ViewSlot* slot, unsigned int width, unsigned int height)
+{
+    if (!slot->viewportDimensions)
+    {
+        slot->viewportDimensions = new osg::Uniform("viewportDimensions", osg::Vec4());
+        slot->viewportDimensions->setDataVariance(osg::Object::DYNAMIC);
+    }
+    slot->viewportDimensions->set(osg::Vec4(0.0f, 0.0f, static_cast<float>(width), static_cast<float>(height)));
+
+    // tiles for binning the boundaries, written on the host so they're only uploaded on the slot's own draw
+    if (_boundaryTileSize>0)
+    {
+        unsigned int columns = (width+_boundaryTileSize-1)/_boundaryTileSize;
+        unsigned int rows = (height+_boundaryTileSize-1)/_boundaryTileSize;
+
+        if (!slot->boundaryTiles)
+        {
+            slot->boundaryTiles = new osg::Texture2D;
+            slot->boundaryTiles->setDataVariance(osg::Object::DYNAMIC);
+            slot->boundaryTiles->setInternalFormat(GL_RG32F);
+            slot->boundaryTiles->setResizeNonPowerOfTwoHint(false);
+            slot->boundaryTiles->setFilter(osg::Texture2D::MIN_FILTER,osg::Texture2D::NEAREST);
+            slot->boundaryTiles->setFilter(osg::Texture2D::MAG_FILTER,osg::Texture2D::NEAREST);
+            slot->boundaryTiles->setWrap(osg::Texture2D::WRAP_S,osg::Texture2D::CLAMP_TO_EDGE);
+            slot->boundaryTiles->setWrap(osg::Texture2D::WRAP_T,osg::Texture2D::CLAMP_TO_EDGE);
+
+            slot->boundaryTileScale = new osg::Uniform("boundaryTileScale", osg::Vec2());
+            slot->boundaryTileScale->setDataVariance(osg::Object::DYNAMIC);
+        }
+
+        osg::Image* image = slot->boundaryTiles->getImage();
+        if (!image || image->s()!=static_cast<int>(columns) || image->t()!=static_cast<int>(rows))
+        {
+            osg::ref_ptr<osg::Image> tiles = new osg::Image;
+            tiles->allocateImage(columns, rows, 1, GL_RG, GL_FLOAT);
+            tiles->setInternalTextureFormat(GL_RG32F);
+            tiles->setDataVariance(osg::Object::DYNAMIC);
+            slot->boundaryTiles->setImage(tiles.get());
+        }
+
+        slot->boundaryTileSize = _boundaryTileSize;
+
+        // the last row and column of tiles overhang the viewport
+        slot->boundaryTileScale->set(osg::Vec2(static_cast<float>(width)/static_cast<float>(columns*_boundaryTileSize),
+                                               static_cast<float>(height)/static_cast<float>(rows*_boundaryTileSize)));
+    }
+    else
+    {
+        slot->boundaryTileSize = 0;
+        slot->boundaryTiles = 0;
+        slot->boundaryTileScale = 0;
+    }
+
+    // render targets for the depth textures, those the slot already has are kept if their size and format still match
+    ViewSlot::TextureCopies previousTextures;
+    previousTextures.swap(slot->textures);
+
+    TextureMap textureMap;
+    for(unsigned int i=0; i<_depthSubgraph->getNumChildren(); ++i)
+    {
+        osg::Camera* camera = _depthSubgraph->getChild(i)->asCamera();
+        if (!camera) continue;
+
+        for(osg::Camera::BufferAttachmentMap::const_iterator itr = camera->getBufferAttachmentMap().begin();
+            itr != camera->getBufferAttachmentMap().end();
+            ++itr)
+        {
+            osg::Texture* texture = itr->second._texture.get();
+            if (!texture || textureMap.count(texture)!=0) continue;
+
+            float scale = getTextureScale(texture);
+            unsigned int textureWidth = getScaledSize(width, scale);
+            unsigned int textureHeight = getScaledSize(height, scale);
+
+            osg::ref_ptr<osg::Texture> copy;
+            ViewSlot::TextureCopies::iterator pitr = previousTextures.find(texture);
+            if (pitr!=previousTextures.end() &&
+                pitr->second->getInternalFormat()==texture->getInternalFormat() &&
+                pitr->second->getTextureWidth()==static_cast<int>(textureWidth) &&
+                pitr->second->getTextureHeight()==static_cast<int>(textureHeight) &&
+                pitr->second->getTextureDepth()==texture->getTextureDepth())
+            {
+                copy = pitr->second;
+                previousTextures.erase(pitr);
+            }
+            else
+            {
+                copy = _renderTargetPool->acquire(texture, textureWidth, textureHeight, texture->getTextureDepth());
+            }
+
+            textureMap[texture] = copy.get();
+            slot->textures[texture] = copy;
+        }
+    }
+
+    // targets of removed boundaries and of the previous size, the slot's draw of them has completed before its next cull
+    for(ViewSlot::TextureCopies::iterator itr = previousTextures.begin();
+        itr != previousTextures.end();
+        ++itr)
+    {
+        _renderTargetPool->release(itr->second.get());
+    }
+
+    // depth cameras rendering to the slot's textures, sharing the boundary subgraphs and timers
+    slot->depthSubgraph = new osg::Group(*_depthSubgraph, osg::CopyOp::SHALLOW_COPY);
+    for(unsigned int i=0; i<slot->depthSubgraph->getNumChildren(); ++i)
+    {
+        osg::Camera* sharedCamera = slot->depthSubgraph->getChild(i)->asCamera();
+        if (!sharedCamera) continue;
+
+        osg::ref_ptr<osg::Camera> camera = new osg::Camera(*sharedCamera, osg::CopyOp::SHALLOW_COPY);
+
+        // the viewport is shared by the copy and set on its StateSet, so both are replaced before it can be resized
+        if (sharedCamera->getStateSet()) camera->setStateSet(new osg::StateSet(*(sharedCamera->getStateSet()), osg::CopyOp::SHALLOW_COPY));
+        camera->setViewport(new osg::Viewport(*(sharedCamera->getViewport())));
+
+        for(osg::Camera::BufferAttachmentMap::const_iterator itr = sharedCamera->getBufferAttachmentMap().begin();
+            itr != sharedCamera->getBufferAttachmentMap().end();
+            ++itr)
+        {
+            const osg::Camera::Attachment& attachment = itr->second;
+            TextureMap::iterator mitr = textureMap.find(attachment._texture.get());
+            if (mitr==textureMap.end()) continue;
+
+            camera->attach(itr->first, mitr->second, attachment._level, attachment._face, attachment._mipMapGeneration, attachment._multisampleSamples, attachment._multisampleColorSamples);
+        }
+
+        RTTCameraCullCallback* sharedCallback = dynamic_cast<RTTCameraCullCallback*>(sharedCamera->getCullCallback());
+        camera->setCullCallback(new RTTCameraCullCallback(sharedCallback ? sharedCallback->getPassTimer() : 0, slot));
+
+        slot->depthSubgraph->setChild(i, camera.get());
+    }
+
+    // render subgraphs reading the slot's textures and viewport dimensions
+    slot->renderSubgraph = new osg::Group(*_renderSubgraph, osg::CopyOp::SHALLOW_COPY);
+    for(unsigned int i=0; i<slot->renderSubgraph->getNumChildren(); ++i)
+    {
+        osg::Group* sharedGroup = slot->renderSubgraph->getChild(i)->asGroup();
+        if (!sharedGroup || !sharedGroup->getStateSet()) continue;
+
+        osg::ref_ptr<osg::Group> group = new osg::Group(*sharedGroup, osg::CopyOp::SHALLOW_COPY);
+        group->setStateSet(new osg::StateSet(*(sharedGroup->getStateSet()), osg::CopyOp::SHALLOW_COPY));
+        remapTextures(group->getStateSet(), textureMap);
+        group->getStateSet()->addUniform(slot->viewportDimensions.get());
+
+        if (slot->boundaryTiles.valid() && group->getStateSet()->getDefinePair("BOUNDARY_TILES"))
+        {
+            group->getStateSet()->setTextureAttribute(_boundaryTileTextureUnit, slot->boundaryTiles.get());
+            group->getStateSet()->addUniform(slot->boundaryTileScale.get());
+        }
+
+        slot->renderSubgraph->setChild(i, group.get());
+    }
+
+    resizeDepthCameras(slot->depthSubgraph.get());
+
+    slot->width = width;
+    slot->height = height;
+    slot->generation = _generation;
+    slot->ready.exchange(1);
+}
+
+bool ParametricScene::isBoundary(const Subgraph* sg) const
+{
+    if (_depthCaptureMode==DEPTH_RANGE_ARRAY) return _depthRangeTexture.valid() && sg->depthRangeLayer>=0;
+    return sg->frontTexture.valid() && sg->backTexture.valid();
+}
+
+void ParametricScene::updateBoundaryTiles(osgUtil::CullVisitor* cv, ViewSlot* slot)
+{
+    osg::Image* image = slot->boundaryTiles->getImage();
+    int columns = image->s();
+    int rows = image->t();
+    float* tiles = reinterpret_cast<float*>(image->data());
+
+    // first count the boundaries that cover each tile and sum their indices
+    std::fill(tiles, tiles+columns*rows*2, 0.0f);
+
+    const osg::Viewport* viewport = cv->getViewport();
+    osg::Vec4d window = viewport ? osg::Vec4d(viewport->x(), viewport->y(), viewport->width(), viewport->height()) :
+                                   osg::Vec4d(0.0, 0.0, static_cast<double>(slot->width), static_cast<double>(slot->height));
+
+    // the boundaries are drawn by RELATIVE_RF cameras, so in the scene's own coordinates
+    osg::Matrixd mvp = (*cv->getModelViewMatrix()) * (*cv->getProjectionMatrix());
+    double tileSize = static_cast<double>(slot->boundaryTileSize);
+
+    // only the boundaries whose depth textures setupRenderStateSet() binds are binned
+    unsigned int maxNumBoundaries = (_depthCaptureMode==DEPTH_RANGE_ARRAY) ? UINT_MAX : s_maxDepthTexturePairs;
+
+    float numBoundaries = 0.0f;
+    float indexSum = 0.0f;
+    for(Subgraphs::const_iterator itr = _subgraphs.begin();
+        itr != _subgraphs.end() && numBoundaries<static_cast<float>(maxNumBoundaries);
+        ++itr)
+    {
+        const Subgraph* sg = itr->get();
+        if (!isBoundary(sg)) continue;
+
+        float index = numBoundaries;
+        numBoundaries += 1.0f;
+        indexSum += index;
+
+        // rasterization rounds to pixel centres, and reduced resolution depth is read up to a texel away
+        float scale = (_depthCaptureMode==DEPTH_RANGE_ARRAY) ? getDepthRangeResolutionScale() : _depthResolutionScale*sg->depthResolutionScale;
+        double margin = 1.0 + ((scale>0.0f && scale<1.0f) ? std::ceil(1.0/scale) : 0.0);
+
+        int c0, r0, c1, r1;
+        const osg::BoundingSphere& bs = sg->subgraph.valid() ? sg->subgraph->getBound() : osg::BoundingSphere();
+        if (!computeBoundaryTiles(bs, mvp, window, tileSize, margin, columns, rows, c0, r0, c1, r1)) continue;
+
+        for(int r=r0; r<=r1; ++r)
+        {
+            float* tile = tiles + (c0+r*columns)*2;
+            for(int c=c0; c<=c1; ++c, tile+=2)
+            {
+                tile[0] += 1.0f;
+                tile[1] += index;
+            }
+        }
+    }
+
+    // then leave the number of boundaries that miss each tile, and the sum of their indices which names the one when only one misses
+    for(float* tile = tiles; tile != tiles+columns*rows*2; tile+=2)
+    {
+        tile[0] = numBoundaries - tile[0];
+        tile[1] = indexSum - tile[1];
+    }
+
+    image->dirty();
+}
+
+bool ParametricScene::computeBoundaryTiles(const osg::BoundingSphere& bs, const osg::Matrixd& mvp, const osg::Vec4d& window, double tileSize, double margin,
+                                           int columns, int rows, int& c0, int& r0, int& c1, int& r1)
+{
+    c0 = 0; r0 = 0; c1 = columns-1; r1 = rows-1;
+    if (!bs.valid()) return true;
+
+    // the box around the bounding sphere in window coordinates, taken to cover the whole view if it reaches behind the eye
+    osg::BoundingBox bb;
+    for(unsigned int i=0; i<8; ++i)
+    {
+        osg::Vec4d corner(bs.center().x() + ((i&1) ? bs.radius() : -bs.radius()),
+                          bs.center().y() + ((i&2) ? bs.radius() : -bs.radius()),
+                          bs.center().z() + ((i&4) ? bs.radius() : -bs.radius()), 1.0);
+        osg::Vec4d clip = corner * mvp;
+        if (clip.w()<=0.0) return true;
+
+        bb.expandBy(osg::Vec3(window[0] + (clip.x()/clip.w()*0.5+0.5)*window[2],
+                              window[1] + (clip.y()/clip.w()*0.5+0.5)*window[3], 0.0f));
+    }
+
+    double left = std::floor((bb.xMin()-window[0]-margin)/tileSize);
+    double bottom = std::floor((bb.yMin()-window[1]-margin)/tileSize);
+    double right = std::floor((bb.xMax()-window[0]+margin)/tileSize);
+    double top = std::floor((bb.yMax()-window[1]+margin)/tileSize);
+    if (right<0.0 || top<0.0 || left>=columns || bottom>=rows) return false;
+
+    c0 = static_cast<int>(std::max(0.0, left));
+    r0 = static_cast<int>(std::max(0.0, bottom));
+    c1 = static_cast<int>(std::min(static_cast<double>(columns-1), right));
+    r1 = static_cast<int>(std::min(static_cast<double>(rows-1), top));
+    return true;
+}
+
+void ParametricScene::releaseViewSlots()
+{
+    for(ViewSlots::iterator itr = _viewSlots.begin();
+        itr != _viewSlots.end();
+        ++itr)
+    {
+        releaseViewSlot(itr->get());
+    }
+}
+
+void ParametricScene::releaseViewSlot(ViewSlot* slot)
+{
+    for(ViewSlot::TextureCopies::iterator titr = slot->textures.begin();
+        titr != slot->textures.end();
+        ++titr)
+    {
+        _renderTargetPool->release(titr->second.get());
+    }
+    slot->textures.clear();
+
+    // back to the state of a new slot, then free for the next CullVisitor to claim
+    slot->ready.exchange(0);
+    slot->width = 0;
+    slot->height = 0;
+    slot->generation = 0;
+    slot->boundaryTileSize = 0;
+    slot->boundaryTiles = 0;
+    slot->boundaryTileScale = 0;
+    slot->renderSubgraph = 0;
+    slot->depthSubgraph = 0;
+    slot->owner.assign(0, slot->owner.get());
+}
+
+void ParametricScene::releaseIdleViewSlots(unsigned int frameNumber)
+{
+    if (_viewSlotIdleFrames==0) return;
+
+    bool released = false;
+    for(ViewSlots::iterator itr = _viewSlots.begin();
+        itr != _viewSlots.end();
+        ++itr)
+    {
+        ViewSlot* slot = itr->get();
+        if (slot->owner.get()==0 || slot->ready==0) continue;
+
+        // the slot's draws completed long ago, so its render targets can go back to the pool
+        if (frameNumber>slot->lastCullFrame && frameNumber-slot->lastCullFrame>_viewSlotIdleFrames)
+        {
+            releaseViewSlot(slot);
+            released = true;
+        }
+    }
+
+    if (released) _viewSlotsExhausted.exchange(0);
+}
+
+void ParametricScene::resize(unsigned int width, unsigned int height)
+{
+    if (width==_width && height==_height) return;
+
+    _width = width;
+    _height = height;
+
+    _viewportDimensions->set(osg::Vec4(0.0f, 0.0f, static_cast<float>(_width), static_cast<float>(_height)));
+
+    updateDepthTextureSizes();
+}
+
+void ParametricScene::updateDepthTextureSizes()
+{
+    bool resized = false;
+
+    for(Subgraphs::iterator itr = _subgraphs.begin();
+        itr != _subgraphs.end();
+        ++itr)
+    {
+        Subgraph* sg = itr->get();
+        float scale = _depthResolutionScale*sg->depthResolutionScale;
+        osg::Texture2D* textures[] = { sg->frontTexture.get(), sg->backTexture.get() };
+        for(unsigned int i=0; i<2; ++i)
+        {
+            osg::Texture2D* texture = textures[i];
+            if (!texture) continue;
+
+            unsigned int width = getScaledSize(_width, scale);
+            unsigned int height = getScaledSize(_height, scale);
+            if (static_cast<unsigned int>(texture->getTextureWidth())==width && static_cast<unsigned int>(texture->getTextureHeight())==height) continue;
+
+            // reduced resolution textures are tested texel by texel, see parametric.frag
+            osg::Texture::FilterMode filter = (scale<1.0f) ? osg::Texture::NEAREST : osg::Texture::LINEAR;
+            texture->setFilter(osg::Texture::MIN_FILTER, filter);
+            texture->setFilter(osg::Texture::MAG_FILTER, filter);
+
+            RenderTargetPool::setTextureSize(texture, width, height, 1);
+            resized = true;
+        }
+    }
+
+    if (_depthRangeTexture.valid())
+    {
+        float scale = getDepthRangeResolutionScale();
+        unsigned int width = getScaledSize(_width, scale);
+        unsigned int height = getScaledSize(_height, scale);
+        if (static_cast<unsigned int>(_depthRangeTexture->getTextureWidth())!=width || static_cast<unsigned int>(_depthRangeTexture->getTextureHeight())!=height)
+        {
+            RenderTargetPool::setTextureSize(_depthRangeTexture.get(), width, height, _depthRangeTexture->getTextureDepth());
+            resized = true;
+        }
+    }
+
+    if (resized) resizeDepthCameras(_depthSubgraph.get());
+}
+
+void ParametricScene::resizeDepthCameras(osg::Group* depthSubgraph)
+{
+    for(unsigned int i=0; i<depthSubgraph->getNumChildren(); ++i)
+    {
+        osg::Camera* camera = depthSubgraph->getChild(i)->asCamera();
+        if (!camera || camera->getBufferAttachmentMap().empty()) continue;
+
+        // match the viewport to the texture the camera renders to, and have the frame buffer object rebuilt
+        const osg::Texture* texture = camera->getBufferAttachmentMap().begin()->second._texture.get();
+        if (texture) camera->setViewport(0, 0, texture->getTextureWidth(), texture->getTextureHeight());
+        camera->dirtyAttachmentMap();
+    }
+}
+
+unsigned int ParametricScene::getScaledSize(unsigned int size, float scale) const
+{
+    return std::max(1u, static_cast<unsigned int>(static_cast<float>(size)*scale+0.5f));
+}
+
+float ParametricScene::getDepthRangeResolutionScale() const
+{
+    float scale = 0.0f;
+    for(Subgraphs::const_iterator itr = _subgraphs.begin();
+        itr != _subgraphs.end();
+        ++itr)
+    {
+        if ((*itr)->requiresDepthSubgraph) scale = std::max(scale, (*itr)->depthResolutionScale);
+    }
+    return _depthResolutionScale*scale;
+}
+
+bool ParametricScene::hasReducedResolutionDepth() const
+{
+    if (_depthCaptureMode==DEPTH_RANGE_ARRAY) return _depthRangeTexture.valid() && getDepthRangeResolutionScale()<1.0f;
+
+    for(Subgraphs::const_iterator itr = _subgraphs.begin();
+        itr != _subgraphs.end();
+        ++itr)
+    {
+        if ((*itr)->frontTexture.valid() && _depthResolutionScale*(*itr)->depthResolutionScale<1.0f) return true;
+    }
+    return false;
+}
+
+void ParametricScene::setupDerivativeDefines()
+{
+    // with analytic normals turned off the derivatives generated earlier are removed
+    DerivativeDefinesVisitor visitor(!_useAnalyticNormals);
+    visitor.addDerivatives(getStateSet());
+
+    for(Subgraphs::iterator itr = _subgraphs.begin();
+        itr != _subgraphs.end();
+        ++itr)
+    {
+        (*itr)->subgraph->accept(visitor);
+    }
+}
+
+void ParametricScene::setupSurfaceBounds()
+{
+    _surfaceBounds.clear();
+
+    FunctionMap functionMap;
+
+    for(Subgraphs::iterator itr = _subgraphs.begin();
+        itr != _subgraphs.end();
+        ++itr)
+    {
+        Subgraph* sg = itr->get();
+        if (!sg->subgraph) continue;
+
+        CollectSurfacesVisitor csv(getStateSet());
+        sg->subgraph->accept(csv);
+
+        for(CollectSurfacesVisitor::Surfaces::iterator sitr = csv.surfaces.begin();
+            sitr != csv.surfaces.end();
+            ++sitr)
+        {
+            osg::ref_ptr<SurfaceBound> sb = new SurfaceBound;
+            sb->geometry = sitr->geometry;
+
+            bool valid = true;
+            sb->function = getSurfaceFunction(functionMap, sitr->defines, sitr->uniforms, valid);
+            if (sitr->defines.count("Z_HEIGHTFIELD")!=0)
+            {
+                osg::StateSet::UniformList::const_iterator uitr = sitr->uniforms.find("heightFieldRange");
+                valid = uitr!=sitr->uniforms.end() && uitr->second.first->get(sb->heightRange);
+                sb->heightField = true;
+            }
+
+            if (!valid)
+            {
+                // can't reproduce the shader's displacement so leave the surface with its conservative bound.
+                sb->geometry->setDisplacedBound(osg::BoundingBox());
+                continue;
+            }
+
+            // instances evaluate the function with their own parameters, so take a copy to set them on, and share out the samples
+            unsigned int density = _boundsSampleDensity;
+            const SurfaceInstances* instances = sb->geometry->getInstances();
+            if (instances)
+            {
+                if (sb->function.valid()) sb->function = new SurfaceFunction(*(sb->function));
+
+                double numInstances = static_cast<double>(std::max(1u, instances->getNumInstances()));
+                density = std::max(1u, density/static_cast<unsigned int>(std::ceil(std::sqrt(numInstances))));
+            }
+
+            sb->geometry->getBoundSamples(density, sb->x, sb->y, sb->z);
+
+            _surfaceBounds.push_back(sb);
+        }
+
+        // the level of detail nodes evaluate the functions themselves to pick their patches and bound them
+        for(CollectSurfacesVisitor::LODs::iterator litr = csv.lods.begin();
+            litr != csv.lods.end();
+            ++litr)
+        {
+            bool valid = true;
+            osg::ref_ptr<SurfaceFunction> function = getSurfaceFunction(functionMap, litr->defines, litr->uniforms, valid);
+            litr->lod->setSurfaceFunction(function.get());
+            litr->lod->setBoundsMargin(_boundsMargin);
+        }
+    }
+}
+
+osg::ref_ptr<SurfaceFunction> ParametricScene::getSurfaceFunction(FunctionMap& functionMap, const osg::StateSet::DefineList& defines, const osg::StateSet::UniformList& uniforms, bool& valid)
+{
+    valid = true;
+
+    // share a SurfaceFunction between all the surfaces that use the same functions and uniform values
+    std::ostringstream key;
+    for(osg::StateSet::DefineList::const_iterator ditr = defines.begin(); ditr != defines.end(); ++ditr)
+    {
+        key<<ditr->first<<"="<<ditr->second.first<<";";
+    }
+    for(osg::StateSet::UniformList::const_iterator uitr = uniforms.begin(); uitr != uniforms.end(); ++uitr)
+    {
+        float value;
+        if (uitr->second.first->getType()==osg::Uniform::FLOAT && uitr->second.first->get(value)) key<<uitr->first<<"="<<value<<";";
+    }
+
+    FunctionMap::iterator fitr = functionMap.find(key.str());
+    if (fitr!=functionMap.end()) return fitr->second;
+
+    // the heights of a heightfield only exist in its stream's frames, so there's no function to evaluate
+    if (defines.count("Z_HEIGHTFIELD")!=0)
+    {
+        functionMap[key.str()] = 0;
+        return 0;
+    }
 
-    if (pm) cv->pushProjectionMatrix( pm );
+    bool hasFunction = defines.count("Z_FUNCTION")!=0 || defines.count("Z_BASE")!=0 || defines.count("Z_TOP")!=0;
 
-    traverse(node, nv);
+    osg::ref_ptr<SurfaceFunction> function = new SurfaceFunction;
+    function->setUniforms(uniforms);
+    if (!function->set(defines))
+    {
+        if (hasFunction)
+        {
+            OSG_NOTICE<<"ParametricScene::setupSurfaceBounds() unable to evaluate surface function, "<<function->getErrorMessage()<<std::endl;
+            valid = false;
+            return 0;
+        }
+        function = 0;
+    }
 
-    if (pm) cv->popProjectionMatrix();
+    functionMap[key.str()] = function;
+    return function;
 }
 
-void NearFarCallback::operator()(osg::Node* node, osg::NodeVisitor* nv)
+void ParametricScene::updateSurfaceBounds(double simulationTime, bool timeDependentOnly)
 {
-    osgUtil::CullVisitor* cv = dynamic_cast<osgUtil::CullVisitor*>(nv);
+    _simulationTime = simulationTime;
 
-    osg::ref_ptr<osg::RefMatrix> pm = cv->getProjectionMatrix();
-    pm->setName("ProjectionMatrix");
+    bool boundsChanged = false;
+    std::vector<float> displacements;
 
-    osg::UserDataContainer* udc = cv->getOrCreateUserDataContainer();
-    udc->addUserObject(pm.get());
+    for(SurfaceBounds::iterator itr = _surfaceBounds.begin();
+        itr != _surfaceBounds.end();
+        ++itr)
+    {
+        SurfaceBound* sb = itr->get();
+        if (timeDependentOnly && (!sb->function || !sb->function->isTimeDependent())) continue;
 
-    traverse(node, nv);
+        unsigned int numSamples = static_cast<unsigned int>(sb->x.size());
+        if (numSamples==0) continue;
 
-    cv->updateCalculatedNearFar(*(cv->getModelViewMatrix()), _bb);
+        osg::BoundingBox bb;
+        const SurfaceInstances* instances = sb->geometry->getInstances();
+        if (instances)
+        {
+            // each instance displaces the grid with its own parameters, and its bound is placed on its axes
+            for(SurfaceInstances::Instances::const_iterator iitr = instances->getInstances().begin();
+                iitr != instances->getInstances().end();
+                ++iitr)
+            {
+                if (sb->function.valid())
+                {
+                    sb->function->setUniform("instanceParameter0", iitr->parameters.x());
+                    sb->function->setUniform("instanceParameter1", iitr->parameters.y());
+                    sb->function->setUniform("instanceParameter2", iitr->parameters.z());
+                    sb->function->setUniform("instanceParameter3", iitr->parameters.w());
+                }
+
+                osg::BoundingBox instanceBB = computeDisplacedBound(sb, simulationTime, displacements);
+                if (!instanceBB.valid()) continue;
+
+                for(unsigned int i=0; i<8; ++i)
+                {
+                    bb.expandBy(iitr->transform(instanceBB.corner(i)));
+                }
+            }
+        }
+        else
+        {
+            bb = computeDisplacedBound(sb, simulationTime, displacements);
+        }
+
+        sb->geometry->setDisplacedBound(bb);
+        boundsChanged = true;
+    }
 
-    // remove the matrix
-    unsigned int i = udc->getUserObjectIndex(pm.get());
-    udc->removeUserObject(i);
+    if (boundsChanged) updateNearFarBound();
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////////////
-//
-// ParametricScene::Subgraph
-//
-ParametricScene::Subgraph::Subgraph(parameter_ptr<osg::Node> sg, bool rrs, bool rds):
-    subgraph(sg.get()),
-    requiresRenderSubgraph(rrs),
-    requiresDepthSubgraph(rds)
+osg::BoundingBox ParametricScene::computeDisplacedBound(SurfaceBound* sb, double simulationTime, std::vector<float>& displacements) const
 {
-}
+    unsigned int numSamples = static_cast<unsigned int>(sb->x.size());
 
+    // surfaces without a function aren't displaced by the shader
+    displacements.assign(numSamples, 0.0f);
+    if (sb->function.valid())
+    {
+        sb->function->evaluate(numSamples, &(sb->x.front()), &(sb->y.front()), &(sb->z.front()), static_cast<float>(simulationTime), &(displacements.front()));
+    }
 
-//////////////////////////////////////////////////////////////////////////////////////////////////
-//
-// ParametricScene
-//
-ParametricScene::ParametricScene()
-{
-    init();
+    osg::Vec3 verticalAxis = sb->geometry->getVerticalAxis();
+
+    osg::BoundingBox bb;
+    float minDisplacement = FLT_MAX;
+    float maxDisplacement = -FLT_MAX;
+    for(unsigned int i=0; i<numSamples; ++i)
+    {
+        float d = displacements[i];
+        if (d!=d) continue; // skip NaN's, the shader wouldn't produce visible geometry for them either
+
+        osg::Vec3 position(sb->x[i], sb->y[i], sb->z[i]);
+        if (sb->heightField)
+        {
+            bb.expandBy(position + verticalAxis*sb->heightRange.x());
+            bb.expandBy(position + verticalAxis*sb->heightRange.y());
+            minDisplacement = sb->heightRange.x();
+            maxDisplacement = sb->heightRange.y();
+            continue;
+        }
+
+        bb.expandBy(position + verticalAxis*d);
+        minDisplacement = std::min(minDisplacement, d);
+        maxDisplacement = std::max(maxDisplacement, d);
+    }
+
+    if (bb.valid())
+    {
+        osg::Vec3 margin = verticalAxis*((maxDisplacement-minDisplacement)*_boundsMargin);
+        osg::BoundingBox sampledBB(bb);
+        for(unsigned int i=0; i<8; ++i)
+        {
+            bb.expandBy(sampledBB.corner(i)+margin);
+            bb.expandBy(sampledBB.corner(i)-margin);
+        }
+    }
+
+    return bb;
 }
 
-ParametricScene::ParametricScene(const ParametricScene& ps,const osg::CopyOp& copyop)
+bool ParametricScene::findSurfaceFunction(const SurfaceGeometry* geometry, osg::ref_ptr<SurfaceFunction>& function) const
 {
-    init();
+    for(SurfaceBounds::const_iterator itr = _surfaceBounds.begin();
+        itr != _surfaceBounds.end();
+        ++itr)
+    {
+        if ((*itr)->geometry.get()!=geometry) continue;
+        if ((*itr)->heightField || geometry->getInstances()) return false;
+
+        function = (*itr)->function;
+        return true;
+    }
+    return false;
 }
 
-ParametricScene::~ParametricScene()
+void ParametricScene::updateNearFarBound()
 {
+    if (!_nearFarCallback) return;
+
+    osg::ComputeBoundsVisitor cbv;
+    for(Subgraphs::iterator itr = _subgraphs.begin();
+        itr != _subgraphs.end();
+        ++itr)
+    {
+        Subgraph* sg = itr->get();
+        if (sg->subgraph) sg->subgraph->accept(cbv);
+    }
+
+    _nearFarCallback->_bb = cbv.getBoundingBox();
 }
 
-void ParametricScene::init()
+void ParametricScene::publishStats(unsigned int frameNumber)
 {
-    _width = 1280;
-    _height = 1024;
+    if (!_stats || !_stats->collectStats("parametric")) return;
 
-    _renderSubgraph = new osg::Group;
-    _renderSubgraph->setName("RenderSubgraph");
-    addChild(_renderSubgraph.get());
+    // GPU times arrive a few frames late, so the recent frames are published again until they're complete
+    const unsigned int numFramesToRefresh = 8;
+    unsigned int startFrame = frameNumber>numFramesToRefresh ? frameNumber-numFramesToRefresh : 0;
+    for(unsigned int frame = startFrame; frame<frameNumber; ++frame)
+    {
+        for(PassTimers::iterator itr = _passTimers.begin();
+            itr != _passTimers.end();
+            ++itr)
+        {
+            (*itr)->publish(_stats.get(), frame);
+        }
+    }
 
-    _depthSubgraph = new osg::Group;
-    _depthSubgraph->setName("DepthSubgraph");
-    addChild(_depthSubgraph.get());
+    _stats->setAttribute(frameNumber, "Depth texture memory", static_cast<double>(getDepthTextureMemory())/(1024.0*1024.0));
+
+    // the pool also holds released targets kept for reuse, and may be shared with other scenes
+    RenderTargetPool::Usage usage = _renderTargetPool->getUsage();
+    _stats->setAttribute(frameNumber, "Render target pool memory", static_cast<double>(usage.memoryInUse+usage.memoryReleased)/(1024.0*1024.0));
 }
 
-void ParametricScene::addSubgraph(parameter_ptr<osg::Node> subgraph, bool requiresRenderSubgraph, bool requiresDepthSubgraph)
+unsigned long long ParametricScene::getDepthTextureMemory() const
 {
-    _subgraphs.push_back(new Subgraph(subgraph, requiresRenderSubgraph, requiresDepthSubgraph));
+    // the textures of the scene itself are only templates for the views' textures, unless no view has culled the scene yet
+    unsigned long long size = 0;
+    bool viewsCulled = false;
+    for(ViewSlots::const_iterator itr = _viewSlots.begin();
+        itr != _viewSlots.end();
+        ++itr)
+    {
+        const ViewSlot* slot = itr->get();
+        if (slot->ready==0) continue;
+
+        viewsCulled = true;
+        for(ViewSlot::TextureCopies::const_iterator titr = slot->textures.begin();
+            titr != slot->textures.end();
+            ++titr)
+        {
+            size += RenderTargetPool::computeMemory(titr->second.get());
+        }
+    }
+    if (viewsCulled) return size;
+
+    if (_depthRangeTexture.valid()) size += RenderTargetPool::computeMemory(_depthRangeTexture.get());
+
+    for(Subgraphs::const_iterator itr = _subgraphs.begin();
+        itr != _subgraphs.end();
+        ++itr)
+    {
+        const Subgraph* sg = itr->get();
+        if (sg->frontTexture.valid()) size += RenderTargetPool::computeMemory(sg->frontTexture.get());
+        if (sg->backTexture.valid()) size += RenderTargetPool::computeMemory(sg->backTexture.get());
+    }
+    return size;
 }
 
-void ParametricScene::setup()
+void ParametricScene::setupRenderSubgraphs()
 {
-    setupDepthSubgraphs();
-    setupRenderSubgraphs();
+    _renderSubgraph->removeChildren(0, _renderSubgraph->getNumChildren());
 
-    osg::BoundingBox bb;
     for(Subgraphs::iterator itr = _subgraphs.begin();
         itr != _subgraphs.end();
         ++itr)
     {
         Subgraph* sg = itr->get();
-        if (sg->subgraph) bb.expandBy(sg->subgraph->getBound());
+        sg->renderGroup = 0;
+        if (sg->requiresRenderSubgraph) addRenderPass(sg);
+    }
+}
+
+void ParametricScene::addRenderPass(Subgraph* sg)
+{
+    if (!sg->subgraph) return;
+
+    osg::ref_ptr<osg::Group> group = new osg::Group;
+    group->setName("Render "+toString(sg->id));
+    group->addChild(sg->subgraph.get());
+
+    setupRenderStateSet(sg, group->getOrCreateStateSet());
+
+    if (_collectPassTimes)
+    {
+        group->setCullCallback(new osgParametric::RenderSubgraphCullCallback(new PassTimer(group->getName())));
     }
 
-    setCullCallback(new osgParametric::NearFarCallback(bb));
+    _renderSubgraph->addChild(group.get());
+    sg->renderGroup = group;
 }
 
-void ParametricScene::setupRenderSubgraphs()
+void ParametricScene::removeRenderPass(Subgraph* sg)
 {
-    _renderSubgraph->removeChildren(0, _renderSubgraph->getNumChildren());
+    if (!sg->renderGroup) return;
 
+    _renderSubgraph->removeChild(sg->renderGroup.get());
+    sg->renderGroup = 0;
+}
+
+void ParametricScene::setupRenderStateSets()
+{
+    // new StateSets rather than modifying the existing ones, which a draw thread may still be using
     for(Subgraphs::iterator itr = _subgraphs.begin();
         itr != _subgraphs.end();
         ++itr)
     {
         Subgraph* sg = itr->get();
-        if (sg->requiresRenderSubgraph)
-        {
-            if ((*itr)->subgraph)
-            {
-                osg::ref_ptr<osg::Group> group = new osg::Group;
-                group->addChild((*itr)->subgraph);
+        if (!sg->renderGroup) continue;
 
-                setupRenderStateSet(sg, group->getOrCreateStateSet(), _width, _height);
+        osg::ref_ptr<osg::StateSet> stateset = new osg::StateSet;
+        setupRenderStateSet(sg, stateset.get());
+        sg->renderGroup->setStateSet(stateset.get());
+    }
+}
 
-                _renderSubgraph->addChild(group);
-            }
-        }
+void ParametricScene::collectPassTimers()
+{
+    _passTimers.clear();
+
+    for(unsigned int i=0; i<_depthSubgraph->getNumChildren(); ++i)
+    {
+        RTTCameraCullCallback* callback = dynamic_cast<RTTCameraCullCallback*>(_depthSubgraph->getChild(i)->getCullCallback());
+        if (callback && callback->getPassTimer()) _passTimers.push_back(callback->getPassTimer());
+    }
+
+    for(unsigned int i=0; i<_renderSubgraph->getNumChildren(); ++i)
+    {
+        RenderSubgraphCullCallback* callback = dynamic_cast<RenderSubgraphCullCallback*>(_renderSubgraph->getChild(i)->getCullCallback());
+        if (callback && callback->getPassTimer()) _passTimers.push_back(callback->getPassTimer());
     }
 }
 
 void ParametricScene::setupDepthSubgraphs()
 {
     _depthSubgraph->removeChildren(0, _depthSubgraph->getNumChildren());
+    _depthRangeTexture = 0;
+    _depthRangeCameras.clear();
 
+    unsigned int numBoundaries = 0;
     for(Subgraphs::iterator itr = _subgraphs.begin();
         itr != _subgraphs.end();
         ++itr)
     {
         Subgraph* sg = itr->get();
-        if (sg->requiresDepthSubgraph)
-        {
-            osg::ref_ptr<osg::Node> boundarySubgraph = (*itr)->subgraph;
+        sg->frontTexture = 0;
+        sg->backTexture = 0;
+        sg->frontCamera = 0;
+        sg->backCamera = 0;
+        sg->depthRangeLayer = -1;
+        if (sg->requiresDepthSubgraph) ++numBoundaries;
+    }
+
+    if (_depthCaptureMode==DEPTH_RANGE_ARRAY)
+    {
+        if (numBoundaries==0) return;
+
+        // allocate all the layers up front rather than growing the array boundary by boundary
+        float scale = getDepthRangeResolutionScale();
+        _depthRangeTexture = createDepthRangeTexture(getScaledSize(_width, scale), getScaledSize(_height, scale), numBoundaries);
+    }
+    else if (numBoundaries>s_maxDepthTexturePairs)
+    {
+        OSG_NOTICE<<"ParametricScene : parametric.frag only clips against the first "<<s_maxDepthTexturePairs<<" of "<<numBoundaries<<" boundaries, use DEPTH_RANGE_ARRAY for more"<<std::endl;
+    }
 
-            // set up the depth texture for front face of the boundary
-            osg::ref_ptr<osg::Texture2D> frontDepthTexture = createDepthTexture(_width, _height);
-            osg::ref_ptr<osg::Camera> frontDepthCamera = createDepthCamera(frontDepthTexture, false);
-            frontDepthCamera->getOrCreateStateSet()->setAttributeAndModes(new osg::CullFace(osg::CullFace::BACK), osg::StateAttribute::ON);
-            frontDepthCamera->addChild(boundarySubgraph);
+    for(Subgraphs::iterator itr = _subgraphs.begin();
+        itr != _subgraphs.end();
+        ++itr)
+    {
+        Subgraph* sg = itr->get();
+        if (sg->requiresDepthSubgraph) addDepthPasses(sg);
+    }
+}
 
-            _depthSubgraph->addChild(frontDepthCamera.get());
+void ParametricScene::addDepthPasses(Subgraph* sg)
+{
+    if (_depthCaptureMode==DEPTH_RANGE_ARRAY)
+    {
+        float scale = getDepthRangeResolutionScale();
+        if (!_depthRangeTexture)
+        {
+            _depthRangeTexture = createDepthRangeTexture(getScaledSize(_width, scale), getScaledSize(_height, scale), 1);
+        }
 
-            sg->frontTexture = frontDepthTexture;
+        // reuse the layer of a removed boundary, its camera has just been clearing it to the full range
+        unsigned int layer = 0;
+        while(layer<_depthRangeCameras.size() && _depthRangeCameras[layer]->getNumChildren()>0) ++layer;
 
-            // set up the depth texture for back face of the boundary
-            osg::ref_ptr<osg::Texture2D> backDepthTexture = createDepthTexture(_width, _height);
-            osg::ref_ptr<osg::Camera> backDepthCamera = createDepthCamera(backDepthTexture, true);
-            backDepthCamera->getOrCreateStateSet()->setAttributeAndModes(new osg::CullFace(osg::CullFace::FRONT), osg::StateAttribute::ON);
-            backDepthCamera->addChild(boundarySubgraph);
+        if (layer==_depthRangeCameras.size())
+        {
+            // the array only has to be reallocated when it runs out of layers
+            if (layer>=static_cast<unsigned int>(_depthRangeTexture->getTextureDepth()))
+            {
+                RenderTargetPool::setTextureSize(_depthRangeTexture.get(), _depthRangeTexture->getTextureWidth(), _depthRangeTexture->getTextureHeight(), layer+1);
+            }
 
-            _depthSubgraph->addChild(backDepthCamera.get());
+            osg::ref_ptr<osg::Camera> depthRangeCamera = createDepthRangeCamera(_depthRangeTexture.get(), layer);
+            setupPassTimer(depthRangeCamera.get(), "Depth range "+toString(layer));
 
-            sg->backTexture = backDepthTexture;
+            _depthSubgraph->addChild(depthRangeCamera.get());
+            _depthRangeCameras.push_back(depthRangeCamera);
         }
+
+        _depthRangeCameras[layer]->setClearColor(s_emptyDepthRange);
+        _depthRangeCameras[layer]->addChild(sg->subgraph.get());
+        sg->depthRangeLayer = static_cast<int>(layer);
+
+        // a boundary with a larger scale than the others raises the resolution of the whole array
+        updateDepthTextureSizes();
+        return;
+    }
+
+    float scale = _depthResolutionScale*sg->depthResolutionScale;
+    unsigned int width = getScaledSize(_width, scale);
+    unsigned int height = getScaledSize(_height, scale);
+
+    // set up the depth texture for front face of the boundary
+    sg->frontTexture = createDepthTexture(width, height, scale<1.0f, getDepthFormat(sg));
+    sg->frontCamera = createDepthCamera(sg->frontTexture, false);
+    setupPassTimer(sg->frontCamera.get(), "Depth front "+toString(sg->id));
+    sg->frontCamera->getOrCreateStateSet()->setAttributeAndModes(new osg::CullFace(osg::CullFace::BACK), osg::StateAttribute::ON);
+    sg->frontCamera->addChild(sg->subgraph.get());
+
+    _depthSubgraph->addChild(sg->frontCamera.get());
+
+    // set up the depth texture for back face of the boundary
+    sg->backTexture = createDepthTexture(width, height, scale<1.0f, getDepthFormat(sg));
+    sg->backCamera = createDepthCamera(sg->backTexture, true);
+    setupPassTimer(sg->backCamera.get(), "Depth back "+toString(sg->id));
+    sg->backCamera->getOrCreateStateSet()->setAttributeAndModes(new osg::CullFace(osg::CullFace::FRONT), osg::StateAttribute::ON);
+    sg->backCamera->addChild(sg->subgraph.get());
+
+    _depthSubgraph->addChild(sg->backCamera.get());
+}
+
+void ParametricScene::removeDepthPasses(Subgraph* sg)
+{
+    if (sg->depthRangeLayer>=0)
+    {
+        // keep the layer's camera, without the boundary it clears the layer to the full range, which parametric.frag's
+        // loop over all the layers passes, until the layer is reused
+        osg::Camera* camera = _depthRangeCameras[sg->depthRangeLayer].get();
+        camera->removeChildren(0, camera->getNumChildren());
+        camera->setClearColor(s_fullDepthRange);
+        sg->depthRangeLayer = -1;
+        return;
     }
+
+    if (sg->frontCamera.valid()) _depthSubgraph->removeChild(sg->frontCamera.get());
+    if (sg->backCamera.valid()) _depthSubgraph->removeChild(sg->backCamera.get());
+
+    sg->frontCamera = 0;
+    sg->backCamera = 0;
+    sg->frontTexture = 0;
+    sg->backTexture = 0;
 }
 
 
-osg::ref_ptr<osg::Texture2D> ParametricScene::createDepthTexture(unsigned int width, unsigned int height)
+osg::ref_ptr<osg::Texture2D> ParametricScene::createDepthTexture(unsigned int width, unsigned int height, bool reducedResolution, GLenum format)
 {
+    // reduced resolution textures are tested texel by texel, see parametric.frag
+    osg::Texture::FilterMode filter = reducedResolution ? osg::Texture2D::NEAREST : osg::Texture2D::LINEAR;
+
     osg::ref_ptr<osg::Texture2D> depthTexture = new osg::Texture2D;
     depthTexture->setTextureSize(width, height);
-    depthTexture->setInternalFormat(GL_DEPTH_COMPONENT);
-    depthTexture->setFilter(osg::Texture2D::MIN_FILTER,osg::Texture2D::LINEAR);
-    depthTexture->setFilter(osg::Texture2D::MAG_FILTER,osg::Texture2D::LINEAR);
+    setDepthFormat(depthTexture.get(), format);
+    depthTexture->setFilter(osg::Texture2D::MIN_FILTER,filter);
+    depthTexture->setFilter(osg::Texture2D::MAG_FILTER,filter);
     depthTexture->setWrap(osg::Texture2D::WRAP_S,osg::Texture2D::CLAMP_TO_BORDER);
     depthTexture->setWrap(osg::Texture2D::WRAP_T,osg::Texture2D::CLAMP_TO_BORDER);
     depthTexture->setBorderColor(osg::Vec4(1.0f,1.0f,1.0f,1.0f));
     return depthTexture;
 }
 
-osg::ref_ptr<osg::Camera> ParametricScene::createDepthCamera(parameter_ptr<osg::Texture> depthTexture, bool backFace)
+void ParametricScene::setupPassTimer(osg::Camera* camera, const std::string& name)
 {
-    osg::ref_ptr<osg::Camera> camera = new osg::Camera;
-    camera->attach(osg::Camera::DEPTH_BUFFER, depthTexture.get());
-    camera->setViewport(0, 0, depthTexture->getTextureWidth(), depthTexture->getTextureHeight());
+    camera->setName(name);
+    if (!_collectPassTimes) return;
 
-    // clear the depth and colour bufferson each clear.
-    camera->setClearMask(GL_DEPTH_BUFFER_BIT);
+    osg::ref_ptr<PassTimer> timer = new PassTimer(name);
+    timer->attach(camera);
+
+    RTTCameraCullCallback* cullCallback = dynamic_cast<RTTCameraCullCallback*>(camera->getCullCallback());
+    if (cullCallback) cullCallback->setPassTimer(timer.get());
+}
+
+osg::ref_ptr<osg::Camera> ParametricScene::createRTTCamera(unsigned int width, unsigned int height)
+{
+    osg::ref_ptr<osg::Camera> camera = new osg::Camera;
+    camera->setViewport(0, 0, width, height);
 
     // set the camera to render before the main camera.
     camera->setRenderOrder(osg::Camera::PRE_RENDER);
@@ -212,6 +1892,20 @@ osg::ref_ptr<osg::Camera> ParametricScene::createDepthCamera(parameter_ptr<osg::
 
     camera->setCullCallback(new osgParametric::RTTCameraCullCallback());
 
+    return camera;
+}
+
+osg::ref_ptr<osg::Camera> ParametricScene::createDepthCamera(parameter_ptr<osg::Texture> depthTexture, bool backFace)
+{
+    osg::ref_ptr<osg::Camera> camera = createRTTCamera(depthTexture->getTextureWidth(), depthTexture->getTextureHeight());
+    camera->attach(osg::Camera::DEPTH_BUFFER, depthTexture.get());
+
+    // clear the depth and colour bufferson each clear.
+    camera->setClearMask(GL_DEPTH_BUFFER_BIT);
+
+    // only depth is captured, so the shaders skip the normals and lighting
+    camera->getOrCreateStateSet()->setDefine("DEPTH_ONLY");
+
     if (backFace)
     {
         camera->getOrCreateStateSet()->setAttribute(new osg::Depth(osg::Depth::GREATER));
@@ -226,47 +1920,127 @@ osg::ref_ptr<osg::Camera> ParametricScene::createDepthCamera(parameter_ptr<osg::
     return camera;
 }
 
-void ParametricScene::setupRenderStateSet(Subgraph* sgToExclude, osg::StateSet* stateset, unsigned int width, unsigned int height)
+osg::ref_ptr<osg::Texture2DArray> ParametricScene::createDepthRangeTexture(unsigned int width, unsigned int height, unsigned int numLayers)
+{
+    osg::ref_ptr<osg::Texture2DArray> texture = new osg::Texture2DArray;
+    texture->setTextureSize(width, height, numLayers);
+    texture->setInternalFormat(GL_RG32F);
+    texture->setSourceFormat(GL_RG);
+    texture->setSourceType(GL_FLOAT);
+
+    // the ranges are compared per pixel, interpolating between the depths of different surfaces would move the boundary
+    texture->setFilter(osg::Texture2DArray::MIN_FILTER,osg::Texture2DArray::NEAREST);
+    texture->setFilter(osg::Texture2DArray::MAG_FILTER,osg::Texture2DArray::NEAREST);
+    texture->setWrap(osg::Texture2DArray::WRAP_S,osg::Texture2DArray::CLAMP_TO_EDGE);
+    texture->setWrap(osg::Texture2DArray::WRAP_T,osg::Texture2DArray::CLAMP_TO_EDGE);
+    return texture;
+}
+
+osg::ref_ptr<osg::Camera> ParametricScene::createDepthRangeCamera(osg::Texture2DArray* depthRangeTexture, unsigned int layer)
+{
+    osg::ref_ptr<osg::Camera> camera = createRTTCamera(depthRangeTexture->getTextureWidth(), depthRangeTexture->getTextureHeight());
+    camera->attach(osg::Camera::COLOR_BUFFER, depthRangeTexture, 0, layer);
+
+    // no depth buffer, every fragment of the boundary is blended into the range
+    camera->setImplicitBufferAttachmentMask(0, 0);
+
+    // r holds the negated nearest depth and g the furthest depth, cleared to the empty range used for pixels the boundary doesn't cover
+    camera->setClearMask(GL_COLOR_BUFFER_BIT);
+    camera->setClearColor(s_emptyDepthRange);
+
+    osg::StateSet* stateset = camera->getOrCreateStateSet();
+    stateset->setMode(GL_DEPTH_TEST, osg::StateAttribute::OFF | osg::StateAttribute::OVERRIDE);
+    stateset->setMode(GL_CULL_FACE, osg::StateAttribute::OFF | osg::StateAttribute::OVERRIDE);
+    stateset->setAttributeAndModes(new osg::BlendEquation(osg::BlendEquation::RGBA_MAX), osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE);
+    stateset->setDefine("DEPTH_RANGE_PASS");
+    stateset->setDefine("DEPTH_ONLY");
+
+    return camera;
+}
+
+void ParametricScene::setupRenderStateSet(Subgraph* sgToExclude, osg::StateSet* stateset)
 {
-    Textures backFaceDepthTextures, frontFaceDepthTextures;
+    stateset->addUniform(_viewportDimensions.get());
+    if (hasReducedResolutionDepth()) stateset->setDefine("CONSERVATIVE_DEPTH");
 
+    // the boundaries are numbered in order for the screen tiles, which each view slot binds and fills on every cull,
+    // with depth texture pairs only the first few clip
+    int maxNumBoundaries = (_depthCaptureMode==DEPTH_RANGE_ARRAY) ? INT_MAX : static_cast<int>(s_maxDepthTexturePairs);
+    int numBoundaries = 0;
+    int excludedBoundary = -1;
     for(Subgraphs::iterator itr = _subgraphs.begin();
-        itr != _subgraphs.end();
+        itr != _subgraphs.end() && numBoundaries<maxNumBoundaries;
         ++itr)
     {
-        Subgraph* sg = itr->get();
-        if (sg!=sgToExclude)
+        if (!isBoundary(itr->get())) continue;
+        if (itr->get()==sgToExclude) excludedBoundary = numBoundaries;
+        ++numBoundaries;
+    }
+
+    if (_boundaryTileSize>0 && numBoundaries>0)
+    {
+        stateset->addUniform(new osg::Uniform("boundaryTiles", static_cast<int>(_boundaryTileTextureUnit)));
+        stateset->addUniform(new osg::Uniform("excludedBoundary", static_cast<float>(excludedBoundary)));
+        stateset->setDefine("BOUNDARY_TILES");
+    }
+
+    if (_depthCaptureMode==DEPTH_RANGE_ARRAY)
+    {
+        if (_depthRangeTexture.valid())
         {
-            if (sg->frontTexture) frontFaceDepthTextures.push_back(sg->frontTexture.get());
-            if (sg->backTexture) backFaceDepthTextures.push_back(sg->backTexture.get());
+            stateset->setTextureAttribute(0, _depthRangeTexture.get());
+            stateset->addUniform(new osg::Uniform("depthRanges", 0));
+            stateset->addUniform(new osg::Uniform("numDepthRanges", static_cast<int>(_depthRangeTexture->getTextureDepth())));
+            stateset->addUniform(new osg::Uniform("excludedDepthRange", sgToExclude ? sgToExclude->depthRangeLayer : -1));
+            stateset->addUniform(new osg::Uniform("depthRangeResolutionScale", getDepthRangeResolutionScale()));
+            stateset->setDefine("DEPTH_RANGE_ARRAY");
         }
+
+        stateset->setDefine("NUM_DEPTH_TEXTURES", "0");
+        return;
+    }
+
+    // the same first boundaries as are numbered above, less this subgraph's own
+    Subgraphs boundaries;
+    int index = 0;
+    for(Subgraphs::iterator itr = _subgraphs.begin();
+        itr != _subgraphs.end() && index<numBoundaries;
+        ++itr)
+    {
+        Subgraph* sg = itr->get();
+        if (!isBoundary(sg)) continue;
+        ++index;
+        if (sg!=sgToExclude) boundaries.push_back(sg);
     }
 
     std::stringstream name;
     int unit=0;
-    unsigned int numDepthTextures = std::min(backFaceDepthTextures.size(), frontFaceDepthTextures.size());
+    unsigned int numDepthTextures = static_cast<unsigned int>(boundaries.size());
     for(unsigned int i=0; i<numDepthTextures; ++i)
     {
         name<<"frontDepthTexture"<<i;
-        stateset->setTextureAttribute(unit, frontFaceDepthTextures[i].get());
+        stateset->setTextureAttribute(unit, boundaries[i]->frontTexture.get());
         stateset->addUniform(new osg::Uniform(name.str().c_str(), unit));
 
         name.str("");
         ++unit;
 
         name<<"backDepthTexture"<<i;
-        stateset->setTextureAttribute(unit, backFaceDepthTextures[i].get());
+        stateset->setTextureAttribute(unit, boundaries[i]->backTexture.get());
         stateset->addUniform(new osg::Uniform(name.str().c_str(), unit));
 
         name.str("");
         ++unit;
+
+        name<<"depthResolutionScale"<<i;
+        stateset->addUniform(new osg::Uniform(name.str().c_str(), _depthResolutionScale*boundaries[i]->depthResolutionScale));
+
+        name.str("");
     }
 
     name.str("");
     name<<numDepthTextures;
     stateset->setDefine("NUM_DEPTH_TEXTURES", name.str());
-
-    stateset->addUniform(new osg::Uniform("viewportDimensions",osg::Vec4(0.0f,0.0f,static_cast<float>(width),static_cast<float>(height))));
 }
 
 
@@ -278,12 +2052,123 @@ void ParametricScene::setupRenderStateSet(Subgraph* sgToExclude, osg::StateSet*
 #include <osgDB/InputStream>
 #include <osgDB/OutputStream>
 
+// the render and depth passes, the callbacks and the view slots are all generated by setup(), so rather than the osg::Node and
+// osg::Group serializers, which would write them out, only the scene's StateSet, node mask, subgraphs and extra children are written
+static bool checkSubgraphs( const osgParametric::ParametricScene& /*ps*/ )
+{
+    return true;
+}
+
+static bool readSubgraphs( osgDB::InputStream& is, osgParametric::ParametricScene& ps )
+{
+    unsigned int size = is.readSize(); is >> is.BEGIN_BRACKET;
+    for ( unsigned int i=0; i<size; ++i )
+    {
+        osg::ref_ptr<osg::Node> subgraph = is.readObjectOfType<osg::Node>();
+
+        bool requiresRenderSubgraph = false, requiresDepthSubgraph = false;
+        float depthResolutionScale = 1.0f;
+        DEF_GLENUM(depthFormat);
+        is >> is.PROPERTY("RequiresRenderSubgraph") >> requiresRenderSubgraph;
+        is >> is.PROPERTY("RequiresDepthSubgraph") >> requiresDepthSubgraph;
+        is >> is.PROPERTY("DepthResolutionScale") >> depthResolutionScale;
+        is >> is.PROPERTY("DepthFormat") >> depthFormat;
+
+        if ( subgraph.valid() )
+        {
+            ps.addSubgraph( subgraph, requiresRenderSubgraph, requiresDepthSubgraph, depthResolutionScale );
+            ps.setSubgraphDepthFormat( subgraph.get(), depthFormat.get() );
+        }
+    }
+    is >> is.END_BRACKET;
+
+    // the passes are generated on the first frame, or when the application calls setup() after changing the settings
+    ps.addUpdateCallback( new osgParametric::SetupCallback );
+    return true;
+}
+
+static bool writeSubgraphs( osgDB::OutputStream& os, const osgParametric::ParametricScene& ps )
+{
+    unsigned int size = ps.getNumSubgraphs();
+    os.writeSize(size); os << os.BEGIN_BRACKET << std::endl;
+    for ( unsigned int i=0; i<size; ++i )
+    {
+        os << ps.getSubgraph(i);
+        os << os.PROPERTY("RequiresRenderSubgraph") << ps.getSubgraphRequiresRenderSubgraph(i) << std::endl;
+        os << os.PROPERTY("RequiresDepthSubgraph") << ps.getSubgraphRequiresDepthSubgraph(i) << std::endl;
+        os << os.PROPERTY("DepthResolutionScale") << ps.getSubgraphDepthResolutionScale(i) << std::endl;
+        os << os.PROPERTY("DepthFormat") << GLENUM(ps.getSubgraphDepthFormat(i)) << std::endl;
+    }
+    os << os.END_BRACKET << std::endl;
+    return true;
+}
+
+static bool checkChildren( const osgParametric::ParametricScene& ps )
+{
+    for ( unsigned int i=0; i<ps.getNumChildren(); ++i )
+    {
+        if ( !ps.isPassGroup(ps.getChild(i)) ) return true;
+    }
+    return false;
+}
+
+static bool readChildren( osgDB::InputStream& is, osgParametric::ParametricScene& ps )
+{
+    unsigned int size = is.readSize(); is >> is.BEGIN_BRACKET;
+    for ( unsigned int i=0; i<size; ++i )
+    {
+        osg::ref_ptr<osg::Node> child = is.readObjectOfType<osg::Node>();
+        if ( child.valid() ) ps.addChild( child.get() );
+    }
+    is >> is.END_BRACKET;
+    return true;
+}
+
+static bool writeChildren( osgDB::OutputStream& os, const osgParametric::ParametricScene& ps )
+{
+    unsigned int size = 0;
+    for ( unsigned int i=0; i<ps.getNumChildren(); ++i )
+    {
+        if ( !ps.isPassGroup(ps.getChild(i)) ) ++size;
+    }
+
+    os.writeSize(size); os << os.BEGIN_BRACKET << std::endl;
+    for ( unsigned int i=0; i<ps.getNumChildren(); ++i )
+    {
+        if ( !ps.isPassGroup(ps.getChild(i)) ) os << ps.getChild(i);
+    }
+    os << os.END_BRACKET << std::endl;
+    return true;
+}
+
 REGISTER_OBJECT_WRAPPER( ParametricScene,
                          new osgParametric::ParametricScene,
                          osgParametric::ParametricScene,
-                         "osg::Object osg::Node osgParametric::ParametricScene osg::Group" )
+                         "osg::Object osgParametric::ParametricScene" )
 {
     ADD_UINT_SERIALIZER( Width, 0 );
     ADD_UINT_SERIALIZER( Height, 0 );
+    ADD_UINT_SERIALIZER( BoundsSampleDensity, 256 );
+    ADD_FLOAT_SERIALIZER( BoundsMargin, 0.05f );
+    ADD_FLOAT_SERIALIZER( DepthResolutionScale, 1.0f );
+    ADD_UINT_SERIALIZER( BoundaryTileSize, 16 );
+    ADD_UINT_SERIALIZER( BoundaryTileTextureUnit, 14 );
+    ADD_BOOL_SERIALIZER( CollectPassTimes, false );
+    ADD_BOOL_SERIALIZER( UseAnalyticNormals, true );
+    ADD_UINT_SERIALIZER( MaxNumViewSlots, 16 );
+    ADD_UINT_SERIALIZER( ViewSlotIdleFrames, 60 );
+    ADD_GLENUM_SERIALIZER( DepthTextureFormat, GLenum, GL_DEPTH_COMPONENT24 );
+
+    BEGIN_ENUM_SERIALIZER( DepthCaptureMode, DEPTH_TEXTURE_PAIRS );
+        ADD_ENUM_VALUE( DEPTH_TEXTURE_PAIRS );
+        ADD_ENUM_VALUE( DEPTH_RANGE_ARRAY );
+    END_ENUM_SERIALIZER();
+
+    ADD_OBJECT_SERIALIZER( StateSet, osg::StateSet, NULL );
+    ADD_HEXINT_SERIALIZER( NodeMask, 0xffffffff );
+
+    // read last, as reading the subgraphs installs the SetupCallback
+    ADD_USER_SERIALIZER( Children );
+    ADD_USER_SERIALIZER( Subgraphs );
 }
 
@@ -3,13 +3,29 @@
  * This application is open source is published under GNU GPL license.
 */
 
+#ifndef OSGPARAMETRIC_PARAMETRICSCENE
+#define OSGPARAMETRIC_PARAMETRICSCENE 1
+
 #include <osgParametric/Export>
+#include <osgParametric/SurfaceFunction.h>
+#include <osgParametric/SurfaceGeometry.h>
+#include <osgParametric/SurfaceLOD.h>
+#include <osgParametric/ProgramCache.h>
+#include <osgParametric/PassTimer.h>
+#include <osgParametric/RenderTargetPool.h>
 
 #include <osg/CullFace>
+#include <osg/BlendEquation>
 #include <osg/Depth>
 #include <osg/Texture2D>
+#include <osg/Texture2DArray>
 #include <osg/Camera>
+#include <OpenThreads/Atomic>
+
+#include <map>
+
 
+namespace osgUtil { class CullVisitor; }
 
 namespace osgParametric
 {
@@ -39,19 +55,98 @@ struct parameter_ptr
 
 };
 
+/** State ParametricScene keeps for each CullVisitor that culls it, so views and cull threads never share depth textures.
+  * Viewers that double buffer their SceneViews, as the DrawThreadPerContext threading models do, cull each view with two
+  * CullVisitors that alternate between frames, and so use two slots per view.*/
+class ViewSlot : public osg::Referenced
+{
+    public:
+
+        ViewSlot() : projectionMatrix(0), width(0), height(0), generation(0), lastCullFrame(0), boundaryTileSize(0) {}
+
+        typedef std::map< osg::ref_ptr<osg::Texture>, osg::ref_ptr<osg::Texture> > TextureCopies;
+
+        // the CullVisitor the slot belongs to, claimed with a compare and swap on its first cull
+        OpenThreads::AtomicPtr          owner;
+
+        // set once the slot's subgraphs have been created, the slot is only read by other threads after that
+        OpenThreads::Atomic             ready;
+
+        // projection of the camera culling the scene, owned by the CullVisitor which clamps it to the computed near/far
+        // once the cull completes, so the depth cameras render with exactly the projection of the main camera
+        osg::RefMatrix*                 projectionMatrix;
+
+        unsigned int                    width;
+        unsigned int                    height;
+
+        // ParametricScene's generation the slot was last copied from, the slot is updated when the passes change
+        unsigned int                    generation;
+
+        // frame number of the owner's last cull, written by the owner's cull and read by the update traversal
+        unsigned int                    lastCullFrame;
+
+        osg::ref_ptr<osg::Uniform>      viewportDimensions;
+
+        // screen tiles holding the number of boundaries whose projected bounds miss each tile and the sum of their indices,
+        // refilled on every cull, and the scale from the viewport's texture coordinates to the tiles
+        unsigned int                    boundaryTileSize;
+        osg::ref_ptr<osg::Texture2D>    boundaryTiles;
+        osg::ref_ptr<osg::Uniform>      boundaryTileScale;
+
+        osg::ref_ptr<osg::Group>        renderSubgraph;
+        osg::ref_ptr<osg::Group>        depthSubgraph;
+
+        // the slot's render targets acquired from the RenderTargetPool, keyed by the scene's texture they stand in for
+        TextureCopies                   textures;
+
+    protected:
+
+        virtual ~ViewSlot() {}
+};
+
 class RTTCameraCullCallback : public osg::NodeCallback
 {
     public:
 
-        RTTCameraCullCallback() {}
+        RTTCameraCullCallback(PassTimer* timer=0, const ViewSlot* slot=0) : _timer(timer), _slot(slot) {}
+
+        /** Set the timer that records the time spent culling the camera's subgraph.*/
+        void setPassTimer(PassTimer* timer) { _timer = timer; }
+        PassTimer* getPassTimer() const { return _timer.get(); }
+
+        /** Set the slot providing the projection matrix the camera's subgraph is rendered with.*/
+        void setViewSlot(const ViewSlot* slot) { _slot = slot; }
+        const ViewSlot* getViewSlot() const { return _slot; }
 
         virtual void operator()(osg::Node* node, osg::NodeVisitor* nv);
 
     protected:
 
         virtual ~RTTCameraCullCallback() {}
+
+        osg::ref_ptr<PassTimer> _timer;
+        const ViewSlot*         _slot;
+};
+
+/** Cull callback for one of ParametricScene's render subgraphs, records the time taken to cull it and the triangles it adds to the render stage.*/
+class RenderSubgraphCullCallback : public osg::NodeCallback
+{
+    public:
+
+        RenderSubgraphCullCallback(PassTimer* timer) : _timer(timer) {}
+
+        PassTimer* getPassTimer() const { return _timer.get(); }
+
+        virtual void operator()(osg::Node* node, osg::NodeVisitor* nv);
+
+    protected:
+
+        virtual ~RenderSubgraphCullCallback() {}
+
+        osg::ref_ptr<PassTimer> _timer;
 };
 
+/** Cull callback of ParametricScene, culls the subgraphs of the view's ViewSlot and adds the bound of the subgraphs to the computed near/far.*/
 class NearFarCallback : public osg::NodeCallback
 {
     public:
@@ -67,6 +162,77 @@ class NearFarCallback : public osg::NodeCallback
         virtual ~NearFarCallback() {}
 };
 
+/** Event callback that resizes ParametricScene's depth textures to follow the window it's rendered to.*/
+class ViewportResizeCallback : public osg::NodeCallback
+{
+    public:
+
+        ViewportResizeCallback() {}
+
+        virtual void operator()(osg::Node* node, osg::NodeVisitor* nv);
+
+    protected:
+
+        virtual ~ViewportResizeCallback() {}
+};
+
+/** Update callback that keeps the bounds of surfaces animated by osg_SimulationTime in step with the simulation time.*/
+class SurfaceBoundsCallback : public osg::NodeCallback
+{
+    public:
+
+        SurfaceBoundsCallback() {}
+
+        virtual void operator()(osg::Node* node, osg::NodeVisitor* nv);
+
+    protected:
+
+        virtual ~SurfaceBoundsCallback() {}
+};
+
+/** Update callback added to a ParametricScene read from file, which runs setup() on the first update traversal
+  * unless the application has already called it, then removes itself.*/
+class SetupCallback : public osg::NodeCallback
+{
+    public:
+
+        SetupCallback() {}
+
+        virtual void operator()(osg::Node* node, osg::NodeVisitor* nv);
+
+    protected:
+
+        virtual ~SetupCallback() {}
+};
+
+/** Update callback that applies the changes made by ParametricScene's addSubgraph(), removeSubgraph() and updateSubgraph() once setup() has been called.*/
+class ApplyChangesCallback : public osg::NodeCallback
+{
+    public:
+
+        ApplyChangesCallback() {}
+
+        virtual void operator()(osg::Node* node, osg::NodeVisitor* nv);
+
+    protected:
+
+        virtual ~ApplyChangesCallback() {}
+};
+
+/** Update callback that publishes ParametricScene's pass timings to the osg::Stats assigned by ParametricScene::setStats().*/
+class PublishStatsCallback : public osg::NodeCallback
+{
+    public:
+
+        PublishStatsCallback() {}
+
+        virtual void operator()(osg::Node* node, osg::NodeVisitor* nv);
+
+    protected:
+
+        virtual ~PublishStatsCallback() {}
+};
+
 class OSGPARAMETRIC_EXPORT ParametricScene : public osg::Group
 {
 public:
@@ -80,57 +246,363 @@ public:
 
     void setDimensions(unsigned int w, unsigned int h) { _width = w; _height = h; }
 
+    /** Resize the depth textures, reusing the existing texture and camera objects, and update the viewportDimensions uniform.
+      * Called by ViewportResizeCallback when the window is resized, once setup() has been called.*/
+    void resize(unsigned int width, unsigned int height);
+
     void setWidth(unsigned int w) { _width = w; }
     unsigned int getWidth() const { return _width; }
 
     void setHeight(unsigned int h) { _height = h; }
     unsigned int getHeight() const { return _height; }
 
-    void addSubgraph(parameter_ptr<osg::Node> subgraph, bool requiresRenderSubgraph, bool requiresDepthSubgraph);
+    /** Set the maximum number of samples along each axis of a SurfaceGeometry used to compute its displaced bound.*/
+    void setBoundsSampleDensity(unsigned int density) { _boundsSampleDensity = density; }
+    unsigned int getBoundsSampleDensity() const { return _boundsSampleDensity; }
+
+    /** Set the fraction of a surface's displacement range added above and below its sampled bound, to cover peaks that fall between samples.*/
+    void setBoundsMargin(float margin) { _boundsMargin = margin; }
+    float getBoundsMargin() const { return _boundsMargin; }
+
+    enum DepthCaptureMode
+    {
+        /** a front and a back face depth texture per boundary, each rendered by its own camera, parametric.frag handles up to four boundaries.*/
+        DEPTH_TEXTURE_PAIRS,
+        /** a single pass per boundary keeping its nearest and furthest depth through GL_MAX blending, written to one layer of a
+          * GL_RG32F Texture2DArray shared by all boundaries, so there is no limit on the number of boundaries.*/
+        DEPTH_RANGE_ARRAY
+    };
+
+    /** Set how the depths of the boundary subgraphs are captured, takes effect on the next setup().*/
+    void setDepthCaptureMode(DepthCaptureMode mode) { _depthCaptureMode = mode; }
+    DepthCaptureMode getDepthCaptureMode() const { return _depthCaptureMode; }
+
+    /** Set the cache of program binaries, setup() then replaces the osg::Program of the scene and its subgraphs by CachedProgram.*/
+    void setProgramCache(ProgramCache* cache) { _programCache = cache; }
+    ProgramCache* getProgramCache() const { return _programCache.get(); }
+
+    typedef std::vector< osg::ref_ptr<PassTimer> > PassTimers;
+
+    /** Set whether setup() gives each depth camera a PassTimer recording its cull, draw and GPU times and triangle count,
+      * and each render subgraph one recording its cull time and triangle count. The triangles are counted by the CountTrianglesCallback
+      * setup() gives the subgraphs' drawables, those with cull callbacks of their own aren't counted.*/
+    void setCollectPassTimes(bool flag) { _collectPassTimes = flag; }
+    bool getCollectPassTimes() const { return _collectPassTimes; }
+
+    /** Timers of the depth cameras, in rendering order, followed by those of the render subgraphs.*/
+    const PassTimers& getPassTimers() const { return _passTimers; }
+
+    /** Set the stats, usually the viewer's, that the pass timings are published to during the update traversal while
+      * stats->collectStats("parametric") is set. Requires setCollectPassTimes(true) before setup().*/
+    void setStats(osg::Stats* stats) { _stats = stats; }
+    osg::Stats* getStats() const { return _stats.get(); }
+
+    /** Publish the records of the frames before frameNumber that may have changed since the last call, along with
+      * the "Depth texture memory" and "Render target pool memory" attributes in megabytes. Called by PublishStatsCallback.*/
+    void publishStats(unsigned int frameNumber);
+
+    /** Memory used by the views' depth textures and depth range texture arrays in bytes, or by the scene's own textures until a view has culled the scene.*/
+    unsigned long long getDepthTextureMemory() const;
+
+    /** Set the pool the views acquire their depth textures from, which may be shared between scenes to share its memory budget.*/
+    void setRenderTargetPool(RenderTargetPool* pool) { _renderTargetPool = pool; }
+    RenderTargetPool* getRenderTargetPool() const { return _renderTargetPool.get(); }
+
+    /** Set the internal format of the boundaries' depth textures, GL_DEPTH_COMPONENT16, GL_DEPTH_COMPONENT24 or GL_DEPTH_COMPONENT32F,
+      * GL_DEPTH_COMPONENT24 by default. Takes effect on the next setup(), see setSubgraphDepthFormat() for the format of a single boundary.*/
+    void setDepthTextureFormat(GLenum format) { _depthTextureFormat = format; }
+    GLenum getDepthTextureFormat() const { return _depthTextureFormat; }
+
+    /** Set whether setup() adds the partial derivatives of the Z_FUNCTION, Z_BASE and Z_TOP defines as Z_DX/Z_DY, Z_BASE_DX/Z_BASE_DY
+      * and Z_TOP_DX/Z_TOP_DY defines, letting the shaders compute normals analytically. Without them normals use finite differences.
+      * Generated derivatives are tagged with a Z_FUNCTION_DERIVATIVES_SOURCE style user value on their StateSet, and are regenerated
+      * when that no longer matches the function, see dirtySurfaceFunctions(). Derivatives without the tag are left alone.*/
+    void setUseAnalyticNormals(bool flag) { _useAnalyticNormals = flag; }
+    bool getUseAnalyticNormals() const { return _useAnalyticNormals; }
+
+    /** Set the resolution of the depth textures relative to the viewport, applied to all boundaries on top of their own scale.*/
+    void setDepthResolutionScale(float scale) { _depthResolutionScale = scale; }
+    float getDepthResolutionScale() const { return _depthResolutionScale; }
+
+    /** Set the size in pixels of the screen tiles that the boundaries' projected bounds are binned over on each cull. Fragments in
+      * a tile that a boundary misses lie outside it, so are discarded before any depth is read. 16 by default, 0 disables the
+      * binning. Changes made after setup() are applied on the next update traversal.*/
+    void setBoundaryTileSize(unsigned int size);
+    unsigned int getBoundaryTileSize() const { return _boundaryTileSize; }
+
+    /** Set the texture unit the screen tiles are bound to, 14 by default to keep clear of the depth textures bound from unit 0
+      * and the HeightFieldTexture's unit 15.*/
+    void setBoundaryTileTextureUnit(unsigned int unit);
+    unsigned int getBoundaryTileTextureUnit() const { return _boundaryTileTextureUnit; }
+
+    /** Compute the range of screen tiles, columns by rows tiles of tileSize pixels from the window's origin, covered by the window
+      * coordinate bound of a boundary's bounding sphere padded by margin pixels. The range covers every tile when the sphere is
+      * invalid or reaches behind the eye. Returns false if the bound misses all the tiles.*/
+    static bool computeBoundaryTiles(const osg::BoundingSphere& bs, const osg::Matrixd& mvp, const osg::Vec4d& window, double tileSize, double margin,
+                                     int columns, int rows, int& c0, int& r0, int& c1, int& r1);
+
+    /** Add a subgraph. A boundary's depth is captured at depthResolutionScale times the depth resolution, when reduced
+      * parametric.frag only clips fragments that lie outside all of the 2x2 depth texels around them. With DEPTH_RANGE_ARRAY
+      * all boundaries share the texture array so the largest scale of the boundaries is used for all of them.
+      * Once setup() has been called only the passes of the new subgraph are created, see applyChanges().*/
+    void addSubgraph(parameter_ptr<osg::Node> subgraph, bool requiresRenderSubgraph, bool requiresDepthSubgraph, float depthResolutionScale=1.0f);
+
+    /** Remove a subgraph along with its render and depth passes, returns false if it hadn't been added.
+      * The depth textures of the other boundaries are kept, with DEPTH_RANGE_ARRAY the freed layer is cleared
+      * to the full depth range, so that it clips nothing, until it is reused by the next boundary added.*/
+    bool removeSubgraph(osg::Node* subgraph);
+
+    /** Change whether a subgraph is rendered and clips the others, and the scale of its depth textures, which are resized rather than recreated.
+      * Returns false if the subgraph hadn't been added.*/
+    bool updateSubgraph(osg::Node* subgraph, bool requiresRenderSubgraph, bool requiresDepthSubgraph, float depthResolutionScale=1.0f);
+
+    /** Set the internal format of a boundary's depth textures, 0 to use getDepthTextureFormat(). Lower precision formats halve the
+      * memory of boundaries that are far from the surfaces they clip. Doesn't apply to DEPTH_RANGE_ARRAY, whose ranges are stored as
+      * GL_RG32F. Returns false if the subgraph hadn't been added.*/
+    bool setSubgraphDepthFormat(osg::Node* subgraph, GLenum format);
+
+    /** Mark the bound of a subgraph as changed, e.g. after moving a boundary, so the computed near/far follows it.*/
+    void dirtySubgraph(osg::Node* subgraph);
+
+    /** Mark the Z_FUNCTION, Z_BASE or Z_TOP defines of the subgraphs as changed, so their derivative defines and the surface bounds
+      * are regenerated on the next update traversal.*/
+    void dirtySurfaceFunctions();
+
+    /** Bring the render StateSets, pass timers, surface bounds and view slots up to date after subgraphs have been added, removed or
+      * updated since setup(). Called during the update traversal by ApplyChangesCallback, so changes made between frames cost a single update.*/
+    void applyChanges();
 
     void setup();
 
+    /** Return true once setup() has been called, a ParametricScene read from file is set up by SetupCallback on its first update.*/
+    bool isSetup() const { return _isSetup; }
+
+    unsigned int getNumSubgraphs() const { return static_cast<unsigned int>(_subgraphs.size()); }
+
+    /** Get the subgraphs in the order they were added, along with the settings passed to addSubgraph(), updateSubgraph() and setSubgraphDepthFormat().*/
+    osg::Node* getSubgraph(unsigned int i) const { return _subgraphs[i]->subgraph.get(); }
+    bool getSubgraphRequiresRenderSubgraph(unsigned int i) const { return _subgraphs[i]->requiresRenderSubgraph; }
+    bool getSubgraphRequiresDepthSubgraph(unsigned int i) const { return _subgraphs[i]->requiresDepthSubgraph; }
+    float getSubgraphDepthResolutionScale(unsigned int i) const { return _subgraphs[i]->depthResolutionScale; }
+    GLenum getSubgraphDepthFormat(unsigned int i) const { return _subgraphs[i]->depthFormat; }
+
+    /** Return true if child is one of the render or depth pass groups that setup() adds, rather than a child added by the application.*/
+    bool isPassGroup(const osg::Node* child) const { return child==_renderSubgraph.get() || child==_depthSubgraph.get(); }
+
+    /** Set the number of CullVisitors, and so views, that can cull the scene, each gets its own depth textures and cameras.
+      * Takes effect on the next setup().*/
+    void setMaxNumViewSlots(unsigned int num) { _maxNumViewSlots = num; }
+    unsigned int getMaxNumViewSlots() const { return _maxNumViewSlots; }
+
+    /** Set the number of frames after which the slot of a CullVisitor that has stopped culling the scene, such as that of a closed view,
+      * is released along with its render targets so that another view can claim it. 0 keeps the slots until the next setup().*/
+    void setViewSlotIdleFrames(unsigned int frames) { _viewSlotIdleFrames = frames; }
+    unsigned int getViewSlotIdleFrames() const { return _viewSlotIdleFrames; }
+
+    /** Release the slots that haven't culled the scene in the last getViewSlotIdleFrames() frames, called by ApplyChangesCallback
+      * from the update traversal, which doesn't overlap the cull traversals.*/
+    void releaseIdleViewSlots(unsigned int frameNumber);
+
+    /** Return the slot of cv, claiming and creating a free slot on its first cull. Returns 0 if all the slots are in use.
+      * Lookups of existing slots are lock free and don't allocate.*/
+    ViewSlot* getOrCreateViewSlot(osgUtil::CullVisitor* cv);
+
+    /** Cull the subgraphs of slot in place of the shared render and depth subgraphs, called by NearFarCallback.*/
+    void cull(osgUtil::CullVisitor* cv, ViewSlot* slot);
+
+    /** Recompute the displaced bounds of the SurfaceGeometry in the subgraphs by evaluating their surface functions at simulationTime.
+      * If timeDependentOnly is true only surfaces animated by osg_SimulationTime are recomputed.*/
+    void updateSurfaceBounds(double simulationTime, bool timeDependentOnly);
+
+    /** Return true if setup() found how the shaders displace geometry and can reproduce it on the host, setting function to the
+      * surface function, or to 0 if the geometry isn't displaced. Heightfield surfaces and unparsable functions return false.*/
+    bool findSurfaceFunction(const SurfaceGeometry* geometry, osg::ref_ptr<SurfaceFunction>& function) const;
+
 protected:
 
     virtual ~ParametricScene();
 
     void init();
 
-    osg::ref_ptr<osg::Texture2D> createDepthTexture(unsigned int width, unsigned int height);
+    osg::ref_ptr<osg::Texture2D> createDepthTexture(unsigned int width, unsigned int height, bool reducedResolution, GLenum format);
+
+    unsigned int getScaledSize(unsigned int size, float scale) const;
+
+    float getDepthRangeResolutionScale() const;
+
+    bool hasReducedResolutionDepth() const;
+
+    osg::ref_ptr<osg::Camera> createRTTCamera(unsigned int width, unsigned int height);
 
     osg::ref_ptr<osg::Camera> createDepthCamera(parameter_ptr<osg::Texture> depthTexture, bool backFace);
 
+    osg::ref_ptr<osg::Texture2DArray> createDepthRangeTexture(unsigned int width, unsigned int height, unsigned int numLayers);
+
+    osg::ref_ptr<osg::Camera> createDepthRangeCamera(osg::Texture2DArray* depthRangeTexture, unsigned int layer);
+
     typedef std::vector< osg::ref_ptr<osg::Texture2D> > Textures;
 
 
     struct Subgraph : public osg::Referenced
     {
-        Subgraph(parameter_ptr<osg::Node> sg, bool rrs, bool rds);
+        Subgraph(parameter_ptr<osg::Node> sg, bool rrs, bool rds, float drs);
 
         osg::ref_ptr<osg::Node>         subgraph;
 
         bool                            requiresRenderSubgraph;
         bool                            requiresDepthSubgraph;
+        float                           depthResolutionScale;
 
         osg::ref_ptr<osg::Texture2D>    frontTexture;
         osg::ref_ptr<osg::Texture2D>    backTexture;
+
+        osg::ref_ptr<osg::Camera>       frontCamera;
+        osg::ref_ptr<osg::Camera>       backCamera;
+
+        // internal format of the depth textures, 0 for the scene's format
+        GLenum                          depthFormat;
+
+        // layer of the depth range texture when using DEPTH_RANGE_ARRAY, -1 if the subgraph isn't a boundary
+        int                             depthRangeLayer;
+
+        osg::ref_ptr<osg::Group>        renderGroup;
+
+        // unique for the lifetime of the ParametricScene, names the subgraph's passes
+        unsigned int                    id;
     };
 
     typedef std::vector< osg::ref_ptr<Subgraph> > Subgraphs;
 
-    void setupRenderStateSet(Subgraph* sgToExclude, osg::StateSet* stateset, unsigned int width, unsigned int height);
+    void resizeDepthCameras(osg::Group* depthSubgraph);
+
+    void updateDepthTextureSizes();
+
+    float getTextureScale(const osg::Texture* texture) const;
+
+    void setupViewSlot(ViewSlot* slot, unsigned int width, unsigned int height);
+
+    void releaseViewSlots();
+
+    void releaseViewSlot(ViewSlot* slot);
+
+    GLenum getDepthFormat(const Subgraph* sg) const;
+
+    void setupPassTimer(osg::Camera* camera, const std::string& name);
+
+    void setupRenderStateSet(Subgraph* sgToExclude, osg::StateSet* stateset);
+
+    bool isBoundary(const Subgraph* sg) const;
+
+    void updateBoundaryTiles(osgUtil::CullVisitor* cv, ViewSlot* slot);
 
     void setupRenderSubgraphs();
 
+    void addRenderPass(Subgraph* sg);
+
+    void removeRenderPass(Subgraph* sg);
+
+    void setupRenderStateSets();
+
     void setupDepthSubgraphs();
 
+    void addDepthPasses(Subgraph* sg);
+
+    void removeDepthPasses(Subgraph* sg);
+
+    void collectPassTimers();
+
+    void setupUpdateCallbacks();
+
+    enum DirtyMask
+    {
+        DIRTY_RENDER_STATESETS = 0x1,
+        DIRTY_PASS_TIMERS = 0x2,
+        DIRTY_SURFACES = 0x4,
+        DIRTY_BOUNDS = 0x8,
+        DIRTY_VIEW_SLOTS = 0x10,
+        DIRTY_SURFACE_FUNCTIONS = 0x20
+    };
+
+    struct SurfaceBound : public osg::Referenced
+    {
+        SurfaceBound(): heightField(false) {}
+
+        osg::ref_ptr<SurfaceGeometry>   geometry;
+        osg::ref_ptr<SurfaceFunction>   function;
+
+        // surfaces displaced by a HeightFieldTexture are bounded over the height range of its stream
+        bool                            heightField;
+        osg::Vec2                       heightRange;
+
+        // undisplaced sample positions, cached so per frame updates only need to evaluate the function
+        std::vector<float>              x;
+        std::vector<float>              y;
+        std::vector<float>              z;
+    };
+
+    typedef std::vector< osg::ref_ptr<SurfaceBound> > SurfaceBounds;
+
+    void setupDerivativeDefines();
+
+    void setupSurfaceBounds();
+
+    typedef std::map<std::string, osg::ref_ptr<SurfaceFunction> > FunctionMap;
+
+    osg::ref_ptr<SurfaceFunction> getSurfaceFunction(FunctionMap& functionMap, const osg::StateSet::DefineList& defines, const osg::StateSet::UniformList& uniforms, bool& valid);
+
+    /** Bound of a surface's samples displaced by its function, in the grid's own coordinates.*/
+    osg::BoundingBox computeDisplacedBound(SurfaceBound* sb, double simulationTime, std::vector<float>& displacements) const;
+
+    void updateNearFarBound();
+
     unsigned int _width;
     unsigned int _height;
 
+    unsigned int _boundsSampleDensity;
+    float _boundsMargin;
+    bool _useAnalyticNormals;
+    DepthCaptureMode _depthCaptureMode;
+    float _depthResolutionScale;
+    unsigned int _boundaryTileSize;
+    unsigned int _boundaryTileTextureUnit;
+    bool _collectPassTimes;
+
     Subgraphs _subgraphs;
 
+    SurfaceBounds _surfaceBounds;
+    osg::ref_ptr<NearFarCallback> _nearFarCallback;
+
     osg::ref_ptr<osg::Group> _renderSubgraph;
     osg::ref_ptr<osg::Group> _depthSubgraph;
+    osg::ref_ptr<osg::Texture2DArray> _depthRangeTexture;
+
+    // one camera per layer of the depth range texture, those without children clear layers freed by removed boundaries
+    typedef std::vector< osg::ref_ptr<osg::Camera> > Cameras;
+    Cameras _depthRangeCameras;
+    osg::ref_ptr<osg::Uniform> _viewportDimensions;
+
+    osg::ref_ptr<RenderTargetPool> _renderTargetPool;
+    GLenum _depthTextureFormat;
+
+    osg::ref_ptr<ProgramCache> _programCache;
+    PassTimers _passTimers;
+    osg::ref_ptr<osg::Stats> _stats;
+
+    typedef std::vector< osg::ref_ptr<ViewSlot> > ViewSlots;
+
+    // created by setup() and never resized afterwards, so cull threads can search it without locking
+    unsigned int _maxNumViewSlots;
+    unsigned int _viewSlotIdleFrames;
+    ViewSlots _viewSlots;
+    OpenThreads::Atomic _viewSlotsExhausted;
+
+    unsigned int _nextSubgraphId;
+    bool _isSetup;
+    unsigned int _dirtyMask;
+    unsigned int _generation;
+    double _simulationTime;
 };
 
-}
\ No newline at end of file
+}
+
+#endif
@@ -0,0 +1,372 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "PassTimer.h"
+
+#include <osg/State>
+#include <osg/FrameStamp>
+#include <osg/ContextData>
+#include <osg/Geometry>
+
+#include <osgUtil/CullVisitor>
+
+#include <OpenThreads/ScopedLock>
+
+#include <algorithm>
+
+#ifndef GL_TIMESTAMP
+    #define GL_TIMESTAMP 0x8E28
+#endif
+
+#ifndef GL_QUERY_RESULT
+    #define GL_QUERY_RESULT 0x8866
+#endif
+
+#ifndef GL_QUERY_RESULT_AVAILABLE
+    #define GL_QUERY_RESULT_AVAILABLE 0x8867
+#endif
+
+using namespace osgParametric;
+
+namespace
+{
+
+/** Deletes the timer queries of a context the next time the context flushes its deleted GL objects.*/
+class GLQueryObjectManager : public osg::GLObjectManager
+{
+public:
+
+    GLQueryObjectManager(unsigned int contextID): osg::GLObjectManager("GLQueryObjectManager", contextID) {}
+
+    virtual void deleteGLObject(GLuint globj)
+    {
+        const osg::GLExtensions* extensions = osg::GLExtensions::Get(_contextID, true);
+        if (extensions->isARBTimerQuerySupported) extensions->glDeleteQueries(1, &globj);
+    }
+};
+
+class BeginDrawCallback : public osg::Camera::DrawCallback
+{
+public:
+
+    BeginDrawCallback(PassTimer* timer): _timer(timer) {}
+
+    virtual void operator () (osg::RenderInfo& renderInfo) const { _timer->beginDraw(renderInfo); }
+
+    // released along with the camera, the end callback shares the timer so only the begin callback passes it on
+    virtual void releaseGLObjects(osg::State* state=0) const
+    {
+        _timer->releaseGLObjects(state);
+        osg::Camera::DrawCallback::releaseGLObjects(state);
+    }
+
+protected:
+
+    osg::ref_ptr<PassTimer> _timer;
+};
+
+class EndDrawCallback : public osg::Camera::DrawCallback
+{
+public:
+
+    EndDrawCallback(PassTimer* timer): _timer(timer) {}
+
+    virtual void operator () (osg::RenderInfo& renderInfo) const { _timer->endDraw(renderInfo); }
+
+protected:
+
+    osg::ref_ptr<PassTimer> _timer;
+};
+
+unsigned int getFrameNumber(const osg::State& state)
+{
+    return state.getFrameStamp() ? state.getFrameStamp()->getFrameNumber() : 0;
+}
+
+unsigned int countTriangles(const osg::PrimitiveSet& primitiveSet)
+{
+    unsigned int numIndices = primitiveSet.getNumIndices();
+    unsigned int numTriangles = 0;
+    switch(primitiveSet.getMode())
+    {
+        case(GL_TRIANGLES): numTriangles = numIndices/3; break;
+        case(GL_TRIANGLE_STRIP):
+        case(GL_TRIANGLE_FAN):
+        case(GL_POLYGON): numTriangles = numIndices>2 ? numIndices-2 : 0; break;
+        case(GL_QUADS): numTriangles = (numIndices/4)*2; break;
+        case(GL_QUAD_STRIP): numTriangles = numIndices>2 ? numIndices-2 : 0; break;
+        default: break;
+    }
+
+    // instanced primitive sets draw all their triangles once per instance
+    return numTriangles*static_cast<unsigned int>(std::max(1, primitiveSet.getNumInstances()));
+}
+
+}
+
+PassTimer::PassTimer(const std::string& name):
+    _name(name),
+    _maxNumRecords(256)
+{
+}
+
+PassTimer::~PassTimer()
+{
+    for(ContextDataMap::iterator itr = _contextData.begin();
+        itr != _contextData.end();
+        ++itr)
+    {
+        releaseQueries(itr->first, itr->second);
+    }
+}
+
+void PassTimer::attach(osg::Camera* camera)
+{
+    // the camera's own draw callbacks are kept, timed along with its drawing by running the begin first and the end last
+    osg::ref_ptr<osg::Camera::DrawCallback> beginDrawCallback = new BeginDrawCallback(this);
+    beginDrawCallback->setNestedCallback(camera->getInitialDrawCallback());
+    camera->setInitialDrawCallback(beginDrawCallback.get());
+
+    camera->addFinalDrawCallback(new EndDrawCallback(this));
+}
+
+PassTimer::Record* PassTimer::getOrCreateRecord(unsigned int frameNumber)
+{
+    Records::iterator itr = _records.find(frameNumber);
+    if (itr!=_records.end()) return &(itr->second);
+
+    // room is made before inserting, and a frame older than all those kept is dropped rather than evicting a newer one
+    if (_maxNumRecords==0) return 0;
+    if (_records.size()>=_maxNumRecords)
+    {
+        if (frameNumber<_records.begin()->first) return 0;
+        while(_records.size()>=_maxNumRecords) _records.erase(_records.begin());
+    }
+
+    return &(_records[frameNumber]);
+}
+
+void PassTimer::addCullTime(unsigned int frameNumber, double milliseconds)
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    Record* record = getOrCreateRecord(frameNumber);
+    if (record) record->cullTime += milliseconds;
+}
+
+void PassTimer::addTriangles(unsigned int frameNumber, unsigned int numTriangles)
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    Record* record = getOrCreateRecord(frameNumber);
+    if (record) record->numTriangles += numTriangles;
+}
+
+GLuint PassTimer::allocateQuery(const osg::GLExtensions* extensions, ContextData& data)
+{
+    if (!data.freeQueries.empty())
+    {
+        GLuint query = data.freeQueries.back();
+        data.freeQueries.pop_back();
+        return query;
+    }
+
+    GLuint query = 0;
+    extensions->glGenQueries(1, &query);
+    return query;
+}
+
+void PassTimer::beginDraw(osg::RenderInfo& renderInfo)
+{
+    osg::State& state = *renderInfo.getState();
+
+    // results of earlier frames are read back first so that queries are recycled
+    collectGPUResults(state);
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    ContextData& data = _contextData[state.getContextID()];
+    data.beginTick = osg::Timer::instance()->tick();
+    data.beginQuery = 0;
+
+    const osg::GLExtensions* extensions = state.get<osg::GLExtensions>();
+    if (extensions && extensions->isARBTimerQuerySupported)
+    {
+        data.beginQuery = allocateQuery(extensions, data);
+        extensions->glQueryCounter(data.beginQuery, GL_TIMESTAMP);
+    }
+}
+
+void PassTimer::endDraw(osg::RenderInfo& renderInfo)
+{
+    osg::State& state = *renderInfo.getState();
+    unsigned int frameNumber = getFrameNumber(state);
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    ContextData& data = _contextData[state.getContextID()];
+
+    Record* record = getOrCreateRecord(frameNumber);
+    if (record) record->drawTime += osg::Timer::instance()->delta_m(data.beginTick, osg::Timer::instance()->tick());
+
+    if (data.beginQuery!=0)
+    {
+        const osg::GLExtensions* extensions = state.get<osg::GLExtensions>();
+
+        PendingQuery query;
+        query.frameNumber = frameNumber;
+        query.begin = data.beginQuery;
+        query.end = allocateQuery(extensions, data);
+        extensions->glQueryCounter(query.end, GL_TIMESTAMP);
+
+        data.pending.push_back(query);
+        data.beginQuery = 0;
+    }
+}
+
+void PassTimer::collectGPUResults(osg::State& state, bool wait)
+{
+    const osg::GLExtensions* extensions = state.get<osg::GLExtensions>();
+    if (!extensions || !extensions->isARBTimerQuerySupported) return;
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    ContextData& data = _contextData[state.getContextID()];
+    while(!data.pending.empty())
+    {
+        PendingQuery& query = data.pending.front();
+
+        // the queries complete in order, so only the end of the oldest pass needs checking
+        if (!wait)
+        {
+            GLint available = 0;
+            extensions->glGetQueryObjectiv(query.end, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) break;
+        }
+
+        GLuint64 begin = 0;
+        GLuint64 end = 0;
+        extensions->glGetQueryObjectui64v(query.begin, GL_QUERY_RESULT, &begin);
+        extensions->glGetQueryObjectui64v(query.end, GL_QUERY_RESULT, &end);
+
+        Record* record = getOrCreateRecord(query.frameNumber);
+        if (record) record->gpuTime = std::max(record->gpuTime, 0.0) + static_cast<double>(end-begin)*1e-6;
+
+        data.freeQueries.push_back(query.begin);
+        data.freeQueries.push_back(query.end);
+        data.pending.pop_front();
+    }
+}
+
+void PassTimer::releaseQueries(unsigned int contextID, ContextData& data)
+{
+    // the context may not be current, so the queries are deleted when it next flushes its deleted GL objects
+    GLQueryObjectManager* manager = osg::get<GLQueryObjectManager>(contextID);
+
+    for(std::vector<GLuint>::iterator itr = data.freeQueries.begin();
+        itr != data.freeQueries.end();
+        ++itr)
+    {
+        manager->scheduleGLObjectForDeletion(*itr);
+    }
+
+    for(PendingQueries::iterator itr = data.pending.begin();
+        itr != data.pending.end();
+        ++itr)
+    {
+        manager->scheduleGLObjectForDeletion(itr->begin);
+        manager->scheduleGLObjectForDeletion(itr->end);
+    }
+
+    if (data.beginQuery!=0) manager->scheduleGLObjectForDeletion(data.beginQuery);
+
+    data = ContextData();
+}
+
+void PassTimer::releaseGLObjects(osg::State* state)
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    if (state)
+    {
+        ContextDataMap::iterator itr = _contextData.find(state->getContextID());
+        if (itr==_contextData.end()) return;
+
+        releaseQueries(itr->first, itr->second);
+        _contextData.erase(itr);
+    }
+    else
+    {
+        for(ContextDataMap::iterator itr = _contextData.begin();
+            itr != _contextData.end();
+            ++itr)
+        {
+            releaseQueries(itr->first, itr->second);
+        }
+        _contextData.clear();
+    }
+}
+
+bool PassTimer::getRecord(unsigned int frameNumber, Record& record) const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    Records::const_iterator itr = _records.find(frameNumber);
+    if (itr==_records.end()) return false;
+
+    record = itr->second;
+    return true;
+}
+
+PassTimer::Records PassTimer::getRecords() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    return _records;
+}
+
+bool PassTimer::publish(osg::Stats* stats, unsigned int frameNumber) const
+{
+    Record record;
+    if (!getRecord(frameNumber, record)) return false;
+
+    stats->setAttribute(frameNumber, _name+" cull time", record.cullTime);
+    stats->setAttribute(frameNumber, _name+" draw time", record.drawTime);
+    if (record.gpuTime>=0.0) stats->setAttribute(frameNumber, _name+" GPU time", record.gpuTime);
+    stats->setAttribute(frameNumber, _name+" triangles", static_cast<double>(record.numTriangles));
+    return true;
+}
+
+CountTrianglesCallback* CountTrianglesCallback::instance()
+{
+    static osg::ref_ptr<CountTrianglesCallback> s_callback = new CountTrianglesCallback;
+    return s_callback.get();
+}
+
+bool CountTrianglesCallback::cull(osg::NodeVisitor* nv, osg::Drawable* drawable, osg::RenderInfo*) const
+{
+    TriangleCount* count = dynamic_cast<TriangleCount*>(nv->getUserData());
+    if (!count) return false;
+
+    // the view frustum and small feature test the CullVisitor makes after its drawables' cull callbacks, so that only the
+    // drawables it accepts are counted
+    osgUtil::CullVisitor* cv = dynamic_cast<osgUtil::CullVisitor*>(nv);
+    if (cv && drawable->isCullingActive() && cv->isCulled(drawable->getBoundingBox())) return true;
+
+    count->addTriangles(countTriangles(drawable));
+    return false;
+}
+
+unsigned int CountTrianglesCallback::countTriangles(const osg::Drawable* drawable)
+{
+    const osg::Geometry* geometry = drawable ? drawable->asGeometry() : 0;
+    if (!geometry) return 0;
+
+    unsigned int numTriangles = 0;
+    for(unsigned int i=0; i<geometry->getNumPrimitiveSets(); ++i)
+    {
+        numTriangles += ::countTriangles(*geometry->getPrimitiveSet(i));
+    }
+    return numTriangles;
+}
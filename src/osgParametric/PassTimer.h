@@ -0,0 +1,158 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_PASSTIMER
+#define OSGPARAMETRIC_PASSTIMER 1
+
+#include <osgParametric/Export>
+
+#include <osg/Camera>
+#include <osg/Drawable>
+#include <osg/RenderInfo>
+#include <osg/GLExtensions>
+#include <osg/Timer>
+#include <osg/Stats>
+#include <OpenThreads/Mutex>
+
+#include <map>
+#include <vector>
+#include <list>
+#include <string>
+
+namespace osgParametric
+{
+
+/** Per frame CPU cull, CPU draw and GPU times and triangle count of one rendering pass, such as a depth camera or the main camera.
+  * The GPU time comes from GL_TIMESTAMP queries issued around the camera's drawing, their results are read back
+  * without stalling a few frames later so the GPU time of a frame is only available once it has been collected.*/
+class OSGPARAMETRIC_EXPORT PassTimer : public osg::Referenced
+{
+public:
+
+    PassTimer(const std::string& name);
+
+    const std::string& getName() const { return _name; }
+
+    /** Times in milliseconds, gpuTime is negative until the query results have been read back or if timer queries aren't supported.*/
+    struct Record
+    {
+        Record(): cullTime(0.0), drawTime(0.0), gpuTime(-1.0), numTriangles(0) {}
+
+        double          cullTime;
+        double          drawTime;
+        double          gpuTime;
+        unsigned int    numTriangles;
+    };
+
+    typedef std::map<unsigned int, Record> Records;
+
+    /** Set the number of frames kept, older records are discarded.*/
+    void setMaxNumRecords(unsigned int num) { _maxNumRecords = num; }
+    unsigned int getMaxNumRecords() const { return _maxNumRecords; }
+
+    /** Chain initial and final draw callbacks on camera that time its drawing, ahead of and after any it already has.*/
+    void attach(osg::Camera* camera);
+
+    void addCullTime(unsigned int frameNumber, double milliseconds);
+
+    void addTriangles(unsigned int frameNumber, unsigned int numTriangles);
+
+    void beginDraw(osg::RenderInfo& renderInfo);
+    void endDraw(osg::RenderInfo& renderInfo);
+
+    /** Read back the available timer query results for the context of state, if wait is set block until all are available.*/
+    void collectGPUResults(osg::State& state, bool wait=false);
+
+    /** Release the timer queries of the context of state, or of every context if state is null. Results still pending are lost.*/
+    void releaseGLObjects(osg::State* state=0);
+
+    bool getRecord(unsigned int frameNumber, Record& record) const;
+
+    Records getRecords() const;
+
+    /** Set the cull, draw and GPU times and triangle count of frameNumber on stats as the attributes
+      * "<name> cull time", "<name> draw time", "<name> GPU time" and "<name> triangles", returns false if there's no record.*/
+    bool publish(osg::Stats* stats, unsigned int frameNumber) const;
+
+protected:
+
+    virtual ~PassTimer();
+
+    /** Get the record of frameNumber, or null if the frame is older than all of the getMaxNumRecords() frames kept.*/
+    Record* getOrCreateRecord(unsigned int frameNumber);
+
+    struct PendingQuery
+    {
+        unsigned int    frameNumber;
+        GLuint          begin;
+        GLuint          end;
+    };
+
+    typedef std::list<PendingQuery> PendingQueries;
+
+    struct ContextData
+    {
+        ContextData(): beginTick(0), beginQuery(0) {}
+
+        std::vector<GLuint>     freeQueries;
+        PendingQueries          pending;
+        osg::Timer_t            beginTick;
+        GLuint                  beginQuery;
+    };
+
+    typedef std::map<unsigned int, ContextData> ContextDataMap;
+
+    GLuint allocateQuery(const osg::GLExtensions* extensions, ContextData& data);
+
+    void releaseQueries(unsigned int contextID, ContextData& data);
+
+    std::string                 _name;
+    unsigned int                _maxNumRecords;
+
+    mutable OpenThreads::Mutex  _mutex;
+    Records                     _records;
+    ContextDataMap              _contextData;
+};
+
+/** Triangles counted while culling one pass, set as the CullVisitor's user data by the pass's cull callback for the duration
+  * of its traversal.*/
+class OSGPARAMETRIC_EXPORT TriangleCount : public osg::Referenced
+{
+public:
+
+    TriangleCount(): _numTriangles(0) {}
+
+    void addTriangles(unsigned int numTriangles) { _numTriangles += numTriangles; }
+    unsigned int getNumTriangles() const { return _numTriangles; }
+
+protected:
+
+    virtual ~TriangleCount() {}
+
+    unsigned int _numTriangles;
+};
+
+/** Drawable cull callback adding the triangles of the drawables the CullVisitor accepts to the TriangleCount of the pass being
+  * culled, if any. ParametricScene gives it to the drawables of its subgraphs that have no cull callback of their own when
+  * collecting pass times, SurfaceLOD and PagedSurface to the geometry they create while culling.*/
+class OSGPARAMETRIC_EXPORT CountTrianglesCallback : public osg::DrawableCullCallback
+{
+public:
+
+    static CountTrianglesCallback* instance();
+
+    virtual bool cull(osg::NodeVisitor* nv, osg::Drawable* drawable, osg::RenderInfo* renderInfo) const;
+
+    /** Number of triangles drawn by drawable, counting each instance of instanced primitive sets.*/
+    static unsigned int countTriangles(const osg::Drawable* drawable);
+
+protected:
+
+    virtual ~CountTrianglesCallback() {}
+};
+
+}
+
+#endif
@@ -0,0 +1,446 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "ProgramCache.h"
+
+#include <osg/GLExtensions>
+#include <osg/GraphicsContext>
+#include <osg/Drawable>
+#include <osg/State>
+
+#include <osgDB/FileUtils>
+#include <osgDB/FileNameUtils>
+
+#include <OpenThreads/ScopedLock>
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+    #define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#endif
+
+using namespace osgParametric;
+
+namespace
+{
+
+// bump when the file layout or the contents of the keys change
+const char* s_cacheVersion = "osgParametric program cache 1";
+
+// 64 bit FNV-1a, only used to name the files, the full key is stored in each file and checked on reading
+std::string hashKey(const std::string& key)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for(std::string::const_iterator itr = key.begin(); itr != key.end(); ++itr)
+    {
+        hash ^= static_cast<unsigned char>(*itr);
+        hash *= 1099511628211ULL;
+    }
+
+    std::ostringstream str;
+    str<<std::hex<<std::setw(16)<<std::setfill('0')<<hash;
+    return str.str();
+}
+
+void writeUInt(std::ostream& out, unsigned int value)
+{
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+bool readUInt(std::istream& in, unsigned int& value)
+{
+    in.read(reinterpret_cast<char*>(&value), sizeof(value));
+    return in.good();
+}
+
+std::string getGLString(GLenum name)
+{
+    const GLubyte* str = glGetString(name);
+    return str ? std::string(reinterpret_cast<const char*>(str)) : std::string();
+}
+
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// ProgramCache
+//
+ProgramCache::ProgramCache(const std::string& directory):
+    _directory(directory),
+    _numHits(0),
+    _numMisses(0)
+{
+    if (!osgDB::fileExists(_directory)) osgDB::makeDirectory(_directory);
+}
+
+ProgramCache::~ProgramCache()
+{
+}
+
+void ProgramCache::recordHit()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    ++_numHits;
+}
+
+void ProgramCache::recordMiss()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    ++_numMisses;
+}
+
+std::string ProgramCache::createKey(osg::State& state, const osg::Program& program, const std::string& defineString)
+{
+    std::string driver;
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+        DriverStrings::iterator itr = _driverStrings.find(state.getContextID());
+        if (itr==_driverStrings.end())
+        {
+            driver = getGLString(GL_VENDOR) + "\n" + getGLString(GL_RENDERER) + "\n" + getGLString(GL_VERSION);
+            _driverStrings[state.getContextID()] = driver;
+        }
+        else driver = itr->second;
+    }
+
+    std::ostringstream key;
+    key<<s_cacheVersion<<"\n"<<driver<<"\n"<<defineString<<"\n";
+
+    for(unsigned int i=0; i<program.getNumShaders(); ++i)
+    {
+        const osg::Shader* shader = program.getShader(i);
+        key<<shader->getTypename()<<"\n"<<shader->getShaderSource()<<"\n";
+    }
+
+    const osg::Program::AttribBindingList& attribBindings = program.getAttribBindingList();
+    for(osg::Program::AttribBindingList::const_iterator itr = attribBindings.begin(); itr != attribBindings.end(); ++itr)
+    {
+        key<<"attribute "<<itr->first<<" "<<itr->second<<"\n";
+    }
+
+    const osg::Program::FragDataBindingList& fragDataBindings = program.getFragDataBindingList();
+    for(osg::Program::FragDataBindingList::const_iterator itr = fragDataBindings.begin(); itr != fragDataBindings.end(); ++itr)
+    {
+        key<<"fragdata "<<itr->first<<" "<<itr->second<<"\n";
+    }
+
+    return key.str();
+}
+
+std::string ProgramCache::getFileName(const std::string& key) const
+{
+    return osgDB::concatPaths(_directory, hashKey(key)+".bin");
+}
+
+osg::ref_ptr<osg::ProgramBinary> ProgramCache::read(const std::string& key) const
+{
+    std::ifstream in(getFileName(key).c_str(), std::ios::in | std::ios::binary);
+    if (!in) return 0;
+
+    unsigned int keyLength = 0;
+    if (!readUInt(in, keyLength) || keyLength!=key.size()) return 0;
+
+    std::string storedKey(keyLength, '\0');
+    in.read(&storedKey[0], keyLength);
+    if (!in || storedKey!=key) return 0;
+
+    unsigned int format = 0;
+    unsigned int size = 0;
+    if (!readUInt(in, format) || !readUInt(in, size) || size==0) return 0;
+
+    std::vector<unsigned char> data(size);
+    in.read(reinterpret_cast<char*>(&data.front()), size);
+    if (in.gcount()!=static_cast<std::streamsize>(size)) return 0;
+
+    osg::ref_ptr<osg::ProgramBinary> binary = new osg::ProgramBinary;
+    binary->setFormat(format);
+    binary->assign(size, &data.front());
+    return binary;
+}
+
+bool ProgramCache::write(const std::string& key, const osg::ProgramBinary& binary) const
+{
+    if (binary.getSize()==0) return false;
+
+    // written to a temporary file and renamed so other processes sharing the cache never read a partial file
+    std::string fileName = getFileName(key);
+    std::string tempFileName = fileName+".tmp";
+    {
+        std::ofstream out(tempFileName.c_str(), std::ios::out | std::ios::binary);
+        if (!out) return false;
+
+        writeUInt(out, static_cast<unsigned int>(key.size()));
+        out.write(key.data(), key.size());
+        writeUInt(out, binary.getFormat());
+        writeUInt(out, binary.getSize());
+        out.write(reinterpret_cast<const char*>(binary.getData()), binary.getSize());
+        if (!out) return false;
+    }
+
+    std::remove(fileName.c_str());
+    return std::rename(tempFileName.c_str(), fileName.c_str())==0;
+}
+
+void ProgramCache::remove(const std::string& key) const
+{
+    std::remove(getFileName(key).c_str());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CachedProgram
+//
+CachedProgram::CachedProgram()
+{
+}
+
+CachedProgram::CachedProgram(const osg::Program& program, ProgramCache* cache):
+    osg::Program(program, osg::CopyOp::SHALLOW_COPY),
+    _cache(cache)
+{
+}
+
+CachedProgram::CachedProgram(const CachedProgram& program, const osg::CopyOp& copyop):
+    osg::Program(program, copyop),
+    _cache(program._cache)
+{
+}
+
+CachedProgram::~CachedProgram()
+{
+}
+
+osg::Program* CachedProgram::getCachedVariant(osg::State& state, const std::string& defineString) const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_variantMutex);
+
+    // variants that missed the cache are remembered as null so the cache is only read once
+    VariantKey variantKey(state.getContextID(), defineString);
+    Variants::iterator itr = _variants.find(variantKey);
+    if (itr!=_variants.end())
+    {
+        if (!itr->second || !itr->second->getPCP(state)->needsLink()) return itr->second.get();
+
+        // an edited shader dirties the private program too, whose binary is then out of date
+        itr->second->releaseGLObjects(&state);
+        _variants.erase(itr);
+    }
+
+    osg::ref_ptr<osg::Program>& variant = _variants[variantKey];
+
+    std::string key = _cache->createKey(state, *this, defineString);
+    osg::ref_ptr<osg::ProgramBinary> binary = _cache->read(key);
+    if (!binary) return 0;
+
+    // osg::Program links from its binary when it has one, this private copy keeps the binary for good so it's only linked once
+    osg::ref_ptr<osg::Program> program = new osg::Program(*this, osg::CopyOp::SHALLOW_COPY);
+    program->setProgramBinary(binary.get());
+    program->apply(state);
+
+    if (!program->getPCP(state)->isLinked())
+    {
+        OSG_INFO<<"CachedProgram : cached binary rejected by the driver, compiling from source"<<std::endl;
+        program->releaseGLObjects(&state);
+        _cache->remove(key);
+        return 0;
+    }
+
+    _cache->recordHit();
+    variant = program;
+    return variant.get();
+}
+
+void CachedProgram::apply(osg::State& state) const
+{
+    if (!_cache || isFixedFunction() || getProgramBinary())
+    {
+        osg::Program::apply(state);
+        return;
+    }
+
+    PerContextProgram* pcp = getPCP(state);
+    if (!pcp->needsLink())
+    {
+        osg::Program::apply(state);
+        return;
+    }
+
+    // this program's own PerContextProgram is left unlinked for variants found in the cache, they're drawn by their private program
+    osg::Program* variant = getCachedVariant(state, pcp->getDefineString());
+    if (variant)
+    {
+        variant->apply(state);
+        return;
+    }
+
+    _cache->recordMiss();
+
+    const osg::GLExtensions* extensions = state.get<osg::GLExtensions>();
+    if (extensions && extensions->glProgramParameteri)
+    {
+        extensions->glProgramParameteri(pcp->getHandle(), GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+
+    osg::Program::apply(state);
+
+    if (pcp->isLinked())
+    {
+        osg::ref_ptr<osg::ProgramBinary> linked = pcp->compileProgramBinary(state);
+        if (linked.valid()) _cache->write(_cache->createKey(state, *this, pcp->getDefineString()), *linked);
+    }
+}
+
+void CachedProgram::resizeGLObjectBuffers(unsigned int maxSize)
+{
+    osg::Program::resizeGLObjectBuffers(maxSize);
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_variantMutex);
+    for(Variants::iterator itr = _variants.begin(); itr != _variants.end(); ++itr)
+    {
+        if (itr->second.valid()) itr->second->resizeGLObjectBuffers(maxSize);
+    }
+}
+
+void CachedProgram::releaseGLObjects(osg::State* state) const
+{
+    osg::Program::releaseGLObjects(state);
+
+    // released variants are read from the cache again when next applied
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_variantMutex);
+    for(Variants::iterator itr = _variants.begin(); itr != _variants.end();)
+    {
+        if (!state || itr->first.first==state->getContextID())
+        {
+            if (itr->second.valid()) itr->second->releaseGLObjects(state);
+            _variants.erase(itr++);
+        }
+        else ++itr;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// UseProgramCacheVisitor
+//
+UseProgramCacheVisitor::UseProgramCacheVisitor(ProgramCache* cache):
+    osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN),
+    _cache(cache)
+{
+}
+
+void UseProgramCacheVisitor::apply(osg::Node& node)
+{
+    apply(node.getStateSet());
+    traverse(node);
+}
+
+void UseProgramCacheVisitor::apply(osg::Drawable& drawable)
+{
+    apply(drawable.getStateSet());
+}
+
+void UseProgramCacheVisitor::apply(osg::StateSet* stateset)
+{
+    if (!stateset) return;
+
+    const osg::StateSet::RefAttributePair* pair = stateset->getAttributePair(osg::StateAttribute::PROGRAM);
+    osg::Program* program = pair ? dynamic_cast<osg::Program*>(pair->first.get()) : 0;
+    if (!program) return;
+
+    // programs read from file are already CachedProgram, but without a cache
+    CachedProgram* cachedProgram = dynamic_cast<CachedProgram*>(program);
+    if (cachedProgram)
+    {
+        if (!cachedProgram->getProgramCache()) cachedProgram->setProgramCache(_cache.get());
+        return;
+    }
+
+    // programs shared between StateSets stay shared
+    ProgramMap::iterator itr = _programMap.find(program);
+    if (itr==_programMap.end())
+    {
+        itr = _programMap.insert(ProgramMap::value_type(program, new CachedProgram(*program, _cache.get()))).first;
+    }
+
+    stateset->setAttribute(itr->second.get(), pair->second);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// CompileProgramsOperation
+//
+namespace
+{
+
+// Accumulates the StateSets down to each drawable and applies them, so every program is linked with the defines it will be drawn with.
+class CompileProgramsVisitor : public osg::NodeVisitor
+{
+public:
+
+    CompileProgramsVisitor(osg::State& state):
+        osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN),
+        _state(state) {}
+
+    virtual void apply(osg::Node& node)
+    {
+        if (node.getStateSet()) _state.pushStateSet(node.getStateSet());
+
+        traverse(node);
+
+        if (node.getStateSet()) _state.popStateSet();
+    }
+
+    virtual void apply(osg::Drawable& drawable)
+    {
+        if (drawable.getStateSet()) _state.pushStateSet(drawable.getStateSet());
+
+        _state.apply();
+
+        if (drawable.getStateSet()) _state.popStateSet();
+    }
+
+protected:
+
+    osg::State& _state;
+};
+
+}
+
+CompileProgramsOperation::CompileProgramsOperation(osg::Node* subgraph):
+    osg::GraphicsOperation("CompileProgramsOperation", false),
+    _subgraph(subgraph)
+{
+}
+
+void CompileProgramsOperation::operator () (osg::GraphicsContext* context)
+{
+    osg::State* state = context ? context->getState() : 0;
+    if (!state || !_subgraph) return;
+
+    CompileProgramsVisitor visitor(*state);
+    _subgraph->accept(visitor);
+
+    state->popAllStateSets();
+    state->apply();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  Serializers for CachedProgram, the cache itself is set up by the application
+//
+#include <osgDB/ObjectWrapper>
+#include <osgDB/InputStream>
+#include <osgDB/OutputStream>
+
+REGISTER_OBJECT_WRAPPER( CachedProgram,
+                         new osgParametric::CachedProgram,
+                         osgParametric::CachedProgram,
+                         "osg::Object osg::StateAttribute osg::Program osgParametric::CachedProgram" )
+{
+}
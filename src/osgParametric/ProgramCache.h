@@ -0,0 +1,147 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_PROGRAMCACHE
+#define OSGPARAMETRIC_PROGRAMCACHE 1
+
+#include <osgParametric/Export>
+
+#include <osg/Program>
+#include <osg/NodeVisitor>
+#include <osg/GraphicsThread>
+#include <OpenThreads/Mutex>
+
+#include <map>
+#include <string>
+
+namespace osgParametric
+{
+
+/** On disk cache of linked program binaries, one file per program variant. A variant is keyed on the shader sources, the define
+  * string OSG compiles them with and the GL vendor, renderer and version strings, so editing a shader or updating the driver
+  * simply misses the cache. Binaries the driver rejects are removed and the variant is compiled from source.*/
+class OSGPARAMETRIC_EXPORT ProgramCache : public osg::Referenced
+{
+public:
+
+    ProgramCache(const std::string& directory);
+
+    const std::string& getDirectory() const { return _directory; }
+
+    /** Key for the variant of program compiled with defineString in the current context of state.*/
+    std::string createKey(osg::State& state, const osg::Program& program, const std::string& defineString);
+
+    /** Read the binary stored for key, returns 0 on a cache miss.*/
+    osg::ref_ptr<osg::ProgramBinary> read(const std::string& key) const;
+
+    /** Write the binary for key, returns false if the cache directory isn't writable.*/
+    bool write(const std::string& key, const osg::ProgramBinary& binary) const;
+
+    /** Remove the binary stored for key.*/
+    void remove(const std::string& key) const;
+
+    unsigned int getNumHits() const { return _numHits; }
+    unsigned int getNumMisses() const { return _numMisses; }
+
+    void recordHit();
+    void recordMiss();
+
+protected:
+
+    virtual ~ProgramCache();
+
+    std::string getFileName(const std::string& key) const;
+
+    typedef std::map<unsigned int, std::string> DriverStrings;
+
+    std::string                 _directory;
+
+    OpenThreads::Mutex          _mutex;
+    DriverStrings               _driverStrings;
+    unsigned int                _numHits;
+    unsigned int                _numMisses;
+};
+
+/** Program that loads each of its define variants from a ProgramCache before linking, and stores newly linked variants in it.
+  * A variant found in the cache is linked once per context from its binary by a private osg::Program sharing the shaders,
+  * which is then applied in place of this program for that variant.*/
+class OSGPARAMETRIC_EXPORT CachedProgram : public osg::Program
+{
+public:
+
+    CachedProgram();
+
+    /** Create a CachedProgram sharing the shaders and settings of program.*/
+    CachedProgram(const osg::Program& program, ProgramCache* cache);
+
+    /** Copy constructor using CopyOp to manage deep vs shallow copy. */
+    CachedProgram(const CachedProgram& program, const osg::CopyOp& copyop=osg::CopyOp::SHALLOW_COPY);
+
+    META_StateAttribute(osgParametric, CachedProgram, PROGRAM);
+
+    void setProgramCache(ProgramCache* cache) { _cache = cache; }
+    ProgramCache* getProgramCache() const { return _cache.get(); }
+
+    virtual void apply(osg::State& state) const;
+
+    virtual void resizeGLObjectBuffers(unsigned int maxSize);
+    virtual void releaseGLObjects(osg::State* state=0) const;
+
+protected:
+
+    virtual ~CachedProgram();
+
+    /** Return the program linked from the cached binary of the variant with defineString, loading it on first use,
+      * or 0 if the variant isn't in the cache or the driver rejects its binary.*/
+    osg::Program* getCachedVariant(osg::State& state, const std::string& defineString) const;
+
+    typedef std::pair<unsigned int, std::string> VariantKey;
+    typedef std::map< VariantKey, osg::ref_ptr<osg::Program> > Variants;
+
+    osg::ref_ptr<ProgramCache>      _cache;
+
+    // variants are looked up by context and define string from each context's draw thread
+    mutable OpenThreads::Mutex      _variantMutex;
+    mutable Variants                _variants;
+};
+
+/** Replaces the osg::Program in the StateSets of a subgraph by CachedProgram using the given cache.*/
+class OSGPARAMETRIC_EXPORT UseProgramCacheVisitor : public osg::NodeVisitor
+{
+public:
+
+    UseProgramCacheVisitor(ProgramCache* cache);
+
+    virtual void apply(osg::Node& node);
+    virtual void apply(osg::Drawable& drawable);
+
+    void apply(osg::StateSet* stateset);
+
+protected:
+
+    typedef std::map< osg::Program*, osg::ref_ptr<CachedProgram> > ProgramMap;
+
+    osg::ref_ptr<ProgramCache>  _cache;
+    ProgramMap                  _programMap;
+};
+
+/** Compiles and links every program variant used by a subgraph, by applying the accumulated state of each drawable
+  * in the graphics context. Add it to a GraphicsContext, or call it with the context current, before the first frame.*/
+class OSGPARAMETRIC_EXPORT CompileProgramsOperation : public osg::GraphicsOperation
+{
+public:
+
+    CompileProgramsOperation(osg::Node* subgraph);
+
+    virtual void operator () (osg::GraphicsContext* context);
+
+protected:
+
+    osg::ref_ptr<osg::Node>     _subgraph;
+};
+
+}
+
+#endif
@@ -0,0 +1,166 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "RenderTargetPool.h"
+
+#include <osg/Texture2D>
+#include <osg/Texture2DArray>
+#include <osg/Notify>
+#include <OpenThreads/ScopedLock>
+
+#include <algorithm>
+
+using namespace osgParametric;
+
+RenderTargetPool::RenderTargetPool():
+    _memoryBudget(0),
+    _overBudget(false)
+{
+}
+
+RenderTargetPool::~RenderTargetPool()
+{
+}
+
+void RenderTargetPool::setMemoryBudget(unsigned long long budget)
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    _memoryBudget = budget;
+    evict(0);
+}
+
+osg::ref_ptr<osg::Texture> RenderTargetPool::acquire(const osg::Texture* prototype, unsigned int width, unsigned int height, int depth)
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    // most recently released first, as it's the most likely to still be resident
+    for(ReleasedTargets::reverse_iterator itr = _released.rbegin();
+        itr != _released.rend();
+        ++itr)
+    {
+        if (!matches(itr->first.get(), prototype, width, height, depth)) continue;
+
+        osg::ref_ptr<osg::Texture> target = itr->first;
+        unsigned long long memory = itr->second;
+        _released.erase(--(itr.base()));
+
+        // sampling may differ between boundaries sharing a size and format
+        for(int i=osg::Texture::MIN_FILTER; i<=osg::Texture::MAG_FILTER; ++i)
+        {
+            osg::Texture::FilterParameter parameter = static_cast<osg::Texture::FilterParameter>(i);
+            if (target->getFilter(parameter)!=prototype->getFilter(parameter)) target->setFilter(parameter, prototype->getFilter(parameter));
+        }
+
+        _inUse[target] = memory;
+        _usage.memoryReleased -= memory;
+        _usage.memoryInUse += memory;
+        --_usage.numReleased;
+        ++_usage.numInUse;
+        return target;
+    }
+
+    osg::ref_ptr<osg::Texture> target = osg::clone(prototype, osg::CopyOp::SHALLOW_COPY);
+    setTextureSize(target.get(), width, height, depth);
+
+    unsigned long long memory = computeMemory(target.get());
+    evict(memory);
+
+    _inUse[target] = memory;
+    _usage.memoryInUse += memory;
+    ++_usage.numInUse;
+    return target;
+}
+
+void RenderTargetPool::release(osg::Texture* target)
+{
+    if (!target) return;
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    TargetsInUse::iterator itr = _inUse.find(target);
+    if (itr==_inUse.end()) return;
+
+    _released.push_back(ReleasedTargets::value_type(itr->first, itr->second));
+
+    _usage.memoryInUse -= itr->second;
+    _usage.memoryReleased += itr->second;
+    --_usage.numInUse;
+    ++_usage.numReleased;
+
+    _inUse.erase(itr);
+}
+
+void RenderTargetPool::flush()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    _usage.numEvicted += _usage.numReleased;
+    _usage.memoryReleased = 0;
+    _usage.numReleased = 0;
+    _released.clear();
+}
+
+RenderTargetPool::Usage RenderTargetPool::getUsage() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    return _usage;
+}
+
+void RenderTargetPool::evict(unsigned long long memoryRequired)
+{
+    if (_memoryBudget==0) return;
+
+    // the texture objects are deleted by their contexts once the last reference to the texture has gone
+    while(!_released.empty() && _usage.memoryInUse+_usage.memoryReleased+memoryRequired>_memoryBudget)
+    {
+        _usage.memoryReleased -= _released.front().second;
+        --_usage.numReleased;
+        ++_usage.numEvicted;
+        _released.pop_front();
+    }
+
+    bool overBudget = _usage.memoryInUse+_usage.memoryReleased+memoryRequired>_memoryBudget;
+    if (overBudget && !_overBudget)
+    {
+        OSG_NOTICE<<"RenderTargetPool : "<<(_usage.memoryInUse+memoryRequired)/(1024*1024)<<"MB of render targets in use exceeds the budget of "<<_memoryBudget/(1024*1024)<<"MB"<<std::endl;
+    }
+    _overBudget = overBudget;
+}
+
+bool RenderTargetPool::matches(const osg::Texture* target, const osg::Texture* prototype, unsigned int width, unsigned int height, int depth) const
+{
+    return target->getTextureTarget()==prototype->getTextureTarget() &&
+           target->getInternalFormat()==prototype->getInternalFormat() &&
+           target->getTextureWidth()==static_cast<int>(width) &&
+           target->getTextureHeight()==static_cast<int>(height) &&
+           std::max(1, target->getTextureDepth())==std::max(1, depth);
+}
+
+unsigned long long RenderTargetPool::computeMemory(const osg::Texture* texture)
+{
+    unsigned long long bytesPerTexel = 4;
+    switch(texture->getInternalFormat())
+    {
+        case(GL_DEPTH_COMPONENT16): bytesPerTexel = 2; break;
+        case(GL_RG32F): bytesPerTexel = 8; break;
+        default: break;
+    }
+    return static_cast<unsigned long long>(texture->getTextureWidth())*texture->getTextureHeight()*std::max(1, texture->getTextureDepth())*bytesPerTexel;
+}
+
+void RenderTargetPool::setTextureSize(osg::Texture* texture, unsigned int width, unsigned int height, int depth)
+{
+    if (texture->getTextureWidth()==static_cast<int>(width) && texture->getTextureHeight()==static_cast<int>(height) &&
+        std::max(1, texture->getTextureDepth())==std::max(1, depth)) return;
+
+    osg::Texture2D* texture2D = dynamic_cast<osg::Texture2D*>(texture);
+    if (texture2D) texture2D->setTextureSize(width, height);
+
+    osg::Texture2DArray* textureArray = dynamic_cast<osg::Texture2DArray*>(texture);
+    if (textureArray) textureArray->setTextureSize(width, height, depth);
+
+    texture->dirtyTextureObject();
+}
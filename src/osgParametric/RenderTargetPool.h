@@ -0,0 +1,88 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_RENDERTARGETPOOL
+#define OSGPARAMETRIC_RENDERTARGETPOOL 1
+
+#include <osgParametric/Export>
+
+#include <osg/Texture>
+#include <OpenThreads/Mutex>
+
+#include <map>
+#include <list>
+
+namespace osgParametric
+{
+
+/** Pool of the textures the views render their boundary depths to, handed out by size, number of layers and internal format.
+  * Released targets are kept for reuse, e.g. when a window is resized back or a boundary is re-added, and the least recently
+  * released are evicted once the memory of all the targets exceeds the budget. Targets in use are never evicted, so the budget
+  * can be exceeded when the views need more than it allows, which is reported once each time it happens.
+  * Memory is counted once per texture, a texture used by several graphics contexts is allocated in each of them.*/
+class OSGPARAMETRIC_EXPORT RenderTargetPool : public osg::Referenced
+{
+public:
+
+    RenderTargetPool();
+
+    /** Set the memory of all the targets in bytes, in use and released, that the pool evicts released targets to stay within, 0 for no limit.*/
+    void setMemoryBudget(unsigned long long budget);
+    unsigned long long getMemoryBudget() const { return _memoryBudget; }
+
+    /** Return a target of the same type, internal format and sampling as prototype with the given size, reusing a released one if there is one.*/
+    osg::ref_ptr<osg::Texture> acquire(const osg::Texture* prototype, unsigned int width, unsigned int height, int depth);
+
+    /** Return target to the pool, textures not acquired from the pool are ignored.*/
+    void release(osg::Texture* target);
+
+    /** Evict all the released targets.*/
+    void flush();
+
+    struct Usage
+    {
+        Usage(): memoryInUse(0), memoryReleased(0), numInUse(0), numReleased(0), numEvicted(0) {}
+
+        unsigned long long  memoryInUse;
+        unsigned long long  memoryReleased;
+        unsigned int        numInUse;
+        unsigned int        numReleased;
+
+        // number of targets evicted since the pool was created
+        unsigned int        numEvicted;
+    };
+
+    Usage getUsage() const;
+
+    /** Memory of a texture in bytes, 24 bit depth is assumed to be padded to 32 bits as most drivers do.*/
+    static unsigned long long computeMemory(const osg::Texture* texture);
+
+    /** Set the size of a Texture2D or Texture2DArray, doing nothing if it's unchanged.*/
+    static void setTextureSize(osg::Texture* texture, unsigned int width, unsigned int height, int depth);
+
+protected:
+
+    virtual ~RenderTargetPool();
+
+    bool matches(const osg::Texture* target, const osg::Texture* prototype, unsigned int width, unsigned int height, int depth) const;
+
+    void evict(unsigned long long memoryRequired);
+
+    typedef std::map< osg::ref_ptr<osg::Texture>, unsigned long long > TargetsInUse;
+
+    // ordered from the least to the most recently released
+    typedef std::list< std::pair< osg::ref_ptr<osg::Texture>, unsigned long long > > ReleasedTargets;
+
+    mutable OpenThreads::Mutex  _mutex;
+    unsigned long long          _memoryBudget;
+    TargetsInUse                _inUse;
+    ReleasedTargets             _released;
+    Usage                       _usage;
+    bool                        _overBudget;
+};
+
+}
+
+#endif
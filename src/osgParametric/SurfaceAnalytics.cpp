@@ -0,0 +1,393 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "SurfaceAnalytics.h"
+#include "ThreadPool.h"
+#include "BoundaryClipper.h"
+
+#include <osg/NodeVisitor>
+#include <osg/Notify>
+
+#include <cmath>
+#include <algorithm>
+
+using namespace osgParametric;
+
+namespace
+{
+
+class CollectGridsVisitor : public osg::NodeVisitor
+{
+public:
+
+    struct Entry
+    {
+        osg::ref_ptr<SurfaceGeometry>   geometry;
+        osg::Matrixd                    localToWorld;
+    };
+
+    CollectGridsVisitor():
+        osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN) {}
+
+    virtual void apply(osg::Drawable& drawable)
+    {
+        SurfaceGeometry* geometry = dynamic_cast<SurfaceGeometry*>(&drawable);
+        if (!geometry || geometry->getType()==SurfaceGeometry::SIDE_WALLS || geometry->getType()==SurfaceGeometry::SOLID) return;
+        if (geometry->getUCells()==0 || geometry->getVCells()==0) return;
+
+        Entry entry;
+        entry.geometry = geometry;
+        entry.localToWorld = osg::computeLocalToWorld(getNodePath());
+        entries.push_back(entry);
+    }
+
+    std::vector<Entry> entries;
+};
+
+/** Sums over the samples, with the same sums over every other sample in each direction for the error estimates.*/
+struct Sums
+{
+    Sums() { for(unsigned int i=0; i<6; ++i) values[i] = 0.0; }
+
+    enum { VOLUME=0, BASE_AREA=1, TOP_AREA=2, COARSE=3 };
+
+    double values[6];
+};
+
+}
+
+bool SurfaceAnalytics::Grid::sameGrid(const Grid& rhs) const
+{
+    return subgraph==rhs.subgraph &&
+           geometry->getType()==rhs.geometry->getType() &&
+           geometry->getOrigin()==rhs.geometry->getOrigin() &&
+           geometry->getUAxis()==rhs.geometry->getUAxis() &&
+           geometry->getVAxis()==rhs.geometry->getVAxis() &&
+           geometry->getUCells()==rhs.geometry->getUCells() &&
+           geometry->getVCells()==rhs.geometry->getVCells() &&
+           localToWorld==rhs.localToWorld;
+}
+
+class SurfaceAnalytics::IntegrateRowsTask : public ThreadPool::Task
+{
+public:
+
+    struct Surface
+    {
+        Surface(): function(0), offset(0.0) {}
+
+        const SurfaceFunction*  function;
+        osg::Vec3               origin;
+        double                  offset;
+    };
+
+    IntegrateRowsTask(const SurfaceGeometry* geometry, unsigned int columns, unsigned int rows, unsigned int grainSize, const Surface* base, const Surface* top,
+                      const BoundaryClipper* clipper, float simulationTime):
+        _geometry(geometry),
+        _columns(columns),
+        _rows(rows),
+        _grainSize(grainSize),
+        _base(base),
+        _top(top),
+        _clipper(clipper),
+        _simulationTime(simulationTime),
+        _sums((rows+grainSize)/grainSize)
+    {
+        osg::Vec3d n = geometry->getVerticalAxis();
+        _du = osg::Vec3d(geometry->getUAxis())/static_cast<double>(columns);
+        _dv = osg::Vec3d(geometry->getVAxis())/static_cast<double>(rows);
+        _verticalAxis = n;
+        _cellArea = (_du ^ _dv).length();
+    }
+
+    virtual void operator()(unsigned int begin, unsigned int end)
+    {
+        unsigned int numColumns = _columns+1;
+
+        // heights of the rows either side of the chunk are needed for the slopes at its edges
+        unsigned int firstRow = begin>0 ? begin-1 : 0;
+        unsigned int lastRow = std::min(end, _rows);
+        unsigned int numSamples = (lastRow-firstRow+1)*numColumns;
+
+        std::vector<float> baseHeights, topHeights;
+        if (_base) evaluate(*_base, firstRow, numSamples, baseHeights);
+        if (_top) evaluate(*_top, firstRow, numSamples, topHeights);
+
+        Sums& sums = _sums[begin/_grainSize];
+        BoundaryClipper::Query query;
+        const BoundaryClipper::Intervals& intervals = query.intervals;
+
+        for(unsigned int r=begin; r<end; ++r)
+        {
+            double rowWeight = (r==0 || r==_rows) ? 0.5 : 1.0;
+            bool coarseRow = (r%2)==0;
+
+            for(unsigned int c=0; c<numColumns; ++c)
+            {
+                double weight = rowWeight*((c==0 || c==_columns) ? 0.5 : 1.0);
+                double coarseWeight = (coarseRow && (c%2)==0) ? weight*4.0 : 0.0;
+
+                // the parts of the vertical line through the sample inside every boundary
+                _clipper->getIntervals(static_cast<double>(c), static_cast<double>(r), query);
+
+                double values[3] = { 0.0, 0.0, 0.0 };
+
+                unsigned int i = c+(r-firstRow)*numColumns;
+                if (_base && _top)
+                {
+                    double lower = std::min(baseHeights[i], topHeights[i]);
+                    double upper = std::max(baseHeights[i], topHeights[i]);
+                    if (lower==lower && upper==upper) values[Sums::VOLUME] = BoundaryClipper::getInsideLength(intervals, lower, upper)*_cellArea;
+                }
+                if (_base && BoundaryClipper::isInside(intervals, baseHeights[i])) values[Sums::BASE_AREA] = getAreaElement(baseHeights, firstRow, lastRow, c, r);
+                if (_top && BoundaryClipper::isInside(intervals, topHeights[i])) values[Sums::TOP_AREA] = getAreaElement(topHeights, firstRow, lastRow, c, r);
+
+                for(unsigned int j=0; j<3; ++j)
+                {
+                    sums.values[j] += values[j]*weight;
+                    sums.values[Sums::COARSE+j] += values[j]*coarseWeight;
+                }
+            }
+        }
+    }
+
+    Sums getSums() const
+    {
+        Sums total;
+        for(std::vector<Sums>::const_iterator itr = _sums.begin(); itr != _sums.end(); ++itr)
+        {
+            for(unsigned int i=0; i<6; ++i) total.values[i] += itr->values[i];
+        }
+        return total;
+    }
+
+protected:
+
+    /** Heights above the plane of the base of numSamples vertices from the start of firstRow.*/
+    void evaluate(const Surface& surface, unsigned int firstRow, unsigned int numSamples, std::vector<float>& heights) const
+    {
+        heights.assign(numSamples, 0.0f);
+
+        if (surface.function)
+        {
+            // the same single precision positions parametric.vert passes the function
+            std::vector<float> x(numSamples), y(numSamples), z(numSamples);
+            for(unsigned int i=0; i<numSamples; ++i)
+            {
+                unsigned int c = i%(_columns+1);
+                unsigned int r = firstRow+i/(_columns+1);
+                osg::Vec3 p = surface.origin + _geometry->getUAxis()*(static_cast<float>(c)/static_cast<float>(_columns)) +
+                                               _geometry->getVAxis()*(static_cast<float>(r)/static_cast<float>(_rows));
+                x[i] = p.x(); y[i] = p.y(); z[i] = p.z();
+            }
+
+            surface.function->evaluate(numSamples, &x.front(), &y.front(), &z.front(), _simulationTime, &heights.front());
+        }
+
+        if (surface.offset!=0.0)
+        {
+            for(unsigned int i=0; i<numSamples; ++i) heights[i] += static_cast<float>(surface.offset);
+        }
+    }
+
+    /** Area of the displaced surface per unit of the sample grid at a vertex, using central differences for the slopes.*/
+    double getAreaElement(const std::vector<float>& heights, unsigned int firstRow, unsigned int lastRow, unsigned int c, unsigned int r) const
+    {
+        unsigned int numColumns = _columns+1;
+        unsigned int c0 = c>0 ? c-1 : c;
+        unsigned int c1 = c<_columns ? c+1 : c;
+        unsigned int r0 = r>firstRow ? r-1 : r;
+        unsigned int r1 = r<lastRow ? r+1 : r;
+
+        double dhdu = (heights[c1+(r-firstRow)*numColumns] - heights[c0+(r-firstRow)*numColumns])/static_cast<double>(c1-c0);
+        double dhdv = (heights[c+(r1-firstRow)*numColumns] - heights[c+(r0-firstRow)*numColumns])/static_cast<double>(r1-r0);
+
+        double area = ((_du + _verticalAxis*dhdu) ^ (_dv + _verticalAxis*dhdv)).length();
+        return area==area ? area : 0.0;
+    }
+
+    const SurfaceGeometry*                  _geometry;
+    unsigned int                            _columns;
+    unsigned int                            _rows;
+    unsigned int                            _grainSize;
+    const Surface*                          _base;
+    const Surface*                          _top;
+    const BoundaryClipper*                  _clipper;
+    float                                   _simulationTime;
+
+    osg::Vec3d                              _du;
+    osg::Vec3d                              _dv;
+    osg::Vec3d                              _verticalAxis;
+    double                                  _cellArea;
+
+    std::vector<Sums>                       _sums;
+};
+
+SurfaceAnalytics::SurfaceAnalytics(ParametricScene* scene):
+    _scene(scene),
+    _samplesPerCell(1),
+    _clipToBoundaries(true)
+{
+}
+
+SurfaceAnalytics::~SurfaceAnalytics()
+{
+}
+
+void SurfaceAnalytics::collectGrids(ParametricScene* scene, Grids& grids) const
+{
+    for(unsigned int i=0; i<scene->getNumSubgraphs(); ++i)
+    {
+        if (!scene->getSubgraph(i)) continue;
+
+        CollectGridsVisitor cgv;
+        scene->getSubgraph(i)->accept(cgv);
+
+        for(std::vector<CollectGridsVisitor::Entry>::iterator itr = cgv.entries.begin();
+            itr != cgv.entries.end();
+            ++itr)
+        {
+            Grid grid;
+            grid.geometry = itr->geometry;
+            grid.localToWorld = itr->localToWorld;
+            grid.subgraph = i;
+
+            // each tile of a tiled mesh is drawn from the same grid, which is only integrated once
+            bool found = false;
+            for(Grids::iterator gitr = grids.begin(); gitr != grids.end() && !found; ++gitr)
+            {
+                found = gitr->sameGrid(grid);
+            }
+            if (found) continue;
+
+            if (!scene->findSurfaceFunction(grid.geometry.get(), grid.function)) continue;
+
+            grids.push_back(grid);
+        }
+    }
+}
+
+SurfaceAnalytics::Results SurfaceAnalytics::compute(double simulationTime) const
+{
+    Results results;
+
+    osg::ref_ptr<ParametricScene> scene;
+    if (!_scene.lock(scene)) return results;
+
+    if (!scene->isSetup())
+    {
+        OSG_NOTICE<<"SurfaceAnalytics::compute() scene must be set up first"<<std::endl;
+        return results;
+    }
+
+    // the triangles of each subgraph that captures depth
+    std::vector<BoundaryClipper::Triangles> boundaries;
+    if (_clipToBoundaries) BoundaryClipper::collectBoundaries(scene.get(), boundaries);
+
+    Grids grids;
+    collectGrids(scene.get(), grids);
+
+    // pair each base with the top drawn above it, the top's origin being offset along the vertical axis
+    std::vector<bool> paired(grids.size(), false);
+    for(unsigned int i=0; i<grids.size(); ++i)
+    {
+        if (paired[i]) continue;
+
+        const Grid* base = grids[i].geometry->getType()==SurfaceGeometry::BASE ? &grids[i] : 0;
+        const Grid* top = base ? 0 : &grids[i];
+        paired[i] = true;
+
+        for(unsigned int j=i+1; j<grids.size() && base && !top; ++j)
+        {
+            const Grid& grid = grids[j];
+            const SurfaceGeometry* geometry = grid.geometry.get();
+            if (paired[j] || geometry->getType()!=SurfaceGeometry::TOP || grid.subgraph!=base->subgraph) continue;
+            if (geometry->getUAxis()!=base->geometry->getUAxis() || geometry->getVAxis()!=base->geometry->getVAxis()) continue;
+            if (geometry->getUCells()!=base->geometry->getUCells() || geometry->getVCells()!=base->geometry->getVCells()) continue;
+            if (grid.localToWorld!=base->localToWorld) continue;
+
+            osg::Vec3d offset = geometry->getOrigin()-base->geometry->getOrigin();
+            osg::Vec3d n = base->geometry->getVerticalAxis();
+            if ((offset ^ n).length2() > offset.length2()*1e-10) continue;
+
+            top = &grid;
+            paired[j] = true;
+        }
+
+        std::vector<const BoundaryClipper::Triangles*> clippingBoundaries;
+        for(unsigned int b=0; b<boundaries.size(); ++b)
+        {
+            // a subgraph isn't clipped by its own depth
+            if (b!=grids[i].subgraph && !boundaries[b].empty()) clippingBoundaries.push_back(&boundaries[b]);
+        }
+
+        Result result;
+        result.subgraph = grids[i].subgraph;
+        integrate(base, top, clippingBoundaries, simulationTime, result);
+        results.push_back(result);
+    }
+
+    return results;
+}
+
+void SurfaceAnalytics::integrate(const Grid* base, const Grid* top, const std::vector<const BoundaryClipper::Triangles*>& boundaries, double simulationTime, Result& result) const
+{
+    const Grid* reference = base ? base : top;
+    const SurfaceGeometry* geometry = reference->geometry.get();
+
+    if (base) result.base = base->geometry;
+    if (top) result.top = top->geometry;
+
+    // an even number of sample cells each way so every other sample covers the grid too
+    unsigned int columns = geometry->getUCells()*_samplesPerCell;
+    unsigned int rows = geometry->getVCells()*_samplesPerCell;
+    columns += columns%2;
+    rows += rows%2;
+
+    // grid coordinates are (column, row, height above the reference grid's plane)
+    osg::Vec3d du = osg::Vec3d(geometry->getUAxis())/static_cast<double>(columns);
+    osg::Vec3d dv = osg::Vec3d(geometry->getVAxis())/static_cast<double>(rows);
+    osg::Vec3d n = geometry->getVerticalAxis();
+    osg::Vec3d o = geometry->getOrigin();
+    osg::Matrixd gridToLocal(du.x(), du.y(), du.z(), 0.0,
+                             dv.x(), dv.y(), dv.z(), 0.0,
+                             n.x(),  n.y(),  n.z(),  0.0,
+                             o.x(),  o.y(),  o.z(),  1.0);
+
+    osg::Matrixd worldToGrid;
+    if (!worldToGrid.invert(gridToLocal*reference->localToWorld)) return;
+
+    osg::ref_ptr<BoundaryClipper> clipper = new BoundaryClipper;
+    clipper->build(boundaries, worldToGrid, static_cast<double>(columns), static_cast<double>(rows));
+
+    IntegrateRowsTask::Surface baseSurface, topSurface;
+    if (base)
+    {
+        baseSurface.function = base->function.get();
+        baseSurface.origin = base->geometry->getOrigin();
+        baseSurface.offset = (osg::Vec3d(base->geometry->getOrigin())-o)*n;
+    }
+    if (top)
+    {
+        topSurface.function = top->function.get();
+        topSurface.origin = top->geometry->getOrigin();
+        topSurface.offset = (osg::Vec3d(top->geometry->getOrigin())-o)*n;
+    }
+
+    unsigned int grainSize = std::max(1u, 65536u/(columns+1));
+    IntegrateRowsTask task(geometry, columns, rows, grainSize, base ? &baseSurface : 0, top ? &topSurface : 0, clipper.get(), static_cast<float>(simulationTime));
+    ThreadPool::instance()->run(rows+1, grainSize, task);
+
+    // the trapezoidal rule over the samples and over every other sample, the difference between the two is taken as the error,
+    // which is conservative for smooth surfaces but allows for the first order convergence where the boundaries cut the grid
+    Sums sums = task.getSums();
+    result.volume = sums.values[Sums::VOLUME];
+    result.volumeError = std::abs(sums.values[Sums::VOLUME]-sums.values[Sums::COARSE+Sums::VOLUME]);
+    result.baseArea = sums.values[Sums::BASE_AREA];
+    result.baseAreaError = std::abs(sums.values[Sums::BASE_AREA]-sums.values[Sums::COARSE+Sums::BASE_AREA]);
+    result.topArea = sums.values[Sums::TOP_AREA];
+    result.topAreaError = std::abs(sums.values[Sums::TOP_AREA]-sums.values[Sums::COARSE+Sums::TOP_AREA]);
+    result.numSamples = static_cast<unsigned long long>(columns+1)*(rows+1);
+}
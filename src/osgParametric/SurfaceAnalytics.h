@@ -0,0 +1,108 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_SURFACEANALYTICS
+#define OSGPARAMETRIC_SURFACEANALYTICS 1
+
+#include <osgParametric/Export>
+#include <osgParametric/ParametricScene.h>
+#include <osgParametric/BoundaryClipper.h>
+
+#include <osg/Matrixd>
+#include <osg/Vec3d>
+
+#include <vector>
+
+namespace osgParametric
+{
+
+/** Integrates the grids of a ParametricScene on the host, reporting the area of each BASE and TOP surface left after clipping
+  * and the volume enclosed between a BASE and the TOP above it. The surface functions are evaluated in batches at the vertices of
+  * a sample grid spread across the ThreadPool, and the integrals use the trapezoidal rule, with the error estimated from the
+  * same integral over every other sample. A point counts as inside when it lies within the solid of each of the other subgraphs
+  * that capture depth, as found by a BoundaryClipper, so the boundaries should be closed meshes. For convex boundaries this
+  * matches the clipping parametric.frag does.
+  * SurfaceLOD patches, side walls, SOLID geometries, instanced and heightfield surfaces aren't integrated.*/
+class OSGPARAMETRIC_EXPORT SurfaceAnalytics : public osg::Referenced
+{
+public:
+
+    SurfaceAnalytics(ParametricScene* scene=0);
+
+    void setScene(ParametricScene* scene) { _scene = scene; }
+    ParametricScene* getScene() const { return _scene.get(); }
+
+    /** Set the number of samples along each side of a grid cell, 1 by default samples the vertices of the grids as drawn.*/
+    void setSamplesPerCell(unsigned int samples) { _samplesPerCell = samples>0 ? samples : 1; }
+    unsigned int getSamplesPerCell() const { return _samplesPerCell; }
+
+    /** Set whether the integrals are clipped by the scene's boundaries, true by default.*/
+    void setClipToBoundaries(bool flag) { _clipToBoundaries = flag; }
+    bool getClipToBoundaries() const { return _clipToBoundaries; }
+
+    struct Result
+    {
+        Result():
+            subgraph(0),
+            volume(0.0), volumeError(0.0),
+            baseArea(0.0), baseAreaError(0.0),
+            topArea(0.0), topAreaError(0.0),
+            numSamples(0) {}
+
+        unsigned int                    subgraph;
+
+        /** A tile of the grids integrated, either may be null when a grid has no partner, in which case the volume is 0.*/
+        osg::ref_ptr<SurfaceGeometry>   base;
+        osg::ref_ptr<SurfaceGeometry>   top;
+
+        /** Integrals in the units of the grids' local coordinates, with estimates of their absolute error.*/
+        double                          volume;
+        double                          volumeError;
+        double                          baseArea;
+        double                          baseAreaError;
+        double                          topArea;
+        double                          topAreaError;
+
+        unsigned long long              numSamples;
+    };
+
+    typedef std::vector<Result> Results;
+
+    /** Integrate every grid of the scene, which must have been set up, at simulationTime.*/
+    Results compute(double simulationTime=0.0) const;
+
+protected:
+
+    virtual ~SurfaceAnalytics();
+
+    /** Whole grid that one or more SurfaceGeometry tiles draw.*/
+    struct Grid
+    {
+        Grid(): subgraph(0) {}
+
+        osg::ref_ptr<SurfaceGeometry>   geometry;
+        osg::ref_ptr<SurfaceFunction>   function;
+        osg::Matrixd                    localToWorld;
+        unsigned int                    subgraph;
+
+        bool sameGrid(const Grid& rhs) const;
+    };
+
+    typedef std::vector<Grid> Grids;
+
+    void collectGrids(ParametricScene* scene, Grids& grids) const;
+
+    void integrate(const Grid* base, const Grid* top, const std::vector<const BoundaryClipper::Triangles*>& boundaries, double simulationTime, Result& result) const;
+
+    class IntegrateRowsTask;
+
+    osg::observer_ptr<ParametricScene>  _scene;
+    unsigned int                        _samplesPerCell;
+    bool                                _clipToBoundaries;
+};
+
+}
+
+#endif
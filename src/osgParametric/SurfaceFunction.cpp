@@ -0,0 +1,334 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "SurfaceFunction.h"
+
+#include <osg/Notify>
+
+#include <algorithm>
+
+using namespace osgParametric;
+
+namespace
+{
+
+const char* s_timeVariable = "osg_SimulationTime";
+
+// number of samples handed to each thread
+const unsigned int s_grainSize = 16384;
+
+typedef std::map<const Expression::Node*, Expression::Node*> CopyMap;
+
+// copy a graph from one Expression to another, remapping variable indices on to the target's variable list.
+Expression::Node* copyNode(Expression& target, const Expression::Node* node, const std::vector<unsigned int>& variableMap, CopyMap& copied)
+{
+    CopyMap::iterator itr = copied.find(node);
+    if (itr!=copied.end()) return itr->second;
+
+    Expression::Node* result = 0;
+    switch(node->op)
+    {
+        case(Expression::CONSTANT): result = target.createConstant(node->value); break;
+        case(Expression::PARAMETER): result = target.createParameter(node->index); break;
+        case(Expression::VARIABLE): result = target.createVariable(variableMap[node->index]); break;
+        default:
+        {
+            Expression::Node* args[3] = { 0, 0, 0 };
+            for(unsigned int i=0; i<node->getNumArgs(); ++i)
+            {
+                args[i] = copyNode(target, node->args[i].get(), variableMap, copied);
+            }
+            result = target.createNode(node->op, args[0], args[1], args[2]);
+            break;
+        }
+    }
+
+    copied[node] = result;
+    return result;
+}
+
+std::vector<unsigned int> mergeVariables(Expression::Names& variables, const Expression::Names& source)
+{
+    std::vector<unsigned int> variableMap;
+    for(Expression::Names::const_iterator itr = source.begin(); itr != source.end(); ++itr)
+    {
+        Expression::Names::iterator vitr = std::find(variables.begin(), variables.end(), *itr);
+        if (vitr==variables.end())
+        {
+            variableMap.push_back(static_cast<unsigned int>(variables.size()));
+            variables.push_back(*itr);
+        }
+        else
+        {
+            variableMap.push_back(static_cast<unsigned int>(vitr-variables.begin()));
+        }
+    }
+    return variableMap;
+}
+
+struct EvaluateTask : public ThreadPool::Task
+{
+    EvaluateTask(const Expression* expression, const Expression::Inputs& inputs, float* results):
+        _expression(expression),
+        _inputs(inputs),
+        _results(results) {}
+
+    virtual void operator()(unsigned int begin, unsigned int end)
+    {
+        Expression::Inputs inputs(_inputs);
+        for(Expression::Inputs::iterator itr = inputs.begin(); itr != inputs.end(); ++itr)
+        {
+            if (itr->data) itr->data += begin;
+        }
+        _expression->evaluate(end-begin, inputs, _results+begin);
+    }
+
+    const Expression*           _expression;
+    const Expression::Inputs&   _inputs;
+    float*                      _results;
+};
+
+struct EvaluateSamplesTask : public ThreadPool::Task
+{
+    EvaluateSamplesTask(const Expression* expression, const Expression::Inputs& inputs, int timeInput, const osg::Vec4* samples, float* results):
+        _expression(expression),
+        _inputs(inputs),
+        _timeInput(timeInput),
+        _samples(samples),
+        _results(results) {}
+
+    virtual void operator()(unsigned int begin, unsigned int end)
+    {
+        const unsigned int batchSize = 1024;
+        std::vector<float> x(batchSize), y(batchSize), z(batchSize), t(batchSize);
+
+        Expression::Inputs inputs(_inputs);
+        inputs[0].data = &x.front();
+        inputs[1].data = &y.front();
+        inputs[2].data = &z.front();
+        if (_timeInput>=0) inputs[_timeInput].data = &t.front();
+
+        // deinterleave into structure of arrays so the expression can read whole blocks
+        for(unsigned int start=begin; start<end; start+=batchSize)
+        {
+            unsigned int count = std::min(batchSize, end-start);
+            for(unsigned int i=0; i<count; ++i)
+            {
+                const osg::Vec4& s = _samples[start+i];
+                x[i] = s.x();
+                y[i] = s.y();
+                z[i] = s.z();
+                t[i] = s.w();
+            }
+
+            _expression->evaluate(count, inputs, _results+start);
+        }
+    }
+
+    const Expression*           _expression;
+    const Expression::Inputs&   _inputs;
+    int                         _timeInput;
+    const osg::Vec4*            _samples;
+    float*                      _results;
+};
+
+}
+
+SurfaceFunction::SurfaceFunction()
+{
+}
+
+SurfaceFunction::~SurfaceFunction()
+{
+}
+
+bool SurfaceFunction::set(const std::string& zFunction, const std::string& zBase, const std::string& zTop)
+{
+    _errorMessage.clear();
+    _expression = 0;
+
+    if (!zFunction.empty())
+    {
+        osg::ref_ptr<Expression> expression = new Expression;
+        if (!expression->parse(zFunction))
+        {
+            _errorMessage = "Z_FUNCTION : "+expression->getErrorMessage();
+            return false;
+        }
+        if (expression->getParameters().size()!=3)
+        {
+            _errorMessage = "Z_FUNCTION : expected three parameters";
+            return false;
+        }
+        _expression = expression;
+        return true;
+    }
+
+    if (zBase.empty() || zTop.empty())
+    {
+        _errorMessage = "requires Z_FUNCTION or both Z_BASE and Z_TOP";
+        return false;
+    }
+
+    osg::ref_ptr<Expression> base = new Expression;
+    if (!base->parse(zBase) || base->getParameters().size()!=3)
+    {
+        _errorMessage = "Z_BASE : "+(base->valid() ? std::string("expected three parameters") : base->getErrorMessage());
+        return false;
+    }
+
+    osg::ref_ptr<Expression> top = new Expression;
+    if (!top->parse(zTop) || top->getParameters().size()!=3)
+    {
+        _errorMessage = "Z_TOP : "+(top->valid() ? std::string("expected three parameters") : top->getErrorMessage());
+        return false;
+    }
+
+    // build ((z==0.0) ? Z_BASE(x,y,z) : Z_TOP(x,y,z)) as a single expression so common sub expressions are shared
+    osg::ref_ptr<Expression> expression = new Expression;
+
+    Expression::Names parameters;
+    parameters.push_back("x");
+    parameters.push_back("y");
+    parameters.push_back("z");
+
+    Expression::Names variables;
+    std::vector<unsigned int> baseVariables = mergeVariables(variables, base->getVariables());
+    std::vector<unsigned int> topVariables = mergeVariables(variables, top->getVariables());
+
+    CopyMap baseCopied, topCopied;
+    Expression::Node* baseRoot = copyNode(*expression, base->getRoot(), baseVariables, baseCopied);
+    Expression::Node* topRoot = copyNode(*expression, top->getRoot(), topVariables, topCopied);
+    Expression::Node* condition = expression->createNode(Expression::EQUAL, expression->createParameter(2), expression->createConstant(0.0f));
+
+    expression->set(parameters, variables, expression->createNode(Expression::SELECT, condition, baseRoot, topRoot));
+
+    _expression = expression;
+    return true;
+}
+
+bool SurfaceFunction::set(const osg::StateSet::DefineList& defines)
+{
+    std::string functions[3];
+    const char* names[3] = { "Z_FUNCTION", "Z_BASE", "Z_TOP" };
+    for(unsigned int i=0; i<3; ++i)
+    {
+        osg::StateSet::DefineList::const_iterator itr = defines.find(names[i]);
+        if (itr!=defines.end()) functions[i] = itr->second.first;
+    }
+
+    return set(functions[0], functions[1], functions[2]);
+}
+
+void SurfaceFunction::setUniforms(const osg::StateSet::UniformList& uniforms)
+{
+    for(osg::StateSet::UniformList::const_iterator itr = uniforms.begin();
+        itr != uniforms.end();
+        ++itr)
+    {
+        const osg::Uniform* uniform = itr->second.first.get();
+        float value;
+        if (uniform && uniform->getType()==osg::Uniform::FLOAT && uniform->get(value))
+        {
+            _uniforms[itr->first] = value;
+        }
+    }
+}
+
+float SurfaceFunction::getUniform(const std::string& name) const
+{
+    UniformMap::const_iterator itr = _uniforms.find(name);
+    return (itr!=_uniforms.end()) ? itr->second : 0.0f;
+}
+
+bool SurfaceFunction::isTimeDependent() const
+{
+    return _expression.valid() && _expression->dependsOnVariable(s_timeVariable);
+}
+
+Expression::Inputs SurfaceFunction::createInputs(const float* x, const float* y, const float* z, const float* t, float time) const
+{
+    Expression::Inputs inputs;
+    inputs.push_back(Expression::Input(x));
+    inputs.push_back(Expression::Input(y));
+    inputs.push_back(Expression::Input(z));
+
+    const Expression::Names& variables = _expression->getVariables();
+    for(Expression::Names::const_iterator itr = variables.begin(); itr != variables.end(); ++itr)
+    {
+        if (*itr==s_timeVariable)
+        {
+            if (t) inputs.push_back(Expression::Input(t));
+            else inputs.push_back(Expression::Input(time));
+        }
+        else
+        {
+            UniformMap::const_iterator uitr = _uniforms.find(*itr);
+            if (uitr==_uniforms.end())
+            {
+                OSG_INFO<<"SurfaceFunction : no value for '"<<*itr<<"', using 0.0"<<std::endl;
+                inputs.push_back(Expression::Input(0.0f));
+            }
+            else
+            {
+                inputs.push_back(Expression::Input(uitr->second));
+            }
+        }
+    }
+    return inputs;
+}
+
+float SurfaceFunction::evaluate(float x, float y, float z, float t) const
+{
+    if (!valid()) return 0.0f;
+
+    float result = 0.0f;
+    _expression->evaluate(1, createInputs(&x, &y, &z, &t, t), &result);
+    return result;
+}
+
+void SurfaceFunction::evaluate(unsigned int n, const float* x, const float* y, const float* z, const float* t, float* results) const
+{
+    if (!valid())
+    {
+        std::fill(results, results+n, 0.0f);
+        return;
+    }
+
+    Expression::Inputs inputs = createInputs(x, y, z, t, 0.0f);
+    EvaluateTask task(_expression.get(), inputs, results);
+    getThreadPool()->run(n, s_grainSize, task);
+}
+
+void SurfaceFunction::evaluate(unsigned int n, const float* x, const float* y, const float* z, float t, float* results) const
+{
+    if (!valid())
+    {
+        std::fill(results, results+n, 0.0f);
+        return;
+    }
+
+    Expression::Inputs inputs = createInputs(x, y, z, 0, t);
+    EvaluateTask task(_expression.get(), inputs, results);
+    getThreadPool()->run(n, s_grainSize, task);
+}
+
+void SurfaceFunction::evaluate(unsigned int n, const osg::Vec4* samples, float* results) const
+{
+    if (!valid())
+    {
+        std::fill(results, results+n, 0.0f);
+        return;
+    }
+
+    Expression::Inputs inputs = createInputs(0, 0, 0, 0, 0.0f);
+
+    const Expression::Names& variables = _expression->getVariables();
+    Expression::Names::const_iterator itr = std::find(variables.begin(), variables.end(), s_timeVariable);
+    int timeInput = (itr!=variables.end()) ? 3+static_cast<int>(itr-variables.begin()) : -1;
+
+    EvaluateSamplesTask task(_expression.get(), inputs, timeInput, samples, results);
+    getThreadPool()->run(n, s_grainSize, task);
+}
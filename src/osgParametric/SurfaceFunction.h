@@ -0,0 +1,80 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_SURFACEFUNCTION
+#define OSGPARAMETRIC_SURFACEFUNCTION 1
+
+#include <osgParametric/Expression.h>
+#include <osgParametric/ThreadPool.h>
+
+#include <osg/StateSet>
+#include <osg/Vec4>
+
+namespace osgParametric
+{
+
+/** Host side equivalent of the Z_FUNCTION used by parametric.vert, built from the same Z_FUNCTION or Z_BASE/Z_TOP defines
+  * and float uniforms, with osg_SimulationTime supplied per sample. Batches are split across a ThreadPool.*/
+class OSGPARAMETRIC_EXPORT SurfaceFunction : public osg::Referenced
+{
+public:
+
+    SurfaceFunction();
+
+    /** Set the functions using the define strings, an empty Z_FUNCTION falls back to selecting between Z_BASE and Z_TOP on z==0.0
+      * as the shader does. Returns false if the required functions are missing or fail to parse.*/
+    bool set(const std::string& zFunction, const std::string& zBase, const std::string& zTop);
+
+    /** Set the functions from a StateSet::DefineList as accumulated along a path to the surface. */
+    bool set(const osg::StateSet::DefineList& defines);
+
+    const std::string& getErrorMessage() const { return _errorMessage; }
+
+    bool valid() const { return _expression.valid() && _expression->valid(); }
+
+    /** Set the value of a uniform used by the functions, as assigned with --uniform.*/
+    void setUniform(const std::string& name, float value) { _uniforms[name] = value; }
+
+    /** Copy the values of all float uniforms in the list.*/
+    void setUniforms(const osg::StateSet::UniformList& uniforms);
+
+    float getUniform(const std::string& name) const;
+
+    /** Return true if the functions reference osg_SimulationTime.*/
+    bool isTimeDependent() const;
+
+    const Expression* getExpression() const { return _expression.get(); }
+
+    void setThreadPool(ThreadPool* threadPool) { _threadPool = threadPool; }
+    ThreadPool* getThreadPool() const { return _threadPool.valid() ? _threadPool.get() : ThreadPool::instance(); }
+
+    float evaluate(float x, float y, float z, float t) const;
+
+    /** Evaluate n samples held in separate arrays, results can't alias the inputs.*/
+    void evaluate(unsigned int n, const float* x, const float* y, const float* z, const float* t, float* results) const;
+
+    /** Evaluate n samples that share a single time.*/
+    void evaluate(unsigned int n, const float* x, const float* y, const float* z, float t, float* results) const;
+
+    /** Evaluate n (x, y, z, t) samples.*/
+    void evaluate(unsigned int n, const osg::Vec4* samples, float* results) const;
+
+protected:
+
+    virtual ~SurfaceFunction();
+
+    Expression::Inputs createInputs(const float* x, const float* y, const float* z, const float* t, float time) const;
+
+    typedef std::map<std::string, float> UniformMap;
+
+    std::string                 _errorMessage;
+    osg::ref_ptr<Expression>    _expression;
+    UniformMap                  _uniforms;
+    osg::ref_ptr<ThreadPool>    _threadPool;
+};
+
+}
+
+#endif
@@ -0,0 +1,807 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "SurfaceGeometry.h"
+#include "GridTopology.h"
+#include "ThreadPool.h"
+
+#include <osg/Notify>
+#include <osg/PrimitiveRestartIndex>
+
+#include <algorithm>
+#include <cstddef>
+
+using namespace osgParametric;
+
+namespace
+{
+
+struct FillGridTask : public ThreadPool::Task
+{
+    FillGridTask(osg::Vec3* vertices, const osg::Vec3& origin, const osg::Vec3& ua, const osg::Vec3& va, unsigned int column, unsigned int row, unsigned int uCells):
+        _vertices(vertices), _origin(origin), _ua(ua), _va(va), _column(column), _row(row), _uCells(uCells) {}
+
+    virtual void operator()(unsigned int begin, unsigned int end)
+    {
+        for(unsigned int r=begin; r<end; ++r)
+        {
+            // positions are computed from the cell indices of the whole grid so that neighbouring tiles share their edge vertices exactly
+            osg::Vec3 rowOrigin = _origin + _va*static_cast<float>(_row+r);
+            osg::Vec3* vertex = _vertices + r*(_uCells+1);
+            for(unsigned int c=0; c<=_uCells; ++c)
+            {
+                *(vertex++) = rowOrigin + _ua*static_cast<float>(_column+c);
+            }
+        }
+    }
+
+    osg::Vec3*      _vertices;
+    osg::Vec3       _origin;
+    osg::Vec3       _ua;
+    osg::Vec3       _va;
+    unsigned int    _column;
+    unsigned int    _row;
+    unsigned int    _uCells;
+};
+
+/** Create an empty GL_TRIANGLES index list able to address numVertices vertices.*/
+osg::ref_ptr<osg::DrawElements> createTriangleElements(std::size_t numVertices, std::size_t numIndices)
+{
+    osg::ref_ptr<osg::DrawElements> elements;
+    if ((numVertices>>16)==0) elements = new osg::DrawElementsUShort(GL_TRIANGLES);
+    else elements = new osg::DrawElementsUInt(GL_TRIANGLES);
+    elements->reserveElements(static_cast<unsigned int>(numIndices));
+    return elements;
+}
+
+// bits of the edges passed to addSideWalls(), in the order they are walked
+const unsigned int U_MIN_EDGE = 1;
+const unsigned int V_MAX_EDGE = 2;
+const unsigned int U_MAX_EDGE = 4;
+const unsigned int V_MIN_EDGE = 8;
+const unsigned int ALL_EDGES = U_MIN_EDGE | V_MAX_EDGE | U_MAX_EDGE | V_MIN_EDGE;
+
+/** Append the walls joining the selected edges of the base and top grids of uCells by vCells cells starting at cell (column, row)
+  * as triangles between strips of (base, top) vertex pairs, with every vertex carrying its wall's outward normal.*/
+void addSideWalls(osg::Vec3Array& vertices, osg::Vec3Array& normals, osg::DrawElements& elements,
+                  const osg::Vec3& baseOrigin, const osg::Vec3& topOrigin, const osg::Vec3& ua, const osg::Vec3& va,
+                  int column, int row, int uCells, int vCells, unsigned int edges)
+{
+    // walk the edges anticlockwise, starting up the u=0 edge
+    const int starts[4][2] = { {0, 0}, {0, vCells}, {uCells, vCells}, {uCells, 0} };
+    const int steps[4][2] = { {0, 1}, {1, 0}, {0, -1}, {-1, 0} };
+    const osg::Vec3 outwards[4] = { osg::Vec3(-1.0f,0.0f,0.0f), osg::Vec3(0.0f,1.0f,0.0f), osg::Vec3(1.0f,0.0f,0.0f), osg::Vec3(0.0f,-1.0f,0.0f) };
+
+    for(unsigned int s=0; s<4; ++s)
+    {
+        if ((edges & (1u<<s))==0) continue;
+
+        int numPairs = (steps[s][0]!=0 ? uCells : vCells)+1;
+        unsigned int first = static_cast<unsigned int>(vertices.size());
+        for(int i=0; i<numPairs; ++i)
+        {
+            osg::Vec3 offset = ua*static_cast<float>(column+starts[s][0]+steps[s][0]*i) + va*static_cast<float>(row+starts[s][1]+steps[s][1]*i);
+            vertices.push_back(baseOrigin + offset);
+            vertices.push_back(topOrigin + offset);
+            normals.push_back(outwards[s]);
+            normals.push_back(outwards[s]);
+        }
+
+        // the same triangles, and winding, as a GL_TRIANGLE_STRIP through the pairs
+        for(int i=0; i<numPairs-1; ++i)
+        {
+            unsigned int b0 = first+2*static_cast<unsigned int>(i);
+            unsigned int t0 = b0+1;
+            unsigned int b1 = b0+2;
+            unsigned int t1 = b0+3;
+            elements.addElement(b0); elements.addElement(t0); elements.addElement(b1);
+            elements.addElement(b1); elements.addElement(t0); elements.addElement(t1);
+        }
+    }
+}
+
+template<class Elements, class Grid>
+bool copyGridIndices(osg::DrawElements& elements, const osg::DrawElements& grid, unsigned int offset)
+{
+    Elements* destination = dynamic_cast<Elements*>(&elements);
+    const Grid* source = dynamic_cast<const Grid*>(&grid);
+    if (!destination || !source) return false;
+
+    typedef typename Elements::value_type Index;
+    std::size_t first = destination->size();
+    std::size_t numIndices = source->size();
+    destination->resize(first+numIndices);
+
+    Index* dst = &((*destination)[first]);
+    const typename Grid::value_type* src = &((*source)[0]);
+    for(std::size_t i=0; i<numIndices; ++i)
+    {
+        dst[i] = static_cast<Index>(src[i]+offset);
+    }
+    return true;
+}
+
+/** Append the indices of a cached grid index list, offset to where the grid's vertices start. The index arrays are copied
+  * directly rather than one virtual addElement() call per index.*/
+void addGridTriangles(osg::DrawElements& elements, const osg::DrawElements& grid, unsigned int offset)
+{
+    if (grid.getNumIndices()==0) return;
+
+    if (copyGridIndices<osg::DrawElementsUShort, osg::DrawElementsUShort>(elements, grid, offset)) return;
+    if (copyGridIndices<osg::DrawElementsUInt, osg::DrawElementsUShort>(elements, grid, offset)) return;
+    if (copyGridIndices<osg::DrawElementsUInt, osg::DrawElementsUInt>(elements, grid, offset)) return;
+
+    for(unsigned int i=0; i<grid.getNumIndices(); ++i)
+    {
+        elements.addElement(grid.index(i)+offset);
+    }
+}
+
+/** Set or remove a define, leaving the StateSet untouched if it's already right.*/
+void setDefine(osg::StateSet* stateset, const std::string& name, bool on)
+{
+    bool defined = stateset->getDefinePair(name)!=0;
+    if (on && !defined) stateset->setDefine(name);
+    else if (!on && defined) stateset->removeDefine(name);
+}
+
+void removeUniform(osg::StateSet* stateset, const std::string& name)
+{
+    if (stateset->getUniform(name)) stateset->removeUniform(name);
+}
+
+struct BuildTilesTask : public ThreadPool::Task
+{
+    typedef std::vector< osg::ref_ptr<SurfaceGeometry> > Tiles;
+
+    BuildTilesTask(Tiles& tiles, unsigned int numTileColumns, unsigned int tileCells, unsigned int firstTile=0):
+        _tiles(tiles), _numTileColumns(numTileColumns), _tileCells(tileCells), _firstTile(firstTile) {}
+
+    void setTile(unsigned int i)
+    {
+        _tiles[i]->setTile((i%_numTileColumns)*_tileCells, (i/_numTileColumns)*_tileCells, _tileCells, _tileCells);
+    }
+
+    virtual void operator()(unsigned int begin, unsigned int end)
+    {
+        for(unsigned int i=begin+_firstTile; i<end+_firstTile; ++i)
+        {
+            setTile(i);
+            _tiles[i]->build();
+        }
+    }
+
+    Tiles&          _tiles;
+    unsigned int    _numTileColumns;
+    unsigned int    _tileCells;
+    unsigned int    _firstTile;
+};
+
+unsigned int getRestartIndex(const SurfaceGeometry& tile)
+{
+    return tile.getUseTriangleStrips() ? GridTopologyCache::getRestartIndex((tile.getNumTileUCells()+1)*(tile.getNumTileVCells()+1)) : 0;
+}
+
+/** Build the tiles in parallel, sharing one StateSet. The first tile is built on its own so that the others find the StateSet
+  * complete and only read it. Tiles drawn from gl_VertexID each need their own gridTile uniform, and a smaller tile on the far
+  * edges may need a different restart index, so those keep their own StateSets.*/
+void buildTiles(BuildTilesTask::Tiles& tiles, unsigned int numTileColumns, unsigned int tileCells)
+{
+    BuildTilesTask buildFirstTile(tiles, numTileColumns, tileCells);
+    buildFirstTile(0, 1);
+
+    SurfaceGeometry* firstTile = tiles.front().get();
+    for(unsigned int i=1; i<tiles.size(); ++i)
+    {
+        buildFirstTile.setTile(i);
+        if (!firstTile->getUseVertexID() && getRestartIndex(*tiles[i])==getRestartIndex(*firstTile))
+        {
+            tiles[i]->setStateSet(firstTile->getStateSet());
+        }
+    }
+
+    BuildTilesTask buildOtherTiles(tiles, numTileColumns, tileCells, 1);
+    ThreadPool::instance()->run(static_cast<unsigned int>(tiles.size())-1, 1, buildOtherTiles);
+}
+
+osg::ref_ptr<osg::Group> createTiles(SurfaceGeometry::Type type, const osg::Vec3& origin, const osg::Vec3& topOrigin, const osg::Vec3& uAxis, const osg::Vec3& vAxis,
+                                     unsigned int uCells, unsigned int vCells, unsigned int tileCells, bool triangleStrips, bool vertexID)
+{
+    if (tileCells==0) tileCells = std::max(uCells, vCells);
+
+    unsigned int numTileColumns = std::max(1u, (uCells+tileCells-1)/tileCells);
+    unsigned int numTileRows = std::max(1u, (vCells+tileCells-1)/tileCells);
+
+    // create the tiles up front so that the worker threads only fill them in
+    BuildTilesTask::Tiles tiles(numTileColumns*numTileRows);
+    for(BuildTilesTask::Tiles::iterator itr = tiles.begin(); itr != tiles.end(); ++itr)
+    {
+        osg::ref_ptr<SurfaceGeometry> tile = new SurfaceGeometry;
+        tile->setType(type);
+        tile->setOrigin(origin);
+        tile->setTopOrigin(topOrigin);
+        tile->setUAxis(uAxis);
+        tile->setVAxis(vAxis);
+        tile->setUCells(uCells);
+        tile->setVCells(vCells);
+        tile->setUseTriangleStrips(triangleStrips);
+        tile->setUseVertexID(vertexID);
+        *itr = tile;
+    }
+
+    buildTiles(tiles, numTileColumns, tileCells);
+
+    osg::ref_ptr<osg::Group> group = new osg::Group;
+    for(BuildTilesTask::Tiles::iterator itr = tiles.begin(); itr != tiles.end(); ++itr)
+    {
+        group->addChild(itr->get());
+    }
+    return group;
+}
+
+}
+
+SurfaceGeometry::SurfaceGeometry():
+    _type(TOP),
+    _uAxis(1.0f, 0.0f, 0.0f),
+    _vAxis(0.0f, 1.0f, 0.0f),
+    _uCells(10),
+    _vCells(10),
+    _tileColumn(0),
+    _tileRow(0),
+    _tileUCells(0),
+    _tileVCells(0),
+    _stitchEdges(0),
+    _useTriangleStrips(false),
+    _useVertexID(false)
+{
+}
+
+SurfaceGeometry::SurfaceGeometry(Type type, const osg::Vec3& origin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, unsigned int uCells, unsigned int vCells):
+    _type(type),
+    _origin(origin),
+    _topOrigin(origin),
+    _uAxis(uAxis),
+    _vAxis(vAxis),
+    _uCells(uCells),
+    _vCells(vCells),
+    _tileColumn(0),
+    _tileRow(0),
+    _tileUCells(0),
+    _tileVCells(0),
+    _stitchEdges(0),
+    _useTriangleStrips(false),
+    _useVertexID(false)
+{
+    build();
+}
+
+SurfaceGeometry::SurfaceGeometry(const osg::Vec3& baseOrigin, const osg::Vec3& topOrigin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, unsigned int uCells, unsigned int vCells, Type type):
+    _type(type),
+    _origin(baseOrigin),
+    _topOrigin(topOrigin),
+    _uAxis(uAxis),
+    _vAxis(vAxis),
+    _uCells(uCells),
+    _vCells(vCells),
+    _tileColumn(0),
+    _tileRow(0),
+    _tileUCells(0),
+    _tileVCells(0),
+    _stitchEdges(0),
+    _useTriangleStrips(false),
+    _useVertexID(false)
+{
+    build();
+}
+
+SurfaceGeometry::SurfaceGeometry(const SurfaceGeometry& geometry, const osg::CopyOp& copyop):
+    osg::Geometry(geometry, copyop),
+    _type(geometry._type),
+    _origin(geometry._origin),
+    _topOrigin(geometry._topOrigin),
+    _uAxis(geometry._uAxis),
+    _vAxis(geometry._vAxis),
+    _uCells(geometry._uCells),
+    _vCells(geometry._vCells),
+    _tileColumn(geometry._tileColumn),
+    _tileRow(geometry._tileRow),
+    _tileUCells(geometry._tileUCells),
+    _tileVCells(geometry._tileVCells),
+    _stitchEdges(geometry._stitchEdges),
+    _useTriangleStrips(geometry._useTriangleStrips),
+    _useVertexID(geometry._useVertexID),
+    _instances(geometry._instances),
+    _displacedBound(geometry._displacedBound)
+{
+}
+
+SurfaceGeometry::~SurfaceGeometry()
+{
+}
+
+void SurfaceGeometry::setInstances(SurfaceInstances* instances)
+{
+    if (instances==_instances.get()) return;
+
+    if (_instances.valid() && getStateSet()) _instances->removeFromStateSet(getStateSet());
+    _instances = instances;
+}
+
+osg::Vec3 SurfaceGeometry::getVerticalAxis() const
+{
+    osg::Vec3 verticalAxis(_uAxis ^ _vAxis);
+    verticalAxis.normalize();
+    return verticalAxis;
+}
+
+void SurfaceGeometry::build()
+{
+    removePrimitiveSet(0, getNumPrimitiveSets());
+
+    setUseVertexBufferObjects(true);
+
+    // the StateSet is only modified where it needs to change, as tiles built in parallel share it
+    osg::StateSet* stateset = getOrCreateStateSet();
+    bool vertexID = _useVertexID && (_type==BASE || _type==TOP);
+    if (!vertexID)
+    {
+        setDefine(stateset, "GRID_VERTEX_ID", false);
+        setDefine(stateset, "GRID_TOP", false);
+        removeUniform(stateset, "gridOrigin");
+        removeUniform(stateset, "gridUAxis");
+        removeUniform(stateset, "gridVAxis");
+        removeUniform(stateset, "gridCells");
+        removeUniform(stateset, "gridTile");
+    }
+
+    // specialize parametric.vert for the role, grids only when all their vertices take the same side of its z==0.0 selection
+    // between Z_BASE and Z_TOP, as the host's SurfaceFunction still selects on z. A SOLID mixes the roles so isn't specialized.
+    bool flat = _uAxis.z()==0.0f && _vAxis.z()==0.0f;
+    setDefine(stateset, "SURFACE_WALLS", _type==SIDE_WALLS);
+    setDefine(stateset, "SURFACE_BASE", _type==BASE && flat && _origin.z()==0.0f);
+    setDefine(stateset, "SURFACE_TOP", _type==TOP && flat && _origin.z()!=0.0f);
+
+    if (_type==SIDE_WALLS) buildSideWalls();
+    else if (_type==SOLID) buildSolid();
+    else if (vertexID) buildVertexIDMesh();
+    else buildMesh();
+
+    osg::Vec3 verticalAxis = getVerticalAxis();
+    osg::Vec3 currentVerticalAxis;
+    const osg::Uniform* verticalAxisUniform = stateset->getUniform("verticalAxis");
+    if (!verticalAxisUniform || !verticalAxisUniform->get(currentVerticalAxis) || currentVerticalAxis!=verticalAxis)
+    {
+        stateset->addUniform(new osg::Uniform("verticalAxis", verticalAxis));
+    }
+
+    if (_instances.valid())
+    {
+        _instances->addToStateSet(stateset);
+        applyInstances();
+    }
+
+    // set up colour
+    osg::Vec4 color(1.0,1.0,1.0,1.0);
+    osg::ref_ptr<osg::Vec4Array> colours = new osg::Vec4Array;
+    colours->push_back(color);
+    setColorArray(colours, osg::Array::BIND_OVERALL);
+
+    dirtyBound();
+}
+
+void SurfaceGeometry::buildMesh()
+{
+    unsigned int uCells = getNumTileUCells();
+    unsigned int vCells = getNumTileVCells();
+    unsigned int numVertices = (uCells+1)*(vCells+1);
+
+    // set up vertices, filled in directly by the ThreadPool for large grids
+    osg::ref_ptr<osg::Vec3Array> vertices = new osg::Vec3Array(numVertices);
+
+    osg::Vec3 ua = _uAxis; ua /= static_cast<float>(_uCells);
+    osg::Vec3 va = _vAxis; va /= static_cast<float>(_vCells);
+
+    FillGridTask fillGrid(&(vertices->front()), _origin, ua, va, _tileColumn, _tileRow, uCells);
+    ThreadPool::instance()->run(vCells+1, std::max(1u, 65536u/(uCells+1)), fillGrid);
+
+    setVertexArray(vertices);
+
+    // set up normal
+    osg::ref_ptr<osg::Vec3Array> normals = new osg::Vec3Array();
+    normals->push_back(osg::Vec3(0.0f,0.0f,0.0f));
+    setNormalArray(normals, osg::Array::BIND_OVERALL);
+
+
+    // set up mesh
+
+    OSG_INFO<<"numVertices = "<<numVertices<<std::endl;
+    OSG_INFO<<"numVertices>>16 = "<<(numVertices>>16)<<std::endl;
+
+    buildPrimitives();
+}
+
+void SurfaceGeometry::buildPrimitives()
+{
+    if (_type==SIDE_WALLS || _type==SOLID || _useVertexID) return;
+
+    unsigned int uCells = getNumTileUCells();
+    unsigned int vCells = getNumTileVCells();
+    unsigned int numVertices = (uCells+1)*(vCells+1);
+
+    removePrimitiveSet(0, getNumPrimitiveSets());
+
+    // grids of the same resolution share their indices, only the vertex positions are unique to each surface
+    GridTopologyCache::Encoding encoding = _useTriangleStrips ? GridTopologyCache::TRIANGLE_STRIPS : GridTopologyCache::TRIANGLES;
+    addPrimitiveSet(GridTopologyCache::instance()->getDrawElements(uCells, vCells, _type==TOP, encoding, _stitchEdges));
+
+    // only touch the StateSet when it needs to change, as it may be shared with copies that are being drawn
+    // and replace the restart index when a resize moved the grid between 16 and 32 bit indices
+    osg::StateSet* stateset = getOrCreateStateSet();
+    const osg::PrimitiveRestartIndex* restartIndex =
+        dynamic_cast<const osg::PrimitiveRestartIndex*>(stateset->getAttribute(osg::StateAttribute::PRIMITIVERESTARTINDEX));
+    unsigned int requiredRestartIndex = GridTopologyCache::getRestartIndex(numVertices);
+    if (_useTriangleStrips && (!restartIndex || restartIndex->getRestartIndex()!=requiredRestartIndex))
+    {
+        stateset->setAttributeAndModes(new osg::PrimitiveRestartIndex(requiredRestartIndex), osg::StateAttribute::ON);
+    }
+    else if (!_useTriangleStrips && restartIndex)
+    {
+        stateset->removeAttribute(osg::StateAttribute::PRIMITIVERESTARTINDEX);
+        stateset->removeMode(GL_PRIMITIVE_RESTART);
+    }
+
+    applyInstances();
+}
+
+void SurfaceGeometry::buildVertexIDMesh()
+{
+    // no per vertex data at all, parametric.vert rebuilds each vertex of the GL_TRIANGLES list from gl_VertexID
+    setVertexArray(0);
+    setNormalArray(0);
+
+    osg::StateSet* stateset = getOrCreateStateSet();
+    stateset->removeAttribute(osg::StateAttribute::PRIMITIVERESTARTINDEX);
+    stateset->removeMode(GL_PRIMITIVE_RESTART);
+
+    stateset->setDefine("GRID_VERTEX_ID");
+    setDefine(stateset, "GRID_TOP", _type==TOP);
+
+    stateset->addUniform(new osg::Uniform("gridOrigin", _origin));
+    stateset->addUniform(new osg::Uniform("gridUAxis", _uAxis));
+    stateset->addUniform(new osg::Uniform("gridVAxis", _vAxis));
+    stateset->addUniform(new osg::Uniform("gridCells", static_cast<int>(_uCells), static_cast<int>(_vCells)));
+    stateset->addUniform(new osg::Uniform("gridTile", static_cast<int>(_tileColumn), static_cast<int>(_tileRow), static_cast<int>(getNumTileUCells()), static_cast<int>(getNumTileVCells())));
+
+    addPrimitiveSet(new osg::DrawArrays(GL_TRIANGLES, 0, 6*getNumTileUCells()*getNumTileVCells()));
+}
+
+void SurfaceGeometry::buildSideWalls()
+{
+    unsigned int numVertices = 4*(_uCells+1) + 4*(_vCells+1);
+
+    // per vertex normals, rather than one per strip, keep the walls on the fast path and let them be drawn in one call
+    osg::ref_ptr<osg::Vec3Array> vertices = new osg::Vec3Array;
+    osg::ref_ptr<osg::Vec3Array> normals = new osg::Vec3Array;
+    vertices->reserve(numVertices);
+    normals->reserve(numVertices);
+
+    osg::Vec3 ua = _uAxis; ua /= static_cast<float>(_uCells);
+    osg::Vec3 va = _vAxis; va /= static_cast<float>(_vCells);
+
+    osg::ref_ptr<osg::DrawElements> elements = createTriangleElements(numVertices, 12*(_uCells+_vCells));
+    addSideWalls(*vertices, *normals, *elements, _origin, _topOrigin, ua, va, 0, 0, static_cast<int>(_uCells), static_cast<int>(_vCells), ALL_EDGES);
+
+    setVertexArray(vertices);
+    setNormalArray(normals, osg::Array::BIND_PER_VERTEX);
+    addPrimitiveSet(elements.get());
+
+    OSG_INFO<<"numVertices = "<<numVertices<<std::endl;
+    OSG_INFO<<"numVertices>>16 = "<<(numVertices>>16)<<std::endl;
+}
+
+void SurfaceGeometry::buildSolid()
+{
+    // a tile of the solid takes its share of the grids, and only the pieces of the walls along the solid's outer edges
+    unsigned int tu = getNumTileUCells();
+    unsigned int tv = getNumTileVCells();
+    if (tu==0 || tv==0) return;
+
+    unsigned int edges = 0;
+    if (_tileColumn==0) edges |= U_MIN_EDGE;
+    if (_tileColumn+tu==_uCells) edges |= U_MAX_EDGE;
+    if (_tileRow==0) edges |= V_MIN_EDGE;
+    if (_tileRow+tv==_vCells) edges |= V_MAX_EDGE;
+
+    // each wall is a strip of (base, top) pairs, one more pair than it has cells
+    std::size_t numWallCells = 0;
+    std::size_t numWalls = 0;
+    if (edges & U_MIN_EDGE) { numWallCells += tv; ++numWalls; }
+    if (edges & U_MAX_EDGE) { numWallCells += tv; ++numWalls; }
+    if (edges & V_MIN_EDGE) { numWallCells += tu; ++numWalls; }
+    if (edges & V_MAX_EDGE) { numWallCells += tu; ++numWalls; }
+
+    std::size_t numGridVertices = (static_cast<std::size_t>(tu)+1)*(static_cast<std::size_t>(tv)+1);
+    std::size_t numVertices = 2*numGridVertices + 2*(numWallCells+numWalls);
+    std::size_t numIndices = 12*static_cast<std::size_t>(tu)*static_cast<std::size_t>(tv) + 6*numWallCells;
+
+    // the largest index has to fit the 32 bit indices, and the index count the DrawElements' unsigned int count
+    const std::size_t maxIndex = 0xffffffffu;
+    if (numVertices-1>maxIndex || numIndices>maxIndex)
+    {
+        OSG_WARN<<"Warning: SurfaceGeometry SOLID of "<<tu<<" by "<<tv<<" cells exceeds 32 bit indices, use createTiledSolid()."<<std::endl;
+        return;
+    }
+
+    // the base grid, then the top grid, then the walls, all in one array. The grids' zero normals have parametric.vert compute
+    // theirs from the surface function, and the base and top are told apart by z as they are for separate geometries
+    osg::ref_ptr<osg::Vec3Array> vertices = new osg::Vec3Array(static_cast<unsigned int>(2*numGridVertices));
+    osg::ref_ptr<osg::Vec3Array> normals = new osg::Vec3Array(static_cast<unsigned int>(2*numGridVertices));
+    vertices->reserve(numVertices);
+    normals->reserve(numVertices);
+
+    osg::Vec3 ua = _uAxis; ua /= static_cast<float>(_uCells);
+    osg::Vec3 va = _vAxis; va /= static_cast<float>(_vCells);
+
+    unsigned int grainSize = std::max(1u, 65536u/(tu+1));
+    FillGridTask fillBase(&(vertices->front()), _origin, ua, va, _tileColumn, _tileRow, tu);
+    ThreadPool::instance()->run(tv+1, grainSize, fillBase);
+
+    FillGridTask fillTop(&(vertices->front())+numGridVertices, _topOrigin, ua, va, _tileColumn, _tileRow, tu);
+    ThreadPool::instance()->run(tv+1, grainSize, fillTop);
+
+    // the grids take the windings of the GridTopologyCache's index lists, so they match separately built grids
+    osg::ref_ptr<osg::DrawElements> elements = createTriangleElements(numVertices, numIndices);
+    GridTopologyCache* cache = GridTopologyCache::instance();
+    addGridTriangles(*elements, *cache->getDrawElements(tu, tv, false, GridTopologyCache::TRIANGLES), 0);
+    addGridTriangles(*elements, *cache->getDrawElements(tu, tv, true, GridTopologyCache::TRIANGLES), static_cast<unsigned int>(numGridVertices));
+    addSideWalls(*vertices, *normals, *elements, _origin, _topOrigin, ua, va,
+                 static_cast<int>(_tileColumn), static_cast<int>(_tileRow), static_cast<int>(tu), static_cast<int>(tv), edges);
+
+    setVertexArray(vertices);
+    setNormalArray(normals, osg::Array::BIND_PER_VERTEX);
+    addPrimitiveSet(elements.get());
+
+    // a solid is never drawn with strips, so drop a restart index left from being built as a grid
+    osg::StateSet* stateset = getOrCreateStateSet();
+    if (stateset->getAttribute(osg::StateAttribute::PRIMITIVERESTARTINDEX))
+    {
+        stateset->removeAttribute(osg::StateAttribute::PRIMITIVERESTARTINDEX);
+        stateset->removeMode(GL_PRIMITIVE_RESTART);
+    }
+
+    OSG_INFO<<"numVertices = "<<numVertices<<std::endl;
+    OSG_INFO<<"numVertices>>16 = "<<(numVertices>>16)<<std::endl;
+}
+
+void SurfaceGeometry::applyInstances()
+{
+    if (!_instances) return;
+
+    unsigned int numInstances = _instances->getNumInstances();
+    if (numInstances==0)
+    {
+        // setNumInstances(0) would draw the grid once, placed by an empty instance buffer, so with no instances the surface is hidden
+        removePrimitiveSet(0, getNumPrimitiveSets());
+        return;
+    }
+
+    // the number of instances belongs to the primitive set, so an instanced grid takes its own copy of the GridTopologyCache's indices
+    bool sharedIndices = (_type==BASE || _type==TOP);
+    for(unsigned int i=0; i<getNumPrimitiveSets(); ++i)
+    {
+        osg::ref_ptr<osg::PrimitiveSet> primitiveSet = getPrimitiveSet(i);
+        if (sharedIndices && primitiveSet->getDrawElements() && primitiveSet->getNumInstances()==0)
+        {
+            primitiveSet = osg::clone(primitiveSet.get(), osg::CopyOp::DEEP_COPY_ALL);
+            setPrimitiveSet(i, primitiveSet.get());
+        }
+        primitiveSet->setNumInstances(numInstances);
+    }
+}
+
+void SurfaceGeometry::getBoundSamples(unsigned int density, std::vector<float>& x, std::vector<float>& y, std::vector<float>& z) const
+{
+    x.clear();
+    y.clear();
+    z.clear();
+
+    if (density==0) density = 1;
+
+    // sample at the vertices when the grid is coarse enough, the bound is then exact as the triangles interpolate the vertices.
+    unsigned int nu = std::max(1u, std::min(_uCells, density));
+    unsigned int nv = std::max(1u, std::min(_vCells, density));
+
+    osg::Vec3 p;
+    if (_type==SIDE_WALLS)
+    {
+        const osg::Vec3* origins[2] = { &_origin, &_topOrigin };
+        for(unsigned int o=0; o<2; ++o)
+        {
+            for(unsigned int c=0; c<=nu; ++c)
+            {
+                for(unsigned int r=0; r<=nv; r+=nv)
+                {
+                    p = *origins[o] + _uAxis*(static_cast<float>(c)/static_cast<float>(nu)) + _vAxis*static_cast<float>(r/nv);
+                    x.push_back(p.x()); y.push_back(p.y()); z.push_back(p.z());
+                }
+            }
+            for(unsigned int r=1; r<nv; ++r)
+            {
+                for(unsigned int c=0; c<=nu; c+=nu)
+                {
+                    p = *origins[o] + _uAxis*static_cast<float>(c/nu) + _vAxis*(static_cast<float>(r)/static_cast<float>(nv));
+                    x.push_back(p.x()); y.push_back(p.y()); z.push_back(p.z());
+                }
+            }
+        }
+    }
+    else
+    {
+        // a tile takes its share of the samples of the whole grid, a SOLID's grids span its walls so sampling both covers the solid
+        unsigned int tu = getNumTileUCells();
+        unsigned int tv = getNumTileVCells();
+        if (tu<_uCells) nu = std::max(1u, std::min(tu, (density*tu+_uCells-1)/_uCells));
+        if (tv<_vCells) nv = std::max(1u, std::min(tv, (density*tv+_vCells-1)/_vCells));
+
+        float uScale = static_cast<float>(tu)/static_cast<float>(nu);
+        float vScale = static_cast<float>(tv)/static_cast<float>(nv);
+
+        const osg::Vec3* origins[2] = { &_origin, &_topOrigin };
+        unsigned int numOrigins = (_type==SOLID) ? 2 : 1;
+        x.reserve(numOrigins*(nu+1)*(nv+1));
+        y.reserve(numOrigins*(nu+1)*(nv+1));
+        z.reserve(numOrigins*(nu+1)*(nv+1));
+        for(unsigned int o=0; o<numOrigins; ++o)
+        {
+            for(unsigned int r=0; r<=nv; ++r)
+            {
+                for(unsigned int c=0; c<=nu; ++c)
+                {
+                    p = *origins[o] + _uAxis*((static_cast<float>(_tileColumn)+static_cast<float>(c)*uScale)/static_cast<float>(_uCells)) +
+                                      _vAxis*((static_cast<float>(_tileRow)+static_cast<float>(r)*vScale)/static_cast<float>(_vCells));
+                    x.push_back(p.x()); y.push_back(p.y()); z.push_back(p.z());
+                }
+            }
+        }
+    }
+}
+
+osg::BoundingBox SurfaceGeometry::computeConservativeBound() const
+{
+    osg::Vec3 wAxis = getVerticalAxis()*((_uAxis.length()+_vAxis.length())*0.5);
+
+    // the side walls aren't tiled, a SOLID tile spans its share of both grids
+    osg::Vec3 tileOffset;
+    osg::Vec3 uAxis = _uAxis;
+    osg::Vec3 vAxis = _vAxis;
+    bool twoOrigins = (_type==SIDE_WALLS || _type==SOLID);
+    if (_type!=SIDE_WALLS && _uCells>0 && _vCells>0)
+    {
+        tileOffset = _uAxis*(static_cast<float>(_tileColumn)/static_cast<float>(_uCells)) + _vAxis*(static_cast<float>(_tileRow)/static_cast<float>(_vCells));
+        uAxis *= static_cast<float>(getNumTileUCells())/static_cast<float>(_uCells);
+        vAxis *= static_cast<float>(getNumTileVCells())/static_cast<float>(_vCells);
+    }
+
+    osg::BoundingBox bb;
+    osg::Vec3 tileOrigin = _origin + tileOffset;
+    osg::Vec3 topOrigin = twoOrigins ? _topOrigin + tileOffset : tileOrigin;
+    const osg::Vec3* origins[2] = { &tileOrigin, &topOrigin };
+    for(unsigned int o=0; o<2; ++o)
+    {
+        const osg::Vec3& origin = *origins[o];
+        bb.expandBy(origin+wAxis);
+        bb.expandBy(origin+uAxis+wAxis);
+        bb.expandBy(origin+vAxis+wAxis);
+        bb.expandBy(origin+uAxis+vAxis+wAxis);
+
+        bb.expandBy(origin-wAxis);
+        bb.expandBy(origin+uAxis-wAxis);
+        bb.expandBy(origin+vAxis-wAxis);
+        bb.expandBy(origin+uAxis+vAxis-wAxis);
+    }
+    return _instances.valid() ? _instances->transform(bb) : bb;
+}
+
+osg::BoundingBox SurfaceGeometry::computeBoundingBox() const
+{
+    if (_displacedBound.valid()) return _displacedBound;
+    return computeConservativeBound();
+}
+
+osg::ref_ptr<SurfaceGeometry> osgParametric::createMesh(const osg::Vec3& origin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, unsigned int uCells, unsigned vCells, bool top, bool triangleStrips, bool vertexID)
+{
+    osg::ref_ptr<SurfaceGeometry> geometry = new SurfaceGeometry(top ? SurfaceGeometry::TOP : SurfaceGeometry::BASE, origin, uAxis, vAxis, uCells, vCells);
+    if (triangleStrips || vertexID)
+    {
+        geometry->setUseTriangleStrips(triangleStrips);
+        geometry->setUseVertexID(vertexID);
+        geometry->build();
+    }
+    return geometry;
+}
+
+osg::ref_ptr<osg::Group> osgParametric::createTiledMesh(const osg::Vec3& origin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, unsigned int uCells, unsigned vCells, bool top,
+                                                        unsigned int tileCells, bool triangleStrips, bool vertexID)
+{
+    return createTiles(top ? SurfaceGeometry::TOP : SurfaceGeometry::BASE, origin, origin, uAxis, vAxis, uCells, vCells, tileCells, triangleStrips, vertexID);
+}
+
+osg::ref_ptr<SurfaceGeometry> osgParametric::createSideWalls(const osg::Vec3& baseOrigin, const osg::Vec3& topOrigin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, int uCells, int vCells)
+{
+    return new SurfaceGeometry(baseOrigin, topOrigin, uAxis, vAxis, static_cast<unsigned int>(uCells), static_cast<unsigned int>(vCells));
+}
+
+osg::ref_ptr<SurfaceGeometry> osgParametric::createSolid(const osg::Vec3& baseOrigin, const osg::Vec3& topOrigin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, unsigned int uCells, unsigned int vCells)
+{
+    return new SurfaceGeometry(baseOrigin, topOrigin, uAxis, vAxis, uCells, vCells, SurfaceGeometry::SOLID);
+}
+
+osg::ref_ptr<osg::Group> osgParametric::createTiledSolid(const osg::Vec3& baseOrigin, const osg::Vec3& topOrigin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, unsigned int uCells, unsigned int vCells,
+                                                         unsigned int tileCells)
+{
+    return createTiles(SurfaceGeometry::SOLID, baseOrigin, topOrigin, uAxis, vAxis, uCells, vCells, tileCells, false, false);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  Serializers for SurfaceGeometry
+//
+#include <osgDB/ObjectWrapper>
+#include <osgDB/InputStream>
+#include <osgDB/OutputStream>
+
+// the vertex arrays and primitive sets are regenerated from the grid description on reading, so the osg::Geometry
+// serializers are left out and a grid of any size is stored in a few hundred bytes
+static bool checkMesh( const osgParametric::SurfaceGeometry& /*geometry*/ )
+{
+    return true;
+}
+
+static bool readMesh( osgDB::InputStream& is, osgParametric::SurfaceGeometry& geometry )
+{
+    bool built = false;
+    is >> built;
+    if ( built ) geometry.build();
+    return true;
+}
+
+static bool writeMesh( osgDB::OutputStream& os, const osgParametric::SurfaceGeometry& geometry )
+{
+    os << (geometry.getNumPrimitiveSets()>0) << std::endl;
+    return true;
+}
+
+REGISTER_OBJECT_WRAPPER( SurfaceGeometry,
+                         new osgParametric::SurfaceGeometry,
+                         osgParametric::SurfaceGeometry,
+                         "osg::Object osg::Node osg::Drawable osgParametric::SurfaceGeometry" )
+{
+    BEGIN_ENUM_SERIALIZER( Type, TOP );
+        ADD_ENUM_VALUE( BASE );
+        ADD_ENUM_VALUE( TOP );
+        ADD_ENUM_VALUE( SIDE_WALLS );
+        ADD_ENUM_VALUE( SOLID );
+    END_ENUM_SERIALIZER();
+
+    ADD_VEC3_SERIALIZER( Origin, osg::Vec3() );
+    ADD_VEC3_SERIALIZER( TopOrigin, osg::Vec3() );
+    ADD_VEC3_SERIALIZER( UAxis, osg::Vec3(1.0f, 0.0f, 0.0f) );
+    ADD_VEC3_SERIALIZER( VAxis, osg::Vec3(0.0f, 1.0f, 0.0f) );
+    ADD_UINT_SERIALIZER( UCells, 10 );
+    ADD_UINT_SERIALIZER( VCells, 10 );
+    ADD_UINT_SERIALIZER( TileColumn, 0 );
+    ADD_UINT_SERIALIZER( TileRow, 0 );
+    ADD_UINT_SERIALIZER( TileUCells, 0 );
+    ADD_UINT_SERIALIZER( TileVCells, 0 );
+    ADD_UINT_SERIALIZER( StitchEdges, 0 );
+    ADD_BOOL_SERIALIZER( UseTriangleStrips, false );
+    ADD_BOOL_SERIALIZER( UseVertexID, false );
+    ADD_OBJECT_SERIALIZER( Instances, osgParametric::SurfaceInstances, NULL );
+
+    // read last, once the grid description is complete
+    ADD_USER_SERIALIZER( Mesh );
+}
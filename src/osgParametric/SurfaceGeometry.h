@@ -0,0 +1,198 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_SURFACEGEOMETRY
+#define OSGPARAMETRIC_SURFACEGEOMETRY 1
+
+#include <osgParametric/Export>
+#include <osgParametric/SurfaceInstances.h>
+
+#include <osg/Geometry>
+#include <osg/Group>
+
+#include <vector>
+#include <algorithm>
+
+namespace osgParametric
+{
+
+/** Grid geometry for the base, top or side walls of a parametric surface, or a SOLID of all three. The grid is displaced along
+  * verticalAxis by the Z_FUNCTION in parametric.vert, so the geometry keeps the grid description so that the host can compute
+  * where the displaced surface actually ends up.*/
+class OSGPARAMETRIC_EXPORT SurfaceGeometry : public osg::Geometry
+{
+public:
+
+    enum Type
+    {
+        BASE,
+        TOP,
+        SIDE_WALLS,
+        /** base, top and side walls in one vertex array drawn by a single DrawElements. The normals tag the faces per vertex,
+          * zero on the grids so that parametric.vert computes them from the surface function, outward on the walls.*/
+        SOLID
+    };
+
+    SurfaceGeometry();
+
+    /** Create a BASE or TOP grid of uCells by vCells cells.*/
+    SurfaceGeometry(Type type, const osg::Vec3& origin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, unsigned int uCells, unsigned int vCells);
+
+    /** Create the SIDE_WALLS joining the edges of base and top grids, or with type SOLID the grids and walls together.*/
+    SurfaceGeometry(const osg::Vec3& baseOrigin, const osg::Vec3& topOrigin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, unsigned int uCells, unsigned int vCells, Type type=SIDE_WALLS);
+
+    /** Copy constructor using CopyOp to manage deep vs shallow copy. */
+    SurfaceGeometry(const SurfaceGeometry& geometry, const osg::CopyOp& copyop=osg::CopyOp::SHALLOW_COPY);
+
+    META_Node(osgParametric, SurfaceGeometry);
+
+    void setType(Type type) { _type = type; }
+    Type getType() const { return _type; }
+
+    /** Origin of the grid, for SIDE_WALLS and SOLID the origin of the base.*/
+    void setOrigin(const osg::Vec3& origin) { _origin = origin; }
+    const osg::Vec3& getOrigin() const { return _origin; }
+
+    /** Origin of the top grid, only used by SIDE_WALLS and SOLID.*/
+    void setTopOrigin(const osg::Vec3& origin) { _topOrigin = origin; }
+    const osg::Vec3& getTopOrigin() const { return _topOrigin; }
+
+    void setUAxis(const osg::Vec3& axis) { _uAxis = axis; }
+    const osg::Vec3& getUAxis() const { return _uAxis; }
+
+    void setVAxis(const osg::Vec3& axis) { _vAxis = axis; }
+    const osg::Vec3& getVAxis() const { return _vAxis; }
+
+    void setUCells(unsigned int cells) { _uCells = cells; }
+    unsigned int getUCells() const { return _uCells; }
+
+    void setVCells(unsigned int cells) { _vCells = cells; }
+    unsigned int getVCells() const { return _vCells; }
+
+    /** Restrict a BASE or TOP grid to the tile of uCells by vCells cells starting at the given column and row, so that a large grid
+      * can be split into separately culled tiles whose shared edges have bitwise identical vertices. Zero cells extends the tile
+      * to the edge of the grid, the default tile covers the whole grid. Takes effect on the next build().*/
+    void setTile(unsigned int column, unsigned int row, unsigned int uCells, unsigned int vCells) { _tileColumn = column; _tileRow = row; _tileUCells = uCells; _tileVCells = vCells; }
+
+    void setTileColumn(unsigned int column) { _tileColumn = column; }
+    unsigned int getTileColumn() const { return _tileColumn; }
+
+    void setTileRow(unsigned int row) { _tileRow = row; }
+    unsigned int getTileRow() const { return _tileRow; }
+
+    void setTileUCells(unsigned int cells) { _tileUCells = cells; }
+    unsigned int getTileUCells() const { return _tileUCells; }
+
+    void setTileVCells(unsigned int cells) { _tileVCells = cells; }
+    unsigned int getTileVCells() const { return _tileVCells; }
+
+    /** Number of cells along the u axis actually covered by the tile.*/
+    unsigned int getNumTileUCells() const { return _tileColumn>=_uCells ? 0 : (_tileUCells==0 ? _uCells-_tileColumn : std::min(_tileUCells, _uCells-_tileColumn)); }
+
+    /** Number of cells along the v axis actually covered by the tile.*/
+    unsigned int getNumTileVCells() const { return _tileRow>=_vCells ? 0 : (_tileVCells==0 ? _vCells-_tileRow : std::min(_tileVCells, _vCells-_tileRow)); }
+
+    /** Set the mask of GridTopologyCache::StitchEdges along which the grid is joined to a neighbour of half its resolution,
+      * takes effect on the next build() or buildPrimitives().*/
+    void setStitchEdges(unsigned int mask) { _stitchEdges = mask; }
+    unsigned int getStitchEdges() const { return _stitchEdges; }
+
+    /** Draw BASE and TOP grids as one triangle strip per row joined with primitive restart rather than as indexed triangles,
+      * takes effect on the next build().*/
+    void setUseTriangleStrips(bool flag) { _useTriangleStrips = flag; }
+    bool getUseTriangleStrips() const { return _useTriangleStrips; }
+
+    /** Generate the BASE and TOP grid vertices in parametric.vert from gl_VertexID and the grid uniforms rather than storing
+      * vertex and index arrays, leaving just a draw count on the host. Needs GL_EXT_gpu_shader4, takes effect on the next build().*/
+    void setUseVertexID(bool flag) { _useVertexID = flag; }
+    bool getUseVertexID() const { return _useVertexID; }
+
+    /** Draw a copy of the grid for each of the instances with a single instanced draw, placed and parametrized by parametric.vert.
+      * The grid description, samples and displaced bound stay in the grid's own coordinates, while the bound covers every instance.
+      * With no instances there is nothing to draw, so the surface is hidden until instances are added and it is rebuilt, set no
+      * SurfaceInstances to draw the grid on its own. Takes effect on the next build().*/
+    void setInstances(SurfaceInstances* instances);
+    SurfaceInstances* getInstances() { return _instances.get(); }
+    const SurfaceInstances* getInstances() const { return _instances.get(); }
+
+    /** Normalized direction that the surface function displaces the grid along.*/
+    osg::Vec3 getVerticalAxis() const;
+
+    /** Rebuild the vertex arrays and primitive sets from the grid description, along with the SURFACE_BASE, SURFACE_TOP or
+      * SURFACE_WALLS define that compiles parametric.vert's choice of function and normal down to the one the geometry needs.*/
+    void build();
+
+    /** Replace the primitive set of a BASE or TOP grid to match the current strip and stitch settings, keeping the vertex arrays.*/
+    void buildPrimitives();
+
+    /** Fill in undisplaced grid positions to sample the surface function at when estimating the displaced bound,
+      * using at most density+1 samples along each axis of the whole grid, a tile gets its share of them.*/
+    void getBoundSamples(unsigned int density, std::vector<float>& x, std::vector<float>& y, std::vector<float>& z) const;
+
+    /** Set the bound of the displaced surface, covering all its instances when it has them. An invalid bound reverts to the
+      * conservative estimate from the grid alone.*/
+    void setDisplacedBound(const osg::BoundingBox& bb) { _displacedBound = bb; dirtyBound(); }
+    const osg::BoundingBox& getDisplacedBound() const { return _displacedBound; }
+
+    /** Conservative bound that assumes the displacement doesn't exceed the size of the grid, used until a displaced bound is assigned.*/
+    osg::BoundingBox computeConservativeBound() const;
+
+    virtual osg::BoundingBox computeBoundingBox() const;
+
+protected:
+
+    virtual ~SurfaceGeometry();
+
+    void buildMesh();
+    void buildVertexIDMesh();
+    void buildSideWalls();
+    void buildSolid();
+    void applyInstances();
+
+    Type                _type;
+    osg::Vec3           _origin;
+    osg::Vec3           _topOrigin;
+    osg::Vec3           _uAxis;
+    osg::Vec3           _vAxis;
+    unsigned int        _uCells;
+    unsigned int        _vCells;
+    unsigned int        _tileColumn;
+    unsigned int        _tileRow;
+    unsigned int        _tileUCells;
+    unsigned int        _tileVCells;
+    unsigned int        _stitchEdges;
+    bool                _useTriangleStrips;
+    bool                _useVertexID;
+
+    osg::ref_ptr<SurfaceInstances>  _instances;
+
+    osg::BoundingBox    _displacedBound;
+};
+
+/** Create the grid mesh for the base or top of a parametric surface.*/
+extern OSGPARAMETRIC_EXPORT osg::ref_ptr<SurfaceGeometry> createMesh(const osg::Vec3& origin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, unsigned int uCells, unsigned vCells, bool top, bool triangleStrips=false, bool vertexID=false);
+
+/** Create the grid mesh for the base or top of a parametric surface as a group of tiles of at most tileCells by tileCells cells,
+  * each with its own bound so the tiles can be culled individually. The default tile size keeps each tile below 65536 vertices
+  * so that the tiles use 16 bit indices. The tiles are built in parallel by the ThreadPool.*/
+extern OSGPARAMETRIC_EXPORT osg::ref_ptr<osg::Group> createTiledMesh(const osg::Vec3& origin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, unsigned int uCells, unsigned vCells, bool top,
+                                                                     unsigned int tileCells=254, bool triangleStrips=false, bool vertexID=false);
+
+/** Create the side walls joining the base and top grids.*/
+extern OSGPARAMETRIC_EXPORT osg::ref_ptr<SurfaceGeometry> createSideWalls(const osg::Vec3& baseOrigin, const osg::Vec3& topOrigin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, int uCells, int vCells);
+
+/** Create the base, top and side walls as one SOLID geometry, a third of the draws and state changes of building them separately.
+  * The solid uses 16 bit indices up to 178 by 178 cells, use createTiledSolid() for larger solids.*/
+extern OSGPARAMETRIC_EXPORT osg::ref_ptr<SurfaceGeometry> createSolid(const osg::Vec3& baseOrigin, const osg::Vec3& topOrigin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, unsigned int uCells, unsigned int vCells);
+
+/** Create a SOLID as a group of tiles of at most tileCells by tileCells cells, each with its share of the base and top grids and
+  * the pieces of the side walls along its outer edges. The default tile size keeps each tile below 65536 vertices so that the tiles
+  * use 16 bit indices. The tiles are built in parallel by the ThreadPool.*/
+extern OSGPARAMETRIC_EXPORT osg::ref_ptr<osg::Group> createTiledSolid(const osg::Vec3& baseOrigin, const osg::Vec3& topOrigin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, unsigned int uCells, unsigned int vCells,
+                                                                      unsigned int tileCells=178);
+
+}
+
+#endif
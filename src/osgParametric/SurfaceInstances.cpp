@@ -0,0 +1,176 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "SurfaceInstances.h"
+#include "SurfaceGeometry.h"
+
+#include <osg/NodeVisitor>
+#include <osg/Image>
+
+#include <algorithm>
+
+using namespace osgParametric;
+
+namespace
+{
+
+class InstanceSurfacesVisitor : public osg::NodeVisitor
+{
+public:
+
+    InstanceSurfacesVisitor(SurfaceInstances* instances):
+        osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN),
+        _instances(instances) {}
+
+    virtual void apply(osg::Drawable& drawable)
+    {
+        SurfaceGeometry* geometry = dynamic_cast<SurfaceGeometry*>(&drawable);
+        if (!geometry) return;
+
+        geometry->setInstances(_instances);
+        geometry->build();
+    }
+
+protected:
+
+    SurfaceInstances* _instances;
+};
+
+}
+
+SurfaceInstances::SurfaceInstances():
+    _textureUnit(13)
+{
+    setInternalFormat(GL_RGBA32F_ARB);
+    dirtyInstances();
+}
+
+SurfaceInstances::SurfaceInstances(const SurfaceInstances& rhs, const osg::CopyOp& copyop):
+    osg::TextureBuffer(rhs, copyop),
+    _instances(rhs._instances),
+    _textureUnit(rhs._textureUnit)
+{
+    // the copy fills its own image rather than the one it may share with rhs
+    setImage(0);
+    dirtyInstances();
+}
+
+SurfaceInstances::~SurfaceInstances()
+{
+}
+
+void SurfaceInstances::dirtyInstances()
+{
+    // a buffer can't be empty, so keep at least one texel
+    unsigned int numTexels = std::max(1u, getNumInstances()*4);
+
+    osg::ref_ptr<osg::Image> image = getImage();
+    if (!image || image->s()!=static_cast<int>(numTexels))
+    {
+        image = new osg::Image;
+        image->allocateImage(numTexels, 1, 1, GL_RGBA, GL_FLOAT);
+        image->setInternalTextureFormat(GL_RGBA32F_ARB);
+        setImage(image.get());
+        setTextureWidth(numTexels);
+    }
+
+    // origin, uAxis, vAxis and parameters of each instance
+    osg::Vec4* texels = reinterpret_cast<osg::Vec4*>(image->data());
+    for(Instances::const_iterator itr = _instances.begin(); itr != _instances.end(); ++itr)
+    {
+        *(texels++) = osg::Vec4(itr->origin, 1.0f);
+        *(texels++) = osg::Vec4(itr->uAxis, 0.0f);
+        *(texels++) = osg::Vec4(itr->vAxis, 0.0f);
+        *(texels++) = itr->parameters;
+    }
+
+    image->dirty();
+}
+
+void SurfaceInstances::addToStateSet(osg::StateSet* stateset)
+{
+    stateset->setTextureAttribute(_textureUnit, this, osg::StateAttribute::ON);
+    stateset->setDefine("SURFACE_INSTANCES");
+    stateset->addUniform(new osg::Uniform("surfaceInstances", static_cast<int>(_textureUnit)));
+}
+
+void SurfaceInstances::removeFromStateSet(osg::StateSet* stateset) const
+{
+    if (stateset->getTextureAttribute(_textureUnit, osg::StateAttribute::TEXTURE)==this)
+    {
+        stateset->removeTextureAttribute(_textureUnit, osg::StateAttribute::TEXTURE);
+    }
+    stateset->removeDefine("SURFACE_INSTANCES");
+    stateset->removeUniform("surfaceInstances");
+}
+
+osg::BoundingBox SurfaceInstances::transform(const osg::BoundingBox& bb) const
+{
+    osg::BoundingBox result;
+    if (!bb.valid()) return result;
+
+    for(Instances::const_iterator itr = _instances.begin(); itr != _instances.end(); ++itr)
+    {
+        for(unsigned int i=0; i<8; ++i)
+        {
+            result.expandBy(itr->transform(bb.corner(i)));
+        }
+    }
+    return result;
+}
+
+void SurfaceInstances::instanceSurfaces(osg::Node* subgraph)
+{
+    InstanceSurfacesVisitor isv(this);
+    subgraph->accept(isv);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  Serializers for SurfaceInstances
+//
+#include <osgDB/ObjectWrapper>
+#include <osgDB/InputStream>
+#include <osgDB/OutputStream>
+
+// the texture buffer's image is rebuilt from the instances on reading
+static bool checkInstances( const osgParametric::SurfaceInstances& instances )
+{
+    return instances.getNumInstances()>0;
+}
+
+static bool readInstances( osgDB::InputStream& is, osgParametric::SurfaceInstances& instances )
+{
+    osgParametric::SurfaceInstances::Instances list(is.readSize()); is >> is.BEGIN_BRACKET;
+    for ( osgParametric::SurfaceInstances::Instances::iterator itr = list.begin(); itr != list.end(); ++itr )
+    {
+        is >> itr->origin >> itr->uAxis >> itr->vAxis >> itr->parameters;
+    }
+    is >> is.END_BRACKET;
+    instances.setInstances( list );
+    return true;
+}
+
+static bool writeInstances( osgDB::OutputStream& os, const osgParametric::SurfaceInstances& instances )
+{
+    const osgParametric::SurfaceInstances::Instances& list = instances.getInstances();
+    os.writeSize( list.size() ); os << os.BEGIN_BRACKET << std::endl;
+    for ( osgParametric::SurfaceInstances::Instances::const_iterator itr = list.begin(); itr != list.end(); ++itr )
+    {
+        os << itr->origin << itr->uAxis << itr->vAxis << itr->parameters << std::endl;
+    }
+    os << os.END_BRACKET << std::endl;
+    return true;
+}
+
+REGISTER_OBJECT_WRAPPER( SurfaceInstances,
+                         new osgParametric::SurfaceInstances,
+                         osgParametric::SurfaceInstances,
+                         "osg::Object osg::StateAttribute osg::Texture osgParametric::SurfaceInstances" )
+{
+    ADD_USER_SERIALIZER( Instances );
+    ADD_UINT_SERIALIZER( TextureUnit, 13 );
+}
@@ -0,0 +1,103 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_SURFACEINSTANCES
+#define OSGPARAMETRIC_SURFACEINSTANCES 1
+
+#include <osgParametric/Export>
+
+#include <osg/TextureBuffer>
+#include <osg/Node>
+#include <osg/StateSet>
+#include <osg/BoundingBox>
+#include <osg/Vec3>
+#include <osg/Vec4>
+
+#include <vector>
+
+namespace osgParametric
+{
+
+/** Placements of many copies of a surface drawn with a single instanced draw per pass. Each instance maps the surface's own
+  * coordinates on to its origin and axes, x along uAxis, y along vAxis and z along their unit normal, so instances can be moved,
+  * scaled and sheared across the grid while keeping the heights of the displacement. Each also carries four parameters that the
+  * surface functions read as instanceParameter0 to instanceParameter3, so the instances share one function and program.
+  * The instances are held in a GL_RGBA32F texture buffer of four texels each, read by parametric.vert with gl_InstanceID,
+  * which needs GL_EXT_gpu_shader4 and GL_ARB_draw_instanced. Set the DataVariance to DYNAMIC if the instances are changed while
+  * being drawn.*/
+class OSGPARAMETRIC_EXPORT SurfaceInstances : public osg::TextureBuffer
+{
+public:
+
+    SurfaceInstances();
+
+    /** Copy constructor using CopyOp to manage deep vs shallow copy. */
+    SurfaceInstances(const SurfaceInstances& rhs, const osg::CopyOp& copyop=osg::CopyOp::SHALLOW_COPY);
+
+    META_StateAttribute(osgParametric, SurfaceInstances, TEXTURE);
+
+    struct Instance
+    {
+        Instance(): uAxis(1.0f, 0.0f, 0.0f), vAxis(0.0f, 1.0f, 0.0f) {}
+
+        Instance(const osg::Vec3& o, const osg::Vec3& u, const osg::Vec3& v, const osg::Vec4& p=osg::Vec4()):
+            origin(o), uAxis(u), vAxis(v), parameters(p) {}
+
+        /** Unit normal of the axes, the direction the surface's z maps to.*/
+        osg::Vec3 getWAxis() const { osg::Vec3 w(uAxis ^ vAxis); w.normalize(); return w; }
+
+        /** Position of a point given in the surface's own coordinates.*/
+        osg::Vec3 transform(const osg::Vec3& p) const { return origin + uAxis*p.x() + vAxis*p.y() + getWAxis()*p.z(); }
+
+        osg::Vec3   origin;
+        osg::Vec3   uAxis;
+        osg::Vec3   vAxis;
+        osg::Vec4   parameters;
+    };
+
+    typedef std::vector<Instance> Instances;
+
+    void setInstances(const Instances& instances) { _instances = instances; dirtyInstances(); }
+    const Instances& getInstances() const { return _instances; }
+
+    void addInstance(const Instance& instance) { _instances.push_back(instance); dirtyInstances(); }
+
+    void setInstance(unsigned int i, const Instance& instance) { _instances[i] = instance; dirtyInstances(); }
+    const Instance& getInstance(unsigned int i) const { return _instances[i]; }
+
+    unsigned int getNumInstances() const { return static_cast<unsigned int>(_instances.size()); }
+
+    /** Copy the instances into the texture buffer's image, done by the setters. The SurfaceGeometry drawing them needs rebuilding
+      * when the number of instances changes, and ParametricScene::updateSurfaceBounds() calling when they move.*/
+    void dirtyInstances();
+
+    /** Set the texture unit used by addToStateSet(), 13 by default to keep clear of the depth textures bound from unit 0 and
+      * the units ParametricScene and HeightFieldTexture use.*/
+    void setTextureUnit(unsigned int unit) { _textureUnit = unit; }
+    unsigned int getTextureUnit() const { return _textureUnit; }
+
+    /** Assign the texture, the SURFACE_INSTANCES define and the surfaceInstances uniform that parametric.vert uses.*/
+    void addToStateSet(osg::StateSet* stateset);
+
+    /** Remove what addToStateSet() assigned.*/
+    void removeFromStateSet(osg::StateSet* stateset) const;
+
+    /** Bound of every instance of a box given in the surface's own coordinates.*/
+    osg::BoundingBox transform(const osg::BoundingBox& bb) const;
+
+    /** Set instances on all the SurfaceGeometry in a subgraph and rebuild them, SurfaceLOD patches aren't instanced.*/
+    void instanceSurfaces(osg::Node* subgraph);
+
+protected:
+
+    virtual ~SurfaceInstances();
+
+    Instances       _instances;
+    unsigned int    _textureUnit;
+};
+
+}
+
+#endif
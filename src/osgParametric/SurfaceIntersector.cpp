@@ -0,0 +1,475 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "SurfaceIntersector.h"
+#include "ThreadPool.h"
+
+#include <osg/NodeVisitor>
+#include <osgUtil/IntersectionVisitor>
+#include <osgUtil/LineSegmentIntersector>
+
+#include <cfloat>
+#include <algorithm>
+
+using namespace osgParametric;
+
+namespace
+{
+
+// segments per chunk of the batch, enough to amortise a traversal of each boundary over
+const unsigned int s_grainSize = 16;
+
+class CollectGeometryVisitor : public osg::NodeVisitor
+{
+public:
+
+    struct Entry
+    {
+        osg::ref_ptr<SurfaceGeometry>   geometry;
+        osg::Matrixd                    localToWorld;
+    };
+
+    CollectGeometryVisitor():
+        osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN) {}
+
+    virtual void apply(osg::Drawable& drawable)
+    {
+        SurfaceGeometry* geometry = dynamic_cast<SurfaceGeometry*>(&drawable);
+        if (!geometry || geometry->getType()==SurfaceGeometry::SIDE_WALLS || geometry->getType()==SurfaceGeometry::SOLID) return;
+        if (geometry->getNumTileUCells()==0 || geometry->getNumTileVCells()==0) return;
+
+        Entry entry;
+        entry.geometry = geometry;
+        entry.localToWorld = osg::computeLocalToWorld(getNodePath());
+        entries.push_back(entry);
+    }
+
+    std::vector<Entry> entries;
+};
+
+/** Clip [t0, t1] of the segment s+d*t to the box, returns false if it misses.*/
+bool intersectBox(const osg::Vec3d& s, const osg::Vec3d& d, const osg::Vec3d& lower, const osg::Vec3d& upper, double& t0, double& t1)
+{
+    for(unsigned int i=0; i<3; ++i)
+    {
+        if (d[i]==0.0)
+        {
+            if (s[i]<lower[i] || s[i]>upper[i]) return false;
+            continue;
+        }
+
+        double a = (lower[i]-s[i])/d[i];
+        double b = (upper[i]-s[i])/d[i];
+        if (a>b) std::swap(a, b);
+
+        t0 = std::max(t0, a);
+        t1 = std::min(t1, b);
+        if (t0>t1) return false;
+    }
+    return true;
+}
+
+/** Moller-Trumbore, triangles with a NaN height are missed as the shaders leave them undrawn.*/
+bool intersectTriangle(const osg::Vec3d& s, const osg::Vec3d& d, const osg::Vec3d& v0, const osg::Vec3d& v1, const osg::Vec3d& v2, double& t)
+{
+    osg::Vec3d e1 = v1-v0;
+    osg::Vec3d e2 = v2-v0;
+    osg::Vec3d p = d ^ e2;
+    double det = e1*p;
+    if (det==0.0 || det!=det) return false;
+
+    double inverseDet = 1.0/det;
+    osg::Vec3d tv = s-v0;
+    double u = (tv*p)*inverseDet;
+    if (u<0.0 || u>1.0) return false;
+
+    osg::Vec3d q = tv ^ e1;
+    double v = (d*q)*inverseDet;
+    if (v<0.0 || u+v>1.0) return false;
+
+    t = (e2*q)*inverseDet;
+    return true;
+}
+
+}
+
+class SurfaceIntersector::IntersectSegmentsTask : public ThreadPool::Task
+{
+public:
+
+    IntersectSegmentsTask(const SurfaceIntersector& intersector, const osg::Vec3d* starts, const osg::Vec3d* ends, Hit* hits):
+        _intersector(intersector),
+        _starts(starts),
+        _ends(ends),
+        _hits(hits) {}
+
+    virtual void operator()(unsigned int begin, unsigned int end)
+    {
+        unsigned int numSegments = end-begin;
+        unsigned int numBoundaries = _intersector._clipToBoundaries ? static_cast<unsigned int>(_intersector._boundaries.size()) : 0;
+
+        // nearest and furthest intersection of each segment with each boundary, a segment that misses gets an empty range
+        std::vector<osg::Vec2d> ranges(numBoundaries*numSegments, osg::Vec2d(1.0, 0.0));
+        for(unsigned int b=0; b<numBoundaries; ++b)
+        {
+            osg::ref_ptr<osgUtil::IntersectorGroup> group = new osgUtil::IntersectorGroup;
+            std::vector< osg::ref_ptr<osgUtil::LineSegmentIntersector> > intersectors(numSegments);
+            for(unsigned int i=0; i<numSegments; ++i)
+            {
+                intersectors[i] = new osgUtil::LineSegmentIntersector(_starts[begin+i], _ends[begin+i]);
+                group->addIntersector(intersectors[i].get());
+            }
+
+            osgUtil::IntersectionVisitor iv(group.get());
+            _intersector._boundaries[b]->accept(iv);
+
+            for(unsigned int i=0; i<numSegments; ++i)
+            {
+                const osgUtil::LineSegmentIntersector::Intersections& intersections = intersectors[i]->getIntersections();
+                if (intersections.empty()) continue;
+
+                ranges[b*numSegments+i].set(intersections.begin()->ratio, intersections.rbegin()->ratio);
+            }
+        }
+
+        for(unsigned int i=0; i<numSegments; ++i)
+        {
+            Hit& hit = _hits[begin+i];
+            hit = Hit();
+
+            for(Surfaces::const_iterator itr = _intersector._surfaces.begin();
+                itr != _intersector._surfaces.end();
+                ++itr)
+            {
+                const Surface& surface = *(itr->get());
+
+                // parametric.frag only keeps fragments between the nearest and furthest depths of each boundary
+                double tMin = 0.0;
+                double tMax = hit.valid() ? hit.ratio : 1.0;
+                if (numBoundaries>0)
+                {
+                    const std::vector<unsigned int>& boundaries = _intersector._subgraphBoundaries[surface.subgraph];
+                    for(std::vector<unsigned int>::const_iterator bitr = boundaries.begin(); bitr != boundaries.end(); ++bitr)
+                    {
+                        const osg::Vec2d& range = ranges[(*bitr)*numSegments+i];
+                        tMin = std::max(tMin, range.x());
+                        tMax = std::min(tMax, range.y());
+                    }
+                }
+                if (tMin>tMax) continue;
+
+                Hit surfaceHit;
+                if (_intersector.intersect(surface, _starts[begin+i], _ends[begin+i], tMin, tMax, surfaceHit)) hit = surfaceHit;
+            }
+        }
+    }
+
+protected:
+
+    const SurfaceIntersector&   _intersector;
+    const osg::Vec3d*           _starts;
+    const osg::Vec3d*           _ends;
+    Hit*                        _hits;
+};
+
+SurfaceIntersector::SurfaceIntersector(ParametricScene* scene):
+    _scene(scene),
+    _clipToBoundaries(true)
+{
+}
+
+SurfaceIntersector::~SurfaceIntersector()
+{
+}
+
+void SurfaceIntersector::build(double simulationTime)
+{
+    _surfaces.clear();
+    _boundaries.clear();
+    _subgraphBoundaries.clear();
+
+    osg::ref_ptr<ParametricScene> scene;
+    if (!_scene.lock(scene)) return;
+
+    std::vector<int> boundaryIndices(scene->getNumSubgraphs(), -1);
+    for(unsigned int i=0; i<scene->getNumSubgraphs(); ++i)
+    {
+        if (!scene->getSubgraph(i) || !scene->getSubgraphRequiresDepthSubgraph(i)) continue;
+
+        boundaryIndices[i] = static_cast<int>(_boundaries.size());
+        _boundaries.push_back(scene->getSubgraph(i));
+    }
+
+    _subgraphBoundaries.resize(scene->getNumSubgraphs());
+    for(unsigned int i=0; i<scene->getNumSubgraphs(); ++i)
+    {
+        // a subgraph isn't clipped by its own depth
+        for(unsigned int j=0; j<scene->getNumSubgraphs(); ++j)
+        {
+            if (j!=i && boundaryIndices[j]>=0) _subgraphBoundaries[i].push_back(static_cast<unsigned int>(boundaryIndices[j]));
+        }
+
+        if (!scene->getSubgraph(i)) continue;
+
+        CollectGeometryVisitor cgv;
+        scene->getSubgraph(i)->accept(cgv);
+
+        for(std::vector<CollectGeometryVisitor::Entry>::iterator itr = cgv.entries.begin();
+            itr != cgv.entries.end();
+            ++itr)
+        {
+            osg::ref_ptr<Surface> surface = new Surface;
+            if (!scene->findSurfaceFunction(itr->geometry.get(), surface->function)) continue;
+
+            SurfaceGeometry* geometry = itr->geometry.get();
+            surface->geometry = geometry;
+            surface->subgraph = i;
+            surface->columns = geometry->getNumTileUCells();
+            surface->rows = geometry->getNumTileVCells();
+            surface->firstColumn = geometry->getTileColumn();
+            surface->firstRow = geometry->getTileRow();
+
+            osg::Vec3d du = geometry->getUAxis()/static_cast<float>(geometry->getUCells());
+            osg::Vec3d dv = geometry->getVAxis()/static_cast<float>(geometry->getVCells());
+            osg::Vec3d h = geometry->getVerticalAxis();
+            osg::Vec3d o = osg::Vec3d(geometry->getOrigin()) + du*static_cast<double>(surface->firstColumn) + dv*static_cast<double>(surface->firstRow);
+
+            osg::Matrixd gridToLocal(du.x(), du.y(), du.z(), 0.0,
+                                     dv.x(), dv.y(), dv.z(), 0.0,
+                                     h.x(),  h.y(),  h.z(),  0.0,
+                                     o.x(),  o.y(),  o.z(),  1.0);
+
+            surface->gridToWorld = gridToLocal * itr->localToWorld;
+            if (!surface->worldToGrid.invert(surface->gridToWorld)) continue;
+
+            buildHeights(*surface, simulationTime);
+            buildPyramid(*surface);
+            _surfaces.push_back(surface);
+        }
+    }
+}
+
+void SurfaceIntersector::update(double simulationTime)
+{
+    for(Surfaces::iterator itr = _surfaces.begin();
+        itr != _surfaces.end();
+        ++itr)
+    {
+        Surface& surface = *(itr->get());
+        if (!surface.function || !surface.function->isTimeDependent()) continue;
+
+        buildHeights(surface, simulationTime);
+        buildPyramid(surface);
+    }
+}
+
+void SurfaceIntersector::buildHeights(Surface& surface, double simulationTime) const
+{
+    const SurfaceGeometry* geometry = surface.geometry.get();
+    unsigned int numColumns = surface.columns+1;
+    unsigned int numRows = surface.rows+1;
+    unsigned int numVertices = numColumns*numRows;
+
+    surface.heights.assign(numVertices, 0.0f);
+    if (!surface.function) return;
+
+    // the undisplaced vertices, as the shaders see them in gl_Vertex
+    std::vector<float> x(numVertices), y(numVertices), z(numVertices);
+    for(unsigned int r=0; r<numRows; ++r)
+    {
+        float t = static_cast<float>(surface.firstRow+r)/static_cast<float>(geometry->getVCells());
+        for(unsigned int c=0; c<numColumns; ++c)
+        {
+            float s = static_cast<float>(surface.firstColumn+c)/static_cast<float>(geometry->getUCells());
+            osg::Vec3 p = geometry->getOrigin() + geometry->getUAxis()*s + geometry->getVAxis()*t;
+
+            unsigned int i = c+r*numColumns;
+            x[i] = p.x(); y[i] = p.y(); z[i] = p.z();
+        }
+    }
+
+    surface.function->evaluate(numVertices, &x.front(), &y.front(), &z.front(), static_cast<float>(simulationTime), &surface.heights.front());
+}
+
+void SurfaceIntersector::buildPyramid(Surface& surface) const
+{
+    surface.pyramid.clear();
+
+    Level cells;
+    cells.columns = surface.columns;
+    cells.rows = surface.rows;
+    cells.ranges.resize(cells.columns*cells.rows);
+    for(unsigned int r=0; r<cells.rows; ++r)
+    {
+        for(unsigned int c=0; c<cells.columns; ++c)
+        {
+            // NaN heights fail the comparisons so are left out, a cell with no heights gets an empty range
+            osg::Vec2 range(FLT_MAX, -FLT_MAX);
+            float corners[4] = { surface.getHeight(c, r), surface.getHeight(c+1, r), surface.getHeight(c, r+1), surface.getHeight(c+1, r+1) };
+            for(unsigned int i=0; i<4; ++i)
+            {
+                if (corners[i]<range.x()) range.x() = corners[i];
+                if (corners[i]>range.y()) range.y() = corners[i];
+            }
+            cells.ranges[c+r*cells.columns] = range;
+        }
+    }
+    surface.pyramid.push_back(cells);
+
+    while(surface.pyramid.back().columns>1 || surface.pyramid.back().rows>1)
+    {
+        const Level& below = surface.pyramid.back();
+
+        Level level;
+        level.columns = (below.columns+1)/2;
+        level.rows = (below.rows+1)/2;
+        level.ranges.resize(level.columns*level.rows, osg::Vec2(FLT_MAX, -FLT_MAX));
+        for(unsigned int r=0; r<below.rows; ++r)
+        {
+            for(unsigned int c=0; c<below.columns; ++c)
+            {
+                const osg::Vec2& child = below.ranges[c+r*below.columns];
+                osg::Vec2& range = level.ranges[c/2+(r/2)*level.columns];
+                range.x() = std::min(range.x(), child.x());
+                range.y() = std::max(range.y(), child.y());
+            }
+        }
+
+        // push_back may reallocate, so below isn't used past here
+        surface.pyramid.push_back(level);
+    }
+}
+
+bool SurfaceIntersector::intersect(const Surface& surface, const osg::Vec3d& start, const osg::Vec3d& end, double tMin, double tMax, Hit& hit) const
+{
+    if (surface.pyramid.empty()) return false;
+
+    osg::Vec3d s = start * surface.worldToGrid;
+    osg::Vec3d d = end * surface.worldToGrid - s;
+
+    struct Node
+    {
+        unsigned int    level;
+        unsigned int    column;
+        unsigned int    row;
+        double          t;
+    };
+
+    // bound of a node of the pyramid in grid coordinates
+    struct Bound
+    {
+        static void get(const Surface& surface, unsigned int level, unsigned int column, unsigned int row, osg::Vec3d& lower, osg::Vec3d& upper)
+        {
+            const osg::Vec2& range = surface.pyramid[level].ranges[column+row*surface.pyramid[level].columns];
+            lower.set(static_cast<double>(column<<level), static_cast<double>(row<<level), range.x());
+            upper.set(static_cast<double>(std::min((column+1)<<level, surface.columns)), static_cast<double>(std::min((row+1)<<level, surface.rows)), range.y());
+        }
+    };
+
+    unsigned int top = static_cast<unsigned int>(surface.pyramid.size())-1;
+
+    osg::Vec3d lower, upper;
+    Bound::get(surface, top, 0, 0, lower, upper);
+    double t0 = tMin, t1 = tMax;
+    if (!intersectBox(s, d, lower, upper, t0, t1)) return false;
+
+    std::vector<Node> stack;
+    Node root = { top, 0, 0, t0 };
+    stack.push_back(root);
+
+    double nearest = tMax;
+    bool found = false;
+    unsigned int hitColumn = 0, hitRow = 0;
+    osg::Vec3d hitTriangle[3];
+
+    while(!stack.empty())
+    {
+        Node node = stack.back();
+        stack.pop_back();
+        if (node.t>nearest) continue;
+
+        if (node.level==0)
+        {
+            // the two triangles of the cell as GridTopology and parametric.vert split it, p0=(c,r), p1=(c,r+1), p2=(c+1,r), p3=(c+1,r+1)
+            unsigned int c = node.column;
+            unsigned int r = node.row;
+            osg::Vec3d p0(c, r, surface.getHeight(c, r));
+            osg::Vec3d p1(c, r+1, surface.getHeight(c, r+1));
+            osg::Vec3d p2(c+1, r, surface.getHeight(c+1, r));
+            osg::Vec3d p3(c+1, r+1, surface.getHeight(c+1, r+1));
+
+            const osg::Vec3d* triangles[2][3] = { { &p0, &p1, &p2 }, { &p2, &p1, &p3 } };
+            for(unsigned int i=0; i<2; ++i)
+            {
+                double t;
+                if (!intersectTriangle(s, d, *triangles[i][0], *triangles[i][1], *triangles[i][2], t) || t<tMin || t>nearest) continue;
+
+                nearest = t;
+                found = true;
+                hitColumn = c;
+                hitRow = r;
+                for(unsigned int j=0; j<3; ++j) hitTriangle[j] = *triangles[i][j];
+            }
+            continue;
+        }
+
+        // visit the children nearest first, so the later ones are usually skipped once a hit is found
+        Node children[4];
+        unsigned int numChildren = 0;
+        const Level& below = surface.pyramid[node.level-1];
+        for(unsigned int j=0; j<2; ++j)
+        {
+            for(unsigned int i=0; i<2; ++i)
+            {
+                unsigned int c = node.column*2+i;
+                unsigned int r = node.row*2+j;
+                if (c>=below.columns || r>=below.rows) continue;
+
+                Bound::get(surface, node.level-1, c, r, lower, upper);
+                t0 = tMin; t1 = nearest;
+                if (!intersectBox(s, d, lower, upper, t0, t1)) continue;
+
+                Node child = { node.level-1, c, r, t0 };
+                unsigned int k = numChildren++;
+                while(k>0 && children[k-1].t<child.t) { children[k] = children[k-1]; --k; }
+                children[k] = child;
+            }
+        }
+
+        for(unsigned int i=0; i<numChildren; ++i) stack.push_back(children[i]);
+    }
+
+    if (!found) return false;
+
+    osg::Vec3d w0 = hitTriangle[0] * surface.gridToWorld;
+    osg::Vec3d w1 = hitTriangle[1] * surface.gridToWorld;
+    osg::Vec3d w2 = hitTriangle[2] * surface.gridToWorld;
+    osg::Vec3d normal = (w1-w0) ^ (w2-w0);
+    normal.normalize();
+    if (normal*(end-start)>0.0) normal = -normal;
+
+    hit.ratio = nearest;
+    hit.point = start + (end-start)*nearest;
+    hit.normal = normal;
+    hit.geometry = surface.geometry;
+    hit.column = surface.firstColumn+hitColumn;
+    hit.row = surface.firstRow+hitRow;
+    return true;
+}
+
+bool SurfaceIntersector::intersect(const osg::Vec3d& start, const osg::Vec3d& end, Hit& hit) const
+{
+    intersect(1, &start, &end, &hit);
+    return hit.valid();
+}
+
+void SurfaceIntersector::intersect(unsigned int numSegments, const osg::Vec3d* starts, const osg::Vec3d* ends, Hit* hits) const
+{
+    if (numSegments==0) return;
+
+    IntersectSegmentsTask task(*this, starts, ends, hits);
+    if (numSegments<=s_grainSize) task(0, numSegments);
+    else ThreadPool::instance()->run(numSegments, s_grainSize, task);
+}
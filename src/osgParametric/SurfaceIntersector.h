@@ -0,0 +1,135 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_SURFACEINTERSECTOR
+#define OSGPARAMETRIC_SURFACEINTERSECTOR 1
+
+#include <osgParametric/Export>
+#include <osgParametric/ParametricScene.h>
+
+#include <osg/Matrixd>
+#include <osg/Vec2>
+#include <osg/Vec3d>
+
+#include <vector>
+
+namespace osgParametric
+{
+
+/** Intersects line segments with the displaced surfaces of a ParametricScene rather than the flat grids osgUtil::LineSegmentIntersector
+  * sees. The surface functions are evaluated on the host at the vertices of each grid, so hits lie on the same triangles the shaders
+  * draw, and a min/max pyramid of the heights lets a segment skip all but the cells it passes close to. Hits are clipped against
+  * the boundaries the way parametric.frag clips fragments, a surface point being kept only if it lies between the nearest and
+  * furthest intersections of the segment with each of the other subgraphs that capture depth.
+  * BASE and TOP grids are handled, side walls, SOLID geometries, SurfaceLOD patches, instanced and heightfield surfaces aren't.*/
+class OSGPARAMETRIC_EXPORT SurfaceIntersector : public osg::Referenced
+{
+public:
+
+    SurfaceIntersector(ParametricScene* scene=0);
+
+    void setScene(ParametricScene* scene) { _scene = scene; }
+    ParametricScene* getScene() const { return _scene.get(); }
+
+    /** Set whether hits are clipped by the scene's boundaries, true by default.*/
+    void setClipToBoundaries(bool flag) { _clipToBoundaries = flag; }
+    bool getClipToBoundaries() const { return _clipToBoundaries; }
+
+    /** Collect the surfaces of the scene, which must have been set up, and build their heights at simulationTime.
+      * Call from the update traversal or between frames, and not while intersecting.*/
+    void build(double simulationTime=0.0);
+
+    /** Rebuild the heights of the surfaces animated by osg_SimulationTime, for picking an animated scene each frame.*/
+    void update(double simulationTime);
+
+    unsigned int getNumSurfaces() const { return static_cast<unsigned int>(_surfaces.size()); }
+
+    struct Hit
+    {
+        Hit(): ratio(-1.0), column(0), row(0) {}
+
+        bool valid() const { return geometry.valid(); }
+
+        /** Fraction of the way from start to end.*/
+        double                          ratio;
+        osg::Vec3d                      point;
+
+        /** Normal of the triangle hit, facing the start of the segment.*/
+        osg::Vec3                       normal;
+
+        osg::ref_ptr<SurfaceGeometry>   geometry;
+
+        /** Cell of the geometry's grid that was hit.*/
+        unsigned int                    column;
+        unsigned int                    row;
+    };
+
+    /** Find the nearest hit along the segment from start to end, returns false if there's none.*/
+    bool intersect(const osg::Vec3d& start, const osg::Vec3d& end, Hit& hit) const;
+
+    /** Find the nearest hit of each of numSegments segments, split across the ThreadPool. Hits that miss are left invalid.*/
+    void intersect(unsigned int numSegments, const osg::Vec3d* starts, const osg::Vec3d* ends, Hit* hits) const;
+
+protected:
+
+    virtual ~SurfaceIntersector();
+
+    /** Levels of the min/max pyramid, level 0 holds the range of heights of each cell, each level above it the range of 2x2 of the level below.*/
+    struct Level
+    {
+        Level(): columns(0), rows(0) {}
+
+        unsigned int            columns;
+        unsigned int            rows;
+        std::vector<osg::Vec2>  ranges;
+    };
+
+    struct Surface : public osg::Referenced
+    {
+        Surface(): subgraph(0), columns(0), rows(0), firstColumn(0), firstRow(0) {}
+
+        osg::ref_ptr<SurfaceGeometry>   geometry;
+        osg::ref_ptr<SurfaceFunction>   function;
+        unsigned int                    subgraph;
+
+        // cells of the tile, and its first cell in the whole grid
+        unsigned int                    columns;
+        unsigned int                    rows;
+        unsigned int                    firstColumn;
+        unsigned int                    firstRow;
+
+        // grid coordinates are (column, row, height) relative to the tile's first vertex
+        osg::Matrixd                    gridToWorld;
+        osg::Matrixd                    worldToGrid;
+
+        std::vector<float>              heights;
+        std::vector<Level>              pyramid;
+
+        float getHeight(unsigned int c, unsigned int r) const { return heights[c+r*(columns+1)]; }
+    };
+
+    typedef std::vector< osg::ref_ptr<Surface> > Surfaces;
+
+    void buildHeights(Surface& surface, double simulationTime) const;
+
+    void buildPyramid(Surface& surface) const;
+
+    /** Nearest hit with the surface's triangles in [tMin, tMax] of the segment, returns false if there's none.*/
+    bool intersect(const Surface& surface, const osg::Vec3d& start, const osg::Vec3d& end, double tMin, double tMax, Hit& hit) const;
+
+    class IntersectSegmentsTask;
+
+    osg::observer_ptr<ParametricScene>      _scene;
+    bool                                    _clipToBoundaries;
+    Surfaces                                _surfaces;
+
+    // the subgraphs that capture depth, and the indices of those among them that clip the surfaces of each subgraph
+    std::vector< osg::ref_ptr<osg::Node> >      _boundaries;
+    std::vector< std::vector<unsigned int> >    _subgraphBoundaries;
+};
+
+}
+
+#endif
@@ -0,0 +1,521 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "SurfaceLOD.h"
+#include "PassTimer.h"
+
+#include <osgUtil/CullVisitor>
+#include <OpenThreads/ScopedLock>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+using namespace osgParametric;
+
+namespace
+{
+
+// number of sample intervals along each axis of a patch used to estimate its bound and curvature
+const unsigned int s_patchSamples = 16;
+
+}
+
+SurfaceLOD::SurfaceLOD():
+    _type(SurfaceGeometry::TOP),
+    _uAxis(1.0f, 0.0f, 0.0f),
+    _vAxis(0.0f, 1.0f, 0.0f),
+    _patchCells(32),
+    _maxLevel(8),
+    _maxScreenError(2.0f),
+    _boundsMargin(0.05f),
+    _expiryFrames(60),
+    _useTriangleStrips(false),
+    _functionRevision(0)
+{
+}
+
+SurfaceLOD::SurfaceLOD(SurfaceGeometry::Type type, const osg::Vec3& origin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, unsigned int patchCells, unsigned int maxLevel):
+    _type(type),
+    _origin(origin),
+    _uAxis(uAxis),
+    _vAxis(vAxis),
+    _patchCells(32),
+    _maxLevel(maxLevel),
+    _maxScreenError(2.0f),
+    _boundsMargin(0.05f),
+    _expiryFrames(60),
+    _useTriangleStrips(false),
+    _functionRevision(0)
+{
+    setPatchCells(patchCells);
+    build();
+}
+
+SurfaceLOD::SurfaceLOD(const SurfaceLOD& lod, const osg::CopyOp& copyop):
+    osg::Group(lod, copyop),
+    _type(lod._type),
+    _origin(lod._origin),
+    _uAxis(lod._uAxis),
+    _vAxis(lod._vAxis),
+    _patchCells(lod._patchCells),
+    _maxLevel(lod._maxLevel),
+    _maxScreenError(lod._maxScreenError),
+    _boundsMargin(lod._boundsMargin),
+    _expiryFrames(lod._expiryFrames),
+    _useTriangleStrips(lod._useTriangleStrips),
+    _function(lod._function),
+    _functionRevision(0)
+{
+}
+
+SurfaceLOD::~SurfaceLOD()
+{
+}
+
+void SurfaceLOD::setSurfaceFunction(SurfaceFunction* function)
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    _function = function;
+
+    // the errors and bounds of the cached patches are no longer valid, each view re-evaluates its own on its next cull traversal
+    ++_functionRevision;
+}
+
+void SurfaceLOD::build()
+{
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+        _views.clear();
+    }
+
+    osg::ref_ptr<SurfaceGeometry> root = new SurfaceGeometry;
+    root->setType(_type);
+    root->setOrigin(_origin);
+    root->setTopOrigin(_origin);
+    root->setUAxis(_uAxis);
+    root->setVAxis(_vAxis);
+    root->setUCells(_patchCells);
+    root->setVCells(_patchCells);
+    root->setUseTriangleStrips(_useTriangleStrips);
+    root->build();
+
+    removeChildren(0, getNumChildren());
+    addChild(root.get());
+}
+
+unsigned int SurfaceLOD::getNumPatches() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+    unsigned int numPatches = 0;
+    for(Views::const_iterator itr = _views.begin(); itr != _views.end(); ++itr)
+    {
+        numPatches += itr->second->numPatches;
+    }
+    return numPatches;
+}
+
+osg::ref_ptr<SurfaceLOD::View> SurfaceLOD::getView(const osg::NodeVisitor* nv, unsigned int frameNumber)
+{
+    unsigned int functionRevision = 0;
+    osg::ref_ptr<View> view;
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+
+        // discard the patches of views that have stopped culling the node
+        Views::iterator itr = _views.begin();
+        while(itr != _views.end())
+        {
+            if (itr->first!=nv && itr->second->lastCullFrame+_expiryFrames<frameNumber) _views.erase(itr++);
+            else ++itr;
+        }
+
+        osg::ref_ptr<View>& entry = _views[nv];
+        if (!entry) entry = new View;
+        entry->lastCullFrame = frameNumber;
+
+        view = entry;
+        functionRevision = _functionRevision;
+    }
+
+    if (view->functionRevision!=functionRevision)
+    {
+        for(Patches::iterator itr = view->patches.begin(); itr != view->patches.end(); ++itr)
+        {
+            itr->second->evaluated = false;
+        }
+        view->functionRevision = functionRevision;
+    }
+
+    return view;
+}
+
+SurfaceLOD::Patch* SurfaceLOD::getPatch(View& view, const PatchKey& key, double time, unsigned int frameNumber)
+{
+    osg::ref_ptr<Patch>& patch = view.patches[key];
+    if (!patch) patch = new Patch;
+
+    if (!patch->evaluated || (patch->time!=time && _function.valid() && _function->isTimeDependent()))
+    {
+        evaluatePatch(key, *patch, time);
+    }
+
+    patch->frameLastUsed = frameNumber;
+    return patch.get();
+}
+
+void SurfaceLOD::evaluatePatch(const PatchKey& key, Patch& patch, double time)
+{
+    const unsigned int n = s_patchSamples+1;
+    const unsigned int numSamples = n*n;
+
+    float levelScale = 1.0f/static_cast<float>(1u<<key.level);
+
+    std::vector<float> x(numSamples), y(numSamples), z(numSamples), d(numSamples, 0.0f);
+    for(unsigned int j=0; j<n; ++j)
+    {
+        float t = (static_cast<float>(key.row) + static_cast<float>(j)/static_cast<float>(s_patchSamples))*levelScale;
+        for(unsigned int i=0; i<n; ++i)
+        {
+            float s = (static_cast<float>(key.column) + static_cast<float>(i)/static_cast<float>(s_patchSamples))*levelScale;
+            osg::Vec3 p = _origin + _uAxis*s + _vAxis*t;
+            x[i+j*n] = p.x(); y[i+j*n] = p.y(); z[i+j*n] = p.z();
+        }
+    }
+
+    if (_function.valid()) _function->evaluate(numSamples, &x.front(), &y.front(), &z.front(), static_cast<float>(time), &d.front());
+
+    osg::Vec3 verticalAxis(_uAxis ^ _vAxis);
+    verticalAxis.normalize();
+
+    // second differences of the displacement give the curvature of the surface at the scale of the samples
+    float minDisplacement = FLT_MAX;
+    float maxDisplacement = -FLT_MAX;
+    float maxSecondDifference = 0.0f;
+    osg::BoundingBox bb;
+    for(unsigned int j=0; j<n; ++j)
+    {
+        for(unsigned int i=0; i<n; ++i)
+        {
+            unsigned int k = i+j*n;
+            if (d[k]!=d[k]) continue;
+
+            bb.expandBy(osg::Vec3(x[k], y[k], z[k]) + verticalAxis*d[k]);
+            minDisplacement = std::min(minDisplacement, d[k]);
+            maxDisplacement = std::max(maxDisplacement, d[k]);
+
+            if (i>0 && i<n-1)
+            {
+                float du = d[k-1]-2.0f*d[k]+d[k+1];
+                if (du==du) maxSecondDifference = std::max(maxSecondDifference, std::abs(du));
+            }
+            if (j>0 && j<n-1)
+            {
+                float dv = d[k-n]-2.0f*d[k]+d[k+n];
+                if (dv==dv) maxSecondDifference = std::max(maxSecondDifference, std::abs(dv));
+            }
+            if (i>0 && i<n-1 && j>0 && j<n-1)
+            {
+                float duv = (d[k+n+1]-d[k+n-1]-d[k-n+1]+d[k-n-1])*0.25f;
+                if (duv==duv) maxSecondDifference = std::max(maxSecondDifference, std::abs(duv));
+            }
+        }
+    }
+
+    if (bb.valid())
+    {
+        // the interpolation error between samples is about an eighth of the second difference, plus the usual margin for missed peaks
+        float margin = maxSecondDifference*0.125f + (maxDisplacement-minDisplacement)*_boundsMargin;
+        bb.expandBy(bb.corner(0) - verticalAxis*margin);
+        bb.expandBy(bb.corner(7) + verticalAxis*margin);
+    }
+    else
+    {
+        osg::Vec3 patchOrigin = _origin + (_uAxis*static_cast<float>(key.column) + _vAxis*static_cast<float>(key.row))*levelScale;
+        bb.expandBy(patchOrigin);
+        bb.expandBy(patchOrigin + (_uAxis + _vAxis)*levelScale);
+    }
+
+    // the error of a cell of size h is about h*h*curvature/8, scaled here from the sample spacing to the patch's cell size
+    float samplesPerCell = static_cast<float>(s_patchSamples)/static_cast<float>(_patchCells);
+    patch.error = maxSecondDifference*samplesPerCell*samplesPerCell*0.125f;
+    patch.bound = bb;
+    patch.time = time;
+    patch.evaluated = true;
+
+    for(unsigned int m=0; m<GridTopologyCache::NUM_STITCH_MASKS; ++m)
+    {
+        if (patch.geometries[m].valid()) patch.geometries[m]->setDisplacedBound(bb);
+    }
+}
+
+SurfaceGeometry* SurfaceLOD::getPatchGeometry(const PatchKey& key, Patch& patch, unsigned int stitchEdges)
+{
+    osg::ref_ptr<SurfaceGeometry>& geometry = patch.geometries[stitchEdges];
+    if (geometry.valid()) return geometry.get();
+
+    osg::ref_ptr<SurfaceGeometry>& unstitched = patch.geometries[0];
+    if (!unstitched)
+    {
+        // a tile of the grid at the patch's level, the vertices of each level then land exactly on those of the finer levels
+        unstitched = new SurfaceGeometry;
+        unstitched->setType(_type);
+        unstitched->setOrigin(_origin);
+        unstitched->setTopOrigin(_origin);
+        unstitched->setUAxis(_uAxis);
+        unstitched->setVAxis(_vAxis);
+        unstitched->setUCells(_patchCells<<key.level);
+        unstitched->setVCells(_patchCells<<key.level);
+        unstitched->setTile(key.column*_patchCells, key.row*_patchCells, _patchCells, _patchCells);
+        unstitched->setUseTriangleStrips(_useTriangleStrips);
+        unstitched->build();
+        unstitched->setDisplacedBound(patch.bound);
+        unstitched->setCullCallback(CountTrianglesCallback::instance());
+    }
+
+    if (stitchEdges!=0)
+    {
+        geometry = new SurfaceGeometry(*unstitched, osg::CopyOp::SHALLOW_COPY);
+        geometry->setStitchEdges(stitchEdges);
+        geometry->buildPrimitives();
+    }
+
+    return geometry.get();
+}
+
+float SurfaceLOD::computeScreenError(osgUtil::CullVisitor* cv, const Patch& patch) const
+{
+    if (patch.error<=0.0f) return 0.0f;
+
+    // project the error at the point of the patch closest to the eye
+    const osg::Vec3 eye = cv->getEyeLocal();
+    const osg::BoundingBox& bb = patch.bound;
+    osg::Vec3 nearest(osg::clampTo(eye.x(), bb.xMin(), bb.xMax()),
+                      osg::clampTo(eye.y(), bb.yMin(), bb.yMax()),
+                      osg::clampTo(eye.z(), bb.zMin(), bb.zMax()));
+
+    if ((nearest-eye).length2()==0.0f) return FLT_MAX;
+
+    return cv->clampedPixelSize(nearest, patch.error);
+}
+
+void SurfaceLOD::addLeaf(View& view, const PatchKey& key, Patch& patch, bool culled)
+{
+    patch.selection = view.selection;
+    patch.culled = culled;
+    view.leaves.push_back(key);
+}
+
+SurfaceLOD::Patch* SurfaceLOD::findLeaf(const View& view, const PatchKey& key) const
+{
+    Patches::const_iterator itr = view.patches.find(key);
+    return (itr!=view.patches.end() && itr->second->selection==view.selection) ? itr->second.get() : 0;
+}
+
+void SurfaceLOD::select(osgUtil::CullVisitor* cv, View& view, const PatchKey& key, double time, unsigned int frameNumber)
+{
+    Patch* patch = getPatch(view, key, time, frameNumber);
+    if (cv->isCulled(patch->bound))
+    {
+        // still recorded so that visible neighbours know what they border
+        addLeaf(view, key, *patch, true);
+        return;
+    }
+
+    if (key.level<_maxLevel && computeScreenError(cv, *patch)>_maxScreenError)
+    {
+        for(unsigned int i=0; i<4; ++i)
+        {
+            select(cv, view, key.child(i), time, frameNumber);
+        }
+    }
+    else
+    {
+        addLeaf(view, key, *patch, false);
+    }
+}
+
+void SurfaceLOD::split(osgUtil::CullVisitor* cv, View& view, const PatchKey& key, double time, unsigned int frameNumber)
+{
+    Patch* leaf = findLeaf(view, key);
+    if (!leaf) return;
+
+    // the key stays in the view's leaves, but no longer matches the patch's selection
+    bool culled = leaf->culled;
+    leaf->selection = 0;
+
+    for(unsigned int i=0; i<4; ++i)
+    {
+        PatchKey child = key.child(i);
+        Patch* patch = getPatch(view, child, time, frameNumber);
+        addLeaf(view, child, *patch, culled || cv->isCulled(patch->bound));
+    }
+}
+
+bool SurfaceLOD::findCoveringLeaf(const View& view, unsigned int level, unsigned int column, unsigned int row, PatchKey& covering) const
+{
+    for(unsigned int shift=0; shift<=level; ++shift)
+    {
+        PatchKey key(level-shift, column>>shift, row>>shift);
+        if (findLeaf(view, key))
+        {
+            covering = key;
+            return true;
+        }
+    }
+    return false;
+}
+
+void SurfaceLOD::balance(osgUtil::CullVisitor* cv, View& view, double time, unsigned int frameNumber)
+{
+    // split any leaf that is more than one level coarser than a neighbour, repeating until none are left, so that every edge
+    // between patches of different levels can be stitched
+    PatchKey covering(0, 0, 0);
+    bool changed = true;
+    while(changed)
+    {
+        changed = false;
+
+        view.keys.assign(view.leaves.begin(), view.leaves.end());
+
+        for(PatchKeys::iterator kitr = view.keys.begin(); kitr != view.keys.end(); ++kitr)
+        {
+            const PatchKey& key = *kitr;
+            if (key.level<2 || !findLeaf(view, key)) continue;
+
+            unsigned int size = 1u<<key.level;
+            int offsets[4][2] = { {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
+            for(unsigned int i=0; i<4; ++i)
+            {
+                int c = static_cast<int>(key.column) + offsets[i][0];
+                int r = static_cast<int>(key.row) + offsets[i][1];
+                if (c<0 || r<0 || c>=static_cast<int>(size) || r>=static_cast<int>(size)) continue;
+
+                if (findCoveringLeaf(view, key.level, static_cast<unsigned int>(c), static_cast<unsigned int>(r), covering) && covering.level+1<key.level)
+                {
+                    split(cv, view, covering, time, frameNumber);
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+unsigned int SurfaceLOD::computeStitchEdges(const View& view, const PatchKey& key) const
+{
+    if (key.level==0) return 0;
+
+    unsigned int size = 1u<<key.level;
+    unsigned int stitchEdges = 0;
+    PatchKey covering(0, 0, 0);
+
+    if (key.column>0 && findCoveringLeaf(view, key.level, key.column-1, key.row, covering) && covering.level<key.level)
+    {
+        stitchEdges |= GridTopologyCache::STITCH_U_MIN;
+    }
+    if (key.column+1<size && findCoveringLeaf(view, key.level, key.column+1, key.row, covering) && covering.level<key.level)
+    {
+        stitchEdges |= GridTopologyCache::STITCH_U_MAX;
+    }
+    if (key.row>0 && findCoveringLeaf(view, key.level, key.column, key.row-1, covering) && covering.level<key.level)
+    {
+        stitchEdges |= GridTopologyCache::STITCH_V_MIN;
+    }
+    if (key.row+1<size && findCoveringLeaf(view, key.level, key.column, key.row+1, covering) && covering.level<key.level)
+    {
+        stitchEdges |= GridTopologyCache::STITCH_V_MAX;
+    }
+
+    return stitchEdges;
+}
+
+void SurfaceLOD::pruneExpiredPatches(View& view, unsigned int frameNumber)
+{
+    if (frameNumber==view.lastPruneFrame) return;
+    view.lastPruneFrame = frameNumber;
+
+    Patches::iterator itr = view.patches.begin();
+    while(itr != view.patches.end())
+    {
+        if (itr->second->frameLastUsed+_expiryFrames<frameNumber) view.patches.erase(itr++);
+        else ++itr;
+    }
+}
+
+void SurfaceLOD::traverse(osg::NodeVisitor& nv)
+{
+    osgUtil::CullVisitor* cv = (nv.getVisitorType()==osg::NodeVisitor::CULL_VISITOR) ? dynamic_cast<osgUtil::CullVisitor*>(&nv) : 0;
+    if (!cv)
+    {
+        osg::Group::traverse(nv);
+        return;
+    }
+
+    const osg::FrameStamp* fs = nv.getFrameStamp();
+    double time = fs ? fs->getSimulationTime() : 0.0;
+    unsigned int frameNumber = fs ? fs->getFrameNumber() : nv.getTraversalNumber();
+
+    osg::ref_ptr<View> view = getView(&nv, frameNumber);
+
+    pruneExpiredPatches(*view, frameNumber);
+
+    // a new selection invalidates the leaves of the last one without touching them, 0 being reserved for patches not selected
+    if (++view->selection==0) view->selection = 1;
+    view->leaves.clear();
+
+    select(cv, *view, PatchKey(0, 0, 0), time, frameNumber);
+    balance(cv, *view, time, frameNumber);
+
+    view->geometries.clear();
+    for(PatchKeys::iterator itr = view->leaves.begin(); itr != view->leaves.end(); ++itr)
+    {
+        Patch* patch = findLeaf(*view, *itr);
+        if (!patch || patch->culled) continue;
+
+        view->geometries.push_back(getPatchGeometry(*itr, *patch, computeStitchEdges(*view, *itr)));
+    }
+
+    // the patches go through the CullVisitor like any other drawable, picking up the small feature and view frustum culling
+    for(Geometries::iterator itr = view->geometries.begin(); itr != view->geometries.end(); ++itr)
+    {
+        (*itr)->accept(nv);
+    }
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    view->numPatches = static_cast<unsigned int>(view->patches.size());
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//
+//  Serializers for SurfaceLOD
+//
+#include <osgDB/ObjectWrapper>
+#include <osgDB/InputStream>
+#include <osgDB/OutputStream>
+
+REGISTER_OBJECT_WRAPPER( SurfaceLOD,
+                         new osgParametric::SurfaceLOD,
+                         osgParametric::SurfaceLOD,
+                         "osg::Object osg::Node osg::Group osgParametric::SurfaceLOD" )
+{
+    BEGIN_ENUM_SERIALIZER2( Type, osgParametric::SurfaceGeometry::Type, TOP );
+        ADD_ENUM_CLASS_VALUE( osgParametric::SurfaceGeometry, BASE );
+        ADD_ENUM_CLASS_VALUE( osgParametric::SurfaceGeometry, TOP );
+        ADD_ENUM_CLASS_VALUE( osgParametric::SurfaceGeometry, SIDE_WALLS );
+    END_ENUM_SERIALIZER();
+
+    ADD_VEC3_SERIALIZER( Origin, osg::Vec3() );
+    ADD_VEC3_SERIALIZER( UAxis, osg::Vec3(1.0f, 0.0f, 0.0f) );
+    ADD_VEC3_SERIALIZER( VAxis, osg::Vec3(0.0f, 1.0f, 0.0f) );
+    ADD_UINT_SERIALIZER( PatchCells, 32 );
+    ADD_UINT_SERIALIZER( MaxLevel, 8 );
+    ADD_FLOAT_SERIALIZER( MaxScreenError, 2.0f );
+    ADD_FLOAT_SERIALIZER( BoundsMargin, 0.05f );
+    ADD_UINT_SERIALIZER( ExpiryFrames, 60 );
+    ADD_BOOL_SERIALIZER( UseTriangleStrips, false );
+}
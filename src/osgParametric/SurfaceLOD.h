@@ -0,0 +1,199 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_SURFACELOD
+#define OSGPARAMETRIC_SURFACELOD 1
+
+#include <osgParametric/Export>
+#include <osgParametric/SurfaceFunction.h>
+#include <osgParametric/SurfaceGeometry.h>
+#include <osgParametric/GridTopology.h>
+
+#include <osg/Group>
+#include <OpenThreads/Mutex>
+
+#include <map>
+#include <vector>
+
+namespace osgUtil { class CullVisitor; }
+
+namespace osgParametric
+{
+
+/** View dependent level of detail for the BASE or TOP grid of a parametric surface. The grid is a quadtree of patches of
+  * patchCells by patchCells cells, level n covering the surface with patchCells<<n cells along each axis. During the cull
+  * traversal each patch is refined while its screen space error, estimated from the curvature of the surface function on the host,
+  * exceeds the maximum screen error. Neighbouring patches are kept within one level of each other and the finer patch stitches
+  * its edge to the coarser one, so the surface is crack free. As the selection is made per CullVisitor the node can be shared by
+  * ParametricScene's render and depth subgraphs. Each CullVisitor keeps its own cache of patches, so cull threads only contend
+  * for the node while looking up their cache.
+  *
+  * The only child is the level 0 patch, which provides the bound of the node and the geometry seen by all other traversals.*/
+class OSGPARAMETRIC_EXPORT SurfaceLOD : public osg::Group
+{
+public:
+
+    SurfaceLOD();
+
+    /** Create a level of detail BASE or TOP grid.*/
+    SurfaceLOD(SurfaceGeometry::Type type, const osg::Vec3& origin, const osg::Vec3& uAxis, const osg::Vec3& vAxis, unsigned int patchCells=32, unsigned int maxLevel=8);
+
+    /** Copy constructor using CopyOp to manage deep vs shallow copy. */
+    SurfaceLOD(const SurfaceLOD& lod, const osg::CopyOp& copyop=osg::CopyOp::SHALLOW_COPY);
+
+    META_Node(osgParametric, SurfaceLOD);
+
+    void setType(SurfaceGeometry::Type type) { _type = type; }
+    SurfaceGeometry::Type getType() const { return _type; }
+
+    void setOrigin(const osg::Vec3& origin) { _origin = origin; }
+    const osg::Vec3& getOrigin() const { return _origin; }
+
+    void setUAxis(const osg::Vec3& axis) { _uAxis = axis; }
+    const osg::Vec3& getUAxis() const { return _uAxis; }
+
+    void setVAxis(const osg::Vec3& axis) { _vAxis = axis; }
+    const osg::Vec3& getVAxis() const { return _vAxis; }
+
+    /** Set the number of cells along each axis of a patch, rounded up to an even number so that patches can be stitched.*/
+    void setPatchCells(unsigned int cells) { _patchCells = std::max(2u, cells+(cells&1)); }
+    unsigned int getPatchCells() const { return _patchCells; }
+
+    /** Set the finest level, the surface is then drawn with at most patchCells<<maxLevel cells along each axis.*/
+    void setMaxLevel(unsigned int level) { _maxLevel = level; }
+    unsigned int getMaxLevel() const { return _maxLevel; }
+
+    /** Set the maximum error in pixels tolerated before a patch is refined.*/
+    void setMaxScreenError(float pixels) { _maxScreenError = pixels; }
+    float getMaxScreenError() const { return _maxScreenError; }
+
+    /** Set the fraction of a patch's displacement range added above and below its sampled bound.*/
+    void setBoundsMargin(float margin) { _boundsMargin = margin; }
+    float getBoundsMargin() const { return _boundsMargin; }
+
+    /** Set the number of frames a patch can go unused before it is discarded.*/
+    void setExpiryFrames(unsigned int frames) { _expiryFrames = frames; }
+    unsigned int getExpiryFrames() const { return _expiryFrames; }
+
+    void setUseTriangleStrips(bool flag) { _useTriangleStrips = flag; }
+    bool getUseTriangleStrips() const { return _useTriangleStrips; }
+
+    /** Set the host version of the surface function used to estimate the error and bound of each patch,
+      * assigned by ParametricScene::setup(). Without a function the surface is assumed to be flat.*/
+    void setSurfaceFunction(SurfaceFunction* function);
+    SurfaceFunction* getSurfaceFunction() { return _function.get(); }
+    const SurfaceFunction* getSurfaceFunction() const { return _function.get(); }
+
+    /** Rebuild the level 0 patch and discard the cached patches, call after changing the grid description.*/
+    void build();
+
+    /** Number of patches cached, summed over the views, as of the end of their last cull traversal.*/
+    unsigned int getNumPatches() const;
+
+    virtual void traverse(osg::NodeVisitor& nv);
+
+protected:
+
+    virtual ~SurfaceLOD();
+
+    struct PatchKey
+    {
+        PatchKey(unsigned int l, unsigned int c, unsigned int r): level(l), column(c), row(r) {}
+
+        bool operator < (const PatchKey& rhs) const
+        {
+            if (level!=rhs.level) return level<rhs.level;
+            if (row!=rhs.row) return row<rhs.row;
+            return column<rhs.column;
+        }
+
+        PatchKey child(unsigned int i) const { return PatchKey(level+1, column*2+(i&1), row*2+(i>>1)); }
+
+        unsigned int level;
+        unsigned int column;
+        unsigned int row;
+    };
+
+    struct Patch : public osg::Referenced
+    {
+        Patch(): error(0.0f), time(0.0), evaluated(false), frameLastUsed(0), selection(0), culled(false) {}
+
+        osg::BoundingBox                bound;
+        float                           error;
+        double                          time;
+        bool                            evaluated;
+        unsigned int                    frameLastUsed;
+
+        // the selection the patch is a leaf of, and whether it is then outside the view frustum
+        unsigned int                    selection;
+        bool                            culled;
+
+        // one geometry per stitch mask, all sharing the vertex arrays of the unstitched geometry
+        osg::ref_ptr<SurfaceGeometry>   geometries[GridTopologyCache::NUM_STITCH_MASKS];
+    };
+
+    typedef std::map< PatchKey, osg::ref_ptr<Patch> > Patches;
+    typedef std::vector<PatchKey> PatchKeys;
+    typedef std::vector< osg::ref_ptr<SurfaceGeometry> > Geometries;
+
+    /** The patches cached for one CullVisitor, along with the containers its selection reuses from frame to frame.
+      * Only the owning cull thread touches it, other than lastCullFrame and numPatches which are guarded by SurfaceLOD's mutex.*/
+    struct View : public osg::Referenced
+    {
+        View(): selection(0), functionRevision(0), lastPruneFrame(0), lastCullFrame(0), numPatches(0) {}
+
+        Patches                         patches;
+        PatchKeys                       leaves;     // keys of the selected patches, including those later split
+        PatchKeys                       keys;
+        Geometries                      geometries;
+        unsigned int                    selection;
+        unsigned int                    functionRevision;
+        unsigned int                    lastPruneFrame;
+        unsigned int                    lastCullFrame;
+        unsigned int                    numPatches;
+    };
+
+    typedef std::map< const osg::NodeVisitor*, osg::ref_ptr<View> > Views;
+
+    osg::ref_ptr<View> getView(const osg::NodeVisitor* nv, unsigned int frameNumber);
+
+    Patch* getPatch(View& view, const PatchKey& key, double time, unsigned int frameNumber);
+    void evaluatePatch(const PatchKey& key, Patch& patch, double time);
+    SurfaceGeometry* getPatchGeometry(const PatchKey& key, Patch& patch, unsigned int stitchEdges);
+
+    float computeScreenError(osgUtil::CullVisitor* cv, const Patch& patch) const;
+
+    void addLeaf(View& view, const PatchKey& key, Patch& patch, bool culled);
+    Patch* findLeaf(const View& view, const PatchKey& key) const;
+
+    void select(osgUtil::CullVisitor* cv, View& view, const PatchKey& key, double time, unsigned int frameNumber);
+    void split(osgUtil::CullVisitor* cv, View& view, const PatchKey& key, double time, unsigned int frameNumber);
+    void balance(osgUtil::CullVisitor* cv, View& view, double time, unsigned int frameNumber);
+    unsigned int computeStitchEdges(const View& view, const PatchKey& key) const;
+    bool findCoveringLeaf(const View& view, unsigned int level, unsigned int column, unsigned int row, PatchKey& covering) const;
+
+    void pruneExpiredPatches(View& view, unsigned int frameNumber);
+
+    SurfaceGeometry::Type           _type;
+    osg::Vec3                       _origin;
+    osg::Vec3                       _uAxis;
+    osg::Vec3                       _vAxis;
+    unsigned int                    _patchCells;
+    unsigned int                    _maxLevel;
+    float                           _maxScreenError;
+    float                           _boundsMargin;
+    unsigned int                    _expiryFrames;
+    bool                            _useTriangleStrips;
+
+    osg::ref_ptr<SurfaceFunction>   _function;
+
+    mutable OpenThreads::Mutex      _mutex;
+    Views                           _views;
+    unsigned int                    _functionRevision;
+};
+
+}
+
+#endif
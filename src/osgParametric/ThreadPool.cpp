@@ -0,0 +1,109 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#include "ThreadPool.h"
+
+#include <OpenThreads/Thread>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/BlockCount>
+
+using namespace osgParametric;
+
+namespace
+{
+
+struct RangeOperation : public osg::Operation
+{
+    RangeOperation(ThreadPool::Task& task, unsigned int begin, unsigned int end, OpenThreads::BlockCount& completed):
+        osg::Operation("RangeOperation", false),
+        _task(task),
+        _begin(begin),
+        _end(end),
+        _completed(completed) {}
+
+    virtual void operator () (osg::Object*)
+    {
+        _task(_begin, _end);
+        _completed.completed();
+    }
+
+    ThreadPool::Task&           _task;
+    unsigned int                _begin;
+    unsigned int                _end;
+    OpenThreads::BlockCount&    _completed;
+};
+
+}
+
+ThreadPool::ThreadPool(unsigned int numThreads)
+{
+    if (numThreads==0)
+    {
+        int numProcessors = OpenThreads::GetNumberOfProcessors();
+        numThreads = (numProcessors>1) ? static_cast<unsigned int>(numProcessors-1) : 0;
+    }
+
+    _queue = new osg::OperationQueue;
+
+    for(unsigned int i=0; i<numThreads; ++i)
+    {
+        osg::ref_ptr<osg::OperationThread> thread = new osg::OperationThread;
+        thread->setOperationQueue(_queue.get());
+        thread->startThread();
+        _threads.push_back(thread);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    for(Threads::iterator itr = _threads.begin();
+        itr != _threads.end();
+        ++itr)
+    {
+        (*itr)->cancel();
+    }
+}
+
+ThreadPool* ThreadPool::instance()
+{
+    static OpenThreads::Mutex s_mutex;
+    static osg::ref_ptr<ThreadPool> s_threadPool;
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_mutex);
+    if (!s_threadPool) s_threadPool = new ThreadPool;
+    return s_threadPool.get();
+}
+
+void ThreadPool::run(unsigned int numItems, unsigned int grainSize, Task& task)
+{
+    if (numItems==0) return;
+    if (grainSize==0) grainSize = 1;
+
+    unsigned int numChunks = (numItems+grainSize-1)/grainSize;
+    if (numChunks==1 || _threads.empty())
+    {
+        task(0, numItems);
+        return;
+    }
+
+    OpenThreads::BlockCount completed(numChunks);
+    completed.reset();
+
+    for(unsigned int begin=0; begin<numItems; begin+=grainSize)
+    {
+        unsigned int end = (numItems-begin>grainSize) ? begin+grainSize : numItems;
+        _queue->add(new RangeOperation(task, begin, end, completed));
+    }
+
+    // help out with the work rather than sit idle, this also keeps nested calls from deadlocking.
+    osg::ref_ptr<osg::Operation> operation;
+    while((operation = _queue->getNextOperation(false)).valid())
+    {
+        (*operation)(0);
+    }
+
+    completed.block();
+}
@@ -0,0 +1,54 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+#ifndef OSGPARAMETRIC_THREADPOOL
+#define OSGPARAMETRIC_THREADPOOL 1
+
+#include <osgParametric/Export>
+
+#include <osg/OperationThread>
+
+#include <vector>
+
+namespace osgParametric
+{
+
+/** Pool of osg::OperationThread that split a range of items into chunks and process them in parallel.
+  * The calling thread takes part in the work, so run() can be called from any thread including the pool's own workers. */
+class OSGPARAMETRIC_EXPORT ThreadPool : public osg::Referenced
+{
+public:
+
+    /** Functor called on each chunk [begin, end) of the range passed to run(). Must be safe to call concurrently. */
+    struct Task
+    {
+        virtual ~Task() {}
+        virtual void operator()(unsigned int begin, unsigned int end) = 0;
+    };
+
+    /** Create a pool with numThreads worker threads, 0 selects one less than the number of processors. */
+    ThreadPool(unsigned int numThreads=0);
+
+    /** Get the process wide pool shared by the osgParametric classes. */
+    static ThreadPool* instance();
+
+    unsigned int getNumThreads() const { return static_cast<unsigned int>(_threads.size()); }
+
+    /** Run task over [0, numItems) in chunks of at most grainSize items, returning once every chunk has completed.*/
+    void run(unsigned int numItems, unsigned int grainSize, Task& task);
+
+protected:
+
+    virtual ~ThreadPool();
+
+    typedef std::vector< osg::ref_ptr<osg::OperationThread> > Threads;
+
+    osg::ref_ptr<osg::OperationQueue>   _queue;
+    Threads                             _threads;
+};
+
+}
+
+#endif
@@ -0,0 +1,182 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+// Checks the inside tests of BoundaryClipper against boxes and octahedra whose insides are known analytically.
+
+#include <osgParametric/BoundaryClipper.h>
+
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+#include <string>
+
+using namespace osgParametric;
+
+namespace
+{
+
+unsigned int s_numFailures = 0;
+
+void check(bool condition, const std::string& message)
+{
+    if (!condition)
+    {
+        if (++s_numFailures<=50) std::cout<<message<<std::endl;
+    }
+}
+
+void addQuad(BoundaryClipper::Triangles& triangles, const osg::Vec3d& a, const osg::Vec3d& b, const osg::Vec3d& c, const osg::Vec3d& d)
+{
+    triangles.push_back(a); triangles.push_back(b); triangles.push_back(c);
+    triangles.push_back(a); triangles.push_back(c); triangles.push_back(d);
+}
+
+// closed box, the top and bottom split along the diagonal from the minimum corner
+BoundaryClipper::Triangles createBox(const osg::Vec3d& minimum, const osg::Vec3d& maximum)
+{
+    osg::Vec3d v[8];
+    for(unsigned int i=0; i<8; ++i)
+    {
+        v[i].set((i&1) ? maximum.x() : minimum.x(), (i&2) ? maximum.y() : minimum.y(), (i&4) ? maximum.z() : minimum.z());
+    }
+
+    BoundaryClipper::Triangles triangles;
+    addQuad(triangles, v[0], v[2], v[3], v[1]);
+    addQuad(triangles, v[4], v[5], v[7], v[6]);
+    addQuad(triangles, v[0], v[1], v[5], v[4]);
+    addQuad(triangles, v[2], v[6], v[7], v[3]);
+    addQuad(triangles, v[0], v[4], v[6], v[2]);
+    addQuad(triangles, v[1], v[3], v[7], v[5]);
+    return triangles;
+}
+
+BoundaryClipper::Triangles createOctahedron(const osg::Vec3d& center, double radius)
+{
+    const osg::Vec3d axes[3] = { osg::Vec3d(radius, 0.0, 0.0), osg::Vec3d(0.0, radius, 0.0), osg::Vec3d(0.0, 0.0, radius) };
+
+    BoundaryClipper::Triangles triangles;
+    for(unsigned int i=0; i<8; ++i)
+    {
+        triangles.push_back(center + axes[0]*((i&1) ? -1.0 : 1.0));
+        triangles.push_back(center + axes[1]*((i&2) ? -1.0 : 1.0));
+        triangles.push_back(center + axes[2]*((i&4) ? -1.0 : 1.0));
+    }
+    return triangles;
+}
+
+// grid of 20 by 20 cells over world x and y in [-5, 5]
+const osg::Matrixd s_worldToGrid = osg::Matrixd::translate(5.0, 5.0, 0.0)*osg::Matrixd::scale(2.0, 2.0, 1.0);
+
+void getIntervals(const BoundaryClipper& clipper, double x, double y, BoundaryClipper::Query& query)
+{
+    osg::Vec3d grid = osg::Vec3d(x, y, 0.0)*clipper.getWorldToGrid();
+    clipper.getIntervals(grid.x(), grid.y(), query);
+}
+
+bool equivalent(const osg::Vec2d& interval, double lower, double upper)
+{
+    return std::fabs(interval.x()-lower)<1e-9 && std::fabs(interval.y()-upper)<1e-9;
+}
+
+void testNoBoundaries()
+{
+    osg::ref_ptr<BoundaryClipper> clipper = new BoundaryClipper;
+    clipper->build(std::vector<const BoundaryClipper::Triangles*>(), s_worldToGrid, 20.0, 20.0);
+
+    BoundaryClipper::Query query;
+    check(clipper->isInside(osg::Vec3d(3.0, 7.0, 1e6), query), "without boundaries every point should be inside");
+}
+
+void testBox()
+{
+    BoundaryClipper::Triangles box = createBox(osg::Vec3d(-1.0, -2.0, 0.0), osg::Vec3d(1.0, 2.0, 3.0));
+    std::vector<const BoundaryClipper::Triangles*> boundaries(1, &box);
+
+    osg::ref_ptr<BoundaryClipper> clipper = new BoundaryClipper;
+    clipper->build(boundaries, s_worldToGrid, 20.0, 20.0);
+
+    BoundaryClipper::Query query;
+
+    // on the diagonal shared by the two top and two bottom triangles, each face is crossed exactly once
+    getIntervals(*clipper, 0.0, 0.0, query);
+    check(query.intervals.size()==1 && equivalent(query.intervals[0], 0.0, 3.0), "box interval on a shared edge");
+
+    getIntervals(*clipper, 0.3, -1.7, query);
+    check(query.intervals.size()==1 && equivalent(query.intervals[0], 0.0, 3.0), "box interval");
+
+    getIntervals(*clipper, 1.5, 0.0, query);
+    check(query.intervals.empty(), "line beside the box should be outside");
+
+    // pseudo random points in and around the box, away from its faces
+    unsigned int state = 1;
+    for(unsigned int i=0; i<10000; ++i)
+    {
+        double p[3];
+        for(unsigned int j=0; j<3; ++j)
+        {
+            state = state*1664525u + 1013904223u;
+            p[j] = (static_cast<double>(state>>8)/16777216.0)*8.0-4.0;
+        }
+
+        bool expected = p[0]>-1.0 && p[0]<1.0 && p[1]>-2.0 && p[1]<2.0 && p[2]>0.0 && p[2]<3.0;
+        osg::Vec3d grid = osg::Vec3d(p[0], p[1], p[2])*s_worldToGrid;
+        check(clipper->isInside(grid, query)==expected, "inside test of a random point doesn't match the box");
+    }
+}
+
+void testIntersection()
+{
+    BoundaryClipper::Triangles box = createBox(osg::Vec3d(-2.0, -2.0, 0.0), osg::Vec3d(2.0, 2.0, 2.0));
+    BoundaryClipper::Triangles octahedron = createOctahedron(osg::Vec3d(0.5, 0.0, 2.0), 1.0);
+
+    std::vector<const BoundaryClipper::Triangles*> boundaries;
+    boundaries.push_back(&box);
+    boundaries.push_back(&octahedron);
+
+    osg::ref_ptr<BoundaryClipper> clipper = new BoundaryClipper;
+    clipper->build(boundaries, s_worldToGrid, 20.0, 20.0);
+
+    BoundaryClipper::Query query;
+
+    // the octahedron spans 2 -/+ (1-|dx|-|dy|), of which the box keeps the part below 2
+    getIntervals(*clipper, 0.75, 0.25, query);
+    check(query.intervals.size()==1 && equivalent(query.intervals[0], 1.5, 2.0), "intersection of the box and octahedron");
+
+    check(clipper->isInside(osg::Vec3d(0.75, 0.25, 1.75)*s_worldToGrid, query), "point inside both boundaries");
+    check(!clipper->isInside(osg::Vec3d(0.75, 0.25, 2.25)*s_worldToGrid, query), "point inside only the octahedron");
+    check(!clipper->isInside(osg::Vec3d(-1.0, 1.0, 1.0)*s_worldToGrid, query), "point inside only the box");
+}
+
+void testIntervals()
+{
+    BoundaryClipper::Intervals intervals;
+    intervals.push_back(osg::Vec2d(0.0, 1.0));
+    intervals.push_back(osg::Vec2d(2.0, 4.0));
+
+    check(BoundaryClipper::isInside(intervals, 0.0) && BoundaryClipper::isInside(intervals, 3.0), "inside the intervals");
+    check(!BoundaryClipper::isInside(intervals, 1.5) && !BoundaryClipper::isInside(intervals, 5.0), "outside the intervals");
+
+    check(BoundaryClipper::getInsideLength(intervals, -1.0, 10.0)==3.0, "length of the whole intervals");
+    check(BoundaryClipper::getInsideLength(intervals, 0.5, 3.0)==1.5, "length of part of the intervals");
+    check(BoundaryClipper::getInsideLength(intervals, 1.2, 1.8)==0.0, "length between the intervals");
+}
+
+}
+
+int main(int, char**)
+{
+    testNoBoundaries();
+    testBox();
+    testIntersection();
+    testIntervals();
+
+    if (s_numFailures>0)
+    {
+        std::cout<<s_numFailures<<" failures"<<std::endl;
+        return 1;
+    }
+
+    return 0;
+}
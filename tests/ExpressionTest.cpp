@@ -0,0 +1,439 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+// Checks the Expression bytecode, in both its SIMD and scalar paths, against a reference evaluation of every operator, and
+// the analytic derivatives used for surface normals against central differences.
+
+#include <osgParametric/Expression.h>
+
+#include <cmath>
+#include <cfloat>
+#include <limits>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <iostream>
+
+using namespace osgParametric;
+
+namespace
+{
+
+struct OperatorTest
+{
+    Expression::Operator    op;
+    const char*             definition;
+};
+
+const OperatorTest s_operatorTests[] =
+{
+    { Expression::NEGATE,       "-x" },
+    { Expression::NOT,          "!x" },
+    { Expression::ADD,          "x + y" },
+    { Expression::SUBTRACT,     "x - y" },
+    { Expression::MULTIPLY,     "x * y" },
+    { Expression::DIVIDE,       "x / y" },
+    { Expression::LESS,         "x < y" },
+    { Expression::LEQUAL,       "x <= y" },
+    { Expression::GREATER,      "x > y" },
+    { Expression::GEQUAL,       "x >= y" },
+    { Expression::EQUAL,        "x == y" },
+    { Expression::NOTEQUAL,     "x != y" },
+    { Expression::AND,          "x && y" },
+    { Expression::OR,           "x || y" },
+    { Expression::SELECT,       "x ? y : z" },
+    { Expression::SIN,          "sin(x)" },
+    { Expression::COS,          "cos(x)" },
+    { Expression::TAN,          "tan(x)" },
+    { Expression::ASIN,         "asin(x)" },
+    { Expression::ACOS,         "acos(x)" },
+    { Expression::ATAN,         "atan(x)" },
+    { Expression::ATAN2,        "atan(x, y)" },
+    { Expression::SINH,         "sinh(x)" },
+    { Expression::COSH,         "cosh(x)" },
+    { Expression::TANH,         "tanh(x)" },
+    { Expression::EXP,          "exp(x)" },
+    { Expression::LOG,          "log(x)" },
+    { Expression::EXP2,         "exp2(x)" },
+    { Expression::LOG2,         "log2(x)" },
+    { Expression::SQRT,         "sqrt(x)" },
+    { Expression::INVERSESQRT,  "inversesqrt(x)" },
+    { Expression::ABS,          "abs(x)" },
+    { Expression::SIGN,         "sign(x)" },
+    { Expression::FLOOR,        "floor(x)" },
+    { Expression::CEIL,         "ceil(x)" },
+    { Expression::FRACT,        "fract(x)" },
+    { Expression::MOD,          "mod(x, y)" },
+    { Expression::MIN,          "min(x, y)" },
+    { Expression::MAX,          "max(x, y)" },
+    { Expression::CLAMP,        "clamp(x, y, z)" },
+    { Expression::MIX,          "mix(x, y, z)" },
+    { Expression::STEP,         "step(x, y)" },
+    { Expression::SMOOTHSTEP,   "smoothstep(x, y, z)" },
+    { Expression::POW,          "pow(x, y)" },
+    { Expression::RADIANS,      "radians(x)" },
+    { Expression::DEGREES,      "degrees(x)" }
+};
+
+// GLSL semantics with the NaN conventions of the SSE comparisons, min(a, b) and max(a, b) return b when either is NaN.
+double reference(Expression::Operator op, float a, float b, float c)
+{
+    double x = a, y = b, z = c;
+    switch(op)
+    {
+        case(Expression::NEGATE):       return -x;
+        case(Expression::NOT):          return (x==0.0) ? 1.0 : 0.0;
+        case(Expression::ADD):          return a+b;
+        case(Expression::SUBTRACT):     return a-b;
+        case(Expression::MULTIPLY):     return a*b;
+        case(Expression::DIVIDE):       return a/b;
+        case(Expression::LESS):         return (x<y) ? 1.0 : 0.0;
+        case(Expression::LEQUAL):       return (x<=y) ? 1.0 : 0.0;
+        case(Expression::GREATER):      return (x>y) ? 1.0 : 0.0;
+        case(Expression::GEQUAL):       return (x>=y) ? 1.0 : 0.0;
+        case(Expression::EQUAL):        return (x==y) ? 1.0 : 0.0;
+        case(Expression::NOTEQUAL):     return !(x==y) ? 1.0 : 0.0;
+        case(Expression::AND):          return (!(x==0.0) && !(y==0.0)) ? 1.0 : 0.0;
+        case(Expression::OR):           return (!(x==0.0) || !(y==0.0)) ? 1.0 : 0.0;
+        case(Expression::SELECT):       return !(x==0.0) ? y : z;
+        case(Expression::SIN):          return std::sin(x);
+        case(Expression::COS):          return std::cos(x);
+        case(Expression::TAN):          return std::tan(x);
+        case(Expression::ASIN):         return std::asin(x);
+        case(Expression::ACOS):         return std::acos(x);
+        case(Expression::ATAN):         return std::atan(x);
+        case(Expression::ATAN2):        return std::atan2(x, y);
+        case(Expression::SINH):         return std::sinh(x);
+        case(Expression::COSH):         return std::cosh(x);
+        case(Expression::TANH):         return std::tanh(x);
+        case(Expression::EXP):          return std::exp(x);
+        case(Expression::LOG):          return std::log(x);
+        case(Expression::EXP2):         return std::pow(2.0, x);
+        case(Expression::LOG2):         return std::log(x)/std::log(2.0);
+        case(Expression::SQRT):         return std::sqrt(x);
+        case(Expression::INVERSESQRT):  return 1.0/std::sqrt(x);
+        case(Expression::ABS):          return std::fabs(x);
+        case(Expression::SIGN):         return (x>0.0) ? 1.0 : (x<0.0) ? -1.0 : 0.0;
+        case(Expression::FLOOR):        return std::floor(x);
+        case(Expression::CEIL):         return std::ceil(x);
+        case(Expression::FRACT):        return a-std::floor(a);
+        case(Expression::MOD):          return a-b*std::floor(a/b);
+        case(Expression::MIN):          return (x<y) ? x : y;
+        case(Expression::MAX):          return (x>y) ? x : y;
+        case(Expression::CLAMP):        { double m = (x>y) ? x : y; return (m<z) ? m : z; }
+        case(Expression::MIX):          return a*(1.0f-c)+b*c;
+        case(Expression::STEP):         return (y>=x) ? 1.0 : 0.0;
+        case(Expression::SMOOTHSTEP):
+        {
+            float t = (c-a)/(b-a);
+            t = (t>0.0f) ? t : 0.0f;
+            t = (t<1.0f) ? t : 1.0f;
+            return t*t*(3.0f-2.0f*t);
+        }
+        case(Expression::POW):          return std::pow(x, y);
+        case(Expression::RADIANS):      return x*0.017453292519943295;
+        case(Expression::DEGREES):      return x*57.29577951308232;
+        default:                        return 0.0;
+    }
+}
+
+// results are single precision, allow a few ulp relative to the larger of 1 and the reference, the absolute part covering
+// cancellation near the zeros of sin, cos and log and the single precision argument reduction of fract and mod.
+bool matches(Expression::Operator op, float result, double expected, float a, float b)
+{
+    float expectedFloat = static_cast<float>(expected);
+    if (std::isnan(expectedFloat)) return std::isnan(result);
+    if (std::isinf(expectedFloat) || std::isinf(result)) return result==expectedFloat;
+
+    double scale = std::max(1.0, std::fabs(expected));
+    if (op==Expression::FRACT || op==Expression::MOD)
+    {
+        // the result is only as accurate as the arguments' own precision
+        scale = std::max(scale, std::max(std::fabs(static_cast<double>(a)), std::fabs(static_cast<double>(b))));
+    }
+    return std::fabs(result-expected) <= 4e-6*scale;
+}
+
+float nan() { return std::numeric_limits<float>::quiet_NaN(); }
+float inf() { return std::numeric_limits<float>::infinity(); }
+
+// special values, domain edges and the limits of the vector kernels followed by pseudo random samples over a few ranges.
+std::vector<float> createSamples(unsigned int seed)
+{
+    const float specials[] =
+    {
+        0.0f, -0.0f, 1.0f, -1.0f, 0.5f, -0.5f, 2.0f, 1e-7f, -1e-7f, FLT_MIN, -FLT_MIN, 1e-40f, FLT_MAX, -FLT_MAX,
+        nan(), inf(), -inf(), 0.785398163f, 1.57079633f, 3.14159265f, 6.28318531f, -3.14159265f,
+        8191.5f, 8192.0f, 8192.5f, -8192.5f, 1e4f, 1e6f, -87.0f, -87.5f, 88.0f, 88.5f, 89.0f, -104.0f,
+        126.9f, 127.0f, 127.5f, 128.0f, -125.0f, -125.5f, -150.0f, 0.707106781f, 0.7071067f, 1.41421356f,
+        8388608.0f, -8388607.5f, 16777216.0f, 2147483648.0f, -2147483648.0f
+    };
+
+    std::vector<float> samples(specials, specials+sizeof(specials)/sizeof(float));
+
+    const float ranges[] = { 1.0f, 20.0f, 1000.0f };
+    unsigned int state = seed;
+    for(unsigned int r=0; r<sizeof(ranges)/sizeof(float); ++r)
+    {
+        for(unsigned int i=0; i<100; ++i)
+        {
+            state = state*1664525u + 1013904223u;
+            float unit = static_cast<float>(state>>8) / 16777216.0f;
+            samples.push_back((unit*2.0f-1.0f)*ranges[r]);
+        }
+    }
+    return samples;
+}
+
+unsigned int s_numFailures = 0;
+
+void fail(const OperatorTest& test, const std::string& path, float a, float b, float c, float result, double expected)
+{
+    if (++s_numFailures<=50)
+    {
+        std::cout<<test.definition<<" ["<<path<<"] x="<<a<<" y="<<b<<" z="<<c
+                 <<" result="<<result<<" expected="<<expected<<std::endl;
+    }
+}
+
+void testOperator(const OperatorTest& test)
+{
+    osg::ref_ptr<Expression> expression = new Expression;
+    if (!expression->parse(std::string("(x, y, z) (")+test.definition+")"))
+    {
+        std::cout<<test.definition<<" failed to parse: "<<expression->getErrorMessage()<<std::endl;
+        ++s_numFailures;
+        return;
+    }
+
+    if (expression->getRoot()->op!=test.op)
+    {
+        std::cout<<test.definition<<" parsed to operator "<<expression->getRoot()->op<<", expected "<<test.op<<std::endl;
+        ++s_numFailures;
+        return;
+    }
+
+    std::vector<float> xs = createSamples(1);
+    std::vector<float> ys = createSamples(2);
+    std::vector<float> zs = createSamples(3);
+
+    // rotate the y and z samples so the special values meet each other in different combinations
+    std::rotate(ys.begin(), ys.begin()+7, ys.end());
+    std::rotate(zs.begin(), zs.begin()+13, zs.end());
+
+    // whole blocks, partial blocks and tails that aren't a multiple of the vector width
+    const unsigned int counts[] = { 1, 3, 4, 7, 8, 9, 63, 64, 65, 127, 130, static_cast<unsigned int>(xs.size()) };
+    const float guard = -12345.0f;
+
+    for(unsigned int ci=0; ci<sizeof(counts)/sizeof(unsigned int); ++ci)
+    {
+        for(unsigned int offset=0; offset+counts[ci]<=xs.size(); offset += std::max(counts[ci], 40u))
+        {
+            unsigned int n = counts[ci];
+
+            Expression::Inputs inputs;
+            inputs.push_back(Expression::Input(&xs[offset]));
+            inputs.push_back(Expression::Input(&ys[offset]));
+            inputs.push_back(Expression::Input(&zs[offset]));
+
+            std::vector<float> results(n+1, guard);
+            expression->evaluate(n, inputs, &results[0]);
+
+            if (results[n]!=guard)
+            {
+                std::cout<<test.definition<<" wrote past the end of "<<n<<" results"<<std::endl;
+                ++s_numFailures;
+            }
+
+            for(unsigned int i=0; i<n; ++i)
+            {
+                float a = xs[offset+i], b = ys[offset+i], c = zs[offset+i];
+                double expected = reference(test.op, a, b, c);
+                if (!matches(test.op, results[i], expected, a, b)) fail(test, "batch", a, b, c, results[i], expected);
+            }
+        }
+    }
+
+    // uniform y and z, broadcast across the block rather than read per sample
+    for(unsigned int j=0; j<xs.size(); j+=17)
+    {
+        Expression::Inputs inputs;
+        inputs.push_back(Expression::Input(&xs[0]));
+        inputs.push_back(Expression::Input(ys[j]));
+        inputs.push_back(Expression::Input(zs[j]));
+
+        std::vector<float> results(xs.size());
+        expression->evaluate(static_cast<unsigned int>(xs.size()), inputs, &results[0]);
+
+        for(unsigned int i=0; i<xs.size(); ++i)
+        {
+            double expected = reference(test.op, xs[i], ys[j], zs[j]);
+            if (!matches(test.op, results[i], expected, xs[i], ys[j])) fail(test, "uniform", xs[i], ys[j], zs[j], results[i], expected);
+        }
+    }
+
+    // single samples and constant folding must give exactly the batch results
+    std::vector<float> batch(xs.size());
+    Expression::Inputs inputs;
+    inputs.push_back(Expression::Input(&xs[0]));
+    inputs.push_back(Expression::Input(&ys[0]));
+    inputs.push_back(Expression::Input(&zs[0]));
+    expression->evaluate(static_cast<unsigned int>(xs.size()), inputs, &batch[0]);
+
+    for(unsigned int i=0; i<xs.size(); ++i)
+    {
+        float values[3] = { xs[i], ys[i], zs[i] };
+        float single = expression->evaluate(values);
+        float folded = Expression::apply(test.op, xs[i], ys[i], zs[i]);
+
+        bool same = (std::isnan(single) && std::isnan(batch[i])) || single==batch[i];
+        if (!same) fail(test, "single", xs[i], ys[i], zs[i], single, batch[i]);
+
+        same = (std::isnan(folded) && std::isnan(batch[i])) || folded==batch[i];
+        if (!same) fail(test, "folded", xs[i], ys[i], zs[i], folded, batch[i]);
+    }
+}
+
+void testFolding()
+{
+    osg::ref_ptr<Expression> expression = new Expression;
+    if (!expression->parse("(x) (x + sin(0.5) * exp(2.0) - log2(8.0))"))
+    {
+        std::cout<<"folding test failed to parse: "<<expression->getErrorMessage()<<std::endl;
+        ++s_numFailures;
+        return;
+    }
+
+    float x = 0.0f;
+    float expected = Expression::apply(Expression::SIN, 0.5f, 0.0f, 0.0f) * Expression::apply(Expression::EXP, 2.0f, 0.0f, 0.0f) -
+                     Expression::apply(Expression::LOG2, 8.0f, 0.0f, 0.0f);
+    float result = expression->evaluate(&x);
+    if (result!=expected)
+    {
+        std::cout<<"folded constants gave "<<result<<", expected "<<expected<<std::endl;
+        ++s_numFailures;
+    }
+
+    // x*0 and 0/x aren't 0 for NaN, infinite or zero x, so they can only be folded when x is a finite constant
+    const char* zeroTerms[] = { "(x) (x*0.0)", "(x) (0.0*x)", "(x) (0.0/x)" };
+    const float inputs[] = { std::numeric_limits<float>::quiet_NaN(), std::numeric_limits<float>::infinity(), 0.0f, 2.0f };
+    for(unsigned int i=0; i<sizeof(zeroTerms)/sizeof(zeroTerms[0]); ++i)
+    {
+        expression = new Expression;
+        if (!expression->parse(zeroTerms[i]))
+        {
+            std::cout<<zeroTerms[i]<<" failed to parse: "<<expression->getErrorMessage()<<std::endl;
+            ++s_numFailures;
+            continue;
+        }
+
+        for(unsigned int j=0; j<sizeof(inputs)/sizeof(inputs[0]); ++j)
+        {
+            x = inputs[j];
+            bool divide = (i==2);
+            float expected = divide ? 0.0f/x : x*0.0f;
+            result = expression->evaluate(&x);
+            if (!((std::isnan(result) && std::isnan(expected)) || result==expected))
+            {
+                std::cout<<zeroTerms[i]<<" gave "<<result<<" for x = "<<x<<", expected "<<expected<<std::endl;
+                ++s_numFailures;
+            }
+        }
+    }
+}
+
+void testDerivatives()
+{
+    const char* definitions[] =
+    {
+        "(x, y, z) (x*x*y - 3.0*y + z)",
+        "(x, y, z) (sin(x*0.7)*cos(y*1.3) + 0.25*exp(-x*x))",
+        "(x, y, z) (sqrt(x*x + y*y + 1.0) / (2.0 + tanh(x - y)))",
+        "(x, y, z) (pow(abs(x) + 1.5, 1.5) * log(y*y + 2.0) + atan(x, y + 4.0))",
+        "(x, y, z) (mix(x, y*y, 0.3) + smoothstep(-2.0, 2.0, x*y) + clamp(x + y, -10.0, 10.0))"
+    };
+
+    // sample points away from the kinks of abs() and clamp()
+    const float points[][2] = { {0.3f, 0.2f}, {-0.7f, 1.1f}, {1.4f, -0.6f}, {-1.2f, -0.9f} };
+    const float h = 1e-3f;
+
+    for(unsigned int i=0; i<sizeof(definitions)/sizeof(definitions[0]); ++i)
+    {
+        osg::ref_ptr<Expression> expression = new Expression;
+        if (!expression->parse(definitions[i]))
+        {
+            std::cout<<definitions[i]<<" failed to parse: "<<expression->getErrorMessage()<<std::endl;
+            ++s_numFailures;
+            continue;
+        }
+
+        for(unsigned int parameter=0; parameter<2; ++parameter)
+        {
+            osg::ref_ptr<Expression> derivative = expression->differentiate(parameter);
+            if (!derivative)
+            {
+                std::cout<<definitions[i]<<" couldn't be differentiated"<<std::endl;
+                ++s_numFailures;
+                continue;
+            }
+
+            // the definition written for the shaders has to evaluate the same as the derivative it came from
+            osg::ref_ptr<Expression> written = new Expression;
+            if (!written->parse(derivative->getDefinition()))
+            {
+                std::cout<<derivative->getDefinition()<<" failed to parse: "<<written->getErrorMessage()<<std::endl;
+                ++s_numFailures;
+                continue;
+            }
+
+            for(unsigned int j=0; j<sizeof(points)/sizeof(points[0]); ++j)
+            {
+                float inputs[3] = { points[j][0], points[j][1], 0.5f };
+
+                float above[3] = { inputs[0], inputs[1], inputs[2] };
+                float below[3] = { inputs[0], inputs[1], inputs[2] };
+                above[parameter] += h;
+                below[parameter] -= h;
+                float expected = (expression->evaluate(above) - expression->evaluate(below))/(2.0f*h);
+
+                float result = derivative->evaluate(inputs);
+                if (!(std::fabs(result-expected) <= 1e-2f*std::max(1.0f, std::fabs(expected))))
+                {
+                    std::cout<<definitions[i]<<" d/d"<<(parameter==0 ? "x" : "y")<<" gave "<<result<<" at ("<<inputs[0]<<", "<<inputs[1]
+                             <<"), central difference "<<expected<<std::endl;
+                    ++s_numFailures;
+                }
+
+                float reparsed = written->evaluate(inputs);
+                if (!(std::fabs(reparsed-result) <= 1e-5f*std::max(1.0f, std::fabs(result))))
+                {
+                    std::cout<<derivative->getDefinition()<<" gave "<<reparsed<<" once written out, "<<result<<" before"<<std::endl;
+                    ++s_numFailures;
+                }
+            }
+        }
+    }
+}
+
+}
+
+int main(int, char**)
+{
+    for(unsigned int i=0; i<sizeof(s_operatorTests)/sizeof(OperatorTest); ++i)
+    {
+        testOperator(s_operatorTests[i]);
+    }
+
+    testFolding();
+    testDerivatives();
+
+    if (s_numFailures>0)
+    {
+        std::cout<<s_numFailures<<" failures"<<std::endl;
+        return 1;
+    }
+
+    return 0;
+}
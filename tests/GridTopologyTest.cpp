@@ -0,0 +1,163 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+// Checks that the cached grid index lists cover every cell once with the requested winding, for triangle lists and strips,
+// 16 and 32 bit indices and every combination of stitched edges.
+
+#include <osgParametric/GridTopology.h>
+
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace osgParametric;
+
+namespace
+{
+
+unsigned int s_numFailures = 0;
+
+void check(bool condition, const std::string& message)
+{
+    if (!condition)
+    {
+        if (++s_numFailures<=50) std::cout<<message<<std::endl;
+    }
+}
+
+struct Triangle
+{
+    Triangle(unsigned int a, unsigned int b, unsigned int c) { v[0] = a; v[1] = b; v[2] = c; }
+    unsigned int v[3];
+};
+
+// expand the index list into triangles, strips restarting at the restart index and alternating their winding.
+std::vector<Triangle> getTriangles(const osg::DrawElements& primitives, unsigned int restartIndex)
+{
+    std::vector<Triangle> triangles;
+    if (primitives.getMode()==GL_TRIANGLES)
+    {
+        for(unsigned int i=0; i+2<primitives.getNumIndices(); i+=3)
+        {
+            triangles.push_back(Triangle(primitives.index(i), primitives.index(i+1), primitives.index(i+2)));
+        }
+        return triangles;
+    }
+
+    std::vector<unsigned int> strip;
+    for(unsigned int i=0; i<=primitives.getNumIndices(); ++i)
+    {
+        if (i==primitives.getNumIndices() || primitives.index(i)==restartIndex)
+        {
+            for(unsigned int j=0; j+2<strip.size(); ++j)
+            {
+                if ((j&1)==0) triangles.push_back(Triangle(strip[j], strip[j+1], strip[j+2]));
+                else triangles.push_back(Triangle(strip[j+1], strip[j], strip[j+2]));
+            }
+            strip.clear();
+        }
+        else
+        {
+            strip.push_back(primitives.index(i));
+        }
+    }
+    return triangles;
+}
+
+void testGrid(unsigned int uCells, unsigned int vCells, bool top, GridTopologyCache::Encoding encoding, unsigned int stitchEdges)
+{
+    std::ostringstream name;
+    name<<uCells<<"x"<<vCells<<(top ? " top" : " base")<<(encoding==GridTopologyCache::TRIANGLE_STRIPS ? " strips" : " triangles")
+        <<" stitch "<<stitchEdges<<": ";
+
+    GridTopologyCache* cache = GridTopologyCache::instance();
+    osg::ref_ptr<osg::DrawElements> primitives = cache->getDrawElements(uCells, vCells, top, encoding, stitchEdges);
+    check(primitives.valid(), name.str()+"no index list");
+    if (!primitives) return;
+
+    check(cache->getDrawElements(uCells, vCells, top, encoding, stitchEdges)==primitives.get(), name.str()+"not shared");
+
+    unsigned int rowLength = uCells+1;
+    unsigned int numVertices = rowLength*(vCells+1);
+    unsigned int restartIndex = GridTopologyCache::getRestartIndex(numVertices);
+
+    bool needsUInt = numVertices>0x10000;
+    check(needsUInt==(dynamic_cast<osg::DrawElementsUInt*>(primitives.get())!=0), name.str()+"wrong index type");
+
+    std::vector<Triangle> triangles = getTriangles(*primitives, restartIndex);
+
+    double area = 0.0;
+    unsigned int numTriangles = 0;
+    for(std::vector<Triangle>::const_iterator itr = triangles.begin(); itr != triangles.end(); ++itr)
+    {
+        double c[3], r[3];
+        bool inRange = true;
+        for(unsigned int i=0; i<3; ++i)
+        {
+            unsigned int index = itr->v[i];
+            inRange = inRange && index<numVertices;
+            c[i] = static_cast<double>(index%rowLength);
+            r[i] = static_cast<double>(index/rowLength);
+
+            // stitched edges may only use the vertices of the half resolution grid
+            unsigned int column = index%rowLength, row = index/rowLength;
+            if ((stitchEdges & GridTopologyCache::STITCH_U_MIN)!=0 && column==0) check((row&1)==0, name.str()+"odd vertex on the u min edge");
+            if ((stitchEdges & GridTopologyCache::STITCH_U_MAX)!=0 && column==uCells) check((row&1)==0, name.str()+"odd vertex on the u max edge");
+            if ((stitchEdges & GridTopologyCache::STITCH_V_MIN)!=0 && row==0) check((column&1)==0, name.str()+"odd vertex on the v min edge");
+            if ((stitchEdges & GridTopologyCache::STITCH_V_MAX)!=0 && row==vCells) check((column&1)==0, name.str()+"odd vertex on the v max edge");
+        }
+        check(inRange, name.str()+"index out of range");
+        if (!inRange) continue;
+
+        // counter clockwise in (column, row) for the top, clockwise for the base
+        double signedArea = 0.5*((c[1]-c[0])*(r[2]-r[0]) - (c[2]-c[0])*(r[1]-r[0]));
+        if (signedArea==0.0) continue;
+
+        check((signedArea>0.0)==top, name.str()+"wrong winding");
+        area += std::fabs(signedArea);
+        ++numTriangles;
+    }
+
+    check(area==static_cast<double>(uCells*vCells), name.str()+"triangles don't cover the grid exactly once");
+    if (stitchEdges==0) check(numTriangles==2*uCells*vCells, name.str()+"wrong number of triangles");
+}
+
+}
+
+int main(int, char**)
+{
+    check(GridTopologyCache::getRestartIndex(0xffff)==0xffff, "16 bit restart index");
+    check(GridTopologyCache::getRestartIndex(0x10000)==0xffffffff, "32 bit restart index");
+
+    const unsigned int sizes[][2] = { { 1, 1 }, { 3, 5 }, { 2, 2 }, { 4, 6 }, { 32, 32 }, { 254, 256 }, { 256, 256 } };
+    for(unsigned int s=0; s<sizeof(sizes)/sizeof(sizes[0]); ++s)
+    {
+        unsigned int uCells = sizes[s][0], vCells = sizes[s][1];
+        bool even = (uCells&1)==0 && (vCells&1)==0;
+        unsigned int numStitchMasks = even ? static_cast<unsigned int>(GridTopologyCache::NUM_STITCH_MASKS) : 1u;
+        for(unsigned int stitchEdges=0; stitchEdges<numStitchMasks; ++stitchEdges)
+        {
+            for(int top=0; top<2; ++top)
+            {
+                testGrid(uCells, vCells, top!=0, GridTopologyCache::TRIANGLES, stitchEdges);
+                testGrid(uCells, vCells, top!=0, GridTopologyCache::TRIANGLE_STRIPS, stitchEdges);
+            }
+        }
+    }
+
+    // entries no longer referenced by any geometry are released
+    GridTopologyCache::instance()->pruneUnused();
+    check(GridTopologyCache::instance()->getNumEntries()==0, "pruneUnused left entries in the cache");
+
+    if (s_numFailures>0)
+    {
+        std::cout<<s_numFailures<<" failures"<<std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,197 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+// Exports a planar parametric surface, with and without a box boundary, and checks the triangles read back from the STL file.
+
+#include <osgParametric/MeshExporter.h>
+
+#include <osg/Geode>
+#include <osg/ShapeDrawable>
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace osgParametric;
+
+namespace
+{
+
+unsigned int s_numFailures = 0;
+
+void check(bool condition, const std::string& message)
+{
+    if (!condition)
+    {
+        if (++s_numFailures<=50) std::cout<<message<<std::endl;
+    }
+}
+
+// the surface is z = 0.25*x + 0.125*y + 0.5 over x and y in [0, 4], the boundary box spans x and y in [1.1, 2.9]
+const unsigned int s_cells = 16;
+const float s_minimum = 1.1f;
+const float s_maximum = 2.9f;
+
+float surfaceHeight(float x, float y) { return 0.25f*x + 0.125f*y + 0.5f; }
+
+osg::ref_ptr<ParametricScene> createScene(bool boundary)
+{
+    osg::ref_ptr<osg::Group> surface = new osg::Group;
+    surface->getOrCreateStateSet()->setDefine("Z_FUNCTION", "(x, y, z) (0.25*x + 0.125*y + 0.5)");
+    surface->addChild(createMesh(osg::Vec3(0.0f, 0.0f, 0.0f), osg::Vec3(4.0f, 0.0f, 0.0f), osg::Vec3(0.0f, 4.0f, 0.0f), s_cells, s_cells, true).get());
+
+    osg::ref_ptr<ParametricScene> scene = new ParametricScene;
+    scene->addSubgraph(surface.get(), true, false);
+
+    if (boundary)
+    {
+        float size = s_maximum-s_minimum;
+        float center = (s_maximum+s_minimum)*0.5f;
+        osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+        geode->addDrawable(new osg::ShapeDrawable(new osg::Box(osg::Vec3(center, center, 1.0f), size, size, 4.0f)));
+        scene->addSubgraph(geode.get(), false, true);
+    }
+
+    scene->setup();
+    return scene;
+}
+
+struct STLTriangle
+{
+    osg::Vec3 vertices[3];
+};
+
+bool readSTL(const std::string& filename, unsigned int& numTriangles, std::vector<STLTriangle>& triangles)
+{
+    std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+    if (!in) return false;
+
+    char header[80];
+    in.read(header, sizeof(header));
+    in.read(reinterpret_cast<char*>(&numTriangles), sizeof(numTriangles));
+
+    // normal, three vertices and the attribute byte count
+    char record[50];
+    while(in.read(record, sizeof(record)))
+    {
+        STLTriangle triangle;
+        std::memcpy(&triangle.vertices[0], record+12, 36);
+        triangles.push_back(triangle);
+    }
+    return true;
+}
+
+double getArea(const std::vector<STLTriangle>& triangles)
+{
+    double area = 0.0;
+    for(std::vector<STLTriangle>::const_iterator itr = triangles.begin(); itr != triangles.end(); ++itr)
+    {
+        area += ((itr->vertices[1]-itr->vertices[0]) ^ (itr->vertices[2]-itr->vertices[0])).length()*0.5;
+    }
+    return area;
+}
+
+bool onSurface(const osg::Vec3& v)
+{
+    return std::fabs(v.z()-surfaceHeight(v.x(), v.y()))<1e-5f;
+}
+
+void testUnclipped()
+{
+    osg::ref_ptr<ParametricScene> scene = createScene(true);
+    osg::ref_ptr<MeshExporter> exporter = new MeshExporter(scene.get());
+    exporter->setClipToBoundaries(false);
+
+    const std::string filename("MeshExporterTest_unclipped.stl");
+    check(exporter->write(filename), "unclipped export failed");
+    check(exporter->getNumTriangles()==2*s_cells*s_cells, "unclipped export should have two triangles per cell");
+
+    unsigned int numTriangles = 0;
+    std::vector<STLTriangle> triangles;
+    check(readSTL(filename, numTriangles, triangles), "couldn't read back the unclipped export");
+    check(numTriangles==exporter->getNumTriangles() && triangles.size()==numTriangles, "STL triangle count doesn't match");
+
+    for(std::vector<STLTriangle>::const_iterator itr = triangles.begin(); itr != triangles.end(); ++itr)
+    {
+        for(unsigned int i=0; i<3; ++i)
+        {
+            check(onSurface(itr->vertices[i]), "unclipped vertex isn't displaced onto the surface");
+        }
+    }
+
+    // the plane's area is its projected area scaled by the length of (-dz/dx, -dz/dy, 1)
+    double slope = std::sqrt(1.0 + 0.25*0.25 + 0.125*0.125);
+    check(std::fabs(getArea(triangles)-16.0*slope)<1e-3, "unclipped area doesn't match the surface");
+
+    std::remove(filename.c_str());
+}
+
+void testClipped()
+{
+    osg::ref_ptr<ParametricScene> scene = createScene(true);
+    osg::ref_ptr<MeshExporter> exporter = new MeshExporter(scene.get());
+
+    const std::string filename("MeshExporterTest_clipped.stl");
+    check(exporter->write(filename), "clipped export failed");
+    check(exporter->getNumTriangles()>0, "clipped export is empty");
+
+    unsigned int numTriangles = 0;
+    std::vector<STLTriangle> triangles;
+    check(readSTL(filename, numTriangles, triangles), "couldn't read back the clipped export");
+    check(numTriangles==exporter->getNumTriangles() && triangles.size()==numTriangles, "STL triangle count doesn't match");
+
+    const float tolerance = 1e-3f;
+    for(std::vector<STLTriangle>::const_iterator itr = triangles.begin(); itr != triangles.end(); ++itr)
+    {
+        for(unsigned int i=0; i<3; ++i)
+        {
+            const osg::Vec3& v = itr->vertices[i];
+            check(onSurface(v), "clipped vertex isn't displaced onto the surface");
+            check(v.x()>=s_minimum-tolerance && v.x()<=s_maximum+tolerance && v.y()>=s_minimum-tolerance && v.y()<=s_maximum+tolerance,
+                  "clipped vertex lies outside the boundary");
+        }
+    }
+
+    // triangles are cut along their edges, so corner triangles with no vertex inside can be lost, at most a cell along the perimeter
+    double slope = std::sqrt(1.0 + 0.25*0.25 + 0.125*0.125);
+    double size = s_maximum-s_minimum;
+    double cellSize = 4.0/static_cast<double>(s_cells);
+    double area = getArea(triangles);
+    check(area<=size*size*slope+1e-3 && area>=(size*size - 4.0*size*cellSize)*slope, "clipped area doesn't match the boundary");
+
+    std::remove(filename.c_str());
+}
+
+void testErrors()
+{
+    osg::ref_ptr<ParametricScene> scene = new ParametricScene;
+    osg::ref_ptr<MeshExporter> exporter = new MeshExporter(scene.get());
+    check(!exporter->write("MeshExporterTest_unset.stl"), "export of a scene that isn't set up should fail");
+
+    scene = createScene(false);
+    exporter->setScene(scene.get());
+    check(!exporter->write("MeshExporterTest.unknown"), "export to an unsupported format should fail");
+}
+
+}
+
+int main(int, char**)
+{
+    testUnclipped();
+    testClipped();
+    testErrors();
+
+    if (s_numFailures>0)
+    {
+        std::cout<<s_numFailures<<" failures"<<std::endl;
+        return 1;
+    }
+
+    return 0;
+}
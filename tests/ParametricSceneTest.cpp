@@ -0,0 +1,252 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+// Adds and removes boundaries of a DEPTH_RANGE_ARRAY scene, checking that removed boundaries free their layers, that the freed
+// layers clip nothing, and that the next boundary added reuses them. Also writes a scene out and reads it back, checking that the
+// subgraphs and their settings survive while the generated passes are left for setup() to recreate, and bins boundaries' bounds
+// into screen tiles.
+
+#include <osgParametric/ParametricScene.h>
+#include <osgParametric/SurfaceGeometry.h>
+
+#include <osg/Camera>
+#include <osg/FrameStamp>
+#include <osg/Geode>
+#include <osg/ShapeDrawable>
+#include <osgDB/Registry>
+#include <osgUtil/UpdateVisitor>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+
+using namespace osgParametric;
+
+namespace
+{
+
+unsigned int s_numFailures = 0;
+
+void check(bool condition, const std::string& message)
+{
+    if (!condition)
+    {
+        ++s_numFailures;
+        std::cout<<message<<std::endl;
+    }
+}
+
+osg::ref_ptr<osg::Node> createBoundary(float x)
+{
+    osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+    geode->addDrawable(new osg::ShapeDrawable(new osg::Box(osg::Vec3(x, 2.0f, 1.0f), 1.0f, 1.0f, 4.0f)));
+    return geode;
+}
+
+osg::Group* getDepthSubgraph(ParametricScene* scene)
+{
+    for(unsigned int i=0; i<scene->getNumChildren(); ++i)
+    {
+        if (scene->isPassGroup(scene->getChild(i)) && scene->getChild(i)->getName()=="DepthSubgraph") return scene->getChild(i)->asGroup();
+    }
+    return 0;
+}
+
+osg::Camera* getDepthRangeCamera(ParametricScene* scene, unsigned int layer)
+{
+    osg::Group* depthSubgraph = getDepthSubgraph(scene);
+    return (depthSubgraph && layer<depthSubgraph->getNumChildren()) ? depthSubgraph->getChild(layer)->asCamera() : 0;
+}
+
+bool draws(osg::Camera* camera, osg::Node* boundary)
+{
+    return camera && camera->getNumChildren()==1 && camera->getChild(0)==boundary;
+}
+
+void testDepthRangeLayers()
+{
+    const osg::Vec4 emptyRange(-1.0f, 0.0f, 0.0f, 0.0f);
+    const osg::Vec4 fullRange(0.0f, 1.0f, 0.0f, 0.0f);
+
+    osg::ref_ptr<osg::Group> surface = new osg::Group;
+    surface->addChild(createMesh(osg::Vec3(0.0f, 0.0f, 0.0f), osg::Vec3(4.0f, 0.0f, 0.0f), osg::Vec3(0.0f, 4.0f, 0.0f), 8, 8, true).get());
+
+    osg::ref_ptr<osg::Node> first = createBoundary(1.0f);
+    osg::ref_ptr<osg::Node> second = createBoundary(3.0f);
+
+    osg::ref_ptr<ParametricScene> scene = new ParametricScene;
+    scene->setDimensions(64, 64);
+    scene->setDepthCaptureMode(ParametricScene::DEPTH_RANGE_ARRAY);
+    scene->addSubgraph(surface.get(), true, false);
+    scene->addSubgraph(first.get(), false, true);
+    scene->addSubgraph(second.get(), false, true);
+    scene->setup();
+
+    osg::Group* depthSubgraph = getDepthSubgraph(scene.get());
+    check(depthSubgraph && depthSubgraph->getNumChildren()==2, "a depth range layer wasn't created for each boundary");
+    check(draws(getDepthRangeCamera(scene.get(), 0), first.get()) && draws(getDepthRangeCamera(scene.get(), 1), second.get()), "the boundaries weren't drawn into their own layers");
+    check(getDepthRangeCamera(scene.get(), 0) && getDepthRangeCamera(scene.get(), 0)->getClearColor()==emptyRange, "a boundary's layer isn't cleared to the empty range");
+
+    // the removed boundary's layer is kept, cleared to the full range so that it clips nothing
+    check(scene->removeSubgraph(first.get()), "the first boundary couldn't be removed");
+    scene->applyChanges();
+
+    osg::Camera* freed = getDepthRangeCamera(scene.get(), 0);
+    check(depthSubgraph->getNumChildren()==2, "removing a boundary didn't keep its layer");
+    check(freed && freed->getNumChildren()==0, "the removed boundary is still drawn into its layer");
+    check(freed && freed->getClearColor()==fullRange, "a freed layer isn't cleared to the full range, it clips every fragment");
+    check(draws(getDepthRangeCamera(scene.get(), 1), second.get()), "removing a boundary moved the other boundary's layer");
+
+    // the next boundary reuses the freed layer rather than growing the array
+    osg::ref_ptr<osg::Node> third = createBoundary(2.0f);
+    scene->addSubgraph(third.get(), false, true);
+    scene->applyChanges();
+
+    check(depthSubgraph->getNumChildren()==2, "a new boundary didn't reuse the freed layer");
+    check(draws(getDepthRangeCamera(scene.get(), 0), third.get()), "a new boundary isn't drawn into the freed layer");
+    check(freed && freed->getClearColor()==emptyRange, "a reused layer isn't cleared to the empty range");
+
+    // with no free layers left the array grows
+    osg::ref_ptr<osg::Node> fourth = createBoundary(0.5f);
+    scene->addSubgraph(fourth.get(), false, true);
+    scene->applyChanges();
+
+    check(depthSubgraph->getNumChildren()==3 && draws(getDepthRangeCamera(scene.get(), 2), fourth.get()), "the array didn't grow a layer for a new boundary");
+}
+
+}
+
+osg::ref_ptr<ParametricScene> writeAndRead(ParametricScene* scene, std::string& written)
+{
+    osgDB::ReaderWriter* rw = osgDB::Registry::instance()->getReaderWriterForExtension("osgt");
+    if (!rw)
+    {
+        check(false, "no ReaderWriter for osgt files");
+        return 0;
+    }
+
+    osg::ref_ptr<osgDB::Options> options = new osgDB::Options;
+    options->setPluginStringData("fileType", "Ascii");
+
+    std::stringstream stream;
+    if (!rw->writeNode(*scene, stream, options.get()).success())
+    {
+        check(false, "the scene couldn't be written");
+        return 0;
+    }
+    written = stream.str();
+
+    osg::ref_ptr<osg::Node> node = rw->readNode(stream, options.get()).getNode();
+    return dynamic_cast<ParametricScene*>(node.get());
+}
+
+void testSerialization()
+{
+    osg::ref_ptr<SurfaceGeometry> mesh = createMesh(osg::Vec3(0.0f, 0.0f, 0.0f), osg::Vec3(4.0f, 0.0f, 0.0f), osg::Vec3(0.0f, 4.0f, 0.0f), 64, 64, true);
+    osg::ref_ptr<osg::Group> surface = new osg::Group;
+    surface->addChild(mesh.get());
+
+    osg::ref_ptr<osg::Node> boundary = createBoundary(1.0f);
+
+    osg::ref_ptr<ParametricScene> scene = new ParametricScene;
+    scene->setDimensions(64, 64);
+    scene->setMaxNumViewSlots(3);
+    scene->setViewSlotIdleFrames(30);
+    scene->addSubgraph(surface.get(), true, false);
+    scene->addSubgraph(boundary.get(), false, true, 0.5f);
+    scene->setSubgraphDepthFormat(boundary.get(), GL_DEPTH_COMPONENT16);
+    scene->setup();
+
+    std::string written;
+    osg::ref_ptr<ParametricScene> read = writeAndRead(scene.get(), written);
+    if (!read)
+    {
+        check(false, "the scene wasn't read back as a ParametricScene");
+        return;
+    }
+
+    // the passes are generated, not written
+    check(written.find("RenderSubgraph")==std::string::npos && written.find("DepthSubgraph")==std::string::npos, "the generated passes were written");
+    check(!read->isSetup() && read->getNumChildren()==0, "the scene read back already has passes");
+
+    check(read->getMaxNumViewSlots()==3 && read->getViewSlotIdleFrames()==30, "the view slot settings weren't read back");
+    check(read->getNumSubgraphs()==2, "the subgraphs weren't read back");
+    if (read->getNumSubgraphs()==2)
+    {
+        check(read->getSubgraphRequiresRenderSubgraph(0) && !read->getSubgraphRequiresDepthSubgraph(0), "the surface's passes weren't read back");
+        check(!read->getSubgraphRequiresRenderSubgraph(1) && read->getSubgraphRequiresDepthSubgraph(1), "the boundary's passes weren't read back");
+        check(read->getSubgraphDepthResolutionScale(1)==0.5f, "the boundary's depth resolution scale wasn't read back");
+        check(read->getSubgraphDepthFormat(1)==GL_DEPTH_COMPONENT16, "the boundary's depth format wasn't read back");
+
+        // the grid is stored as its description and rebuilt on reading
+        osg::Group* readSurface = read->getSubgraph(0)->asGroup();
+        SurfaceGeometry* readMesh = (readSurface && readSurface->getNumChildren()==1) ? dynamic_cast<SurfaceGeometry*>(readSurface->getChild(0)) : 0;
+        check(readMesh && readMesh->getUCells()==64 && readMesh->getVCells()==64, "the grid description wasn't read back");
+        check(readMesh && readMesh->getVertexArray() && readMesh->getVertexArray()->getNumElements()==mesh->getVertexArray()->getNumElements() &&
+              readMesh->getNumPrimitiveSets()==mesh->getNumPrimitiveSets(), "the grid wasn't rebuilt on reading");
+    }
+
+    // the first update sets the scene up
+    osg::ref_ptr<osgUtil::UpdateVisitor> uv = new osgUtil::UpdateVisitor;
+    uv->setFrameStamp(new osg::FrameStamp);
+    read->accept(*uv);
+    check(read->isSetup() && getDepthSubgraph(read.get()), "the scene read back wasn't set up by its first update");
+}
+
+}
+
+// the range of 16 pixel tiles of a 64x64 window covered by a bounding sphere, as "c0,r0-c1,r1", or "none"
+std::string getBoundaryTiles(const osg::BoundingSphere& bs, const osg::Matrixd& mvp, const osg::Vec4d& window, double margin)
+{
+    int c0, r0, c1, r1;
+    if (!ParametricScene::computeBoundaryTiles(bs, mvp, window, 16.0, margin, 4, 4, c0, r0, c1, r1)) return "none";
+
+    std::ostringstream range;
+    range<<c0<<","<<r0<<"-"<<c1<<","<<r1;
+    return range.str();
+}
+
+void testBoundaryTiles()
+{
+    // world x and y map straight to pixels
+    osg::Matrixd pixels = osg::Matrixd::ortho2D(0.0, 64.0, 0.0, 64.0);
+    osg::Vec4d window(0.0, 0.0, 64.0, 64.0);
+
+    // a bound that stays within a tile once padded only covers that tile, more padding reaches its neighbours
+    check(getBoundaryTiles(osg::BoundingSphere(osg::Vec3(24.0f, 24.0f, 0.0f), 6.5f), pixels, window, 1.0)=="1,1-1,1", "a bound inside one tile was binned into others");
+    check(getBoundaryTiles(osg::BoundingSphere(osg::Vec3(24.0f, 24.0f, 0.0f), 6.5f), pixels, window, 2.0)=="0,0-2,2", "the margin didn't reach the neighbouring tiles");
+
+    // tiles are counted from the window's origin
+    check(getBoundaryTiles(osg::BoundingSphere(osg::Vec3(24.0f, 24.0f, 0.0f), 6.5f), pixels, osg::Vec4d(100.0, 50.0, 64.0, 64.0), 1.0)=="1,1-1,1",
+          "the tiles aren't relative to the window's origin");
+
+    // bounds partly off screen are clamped to the edge tiles, and those wholly off screen miss every tile
+    check(getBoundaryTiles(osg::BoundingSphere(osg::Vec3(-2.0f, 30.0f, 0.0f), 4.0f), pixels, window, 1.0)=="0,1-0,2", "a bound crossing the window's edge wasn't clamped");
+    check(getBoundaryTiles(osg::BoundingSphere(osg::Vec3(80.0f, 30.0f, 0.0f), 4.0f), pixels, window, 1.0)=="none", "a bound right of the window was binned");
+    check(getBoundaryTiles(osg::BoundingSphere(osg::Vec3(-10.0f, 30.0f, 0.0f), 4.0f), pixels, window, 1.0)=="none", "a bound left of the window was binned");
+
+    // a bound reaching behind the eye, or without a bound, covers the whole window
+    osg::Matrixd perspective = osg::Matrixd::lookAt(osg::Vec3d(0.0, 0.0, 0.0), osg::Vec3d(0.0, 0.0, -1.0), osg::Vec3d(0.0, 1.0, 0.0)) *
+                               osg::Matrixd::perspective(60.0, 1.0, 1.0, 100.0);
+    check(getBoundaryTiles(osg::BoundingSphere(osg::Vec3(0.0f, 0.0f, 10.0f), 1.0f), perspective, window, 1.0)=="0,0-3,3", "a bound behind the eye didn't cover the window");
+    check(getBoundaryTiles(osg::BoundingSphere(), pixels, window, 1.0)=="0,0-3,3", "an invalid bound didn't cover the window");
+}
+
+}
+
+int main(int, char**)
+{
+    testDepthRangeLayers();
+    testSerialization();
+    testBoundaryTiles();
+
+    if (s_numFailures>0)
+    {
+        std::cout<<s_numFailures<<" failures"<<std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,85 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+// Checks that PassTimer keeps the most recent frames and drops late records of frames older than those it keeps.
+
+#include <osgParametric/PassTimer.h>
+
+#include <iostream>
+#include <string>
+
+using namespace osgParametric;
+
+namespace
+{
+
+unsigned int s_numFailures = 0;
+
+void check(bool condition, const std::string& message)
+{
+    if (!condition)
+    {
+        ++s_numFailures;
+        std::cout<<message<<std::endl;
+    }
+}
+
+void testRecords()
+{
+    osg::ref_ptr<PassTimer> timer = new PassTimer("test");
+    timer->setMaxNumRecords(4);
+
+    for(unsigned int frame=10; frame<16; ++frame)
+    {
+        timer->addCullTime(frame, 1.0);
+        timer->addTriangles(frame, frame);
+    }
+
+    PassTimer::Records records = timer->getRecords();
+    check(records.size()==4, "more records kept than the maximum");
+    check(records.begin()->first==12 && records.rbegin()->first==15, "the most recent frames weren't the ones kept");
+
+    // records of kept frames accumulate
+    timer->addCullTime(13, 2.0);
+    PassTimer::Record record;
+    check(timer->getRecord(13, record) && record.cullTime==3.0 && record.numTriangles==13, "times of a kept frame don't accumulate");
+
+    // a late record of a frame older than all those kept is dropped, rather than evicting a newer frame
+    timer->addCullTime(5, 1.0);
+    timer->addTriangles(11, 1);
+    records = timer->getRecords();
+    check(records.size()==4 && records.begin()->first==12, "a late record of an old frame evicted a newer one");
+    check(!timer->getRecord(5, record) && !timer->getRecord(11, record), "a late record of an old frame was kept");
+
+    // a new frame evicts the oldest
+    timer->addCullTime(16, 1.0);
+    records = timer->getRecords();
+    check(records.size()==4 && records.begin()->first==13 && records.rbegin()->first==16, "a new frame didn't evict the oldest");
+
+    // shrinking the maximum applies on the next new frame
+    timer->setMaxNumRecords(2);
+    timer->addCullTime(17, 1.0);
+    records = timer->getRecords();
+    check(records.size()==2 && records.begin()->first==16, "shrinking the maximum didn't discard the oldest frames");
+
+    timer->setMaxNumRecords(0);
+    timer->addCullTime(18, 1.0);
+    check(!timer->getRecord(18, record), "a record was kept with a maximum of no records");
+}
+
+}
+
+int main(int, char**)
+{
+    testRecords();
+
+    if (s_numFailures>0)
+    {
+        std::cout<<s_numFailures<<" failures"<<std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,152 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+// Checks that RenderTargetPool reuses released targets, most recently released first, and evicts the least recently released
+// to stay within its memory budget without ever evicting a target in use.
+
+#include <osgParametric/RenderTargetPool.h>
+
+#include <osg/Texture2D>
+#include <osg/Texture2DArray>
+
+#include <iostream>
+#include <string>
+
+using namespace osgParametric;
+
+namespace
+{
+
+unsigned int s_numFailures = 0;
+
+void check(bool condition, const std::string& message)
+{
+    if (!condition)
+    {
+        ++s_numFailures;
+        std::cout<<message<<std::endl;
+    }
+}
+
+osg::ref_ptr<osg::Texture> createPrototype(GLenum internalFormat)
+{
+    osg::ref_ptr<osg::Texture2D> prototype = new osg::Texture2D;
+    prototype->setInternalFormat(internalFormat);
+    prototype->setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR);
+    prototype->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+    return prototype;
+}
+
+void testMemory()
+{
+    osg::ref_ptr<osg::Texture2D> texture = new osg::Texture2D;
+    texture->setTextureSize(100, 100);
+
+    texture->setInternalFormat(GL_DEPTH_COMPONENT16);
+    check(RenderTargetPool::computeMemory(texture.get())==20000, "16 bit depth isn't 2 bytes per texel");
+
+    texture->setInternalFormat(GL_DEPTH_COMPONENT24);
+    check(RenderTargetPool::computeMemory(texture.get())==40000, "24 bit depth isn't padded to 4 bytes per texel");
+
+    osg::ref_ptr<osg::Texture2DArray> array = new osg::Texture2DArray;
+    array->setInternalFormat(GL_RG32F);
+    array->setTextureSize(100, 100, 3);
+    check(RenderTargetPool::computeMemory(array.get())==240000, "the layers of an array aren't all counted");
+}
+
+void testReuse()
+{
+    osg::ref_ptr<RenderTargetPool> pool = new RenderTargetPool;
+    osg::ref_ptr<osg::Texture> prototype = createPrototype(GL_DEPTH_COMPONENT24);
+
+    osg::ref_ptr<osg::Texture> target = pool->acquire(prototype.get(), 100, 100, 0);
+    check(target.valid() && target->getTextureWidth()==100 && target->getTextureHeight()==100, "the target hasn't the size asked for");
+
+    // a texture the pool didn't hand out is ignored
+    osg::ref_ptr<osg::Texture> other = createPrototype(GL_DEPTH_COMPONENT24);
+    pool->release(other.get());
+    check(pool->getUsage().numReleased==0, "a texture not acquired from the pool was taken as released");
+
+    pool->release(target.get());
+    RenderTargetPool::Usage usage = pool->getUsage();
+    check(usage.numInUse==0 && usage.numReleased==1 && usage.memoryReleased==40000, "a released target isn't counted as released");
+
+    check(pool->acquire(prototype.get(), 200, 100, 0)!=target, "a target of another size was reused");
+    check(pool->acquire(createPrototype(GL_DEPTH_COMPONENT16).get(), 100, 100, 0)!=target, "a target of another format was reused");
+
+    // sampling is taken from the prototype
+    osg::ref_ptr<osg::Texture> nearest = createPrototype(GL_DEPTH_COMPONENT24);
+    nearest->setFilter(osg::Texture::MIN_FILTER, osg::Texture::NEAREST);
+    nearest->setFilter(osg::Texture::MAG_FILTER, osg::Texture::NEAREST);
+
+    osg::ref_ptr<osg::Texture> reused = pool->acquire(nearest.get(), 100, 100, 0);
+    check(reused==target, "a released target of the same size and format wasn't reused");
+    check(reused->getFilter(osg::Texture::MIN_FILTER)==osg::Texture::NEAREST &&
+          reused->getFilter(osg::Texture::MAG_FILTER)==osg::Texture::NEAREST, "a reused target keeps its old filters");
+
+    usage = pool->getUsage();
+    check(usage.numInUse==3 && usage.numReleased==0 && usage.numEvicted==0, "the usage doesn't match the targets acquired");
+}
+
+void testEviction()
+{
+    osg::ref_ptr<RenderTargetPool> pool = new RenderTargetPool;
+    osg::ref_ptr<osg::Texture> prototype = createPrototype(GL_DEPTH_COMPONENT24);
+
+    // room for three 100x100 targets of 4 bytes per texel
+    pool->setMemoryBudget(120000);
+
+    osg::ref_ptr<osg::Texture> a = pool->acquire(prototype.get(), 100, 100, 0);
+    osg::ref_ptr<osg::Texture> b = pool->acquire(prototype.get(), 100, 100, 0);
+    osg::ref_ptr<osg::Texture> c = pool->acquire(prototype.get(), 100, 100, 0);
+    pool->release(a.get());
+    pool->release(b.get());
+    pool->release(c.get());
+
+    // a new target evicts only the least recently released
+    osg::ref_ptr<osg::Texture> d = pool->acquire(prototype.get(), 200, 50, 0);
+    RenderTargetPool::Usage usage = pool->getUsage();
+    check(usage.numEvicted==1 && usage.numReleased==2 && usage.memoryInUse+usage.memoryReleased==120000,
+          "a new target didn't evict just the least recently released");
+
+    // the most recently released is reused first
+    check(pool->acquire(prototype.get(), 100, 100, 0)==c, "the most recently released target wasn't reused first");
+    check(pool->acquire(prototype.get(), 100, 100, 0)==b, "the remaining released target wasn't reused");
+
+    // the evicted target is gone, and targets in use are kept over budget
+    osg::ref_ptr<osg::Texture> e = pool->acquire(prototype.get(), 100, 100, 0);
+    check(e!=a, "an evicted target was reused");
+    usage = pool->getUsage();
+    check(usage.numInUse==4 && usage.memoryInUse==160000 && usage.numEvicted==1, "targets in use were evicted to meet the budget");
+
+    // lowering the budget evicts released targets straight away
+    pool->release(d.get());
+    pool->release(e.get());
+    pool->setMemoryBudget(100000);
+    usage = pool->getUsage();
+    check(usage.numReleased==0 && usage.numEvicted==3 && usage.memoryInUse==80000, "lowering the budget didn't evict the released targets");
+
+    pool->release(b.get());
+    pool->flush();
+    usage = pool->getUsage();
+    check(usage.numReleased==0 && usage.memoryReleased==0 && usage.numEvicted==4 && usage.numInUse==1, "flush didn't evict the released targets");
+}
+
+}
+
+int main(int, char**)
+{
+    testMemory();
+    testReuse();
+    testEviction();
+
+    if (s_numFailures>0)
+    {
+        std::cout<<s_numFailures<<" failures"<<std::endl;
+        return 1;
+    }
+
+    return 0;
+}
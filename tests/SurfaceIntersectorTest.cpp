@@ -0,0 +1,135 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+// Intersects segments with a planar parametric surface, with and without a box boundary clipping it.
+
+#include <osgParametric/SurfaceIntersector.h>
+
+#include <osg/Geode>
+#include <osg/ShapeDrawable>
+
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace osgParametric;
+
+namespace
+{
+
+unsigned int s_numFailures = 0;
+
+void check(bool condition, const std::string& message)
+{
+    if (!condition)
+    {
+        if (++s_numFailures<=50) std::cout<<message<<std::endl;
+    }
+}
+
+// the surface is z = 0.25*x + 0.125*y + 0.5 over x and y in [0, 4], the boundary box spans x and y in [1, 3] and z in [-1, 3]
+double surfaceHeight(double x, double y) { return 0.25*x + 0.125*y + 0.5; }
+
+osg::ref_ptr<ParametricScene> createScene()
+{
+    osg::ref_ptr<osg::Group> surface = new osg::Group;
+    surface->getOrCreateStateSet()->setDefine("Z_FUNCTION", "(x, y, z) (0.25*x + 0.125*y + 0.5)");
+    surface->addChild(createMesh(osg::Vec3(0.0f, 0.0f, 0.0f), osg::Vec3(4.0f, 0.0f, 0.0f), osg::Vec3(0.0f, 4.0f, 0.0f), 32, 32, true).get());
+
+    osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+    geode->addDrawable(new osg::ShapeDrawable(new osg::Box(osg::Vec3(2.0f, 2.0f, 1.0f), 2.0f, 2.0f, 4.0f)));
+
+    osg::ref_ptr<ParametricScene> scene = new ParametricScene;
+    scene->addSubgraph(surface.get(), true, false);
+    scene->addSubgraph(geode.get(), false, true);
+    scene->setup();
+    return scene;
+}
+
+bool insideBox(double x, double y) { return x>1.0 && x<3.0 && y>1.0 && y<3.0; }
+
+void testVerticalSegments(SurfaceIntersector* intersector, bool clipped)
+{
+    std::vector<osg::Vec3d> starts, ends;
+    for(unsigned int j=0; j<22; ++j)
+    {
+        for(unsigned int i=0; i<22; ++i)
+        {
+            // steps of 0.187 keep at least 0.02 away from the box's faces and the grid lines
+            double x = 0.031 + 0.187*static_cast<double>(i);
+            double y = 0.037 + 0.187*static_cast<double>(j);
+            starts.push_back(osg::Vec3d(x, y, 5.0));
+            ends.push_back(osg::Vec3d(x, y, -5.0));
+        }
+    }
+
+    std::vector<SurfaceIntersector::Hit> hits(starts.size());
+    intersector->intersect(static_cast<unsigned int>(starts.size()), &starts.front(), &ends.front(), &hits.front());
+
+    for(unsigned int i=0; i<starts.size(); ++i)
+    {
+        double x = starts[i].x(), y = starts[i].y();
+        bool expected = !clipped || insideBox(x, y);
+
+        SurfaceIntersector::Hit hit;
+        bool found = intersector->intersect(starts[i], ends[i], hit);
+        check(found==expected, clipped ? "clipped hit doesn't match the boundary" : "segment over the surface missed it");
+        check(hits[i].valid()==found, "batch and single intersections disagree");
+        if (!found) continue;
+
+        double h = surfaceHeight(x, y);
+        check(std::fabs(hit.point.z()-h)<1e-5, "hit isn't on the surface");
+        check(std::fabs(hit.point.x()-x)<1e-9 && std::fabs(hit.point.y()-y)<1e-9, "hit isn't on the segment");
+        check(std::fabs(hit.ratio-(5.0-h)/10.0)<1e-6, "hit ratio doesn't match the hit point");
+        check(hit.normal.z()>0.0f, "normal doesn't face the start of the segment");
+        check(hits[i].valid() && std::fabs(hits[i].ratio-hit.ratio)<1e-12, "batch and single hits differ");
+
+        // the grid is 32 by 32 cells of 0.125
+        check(hit.column==static_cast<unsigned int>(x/0.125) && hit.row==static_cast<unsigned int>(y/0.125), "hit reports the wrong cell");
+    }
+}
+
+void testMisses(SurfaceIntersector* intersector)
+{
+    SurfaceIntersector::Hit hit;
+    check(!intersector->intersect(osg::Vec3d(2.0, 2.0, 5.0), osg::Vec3d(2.0, 2.0, 2.0), hit), "segment ending above the surface hit it");
+    check(!intersector->intersect(osg::Vec3d(5.0, 2.0, 5.0), osg::Vec3d(5.0, 2.0, -5.0), hit), "segment beside the grid hit it");
+
+    // a diagonal segment hits the plane where the line meets it
+    osg::Vec3d start(0.5, 3.5, 4.0), end(3.5, 0.5, -2.0);
+    intersector->setClipToBoundaries(false);
+    check(intersector->intersect(start, end, hit), "diagonal segment missed the surface");
+    osg::Vec3d p = start + (end-start)*hit.ratio;
+    check(std::fabs(p.z()-surfaceHeight(p.x(), p.y()))<1e-5, "diagonal hit isn't on the surface");
+    intersector->setClipToBoundaries(true);
+}
+
+}
+
+int main(int, char**)
+{
+    osg::ref_ptr<ParametricScene> scene = createScene();
+    osg::ref_ptr<SurfaceIntersector> intersector = new SurfaceIntersector(scene.get());
+    intersector->build();
+
+    check(intersector->getNumSurfaces()==1, "expected a single surface");
+
+    intersector->setClipToBoundaries(false);
+    testVerticalSegments(intersector.get(), false);
+
+    intersector->setClipToBoundaries(true);
+    testVerticalSegments(intersector.get(), true);
+
+    testMisses(intersector.get());
+
+    if (s_numFailures>0)
+    {
+        std::cout<<s_numFailures<<" failures"<<std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,170 @@
+/* Copyright (C) 2016 Robert Osfield
+ *
+ * This application is open source is published under GNU GPL license.
+*/
+
+// Checks the error metric SurfaceLOD refines its patches by, the geometric error estimated from the curvature of the surface
+// function and its projection to pixels.
+
+#include <osgParametric/SurfaceLOD.h>
+
+#include <osgUtil/CullVisitor>
+#include <osg/Viewport>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+#include <string>
+
+using namespace osgParametric;
+
+namespace
+{
+
+unsigned int s_numFailures = 0;
+
+void check(bool condition, const std::string& message)
+{
+    if (!condition)
+    {
+        ++s_numFailures;
+        std::cout<<message<<std::endl;
+    }
+}
+
+bool isNear(float value, float expected, float tolerance)
+{
+    return std::fabs(value-expected) <= tolerance*std::max(1e-6f, std::fabs(expected));
+}
+
+/** Exposes the patch evaluation and error projection.*/
+class TestSurfaceLOD : public SurfaceLOD
+{
+public:
+
+    TestSurfaceLOD(const osg::Vec3& uAxis, const osg::Vec3& vAxis, unsigned int patchCells):
+        SurfaceLOD(SurfaceGeometry::TOP, osg::Vec3(0.0f, 0.0f, 0.0f), uAxis, vAxis, patchCells, 8) {}
+
+    float getPatchError(unsigned int level, unsigned int column, unsigned int row, osg::BoundingBox* bound=0)
+    {
+        osg::ref_ptr<Patch> patch = new Patch;
+        evaluatePatch(PatchKey(level, column, row), *patch, 0.0);
+        if (bound) *bound = patch->bound;
+        return patch->error;
+    }
+
+    float getScreenError(osgUtil::CullVisitor* cv, unsigned int level, unsigned int column, unsigned int row)
+    {
+        osg::ref_ptr<Patch> patch = new Patch;
+        evaluatePatch(PatchKey(level, column, row), *patch, 0.0);
+        return computeScreenError(cv, *patch);
+    }
+};
+
+osg::ref_ptr<SurfaceFunction> createFunction(const std::string& definition)
+{
+    osg::ref_ptr<SurfaceFunction> function = new SurfaceFunction;
+    if (!function->set(definition, "", ""))
+    {
+        std::cout<<definition<<" : "<<function->getErrorMessage()<<std::endl;
+        ++s_numFailures;
+    }
+    return function;
+}
+
+// a 1000x1000 pixel, 60 degree view looking straight down on the grid from height
+osg::ref_ptr<osgUtil::CullVisitor> createCullVisitor(const osg::Vec3& center, float height)
+{
+    osg::ref_ptr<osgUtil::CullVisitor> cv = new osgUtil::CullVisitor;
+    cv->pushViewport(new osg::Viewport(0.0, 0.0, 1000.0, 1000.0));
+    cv->pushProjectionMatrix(new osg::RefMatrix(osg::Matrix::perspective(60.0, 1.0, 0.1, 10000.0)));
+    cv->pushModelViewMatrix(new osg::RefMatrix(osg::Matrix::lookAt(center+osg::Vec3(0.0f, 0.0f, height), center, osg::Vec3(0.0f, 1.0f, 0.0f))),
+                            osg::Transform::ABSOLUTE_RF);
+    return cv;
+}
+
+void testFlat()
+{
+    osg::ref_ptr<TestSurfaceLOD> lod = new TestSurfaceLOD(osg::Vec3(4.0f, 0.0f, 0.0f), osg::Vec3(0.0f, 4.0f, 0.0f), 16);
+    lod->setSurfaceFunction(createFunction("(x, y, z) (0.25*x - 0.5*y + 1.0)").get());
+
+    // planes are drawn exactly whatever the resolution
+    check(lod->getPatchError(0, 0, 0)==0.0f, "a plane has non zero error");
+    check(lod->getPatchError(2, 3, 1)==0.0f, "a plane has non zero error at level 2");
+
+    osg::BoundingBox bb;
+    lod->getPatchError(0, 0, 0, &bb);
+    check(bb.zMin()<=-1.0f+1e-5f && bb.zMax()>=2.0f-1e-5f, "the bound of a plane doesn't contain its displacement");
+}
+
+void testQuadratic()
+{
+    // displacement k*x*x has second derivative 2k, so linear interpolation over cells of width h is out by at most k*h*h/4
+    const float k = 0.5f;
+    const float width = 4.0f;
+    const unsigned int patchCells = 16;
+
+    osg::ref_ptr<TestSurfaceLOD> lod = new TestSurfaceLOD(osg::Vec3(width, 0.0f, 0.0f), osg::Vec3(0.0f, width, 0.0f), patchCells);
+    lod->setSurfaceFunction(createFunction("(x, y, z) (0.5*x*x)").get());
+
+    for(unsigned int level=0; level<4; ++level)
+    {
+        float h = width/static_cast<float>(patchCells<<level);
+        float error = lod->getPatchError(level, 0, 0);
+        check(isNear(error, k*h*h*0.25f, 1e-2f), "quadratic error doesn't match the interpolation error");
+    }
+
+    // each level halves the cell size and so quarters the error
+    float coarse = lod->getPatchError(1, 1, 0);
+    float fine = lod->getPatchError(2, 2, 0);
+    check(isNear(fine, coarse*0.25f, 1e-2f), "error doesn't scale with the square of the cell size");
+
+    // the bound holds the displaced surface, here 0.5*x*x over [0, 2] at level 1
+    osg::BoundingBox bb;
+    lod->getPatchError(1, 0, 0, &bb);
+    check(bb.zMin()<=1e-5f && bb.zMax()>=2.0f-1e-5f, "the bound doesn't contain the displaced patch");
+}
+
+void testScreenError()
+{
+    osg::ref_ptr<TestSurfaceLOD> lod = new TestSurfaceLOD(osg::Vec3(4.0f, 0.0f, 0.0f), osg::Vec3(0.0f, 4.0f, 0.0f), 16);
+    lod->setSurfaceFunction(createFunction("(x, y, z) (0.5*x*x)").get());
+
+    float error = lod->getPatchError(0, 0, 0);
+    osg::BoundingBox bb;
+    lod->getPatchError(0, 0, 0, &bb);
+
+    // a length e at distance d spans e*1000/(2*d*tan(30)) pixels, osg's pixel size takes the error as a radius so allows up to twice that
+    osg::Vec3 center(2.0f, 2.0f, 0.0f);
+    float distance = 100.0f;
+    osg::ref_ptr<osgUtil::CullVisitor> cv = createCullVisitor(center, bb.zMax()+distance);
+    float pixels = lod->getScreenError(cv.get(), 0, 0, 0);
+    float expected = error*1000.0f/(2.0f*distance*std::tan(osg::DegreesToRadians(30.0f)));
+    check(pixels>=expected*0.95f && pixels<=expected*2.1f, "screen error doesn't match the projected error");
+
+    // twice as far away gives half the pixels
+    osg::ref_ptr<osgUtil::CullVisitor> farCV = createCullVisitor(center, bb.zMax()+distance*2.0f);
+    check(isNear(lod->getScreenError(farCV.get(), 0, 0, 0), pixels*0.5f, 0.05f), "screen error doesn't fall off with distance");
+
+    // an eye inside the patch's bound always refines
+    osg::ref_ptr<osgUtil::CullVisitor> insideCV = createCullVisitor(center, bb.center().z()-center.z());
+    check(lod->getScreenError(insideCV.get(), 0, 0, 0)==FLT_MAX, "eye inside the bound doesn't force refinement");
+}
+
+}
+
+int main(int, char**)
+{
+    testFlat();
+    testQuadratic();
+    testScreenError();
+
+    if (s_numFailures>0)
+    {
+        std::cout<<s_numFailures<<" failures"<<std::endl;
+        return 1;
+    }
+
+    return 0;
+}